@@ -45,6 +45,7 @@ static void usage(void)
 	     "\n"
 	     "Commands for managing a running filesystem:\n"
 	     "  fs usage             Show disk usage\n"
+	     "  fs top               Monitor I/O, latency and background work\n"
 	     "\n"
 	     "Commands for managing devices within a running filesystem:\n"
 	     "  device add           Add a new device to an existing filesystem\n"
@@ -67,10 +68,16 @@ static void usage(void)
 	     "  migrate              Migrate an existing filesystem to bcachefs, in place\n"
 	     "  migrate-superblock   Add default superblock, after bcachefs migrate\n"
 	     "\n"
+#ifdef BCACHEFS_FUSE
+	     "Mount:\n"
+	     "  fusemount            Mount a filesystem via FUSE\n"
+	     "\n"
+#endif
 	     "Debug:\n"
 	     "These commands work on offline, unmounted filesystems\n"
 	     "  dump                 Dump filesystem metadata to a qcow2 image\n"
 	     "  list                 List filesystem metadata in textual form\n"
+	     "  bench                Run btree microbenchmarks on a scratch filesystem\n"
 	     "\n"
 	     "Miscellaneous:\n"
 	     "  version              Display the version of the invoked bcachefs tool\n");
@@ -100,6 +107,8 @@ static int fs_cmds(int argc, char *argv[])
 
 	if (!strcmp(cmd, "usage"))
 		return cmd_fs_usage(argc, argv);
+	if (!strcmp(cmd, "top"))
+		return cmd_fs_top(argc, argv);
 
 	usage();
 	return 0;
@@ -193,6 +202,13 @@ int main(int argc, char *argv[])
 		return cmd_dump(argc, argv);
 	if (!strcmp(cmd, "list"))
 		return cmd_list(argc, argv);
+	if (!strcmp(cmd, "bench"))
+		return cmd_bench(argc, argv);
+
+#ifdef BCACHEFS_FUSE
+	if (!strcmp(cmd, "fusemount"))
+		return cmd_fusemount(argc, argv);
+#endif
 
 	printf("Unknown command %s\n", cmd);
 	usage();
@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+#include "tools-util.h"
+
+static const char * const bench_default_tests[] = {
+	"rand_insert",
+	"rand_lookup",
+	"rand_mixed",
+	"rand_delete",
+	"seq_insert",
+	"seq_lookup",
+	"seq_overwrite",
+	"seq_delete",
+	NULL
+};
+
+static const char * const bench_time_stats[] = {
+#define x(name) #name,
+	BCH_TIME_STATS()
+#undef x
+	NULL
+};
+
+struct bench_result {
+	const char			*test;
+	struct btree_perf_test_result	r;
+
+	/* filesystem time stats, for just this test: */
+	struct time_stats_hist		phases[BCH_TIME_STAT_NR];
+};
+
+static u64 hist_count(const struct time_stats_hist *h)
+{
+	u64 ret = 0;
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		ret += h->buckets[i];
+	return ret;
+}
+
+static u64 bench_ops_per_sec(const struct bench_result *b)
+{
+	return hist_count(&b->r.latency) * NSEC_PER_SEC /
+		max_t(u64, b->r.duration, 1);
+}
+
+static void bench_run(struct bch_fs *c, const char *test,
+		      u64 nr, unsigned nr_threads,
+		      struct bench_result *b)
+{
+	struct time_stats_hist *before =
+		xcalloc(BCH_TIME_STAT_NR, sizeof(*before));
+	unsigned i, j;
+	int ret;
+
+	memset(b, 0, sizeof(*b));
+	b->test = test;
+
+	for (i = 0; i < BCH_TIME_STAT_NR; i++)
+		bch2_time_stats_hist_read(&c->times[i], &before[i]);
+
+	ret = __bch2_btree_perf_test(c, test, nr, nr_threads, &b->r);
+	if (ret == -EINVAL)
+		die("unknown test %s", test);
+	if (ret)
+		die("error running %s: %s", test, strerror(-ret));
+
+	for (i = 0; i < BCH_TIME_STAT_NR; i++) {
+		bch2_time_stats_hist_read(&c->times[i], &b->phases[i]);
+
+		for (j = 0; j < TIME_STATS_HIST_NR; j++)
+			b->phases[i].buckets[j] -= before[i].buckets[j];
+	}
+
+	free(before);
+}
+
+/*
+ * Runs the first half of a crash test, stops the filesystem as if we'd crashed
+ * and runs the second half after recovery - returns the remounted filesystem,
+ * or NULL if @test isn't a crash test:
+ */
+static struct bch_fs *bench_crash_run(struct bch_fs *c, char *dev,
+				      struct bch_opts opts, const char *test,
+				      u64 nr, struct bench_result *b)
+{
+	u64 start = sched_clock();
+	int ret;
+
+	ret = bch2_btree_crash_test(c, test, nr, BTREE_CRASH_TEST_BEFORE);
+	if (ret == -EINVAL)
+		return NULL;
+	if (ret)
+		die("error running %s: %s", test, strerror(-ret));
+
+	/* halts the journal, and leaves the superblock marked dirty: */
+	bch2_fs_emergency_read_only(c);
+	bch2_fs_stop(c);
+
+	/* a torn journal write needs fixing: */
+	opt_set(opts, fix_errors, FSCK_OPT_YES);
+
+	c = bch2_fs_open(&dev, 1, opts);
+	if (IS_ERR(c))
+		die("error reopening %s: %s", dev, strerror(-PTR_ERR(c)));
+
+	ret = bch2_btree_crash_test(c, test, nr, BTREE_CRASH_TEST_AFTER);
+	if (ret)
+		die("error running %s: %s", test, strerror(-ret));
+
+	memset(b, 0, sizeof(*b));
+	b->test		= test;
+	b->r.nr		= nr;
+	b->r.nr_threads	= 1;
+	b->r.duration	= sched_clock() - start;
+	return c;
+}
+
+static void bench_print(FILE *out, const struct bench_result *b)
+{
+	const struct time_stats_hist *h = &b->r.latency;
+	char b1[16], b2[16], b3[16], b4[16], b5[16];
+	unsigned i;
+
+	fprintf(out, "%-16s%12llu%8u%10s%12llu%10s%10s%10s%10s\n",
+		b->test, b->r.nr, b->r.nr_threads,
+		pr_ns(b1, sizeof(b1), b->r.duration),
+		bench_ops_per_sec(b),
+		pr_ns(b2, sizeof(b2), bch2_time_stats_hist_quantile(h, 50, 100)),
+		pr_ns(b3, sizeof(b3), bch2_time_stats_hist_quantile(h, 99, 100)),
+		pr_ns(b4, sizeof(b4), bch2_time_stats_hist_quantile(h, 999, 1000)),
+		pr_ns(b5, sizeof(b5), bch2_time_stats_hist_quantile(h, 1, 1)));
+
+	for (i = 0; i < BCH_TIME_STAT_NR; i++) {
+		h = &b->phases[i];
+
+		if (!hist_count(h))
+			continue;
+
+		fprintf(out, "  %-44s%12llu%10s%10s%10s%10s\n",
+			bench_time_stats[i], hist_count(h),
+			pr_ns(b2, sizeof(b2), bch2_time_stats_hist_quantile(h, 50, 100)),
+			pr_ns(b3, sizeof(b3), bch2_time_stats_hist_quantile(h, 99, 100)),
+			pr_ns(b4, sizeof(b4), bch2_time_stats_hist_quantile(h, 999, 1000)),
+			pr_ns(b5, sizeof(b5), bch2_time_stats_hist_quantile(h, 1, 1)));
+	}
+}
+
+static void json_hist(FILE *out, const struct time_stats_hist *h)
+{
+	fprintf(out, "{\"count\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu"
+		",\"p999_ns\":%llu,\"max_ns\":%llu}",
+		hist_count(h),
+		bch2_time_stats_hist_quantile(h, 50, 100),
+		bch2_time_stats_hist_quantile(h, 99, 100),
+		bch2_time_stats_hist_quantile(h, 999, 1000),
+		bch2_time_stats_hist_quantile(h, 1, 1));
+}
+
+static void bench_print_json(FILE *out, const struct bench_result *b)
+{
+	bool first = true;
+	unsigned i;
+
+	fprintf(out, "{\"test\":\"%s\",\"nr\":%llu,\"threads\":%u"
+		",\"duration_ns\":%llu,\"ops_per_sec\":%llu,\"latency\":",
+		b->test, b->r.nr, b->r.nr_threads,
+		b->r.duration, bench_ops_per_sec(b));
+	json_hist(out, &b->r.latency);
+
+	fprintf(out, ",\"time_stats\":{");
+	for (i = 0; i < BCH_TIME_STAT_NR; i++) {
+		if (!hist_count(&b->phases[i]))
+			continue;
+
+		fprintf(out, "%s\"%s\":", first ? "" : ",",
+			bench_time_stats[i]);
+		json_hist(out, &b->phases[i]);
+		first = false;
+	}
+	fprintf(out, "}}\n");
+}
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - btree microbenchmarks\n"
+	     "Usage: bcachefs bench [OPTION]... [test]...\n"
+	     "\n"
+	     "Formats a scratch filesystem and runs the given btree tests on it,\n"
+	     "in order. By default runs rand_insert, rand_lookup, rand_mixed,\n"
+	     "rand_delete, seq_insert, seq_lookup, seq_overwrite and seq_delete.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -d, --dev=path              File or device to use; destroys its contents\n"
+	     "                              (default: a temporary file in $TMPDIR)\n"
+	     "  -s, --size=size             Size of the file to create (default 1G)\n"
+	     "  -n, --nr=nr                 Iterations per test (default 1M)\n"
+	     "  -t, --threads=nr            Number of threads (default 1)\n"
+	     "  -j, --json                  Print one JSON object per test\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "dev",		required_argument,	NULL, 'd' },
+		{ "size",		required_argument,	NULL, 's' },
+		{ "nr",			required_argument,	NULL, 'n' },
+		{ "threads",		required_argument,	NULL, 't' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct format_opts format_opts	= format_opts_default();
+	struct dev_opts dev_opts	= dev_opts_default();
+	struct bch_opts opts		= bch2_opts_empty();
+	const char * const *tests	= bench_default_tests;
+	char *dev = NULL, *tmp = NULL;
+	u64 size = 1ULL << 30, nr = 1 << 20;
+	unsigned nr_threads = 1;
+	bool json = false;
+	struct bench_result *b;
+	struct stat st;
+	struct bch_fs *c;
+	FILE *out;
+	int opt, fd;
+
+	while ((opt = getopt_long(argc, argv, "d:s:n:t:jh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &size))
+				die("invalid size %s", optarg);
+			break;
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid nr %s", optarg);
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (argc)
+		tests = (const char * const *) argv;
+
+	/*
+	 * Results go to stdout, everything the filesystem logs goes to
+	 * stderr:
+	 */
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0 ||
+	    dup2(STDERR_FILENO, STDOUT_FILENO) < 0 ||
+	    !(out = fdopen(fd, "w")))
+		die("error redirecting stdout: %m");
+
+	if (!dev) {
+		tmp = mprintf("%s/bcachefs-bench.XXXXXX",
+			      getenv("TMPDIR") ?: "/tmp");
+		fd = mkstemp(tmp);
+		if (fd < 0)
+			die("error creating %s: %m", tmp);
+		close(fd);
+		dev = tmp;
+	}
+
+	if (stat(dev, &st) || S_ISREG(st.st_mode)) {
+		fd = xopen(dev, O_RDWR|O_CREAT, 0600);
+		if (ftruncate(fd, 0) || ftruncate(fd, size))
+			die("error truncating %s: %m", dev);
+		close(fd);
+	}
+
+	dev_opts.path	= dev;
+	dev_opts.fd	= open_for_format(dev, true);
+	free(bch2_format(format_opts, &dev_opts, 1));
+
+	c = bch2_fs_open(&dev, 1, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", dev, strerror(-PTR_ERR(c)));
+
+	b = xmalloc(sizeof(*b));
+
+	if (!json)
+		fprintf(out, "%-16s%12s%8s%10s%12s%10s%10s%10s%10s\n",
+			"Test", "iters", "threads", "time", "ops/s",
+			"p50", "p99", "p999", "max");
+
+	for (; *tests; tests++) {
+		struct bch_fs *n = bench_crash_run(c, dev, opts, *tests, nr, b);
+
+		if (n)
+			c = n;
+		else
+			bench_run(c, *tests, nr, nr_threads, b);
+
+		if (json)
+			bench_print_json(out, b);
+		else
+			bench_print(out, b);
+		fflush(out);
+	}
+
+	free(b);
+	bch2_fs_stop(c);
+
+	/* not unlinked until now - crash tests remount it: */
+	if (tmp)
+		unlink(tmp);
+	free(tmp);
+	fclose(out);
+	return 0;
+}
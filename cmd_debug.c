@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -24,26 +25,35 @@ static void dump_usage(void)
 	     "Usage: bcachefs dump [OPTION]... <devices>\n"
 	     "\n"
 	     "Options:\n"
-	     "  -o output     Output qcow2 image(s)\n"
+	     "  -o output     Output qcow2 image(s); - for stdout\n"
+	     "  -z type       Compress clusters (zlib|zstd)\n"
 	     "  -f            Force; overwrite when needed\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
 
-static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
+struct dump_dev {
+	pthread_t		thread;
+	int			infd;
+	int			outfd;
+	unsigned		block_size;
+	enum qcow2_compression	compression;
+	ranges			data;
+};
+
+static void dump_dev_ranges(struct bch_fs *c, struct bch_dev *ca, ranges *r)
 {
 	struct bch_sb *sb = ca->disk_sb.sb;
-	ranges data;
 	unsigned i;
 
-	darray_init(data);
+	darray_init(*r);
 
 	/* Superblock: */
-	range_add(&data, BCH_SB_LAYOUT_SECTOR << 9,
+	range_add(r, BCH_SB_LAYOUT_SECTOR << 9,
 		  sizeof(struct bch_sb_layout));
 
 	for (i = 0; i < sb->layout.nr_superblocks; i++)
-		range_add(&data,
+		range_add(r,
 			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
 			  vstruct_bytes(sb));
 
@@ -52,7 +62,7 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
 		if (ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
 			u64 bucket = ca->journal.buckets[i];
 
-			range_add(&data,
+			range_add(r,
 				  bucket_bytes(ca) * bucket,
 				  bucket_bytes(ca));
 		}
@@ -68,36 +78,48 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd)
 
 			extent_for_each_ptr(e, ptr)
 				if (ptr->dev == ca->dev_idx)
-					range_add(&data,
+					range_add(r,
 						  ptr->offset << 9,
 						  b->written << 9);
 		}
 		bch2_btree_iter_unlock(&iter);
 	}
+}
+
+static void *dump_dev_thread(void *arg)
+{
+	struct dump_dev *d = arg;
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_fd, fd, &data,
-			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)));
+	qcow2_write_image(d->infd, d->outfd, &d->data,
+			  d->block_size, d->compression);
+	return NULL;
 }
 
 int cmd_dump(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
 	struct bch_dev *ca;
+	struct dump_dev *devs, *d;
+	enum qcow2_compression compression = QCOW2_COMPRESSION_NONE;
 	char *out = NULL;
 	unsigned i, nr_devices = 0;
 	bool force = false;
-	int fd, opt;
+	int opt, stdout_fd = -1;
 
 	opt_set(opts, nochanges,	true);
 	opt_set(opts, noreplay,		true);
 	opt_set(opts, degraded,		true);
 	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
 
-	while ((opt = getopt(argc, argv, "o:fh")) != -1)
+	while ((opt = getopt(argc, argv, "o:z:fh")) != -1)
 		switch (opt) {
 		case 'o':
 			out = optarg;
 			break;
+		case 'z':
+			compression = read_string_list_or_die(optarg,
+					qcow2_compression_types, "compression type");
+			break;
 		case 'f':
 			force = true;
 			break;
@@ -113,6 +135,14 @@ int cmd_dump(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s) to check");
 
+	/* Keep log messages out of the image when writing to stdout: */
+	if (!strcmp(out, "-")) {
+		stdout_fd = dup(STDOUT_FILENO);
+		if (stdout_fd < 0 ||
+		    dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			die("error redirecting stdout: %m");
+	}
+
 	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
@@ -124,6 +154,16 @@ int cmd_dump(int argc, char *argv[])
 
 	BUG_ON(!nr_devices);
 
+	if (!strcmp(out, "-") && nr_devices > 1)
+		die("Can only dump a single device to stdout");
+
+	devs = xcalloc(nr_devices, sizeof(*devs));
+	d = devs;
+
+	/*
+	 * Walk the btrees to find what to dump, then write out the images for
+	 * each device in parallel - that part is pure IO:
+	 */
 	for_each_online_member(ca, c, i) {
 		int flags = O_WRONLY|O_CREAT|O_TRUNC;
 
@@ -133,18 +173,38 @@ int cmd_dump(int argc, char *argv[])
 		if (!c->devs[i])
 			continue;
 
-		char *path = nr_devices > 1
-			? mprintf("%s.%u", out, i)
-			: strdup(out);
-		fd = xopen(path, flags, 0600);
-		free(path);
+		if (stdout_fd >= 0) {
+			d->outfd = stdout_fd;
+		} else {
+			char *path = nr_devices > 1
+				? mprintf("%s.%u", out, i)
+				: strdup(out);
+			d->outfd = xopen(path, flags, 0600);
+			free(path);
+		}
 
-		dump_one_device(c, ca, fd);
-		close(fd);
+		d->infd		= ca->disk_sb.bdev->bd_fd;
+		d->block_size	= max_t(unsigned, btree_bytes(c) / 8,
+					block_bytes(c));
+		d->compression	= compression;
+		dump_dev_ranges(c, ca, &d->data);
+		d++;
 	}
 
 	up_read(&c->gc_lock);
 
+	for (d = devs; d < devs + nr_devices; d++)
+		if (pthread_create(&d->thread, NULL, dump_dev_thread, d))
+			die("pthread_create error: %m");
+
+	for (d = devs; d < devs + nr_devices; d++) {
+		pthread_join(d->thread, NULL);
+		close(d->outfd);
+		darray_free(d->data);
+	}
+
+	free(devs);
+
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -24,7 +24,9 @@
 #include "cmds.h"
 #include "libbcachefs.h"
 #include "crypto.h"
+#include "posix_to_bcachefs.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
 #include "libbcachefs/super-io.h"
 #include "libbcachefs/util.h"
 
@@ -50,6 +52,7 @@ x('e',	error_action,		"(continue|remount-ro|panic)", NULL)		\
 x('L',	label,			"label",		NULL)			\
 x('U',	uuid,			"uuid",			NULL)			\
 x('f',	force,			NULL,			NULL)			\
+x(0,	source,			"path",			"Initialize the filesystem with the contents of a directory")\
 t("")										\
 t("Device specific options:")							\
 x(0,	fs_size,		"size",			"Size of filesystem on device")\
@@ -92,6 +95,8 @@ static void usage(void)
 	     "  -L, --label=label\n"
 	     "  -U, --uuid=uuid\n"
 	     "  -f, --force\n"
+	     "      --source=path           Initialize the filesystem with the contents\n"
+	     "                              of a directory\n"
 	     "\n"
 	     "Device specific options:\n"
 	     "      --fs_size=size          Size of filesystem on device\n"
@@ -148,6 +153,7 @@ int cmd_format(int argc, char *argv[])
 	struct format_opts opts	= format_opts_default();
 	struct dev_opts dev_opts = dev_opts_default(), *dev;
 	bool force = false, no_passphrase = false, quiet = false;
+	char *source = NULL;
 	int opt;
 
 	darray_init(devices);
@@ -241,6 +247,10 @@ int cmd_format(int argc, char *argv[])
 		case 'f':
 			force = true;
 			break;
+		case O_source:
+			source = optarg;
+			opts.source_date_epoch = true;
+			break;
 		case O_fs_size:
 			if (bch2_strtoull_h(optarg, &dev_opts.size))
 				die("invalid filesystem size");
@@ -298,6 +308,33 @@ int cmd_format(int argc, char *argv[])
 
 	if (!quiet)
 		bch2_sb_print(sb, false, 1 << BCH_SB_FIELD_members, HUMAN_READABLE);
+
+	if (source) {
+		struct bch_opts fs_opts = bch2_opts_empty();
+		char **paths = calloc(darray_size(devices), sizeof(char *));
+		struct bch_fs *c;
+		unsigned i = 0;
+
+		if (!paths)
+			die("insufficient memory");
+
+		darray_foreach(dev, devices)
+			paths[i++] = dev->path;
+
+		if (opts.passphrase)
+			bch2_add_key(sb, opts.passphrase);
+
+		c = bch2_fs_open(paths, i, fs_opts);
+		if (IS_ERR(c))
+			die("error opening %s: %s", paths[0],
+			    strerror(-PTR_ERR(c)));
+
+		build_fs_image(c, source);
+
+		bch2_fs_stop(c);
+		free(paths);
+	}
+
 	free(sb);
 
 	if (opts.passphrase) {
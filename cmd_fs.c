@@ -1,5 +1,10 @@
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 
 #include <uuid/uuid.h>
@@ -157,3 +162,713 @@ int cmd_fs_usage(int argc, char *argv[])
 
 	return 0;
 }
+
+/* fs top: */
+
+#define TOP_MAX_TIME_STATS	32
+
+struct top_latency {
+	u64			count;
+	u64			avg;
+	u64			p50;
+	u64			p99;
+	u64			p999;
+	u64			max;
+};
+
+struct top_time_stats {
+	char			*name;
+	struct top_latency	l;
+};
+
+struct top_dev {
+	unsigned		idx;
+	char			*label;
+	u64			io_done[2];
+	u64			cur_latency[2];
+	struct top_latency	latency[2];
+	char			*copygc_rate;
+	char			*copygc_target;
+	char			*copygc_actual;
+};
+
+struct top_journal {
+	u64			seq;
+	u64			last_seq;
+	u64			entry_offset;
+	u64			entry_u64s;
+	unsigned		ring_used;
+	unsigned		ring_nr;
+};
+
+struct top_sample {
+	struct timespec		time;
+
+	unsigned		nr_devs;
+	struct top_dev		devs[BCH_SB_MEMBERS_MAX];
+
+	unsigned		nr_time_stats;
+	struct top_time_stats	time_stats[TOP_MAX_TIME_STATS];
+
+	struct top_journal	journal;
+
+	char			*rebalance_work;
+	char			*rebalance_rate;
+	char			*rebalance_state;
+};
+
+/* Like read_file_str(), but attributes that don't exist aren't fatal: */
+static char *sysfs_read(int dirfd, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY);
+	char *buf;
+	ssize_t len;
+
+	if (fd < 0)
+		return NULL;
+
+	buf = xmalloc(PAGE_SIZE + 1);
+	len = read(fd, buf, PAGE_SIZE);
+	close(fd);
+
+	if (len < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	buf[len] = '\0';
+	return buf;
+}
+
+/*
+ * Returns the value of a "key:<whitespace>value" or "key<whitespace>value"
+ * line:
+ */
+static char *sysfs_field(char *buf, const char *key)
+{
+	size_t key_len = strlen(key);
+	char *line = buf;
+
+	while (line && *line) {
+		char *p = line;
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (!strncmp(p, key, key_len) &&
+		    (p[key_len] == ':' ||
+		     p[key_len] == ' ' ||
+		     p[key_len] == '\t')) {
+			p += key_len;
+			if (*p == ':')
+				p++;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return NULL;
+}
+
+static u64 sysfs_field_u64(char *buf, const char *key)
+{
+	char *v = buf ? sysfs_field(buf, key) : NULL;
+
+	return v ? strtoull(v, NULL, 10) : 0;
+}
+
+static char *sysfs_field_str(char *buf, const char *key)
+{
+	char *v = buf ? sysfs_field(buf, key) : NULL;
+
+	return v ? strndup(v, strcspn(v, "\n")) : NULL;
+}
+
+static u64 time_unit_nsecs(const char *unit)
+{
+	if (!strncmp(unit, "ns", 2))
+		return 1;
+	if (!strncmp(unit, "us", 2))
+		return NSEC_PER_USEC;
+	if (!strncmp(unit, "ms", 2))
+		return NSEC_PER_MSEC;
+	if (!strncmp(unit, "sec", 3))
+		return NSEC_PER_SEC;
+	return 1;
+}
+
+/* Parses a duration as printed by bch2_time_stats_print(), e.g. "12 us": */
+static u64 sysfs_field_duration(char *buf, const char *key)
+{
+	char *v = buf ? sysfs_field(buf, key) : NULL;
+	char *unit;
+	u64 n;
+
+	if (!v)
+		return 0;
+
+	n = strtoull(v, &unit, 10);
+	while (*unit == ' ')
+		unit++;
+
+	return n * time_unit_nsecs(unit);
+}
+
+/*
+ * Older kernels print approximate quantiles in increasing order, with the units
+ * in the key - e.g. "quantiles (us):\t1 2 3 ..." - the middle one is the
+ * median, and the last one (~p94) is the closest we get to a tail latency:
+ */
+static void parse_quantiles(char *buf, struct top_latency *l)
+{
+	char *p = strstr(buf, "quantiles (");
+	u64 q[32], unit;
+	unsigned nr = 0;
+
+	if (!p)
+		return;
+
+	unit = time_unit_nsecs(p + strlen("quantiles ("));
+
+	p = strchr(p, ':');
+	if (!p)
+		return;
+	p++;
+
+	while (nr < ARRAY_SIZE(q)) {
+		char *end;
+		u64 v = strtoull(p, &end, 10);
+
+		if (end == p)
+			break;
+		q[nr++] = v * unit;
+		p = end;
+	}
+
+	if (nr) {
+		l->p50	= q[nr / 2];
+		l->p99	= q[nr - 1];
+		l->p999	= q[nr - 1];
+	}
+}
+
+static void parse_time_stats(char *buf, struct top_latency *l)
+{
+	memset(l, 0, sizeof(*l));
+
+	if (!buf)
+		return;
+
+	l->count	= sysfs_field_u64(buf, "count");
+	l->avg		= sysfs_field_duration(buf, "avg duration");
+	l->max		= sysfs_field_duration(buf, "max duration");
+
+	if (sysfs_field(buf, "p50")) {
+		l->p50	= sysfs_field_duration(buf, "p50");
+		l->p99	= sysfs_field_duration(buf, "p99");
+		l->p999	= sysfs_field_duration(buf, "p999");
+	} else {
+		parse_quantiles(buf, l);
+	}
+}
+
+/* Sums the per data type byte counts in dev-N/iodone: */
+static void parse_iodone(char *buf, u64 io_done[2])
+{
+	char *line = buf;
+	int rw = -1;
+
+	io_done[READ] = io_done[WRITE] = 0;
+
+	while (line && *line) {
+		char *colon = strchr(line, ':');
+
+		if (!strncmp(line, "read:", 5))
+			rw = READ;
+		else if (!strncmp(line, "write:", 6))
+			rw = WRITE;
+		else if (rw >= 0 && colon)
+			io_done[rw] += strtoull(colon + 1, NULL, 10);
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+}
+
+static void parse_journal(char *buf, struct top_journal *j)
+{
+	char *p;
+
+	memset(j, 0, sizeof(*j));
+
+	if (!buf)
+		return;
+
+	j->seq		= sysfs_field_u64(buf, "seq");
+	j->last_seq	= sysfs_field_u64(buf, "last_seq");
+	j->entry_offset	= sysfs_field_u64(buf, "reservation offset");
+	j->entry_u64s	= sysfs_field_u64(buf, "current entry u64s");
+
+	/* Journal ring usage, summed over devices: */
+	for (p = strstr(buf, "\ndev "); p; p = strstr(p + 1, "\ndev ")) {
+		unsigned nr	= sysfs_field_u64(p, "nr");
+		unsigned cur	= sysfs_field_u64(p, "cur_idx");
+		unsigned last	= sysfs_field_u64(p, "last_idx");
+
+		if (!nr)
+			continue;
+
+		j->ring_used	+= (cur + nr - last) % nr + 1;
+		j->ring_nr	+= nr;
+	}
+}
+
+static void top_sample_free(struct top_sample *s)
+{
+	unsigned i;
+
+	for (i = 0; i < s->nr_devs; i++) {
+		free(s->devs[i].label);
+		free(s->devs[i].copygc_rate);
+		free(s->devs[i].copygc_target);
+		free(s->devs[i].copygc_actual);
+	}
+
+	for (i = 0; i < s->nr_time_stats; i++)
+		free(s->time_stats[i].name);
+
+	free(s->rebalance_work);
+	free(s->rebalance_rate);
+	free(s->rebalance_state);
+	memset(s, 0, sizeof(*s));
+}
+
+static int top_time_stats_cmp(const void *_l, const void *_r)
+{
+	const struct top_time_stats *l = _l, *r = _r;
+
+	return strcmp(l->name, r->name);
+}
+
+static void top_sample_read(struct bchfs_handle fs, struct top_sample *s)
+{
+	struct dirent *d;
+	DIR *dir;
+	char *buf, *path;
+	unsigned i;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+
+	for (i = 0; i < BCH_SB_MEMBERS_MAX; i++) {
+		struct top_dev *dev = &s->devs[s->nr_devs];
+		int dev_fd;
+
+		path = mprintf("dev-%u", i);
+		dev_fd = openat(fs.sysfs_fd, path, O_RDONLY);
+		free(path);
+
+		if (dev_fd < 0)
+			continue;
+
+		dev->idx	= i;
+		dev->label	= sysfs_read(dev_fd, "label");
+		if (dev->label)
+			dev->label[strcspn(dev->label, "\n")] = '\0';
+
+		buf = sysfs_read(dev_fd, "iodone");
+		if (buf)
+			parse_iodone(buf, dev->io_done);
+		free(buf);
+
+		buf = sysfs_read(dev_fd, "io_latency_read");
+		dev->cur_latency[READ] = buf ? strtoull(buf, NULL, 10) : 0;
+		free(buf);
+
+		buf = sysfs_read(dev_fd, "io_latency_write");
+		dev->cur_latency[WRITE] = buf ? strtoull(buf, NULL, 10) : 0;
+		free(buf);
+
+		buf = sysfs_read(dev_fd, "io_latency_stats_read");
+		parse_time_stats(buf, &dev->latency[READ]);
+		free(buf);
+
+		buf = sysfs_read(dev_fd, "io_latency_stats_write");
+		parse_time_stats(buf, &dev->latency[WRITE]);
+		free(buf);
+
+		buf = sysfs_read(dev_fd, "copy_gc_rate_debug");
+		dev->copygc_rate	= sysfs_field_str(buf, "rate");
+		dev->copygc_target	= sysfs_field_str(buf, "target");
+		dev->copygc_actual	= sysfs_field_str(buf, "actual");
+		free(buf);
+
+		close(dev_fd);
+		s->nr_devs++;
+	}
+
+	fd = openat(fs.sysfs_fd, "time_stats", O_RDONLY|O_DIRECTORY);
+	dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (fd >= 0 && !dir)
+		close(fd);
+
+	while (dir &&
+	       (d = readdir(dir)) &&
+	       s->nr_time_stats < TOP_MAX_TIME_STATS) {
+		struct top_time_stats *t = &s->time_stats[s->nr_time_stats];
+
+		if (d->d_name[0] == '.')
+			continue;
+
+		buf = sysfs_read(fd, d->d_name);
+		if (!buf)
+			continue;
+
+		t->name = strdup(d->d_name);
+		parse_time_stats(buf, &t->l);
+		free(buf);
+
+		s->nr_time_stats++;
+	}
+
+	if (dir)
+		closedir(dir);
+
+	sort(s->time_stats, s->nr_time_stats, sizeof(s->time_stats[0]),
+	     top_time_stats_cmp, NULL);
+
+	buf = sysfs_read(fs.sysfs_fd, "internal/journal_debug");
+	parse_journal(buf, &s->journal);
+	free(buf);
+
+	buf = sysfs_read(fs.sysfs_fd, "internal/rebalance_work");
+	if (buf) {
+		char *state;
+
+		s->rebalance_work = sysfs_field_str(buf, "total work");
+		s->rebalance_rate = sysfs_field_str(buf, "rate");
+
+		/* The state is on the line(s) following the rate: */
+		state = strstr(buf, "\nrate:");
+		state = state ? strchr(state + 1, '\n') : NULL;
+		if (state && state[1]) {
+			char *nl;
+
+			state = strdup(state + 1);
+			while ((nl = strchr(state, '\n'))) {
+				if (nl[1])
+					*nl = ' ';
+				else
+					*nl = '\0';
+			}
+			s->rebalance_state = state;
+		}
+	}
+	free(buf);
+}
+
+static double top_interval(const struct top_sample *prev,
+			   const struct top_sample *cur)
+{
+	return (cur->time.tv_sec - prev->time.tv_sec) +
+		(cur->time.tv_nsec - prev->time.tv_nsec) / (double) NSEC_PER_SEC;
+}
+
+static u64 top_rate(u64 prev, u64 cur, double interval)
+{
+	return cur > prev && interval > 0 ? (cur - prev) / interval : 0;
+}
+
+static const struct top_dev *top_prev_dev(const struct top_sample *prev,
+					  unsigned idx)
+{
+	unsigned i;
+
+	for (i = 0; i < prev->nr_devs; i++)
+		if (prev->devs[i].idx == idx)
+			return &prev->devs[i];
+	return NULL;
+}
+
+static const struct top_time_stats *
+top_prev_time_stats(const struct top_sample *prev, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < prev->nr_time_stats; i++)
+		if (!strcmp(prev->time_stats[i].name, name))
+			return &prev->time_stats[i];
+	return NULL;
+}
+
+static unsigned top_pct(u64 n, u64 d)
+{
+	return d ? min_t(u64, n * 100 / d, 100) : 0;
+}
+
+static void top_print(const char *fs_name,
+		      const struct top_sample *prev,
+		      const struct top_sample *cur)
+{
+	double interval = top_interval(prev, cur);
+	const struct top_journal *j = &cur->journal;
+	char b1[16], b2[16], b3[16], b4[16], b5[16];
+	unsigned i;
+
+	/* clear screen, home cursor: */
+	printf("\033[H\033[2J");
+	printf("bcachefs fs top: %s (interval %.1fs)\n\n", fs_name, interval);
+
+	printf("%-20s%12s%12s%10s%10s%10s%10s\n",
+	       "Device", "read/s", "write/s",
+	       "rd p50", "rd p99", "wr p50", "wr p99");
+
+	for (i = 0; i < cur->nr_devs; i++) {
+		const struct top_dev *d = &cur->devs[i];
+		const struct top_dev *p = top_prev_dev(prev, d->idx);
+		char *name = mprintf("%u %s", d->idx, d->label ?: "");
+
+		printf("%-20s", name);
+		printf("%12s", pr_units(p ? top_rate(p->io_done[READ],
+				d->io_done[READ], interval) >> 9 : 0,
+				HUMAN_READABLE));
+		printf("%12s", pr_units(p ? top_rate(p->io_done[WRITE],
+				d->io_done[WRITE], interval) >> 9 : 0,
+				HUMAN_READABLE));
+		printf("%10s%10s%10s%10s\n",
+		       pr_ns(b1, sizeof(b1), d->latency[READ].p50),
+		       pr_ns(b2, sizeof(b2), d->latency[READ].p99),
+		       pr_ns(b3, sizeof(b3), d->latency[WRITE].p50),
+		       pr_ns(b4, sizeof(b4), d->latency[WRITE].p99));
+		free(name);
+	}
+
+	printf("\n%-28s%10s%10s%10s%10s%10s%10s\n",
+	       "Operation", "ops/s", "avg", "p50", "p99", "p999", "max");
+
+	for (i = 0; i < cur->nr_time_stats; i++) {
+		const struct top_time_stats *t = &cur->time_stats[i];
+		const struct top_time_stats *p =
+			top_prev_time_stats(prev, t->name);
+
+		printf("%-28s%10llu%10s%10s%10s%10s%10s\n", t->name,
+		       p ? top_rate(p->l.count, t->l.count, interval) : 0,
+		       pr_ns(b1, sizeof(b1), t->l.avg),
+		       pr_ns(b2, sizeof(b2), t->l.p50),
+		       pr_ns(b3, sizeof(b3), t->l.p99),
+		       pr_ns(b4, sizeof(b4), t->l.p999),
+		       pr_ns(b5, sizeof(b5), t->l.max));
+	}
+
+	printf("\nJournal: seq %llu (%llu/s), %llu entries pinned, "
+	       "current entry %u%% full, ring %u%% full\n",
+	       j->seq,
+	       top_rate(prev->journal.seq, j->seq, interval),
+	       j->seq - j->last_seq + 1,
+	       j->entry_offset <= j->entry_u64s
+	       ? top_pct(j->entry_offset, j->entry_u64s) : 0,
+	       top_pct(j->ring_used, j->ring_nr));
+
+	printf("Rebalance: work %s, rate %s, %s\n",
+	       cur->rebalance_work ?: "-",
+	       cur->rebalance_rate ?: "-",
+	       cur->rebalance_state ?: "-");
+
+	for (i = 0; i < cur->nr_devs; i++) {
+		const struct top_dev *d = &cur->devs[i];
+
+		if (d->copygc_rate)
+			printf("Copygc dev %u: rate %s, target %s, actual %s\n",
+			       d->idx, d->copygc_rate,
+			       d->copygc_target ?: "-",
+			       d->copygc_actual ?: "-");
+	}
+
+	fflush(stdout);
+}
+
+static void json_str(const char *s)
+{
+	putchar('"');
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < ' ')
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void json_latency(const struct top_latency *l)
+{
+	printf("{\"count\":%llu,\"avg_ns\":%llu,\"p50_ns\":%llu,"
+	       "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+	       l->count, l->avg, l->p50, l->p99, l->p999, l->max);
+}
+
+static void top_print_json(const struct top_sample *prev,
+			   const struct top_sample *cur)
+{
+	double interval = top_interval(prev, cur);
+	const struct top_journal *j = &cur->journal;
+	unsigned i;
+
+	printf("{\"time\":%lu.%09lu,\"interval\":%.3f,\"devices\":[",
+	       cur->time.tv_sec, cur->time.tv_nsec, interval);
+
+	for (i = 0; i < cur->nr_devs; i++) {
+		const struct top_dev *d = &cur->devs[i];
+		const struct top_dev *p = top_prev_dev(prev, d->idx);
+
+		printf("%s{\"idx\":%u,\"label\":", i ? "," : "", d->idx);
+		json_str(d->label);
+		printf(",\"read_bytes_sec\":%llu,\"write_bytes_sec\":%llu"
+		       ",\"read_latency_ns\":%llu,\"write_latency_ns\":%llu",
+		       p ? top_rate(p->io_done[READ], d->io_done[READ], interval) : 0,
+		       p ? top_rate(p->io_done[WRITE], d->io_done[WRITE], interval) : 0,
+		       d->cur_latency[READ], d->cur_latency[WRITE]);
+		printf(",\"read_latency\":");
+		json_latency(&d->latency[READ]);
+		printf(",\"write_latency\":");
+		json_latency(&d->latency[WRITE]);
+
+		if (d->copygc_rate) {
+			printf(",\"copygc\":{\"rate\":");
+			json_str(d->copygc_rate);
+			printf(",\"target\":");
+			json_str(d->copygc_target);
+			printf(",\"actual\":");
+			json_str(d->copygc_actual);
+			printf("}");
+		}
+		printf("}");
+	}
+
+	printf("],\"time_stats\":{");
+
+	for (i = 0; i < cur->nr_time_stats; i++) {
+		const struct top_time_stats *t = &cur->time_stats[i];
+		const struct top_time_stats *p =
+			top_prev_time_stats(prev, t->name);
+
+		printf("%s", i ? "," : "");
+		json_str(t->name);
+		printf(":{\"rate\":%llu,\"latency\":",
+		       p ? top_rate(p->l.count, t->l.count, interval) : 0);
+		json_latency(&t->l);
+		printf("}");
+	}
+
+	printf("},\"journal\":{\"seq\":%llu,\"last_seq\":%llu"
+	       ",\"entry_u64s\":%llu,\"entry_offset\":%llu"
+	       ",\"ring_used\":%u,\"ring_nr\":%u}",
+	       j->seq, j->last_seq,
+	       j->entry_u64s, j->entry_offset,
+	       j->ring_used, j->ring_nr);
+
+	printf(",\"rebalance\":{\"work\":");
+	json_str(cur->rebalance_work);
+	printf(",\"rate\":");
+	json_str(cur->rebalance_rate);
+	printf(",\"state\":");
+	json_str(cur->rebalance_state);
+	printf("}}\n");
+
+	fflush(stdout);
+}
+
+static void fs_top_usage(void)
+{
+	puts("bcachefs fs top - monitor a running filesystem\n"
+	     "Usage: bcachefs fs top [OPTION]... [filesystem]\n"
+	     "\n"
+	     "Options:\n"
+	     "  -i, --interval=seconds      Time between samples (default 1)\n"
+	     "  -n, --count=nr              Exit after nr samples\n"
+	     "  -j, --json                  Print one JSON object per sample\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_fs_top(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "interval",		required_argument,	NULL, 'i' },
+		{ "count",		required_argument,	NULL, 'n' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct top_sample *prev, *cur;
+	double interval = 1;
+	unsigned long count = 0, nr;
+	bool json = false;
+	char *fs_path;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "i:n:jh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'i':
+			interval = strtod(optarg, NULL);
+			if (interval <= 0)
+				die("invalid interval %s", optarg);
+			break;
+		case 'n':
+			if (kstrtoul(optarg, 10, &count))
+				die("invalid count %s", optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'h':
+			fs_top_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	fs_path = arg_pop() ?: ".";
+	if (argc)
+		die("too many arguments");
+
+	struct bchfs_handle fs = bcache_fs_open(fs_path);
+
+	prev = xcalloc(1, sizeof(*prev));
+	cur = xcalloc(1, sizeof(*cur));
+
+	top_sample_read(fs, prev);
+
+	for (nr = 0; !count || nr < count; nr++) {
+		struct timespec ts = {
+			.tv_sec		= interval,
+			.tv_nsec	= (interval - (u64) interval) * NSEC_PER_SEC,
+		};
+
+		nanosleep(&ts, NULL);
+		top_sample_read(fs, cur);
+
+		if (json)
+			top_print_json(prev, cur);
+		else
+			top_print(fs_path, prev, cur);
+
+		top_sample_free(prev);
+		swap(prev, cur);
+	}
+
+	top_sample_free(prev);
+	free(prev);
+	free(cur);
+	bcache_fs_close(fs);
+	return 0;
+}
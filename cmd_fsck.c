@@ -16,6 +16,7 @@ static void usage(void)
 	     "  -y     Assume \"yes\" to all questions\n"
 	     "  -f     Force checking even if filesystem is marked clean\n"
 	     "  -v     Be verbose\n"
+	     "  -m mem Memory for checking link counts (default 256M)\n"
 	     " --h     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -23,12 +24,13 @@ static void usage(void)
 int cmd_fsck(int argc, char *argv[])
 {
 	struct bch_opts opts = bch2_opts_empty();
+	u64 mem;
 	int opt, ret = 0;
 
 	opt_set(opts, degraded, true);
 	opt_set(opts, fix_errors, FSCK_OPT_ASK);
 
-	while ((opt = getopt(argc, argv, "apynfvh")) != -1)
+	while ((opt = getopt(argc, argv, "apynfvm:h")) != -1)
 		switch (opt) {
 		case 'a': /* outdated alias for -p */
 		case 'p':
@@ -47,6 +49,12 @@ int cmd_fsck(int argc, char *argv[])
 		case 'v':
 			opt_set(opts, verbose_recovery, true);
 			break;
+		case 'm':
+			if (bch2_strtoull_h(optarg, &mem) || mem < (1 << 20))
+				die("invalid memory size");
+
+			opt_set(opts, fsck_memory, min_t(u64, mem >> 20, U32_MAX));
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
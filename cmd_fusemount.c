@@ -0,0 +1,1632 @@
+#ifdef BCACHEFS_FUSE
+
+#include <errno.h>
+#include <float.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#define FUSE_USE_VERSION 32
+#include <fuse_lowlevel.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include <linux/dcache.h>
+#include <linux/rhashtable.h>
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/btree_key_cache.h"
+#include "libbcachefs/btree_update.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/dirent.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/fs.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io.h"
+#include "libbcachefs/journal.h"
+#include "libbcachefs/keylist.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/str_hash.h"
+#include "libbcachefs/super.h"
+
+/*
+ * FUSE frontend: runs the whole filesystem - dirents, inodes, the read and
+ * write paths and the journal - in userspace, on top of libfuse's low level
+ * API.
+ *
+ * We're the only writer, so the kernel is told to cache attributes and
+ * dentries indefinitely and to do writeback caching: the page cache absorbs
+ * small writes and we see them in large, mostly block aligned chunks.
+ */
+
+/* Lookups and attributes can only change through us: */
+#define FUSE_TIMEOUT		DBL_MAX
+
+struct bcachefs_fuse_inode {
+	struct rhash_head	hash;
+	struct list_head	list;
+	u64			inum;
+
+	/* kernel's lookup count, and requests in flight: */
+	u64			nlookup;
+	unsigned		ref;
+	/* kernel forgot it: delete it, if unlinked, when the last ref goes */
+	bool			evict;
+
+	/* serializes read-modify-write of the inode, and writes to it: */
+	struct mutex		lock;
+};
+
+struct bcachefs_fuse {
+	struct bch_fs		*c;
+
+	struct mutex		lock;
+	struct rhashtable	inodes;
+	struct list_head	inodes_list;
+};
+
+static const struct rhashtable_params bcachefs_fuse_inode_params = {
+	.head_offset	= offsetof(struct bcachefs_fuse_inode, hash),
+	.key_offset	= offsetof(struct bcachefs_fuse_inode, inum),
+	.key_len	= sizeof(u64),
+};
+
+static inline u64 map_root_ino(u64 ino)
+{
+	return ino == FUSE_ROOT_ID ? BCACHEFS_ROOT_INO : ino;
+}
+
+static inline u64 unmap_root_ino(u64 ino)
+{
+	return ino == BCACHEFS_ROOT_INO ? FUSE_ROOT_ID : ino;
+}
+
+/*
+ * Requests are run on libfuse's worker threads, which the shims don't know
+ * about - they need a task_struct and to be registered with urcu before they
+ * can call into the filesystem:
+ */
+static pthread_key_t fuse_thread_key;
+
+static void fuse_thread_exit(void *p)
+{
+	rcu_unregister_thread();
+	current = NULL;
+	free(p);
+}
+
+static struct bcachefs_fuse *fuse_req_fs(fuse_req_t req)
+{
+	if (!current) {
+		struct task_struct *p = xcalloc(1, sizeof(*p));
+
+		p->state	= TASK_RUNNING;
+		atomic_set(&p->usage, 1);
+		init_completion(&p->exited);
+
+		current = p;
+		rcu_register_thread();
+		pthread_setspecific(fuse_thread_key, p);
+	}
+
+	return fuse_req_userdata(req);
+}
+
+/* Inode table: */
+
+static struct bcachefs_fuse_inode *fuse_inode_get(struct bcachefs_fuse *f,
+						  u64 inum)
+{
+	struct bcachefs_fuse_inode *inode;
+
+	mutex_lock(&f->lock);
+	inode = rhashtable_lookup_fast(&f->inodes, &inum,
+				       bcachefs_fuse_inode_params);
+	if (!inode) {
+		inode = kzalloc(sizeof(*inode), GFP_KERNEL);
+		if (!inode)
+			goto out;
+
+		inode->inum = inum;
+		mutex_init(&inode->lock);
+
+		if (rhashtable_lookup_insert_fast(&f->inodes, &inode->hash,
+						  bcachefs_fuse_inode_params)) {
+			kfree(inode);
+			inode = NULL;
+			goto out;
+		}
+
+		list_add(&inode->list, &f->inodes_list);
+	}
+
+	inode->ref++;
+out:
+	mutex_unlock(&f->lock);
+	return inode;
+}
+
+/*
+ * Unlinked inodes are deleted when the kernel forgets about them, which can be
+ * well after the last unlink if the file was still open:
+ */
+static void fuse_inode_evict(struct bch_fs *c, u64 inum)
+{
+	struct bch_inode_unpacked inode_u;
+
+	if (!bch2_inode_find_by_inum(c, inum, &inode_u) &&
+	    (inode_u.bi_flags & BCH_INODE_UNLINKED))
+		bch2_inode_rm(c, inum);
+}
+
+static void fuse_inode_put(struct bcachefs_fuse *f,
+			   struct bcachefs_fuse_inode *inode)
+{
+	u64 inum = inode->inum;
+	bool evict = false;
+
+	mutex_lock(&f->lock);
+	if (!--inode->ref && !inode->nlookup) {
+		BUG_ON(rhashtable_remove_fast(&f->inodes, &inode->hash,
+					      bcachefs_fuse_inode_params));
+		list_del(&inode->list);
+		evict = inode->evict;
+		kfree(inode);
+	}
+	mutex_unlock(&f->lock);
+
+	if (evict)
+		fuse_inode_evict(f->c, inum);
+}
+
+static void fuse_inode_nlookup_add(struct bcachefs_fuse *f, u64 inum,
+				   s64 nr)
+{
+	struct bcachefs_fuse_inode *inode = fuse_inode_get(f, inum);
+
+	if (inode) {
+		mutex_lock(&f->lock);
+		inode->nlookup += nr;
+		inode->evict = nr < 0 && !inode->nlookup;
+		mutex_unlock(&f->lock);
+
+		fuse_inode_put(f, inode);
+	}
+}
+
+/* returns 0 if we want to do the update, or error is passed up */
+typedef int (*fuse_inode_set_fn)(struct bch_fs *,
+				 struct bch_inode_unpacked *, void *);
+
+static int __fuse_inode_update(struct bch_fs *c, u64 inum,
+			       struct bch_inode_unpacked *inode_u,
+			       fuse_inode_set_fn set, void *p)
+{
+	return bch2_inode_find_by_inum(c, inum, inode_u) ?:
+		(set ? set(c, inode_u, p) : 0) ?:
+		bch2_inode_write(c, inode_u, NULL);
+}
+
+static int fuse_inode_update(struct bcachefs_fuse *f, u64 inum,
+			     struct bch_inode_unpacked *inode_u,
+			     fuse_inode_set_fn set, void *p)
+{
+	struct bcachefs_fuse_inode *inode = fuse_inode_get(f, inum);
+	int ret;
+
+	if (!inode)
+		return -ENOMEM;
+
+	mutex_lock(&inode->lock);
+	ret = __fuse_inode_update(f->c, inum, inode_u, set, p);
+	mutex_unlock(&inode->lock);
+
+	fuse_inode_put(f, inode);
+	return ret;
+}
+
+/*
+ * Updates that have to touch several inodes atomically - along with dirents -
+ * take their locks in inode number order, so they can't deadlock with each
+ * other:
+ */
+#define FUSE_INODES_MAX		3
+
+struct fuse_inodes {
+	unsigned			nr;
+	u64				inum[FUSE_INODES_MAX];
+	struct bcachefs_fuse_inode	*inode[FUSE_INODES_MAX];
+};
+
+static void fuse_inodes_add(struct fuse_inodes *l, u64 inum)
+{
+	unsigned i;
+
+	for (i = 0; i < l->nr && l->inum[i] <= inum; i++)
+		if (l->inum[i] == inum)
+			return;
+
+	BUG_ON(l->nr == FUSE_INODES_MAX);
+	memmove(&l->inum[i + 1], &l->inum[i],
+		(l->nr - i) * sizeof(l->inum[0]));
+	l->inum[i] = inum;
+	l->nr++;
+}
+
+static void fuse_inodes_unlock(struct bcachefs_fuse *f,
+			       struct fuse_inodes *l, unsigned nr)
+{
+	while (nr--) {
+		mutex_unlock(&l->inode[nr]->lock);
+		fuse_inode_put(f, l->inode[nr]);
+	}
+}
+
+static int fuse_inodes_lock(struct bcachefs_fuse *f, struct fuse_inodes *l)
+{
+	unsigned i;
+
+	for (i = 0; i < l->nr; i++) {
+		l->inode[i] = fuse_inode_get(f, l->inum[i]);
+		if (!l->inode[i]) {
+			fuse_inodes_unlock(f, l, i);
+			return -ENOMEM;
+		}
+
+		mutex_lock(&l->inode[i]->lock);
+	}
+
+	return 0;
+}
+
+/* As __fuse_inode_update(), but as part of a larger transaction: */
+static int fuse_inode_update_trans(struct btree_trans *trans, u64 inum,
+				   struct bch_inode_unpacked *inode_u,
+				   fuse_inode_set_fn set, void *p)
+{
+	struct btree_iter *iter;
+	struct bkey_inode_buf *inode_p, cached;
+	struct bkey_s_c k;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_INODES, POS(inum, 0),
+				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+	if (IS_ERR(iter))
+		return PTR_ERR(iter);
+
+	k = bch2_btree_key_cache_peek_slot(iter, &cached.inode.k_i,
+					   sizeof(cached) / sizeof(u64));
+	if ((ret = btree_iter_err(k)))
+		return ret;
+
+	if (k.k->type != BCH_INODE_FS)
+		return -ENOENT;
+
+	ret = bch2_inode_unpack(bkey_s_c_to_inode(k), inode_u) ?:
+		(set ? set(trans->c, inode_u, p) : 0);
+	if (ret)
+		return ret;
+
+	inode_p = bch2_trans_kmalloc(trans, sizeof(*inode_p));
+	if (IS_ERR(inode_p))
+		return PTR_ERR(inode_p);
+
+	bch2_inode_pack(inode_p, inode_u);
+	bch2_trans_update(trans, iter, &inode_p->inode.k_i, 0);
+	return 0;
+}
+
+/* Helpers: */
+
+static u64 fuse_now(struct bch_fs *c)
+{
+	return timespec_to_bch2_time(c,
+		timespec_trunc(current_kernel_time(), c->sb.time_precision));
+}
+
+static struct bch_io_opts fuse_io_opts(struct bch_fs *c,
+				       struct bch_inode_unpacked *inode_u)
+{
+	struct bch_io_opts opts = bch2_opts_to_inode_opts(c->opts);
+
+	bch2_io_opts_apply(&opts, bch2_inode_opts_get(inode_u));
+	return opts;
+}
+
+static struct stat inode_to_stat(struct bch_fs *c,
+				 struct bch_inode_unpacked *bi)
+{
+	struct stat attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.st_ino	= unmap_root_ino(bi->bi_inum);
+	attr.st_mode	= bi->bi_mode;
+	attr.st_nlink	= bi->bi_flags & BCH_INODE_UNLINKED
+		? 0
+		: bi->bi_nlink + nlink_bias(bi->bi_mode);
+	attr.st_uid	= bi->bi_uid;
+	attr.st_gid	= bi->bi_gid;
+	attr.st_rdev	= bi->bi_dev;
+	attr.st_size	= bi->bi_size;
+	attr.st_blksize	= block_bytes(c);
+	attr.st_blocks	= bi->bi_sectors;
+	attr.st_atim	= bch2_time_to_timespec(c, bi->bi_atime);
+	attr.st_mtim	= bch2_time_to_timespec(c, bi->bi_mtime);
+	attr.st_ctim	= bch2_time_to_timespec(c, bi->bi_ctime);
+
+	return attr;
+}
+
+static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
+					      struct bch_inode_unpacked *bi)
+{
+	return (struct fuse_entry_param) {
+		.ino		= unmap_root_ino(bi->bi_inum),
+		.generation	= bi->bi_generation,
+		.attr		= inode_to_stat(c, bi),
+		.attr_timeout	= FUSE_TIMEOUT,
+		.entry_timeout	= FUSE_TIMEOUT,
+	};
+}
+
+static void fuse_reply_entry_ref(fuse_req_t req, struct bcachefs_fuse *f,
+				 struct bch_inode_unpacked *inode_u)
+{
+	struct fuse_entry_param e = inode_to_entry(f->c, inode_u);
+
+	fuse_inode_nlookup_add(f, inode_u->bi_inum, 1);
+
+	if (fuse_reply_entry(req, &e))
+		fuse_inode_nlookup_add(f, inode_u->bi_inum, -1);
+}
+
+/* Data IO: */
+
+struct fuse_sectors_hook {
+	struct extent_insert_hook	hook;
+	s64				sectors;
+};
+
+static enum btree_insert_ret
+fuse_sectors_hook_fn(struct extent_insert_hook *hook,
+		     struct bpos committed_pos,
+		     struct bpos next_pos,
+		     struct bkey_s_c k,
+		     const struct bkey_i *insert)
+{
+	struct fuse_sectors_hook *h = container_of(hook,
+				struct fuse_sectors_hook, hook);
+	s64 sectors = next_pos.offset - committed_pos.offset;
+	int sign = bkey_extent_is_allocation(&insert->k) -
+		(k.k && bkey_extent_is_allocation(k.k));
+
+	h->sectors += sectors * sign;
+
+	return BTREE_INSERT_OK;
+}
+
+static inline struct fuse_sectors_hook fuse_sectors_hook_init(void)
+{
+	return (struct fuse_sectors_hook) {
+		.hook.fn	= fuse_sectors_hook_fn,
+	};
+}
+
+struct fuse_write_op {
+	struct fuse_sectors_hook	hook;
+
+	/* must be last: */
+	struct bch_write_op		op;
+	struct bio_vec			bv[0];
+};
+
+static int fuse_write_index_update(struct bch_write_op *wop)
+{
+	struct fuse_write_op *op = container_of(wop,
+				struct fuse_write_op, op);
+	struct keylist *keys = &wop->insert_keys;
+	struct btree_iter iter;
+	int ret;
+
+	bch2_btree_iter_init(&iter, wop->c, BTREE_ID_EXTENTS,
+			     bkey_start_pos(&bch2_keylist_front(keys)->k),
+			     BTREE_ITER_INTENT);
+
+	ret = bch2_btree_insert_list_at(&iter, keys, &wop->res,
+					&op->hook.hook, op_journal_seq(wop),
+					BTREE_INSERT_NOFAIL|
+					BTREE_INSERT_USE_RESERVE);
+	bch2_btree_iter_unlock(&iter);
+
+	return ret;
+}
+
+static void fuse_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+/* @offset and @len must be sector aligned, @buf page aligned: */
+static int fuse_read_range(struct bch_fs *c,
+			   struct bch_inode_unpacked *inode_u,
+			   void *buf, u64 offset, size_t len)
+{
+	struct bio *bio;
+	struct closure cl;
+	int ret;
+
+	closure_init_stack(&cl);
+
+	bio = bio_alloc_bioset(GFP_NOFS, DIV_ROUND_UP(len, PAGE_SIZE),
+			       &c->bio_read);
+	bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
+	bio->bi_iter.bi_sector	= offset >> 9;
+	bio->bi_iter.bi_size	= len;
+	bio->bi_end_io		= fuse_read_endio;
+	bio->bi_private		= &cl;
+	bch2_bio_map(bio, buf);
+
+	closure_get(&cl);
+	bch2_read(c, rbio_init(bio, fuse_io_opts(c, inode_u)),
+		  inode_u->bi_inum);
+	closure_sync(&cl);
+
+	ret = blk_status_to_errno(bio->bi_status);
+	bio_put(bio);
+
+	return ret;
+}
+
+/* @offset and @len must be block aligned, @buf page aligned: */
+static int fuse_write_range(struct bch_fs *c,
+			    struct bch_inode_unpacked *inode_u,
+			    void *buf, u64 offset, size_t len,
+			    s64 *sectors_added)
+{
+	struct bch_io_opts opts = fuse_io_opts(c, inode_u);
+	unsigned nr_vecs = DIV_ROUND_UP(len, PAGE_SIZE);
+	struct fuse_write_op *op;
+	struct closure cl;
+	int ret;
+
+	BUG_ON(offset	& (block_bytes(c) - 1));
+	BUG_ON(len	& (block_bytes(c) - 1));
+
+	op = kzalloc(sizeof(*op) + nr_vecs * sizeof(struct bio_vec),
+		     GFP_NOFS);
+	if (!op)
+		return -ENOMEM;
+
+	closure_init_stack(&cl);
+
+	op->hook = fuse_sectors_hook_init();
+
+	bch2_write_op_init(&op->op, c, opts);
+	op->op.target		= opts.foreground_target;
+	op->op.nr_replicas	= opts.data_replicas;
+	op->op.write_point	= writepoint_hashed((unsigned long) current);
+	op->op.pos		= POS(inode_u->bi_inum, offset >> 9);
+	op->op.index_update_fn	= fuse_write_index_update;
+
+	bio_init(&op->op.wbio.bio, op->bv, nr_vecs);
+	op->op.wbio.bio.bi_iter.bi_size = len;
+	bch2_bio_map(&op->op.wbio.bio, buf);
+
+	ret = bch2_disk_reservation_get(c, &op->op.res, len >> 9,
+					op->op.nr_replicas, 0);
+	if (ret)
+		goto err;
+
+	closure_call(&op->op.cl, bch2_write, NULL, &cl);
+	closure_sync(&cl);
+
+	ret = op->op.error;
+	*sectors_added += op->hook.sectors;
+err:
+	kfree(op);
+	return ret;
+}
+
+static int fuse_read_block(struct bch_fs *c,
+			   struct bch_inode_unpacked *inode_u,
+			   void *buf, u64 offset)
+{
+	if (offset >= round_up(inode_u->bi_size, block_bytes(c))) {
+		memset(buf, 0, block_bytes(c));
+		return 0;
+	}
+
+	return fuse_read_range(c, inode_u, buf, offset, block_bytes(c));
+}
+
+static void *fuse_buf_alloc(size_t len)
+{
+	void *buf;
+
+	return posix_memalign(&buf, PAGE_SIZE, len) ? NULL : buf;
+}
+
+/*
+ * Writes and truncates mark the inode I_SIZE_DIRTY and I_SECTORS_DIRTY for
+ * the duration of the IO, as fs-io does - i_size and i_sectors are only
+ * updated once the extents are in, so if we crash in between fsck fixes them:
+ */
+struct fuse_size_update {
+	u64		new_size;
+	s64		sectors;
+	bool		appending;
+};
+
+static int fuse_size_dirty_start_fn(struct bch_fs *c,
+				    struct bch_inode_unpacked *bi, void *p)
+{
+	struct fuse_size_update *s = p;
+
+	if (!s->appending)
+		bi->bi_size = s->new_size;
+
+	bi->bi_flags |= BCH_INODE_I_SIZE_DIRTY|BCH_INODE_I_SECTORS_DIRTY;
+	return 0;
+}
+
+static int fuse_size_dirty_finish_fn(struct bch_fs *c,
+				     struct bch_inode_unpacked *bi, void *p)
+{
+	struct fuse_size_update *s = p;
+
+	if (!s->appending || s->new_size > bi->bi_size)
+		bi->bi_size = s->new_size;
+
+	bi->bi_sectors	+= s->sectors;
+	bi->bi_mtime	= bi->bi_ctime = fuse_now(c);
+	bi->bi_flags	&= ~(BCH_INODE_I_SIZE_DIRTY|BCH_INODE_I_SECTORS_DIRTY);
+	return 0;
+}
+
+/* With the inode locked: */
+static int fuse_write(struct bch_fs *c, struct bch_inode_unpacked *inode_u,
+		      struct fuse_bufvec *bufv, u64 offset, size_t size)
+{
+	unsigned bs = block_bytes(c);
+	u64 start = round_down(offset, bs);
+	u64 end = round_up(offset + size, bs);
+	struct fuse_size_update s = {
+		.new_size	= offset + size,
+		.appending	= true,
+	};
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t copied;
+	void *buf;
+	int ret;
+
+	buf = fuse_buf_alloc(end - start);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Partial blocks at either end have to be read in first: */
+	ret = start != offset
+		? fuse_read_block(c, inode_u, buf, start)
+		: 0;
+	if (!ret && end != offset + size &&
+	    (end - bs != start || start == offset))
+		ret = fuse_read_block(c, inode_u, buf + end - bs - start,
+				      end - bs);
+	if (ret)
+		goto err;
+
+	/*
+	 * If the request came in through a pipe (FUSE_CAP_SPLICE_READ), this
+	 * splices it straight into the buffer the write bio maps:
+	 */
+	dst.buf[0].mem = buf + offset - start;
+
+	copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size) {
+		ret = copied < 0 ? copied : -EIO;
+		goto err;
+	}
+
+	ret = __fuse_inode_update(c, inode_u->bi_inum, inode_u,
+				  fuse_size_dirty_start_fn, &s);
+	if (ret)
+		goto err;
+
+	ret = fuse_write_range(c, inode_u, buf, start, end - start,
+			       &s.sectors);
+	if (ret)
+		s.new_size = 0;
+
+	ret = __fuse_inode_update(c, inode_u->bi_inum, inode_u,
+				  fuse_size_dirty_finish_fn, &s) ?: ret;
+err:
+	free(buf);
+	return ret;
+}
+
+/* With the inode locked: */
+static int fuse_truncate(struct bch_fs *c, struct bch_inode_unpacked *inode_u,
+			 u64 new_size)
+{
+	unsigned bs = block_bytes(c);
+	struct fuse_sectors_hook hook = fuse_sectors_hook_init();
+	struct fuse_size_update s = {
+		.new_size	= new_size,
+	};
+	u64 old_size = inode_u->bi_size;
+	int ret;
+
+	ret = __fuse_inode_update(c, inode_u->bi_inum, inode_u,
+				  fuse_size_dirty_start_fn, &s);
+	if (ret)
+		return ret;
+
+	/*
+	 * Zero the part of the last block past the new i_size, so that it
+	 * reads as zeroes if the file is extended again:
+	 */
+	if ((new_size & (bs - 1)) && new_size < old_size) {
+		u64 start = round_down(new_size, bs);
+		void *buf = fuse_buf_alloc(bs);
+
+		ret = -ENOMEM;
+		if (buf) {
+			inode_u->bi_size = old_size;
+			ret = fuse_read_block(c, inode_u, buf, start);
+			inode_u->bi_size = new_size;
+		}
+
+		if (!ret) {
+			memset(buf + (new_size - start), 0,
+			       bs - (new_size - start));
+			ret = fuse_write_range(c, inode_u, buf, start, bs,
+					       &s.sectors);
+		}
+		free(buf);
+	}
+
+	if (!ret)
+		ret = bch2_inode_truncate(c, inode_u->bi_inum,
+					  round_up(new_size, bs) >> 9,
+					  &hook.hook, NULL);
+
+	/* On error, leave i_size dirty: fsck finishes the truncate */
+	if (ret)
+		return ret;
+
+	s.sectors += hook.sectors;
+
+	return __fuse_inode_update(c, inode_u->bi_inum, inode_u,
+				   fuse_size_dirty_finish_fn, &s);
+}
+
+/* Namespace helpers: */
+
+static void fuse_qstr_init(struct qstr *qstr, const char *name)
+{
+	*qstr = (struct qstr) QSTR_INIT(name, strlen(name));
+}
+
+static int fuse_dir_update_fn(struct bch_fs *c,
+			      struct bch_inode_unpacked *bi, void *p)
+{
+	int *nlink_delta = p;
+
+	bi->bi_nlink	+= *nlink_delta;
+	bi->bi_mtime	= bi->bi_ctime = fuse_now(c);
+	return 0;
+}
+
+static int fuse_link_fn(struct bch_fs *c,
+			struct bch_inode_unpacked *bi, void *p)
+{
+	bi->bi_nlink++;
+	bi->bi_ctime = fuse_now(c);
+	return 0;
+}
+
+static int fuse_unlink_fn(struct bch_fs *c,
+			  struct bch_inode_unpacked *bi, void *p)
+{
+	bi->bi_ctime = fuse_now(c);
+
+	if (bi->bi_nlink && !S_ISDIR(bi->bi_mode))
+		bi->bi_nlink--;
+	else
+		bi->bi_flags |= BCH_INODE_UNLINKED;
+	return 0;
+}
+
+static int fuse_create(struct bcachefs_fuse *f, fuse_req_t req, u64 dir,
+		       const char *name, mode_t mode, dev_t rdev,
+		       struct bch_inode_unpacked *new_inode)
+{
+	struct bch_fs *c = f->c;
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct bch_inode_unpacked dir_u;
+	struct bch_hash_info hash_info;
+	struct qstr qstr;
+	int nlink_delta = S_ISDIR(mode);
+	int ret;
+
+	fuse_qstr_init(&qstr, name);
+
+	ret = bch2_inode_find_by_inum(c, dir, &dir_u);
+	if (ret)
+		return ret;
+
+	hash_info = bch2_hash_info_init(c, &dir_u);
+
+	bch2_inode_init(c, new_inode, ctx->uid, ctx->gid, mode, rdev, &dir_u);
+
+	ret = bch2_inode_create(c, new_inode, BLOCKDEV_INODE_MAX, 0,
+				&c->unused_inode_hint);
+	if (ret)
+		return ret;
+
+	ret = bch2_dirent_create(c, dir, &hash_info, mode_to_type(mode),
+				 &qstr, new_inode->bi_inum, NULL,
+				 BCH_HASH_SET_MUST_CREATE);
+	if (ret) {
+		bch2_inode_rm(c, new_inode->bi_inum);
+		return ret;
+	}
+
+	return fuse_inode_update(f, dir, &dir_u,
+				 fuse_dir_update_fn, &nlink_delta);
+}
+
+static int fuse_unlink(struct bcachefs_fuse *f, u64 dir, const char *name,
+		       bool rmdir)
+{
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked dir_u, inode_u;
+	struct bch_hash_info hash_info;
+	struct fuse_inodes l = { .nr = 0 };
+	struct qstr qstr;
+	int nlink_delta = rmdir ? -1 : 0;
+	u64 inum;
+	int ret;
+
+	fuse_qstr_init(&qstr, name);
+
+	ret = bch2_inode_find_by_inum(c, dir, &dir_u);
+	if (ret)
+		return ret;
+
+	hash_info = bch2_hash_info_init(c, &dir_u);
+
+	inum = bch2_dirent_lookup(c, dir, &hash_info, &qstr);
+	if (!inum)
+		return -ENOENT;
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode_u);
+	if (ret)
+		return ret;
+
+	if (rmdir) {
+		if (!S_ISDIR(inode_u.bi_mode))
+			return -ENOTDIR;
+
+		ret = bch2_empty_dir(c, inum);
+		if (ret)
+			return ret;
+	} else if (S_ISDIR(inode_u.bi_mode)) {
+		return -EISDIR;
+	}
+
+	fuse_inodes_add(&l, dir);
+	fuse_inodes_add(&l, inum);
+
+	ret = fuse_inodes_lock(f, &l);
+	if (ret)
+		return ret;
+
+	ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC|BTREE_INSERT_NOFAIL,
+		__bch2_dirent_delete(&trans, dir, &hash_info, &qstr) ?:
+		fuse_inode_update_trans(&trans, dir, &dir_u,
+					fuse_dir_update_fn, &nlink_delta) ?:
+		fuse_inode_update_trans(&trans, inum, &inode_u,
+					fuse_unlink_fn, NULL));
+
+	fuse_inodes_unlock(f, &l, l.nr);
+	return ret;
+}
+
+/* FUSE operations: */
+
+static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
+{
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+}
+
+static void bcachefs_fuse_destroy(void *arg)
+{
+	struct bcachefs_fuse *f = arg;
+	struct bcachefs_fuse_inode *inode;
+
+	/* Anything the kernel never sent us a forget for: */
+	list_for_each_entry(inode, &f->inodes_list, list)
+		fuse_inode_evict(f->c, inode->inum);
+}
+
+static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
+				 const char *name)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked dir_u, inode_u;
+	struct bch_hash_info hash_info;
+	struct qstr qstr;
+	u64 inum;
+	int ret;
+
+	dir = map_root_ino(dir);
+	fuse_qstr_init(&qstr, name);
+
+	ret = bch2_inode_find_by_inum(c, dir, &dir_u);
+	if (ret)
+		goto err;
+
+	hash_info = bch2_hash_info_init(c, &dir_u);
+
+	inum = bch2_dirent_lookup(c, dir, &hash_info, &qstr);
+	if (!inum) {
+		ret = -ENOENT;
+		goto err;
+	}
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode_u);
+	if (ret)
+		goto err;
+
+	fuse_reply_entry_ref(req, f, &inode_u);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_forget(fuse_req_t req, fuse_ino_t inum,
+				 uint64_t nlookup)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+
+	fuse_inode_nlookup_add(f, map_root_ino(inum), -(s64) nlookup);
+	fuse_reply_none(req);
+}
+
+static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_inode_unpacked inode_u;
+	struct stat attr;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(f->c, map_root_ino(inum), &inode_u);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	attr = inode_to_stat(f->c, &inode_u);
+	fuse_reply_attr(req, &attr, FUSE_TIMEOUT);
+}
+
+struct fuse_setattr {
+	struct stat	*attr;
+	int		to_set;
+};
+
+static int fuse_setattr_fn(struct bch_fs *c,
+			   struct bch_inode_unpacked *bi, void *p)
+{
+	struct fuse_setattr *s = p;
+	u64 now = fuse_now(c);
+
+	if (s->to_set & FUSE_SET_ATTR_MODE)
+		bi->bi_mode = (bi->bi_mode & S_IFMT) |
+			(s->attr->st_mode & ~S_IFMT);
+	if (s->to_set & FUSE_SET_ATTR_UID)
+		bi->bi_uid = s->attr->st_uid;
+	if (s->to_set & FUSE_SET_ATTR_GID)
+		bi->bi_gid = s->attr->st_gid;
+
+	if (s->to_set & FUSE_SET_ATTR_ATIME_NOW)
+		bi->bi_atime = now;
+	else if (s->to_set & FUSE_SET_ATTR_ATIME)
+		bi->bi_atime = timespec_to_bch2_time(c, s->attr->st_atim);
+
+	if (s->to_set & FUSE_SET_ATTR_MTIME_NOW)
+		bi->bi_mtime = now;
+	else if (s->to_set & FUSE_SET_ATTR_MTIME)
+		bi->bi_mtime = timespec_to_bch2_time(c, s->attr->st_mtim);
+
+	bi->bi_ctime = s->to_set & FUSE_SET_ATTR_CTIME
+		? timespec_to_bch2_time(c, s->attr->st_ctim)
+		: now;
+	return 0;
+}
+
+static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
+				  struct stat *attr, int to_set,
+				  struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bcachefs_fuse_inode *inode;
+	struct bch_inode_unpacked inode_u;
+	struct fuse_setattr s = { .attr = attr, .to_set = to_set };
+	struct stat new_attr;
+	int ret;
+
+	inode = fuse_inode_get(f, map_root_ino(inum));
+	if (!inode) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	mutex_lock(&inode->lock);
+	ret = bch2_inode_find_by_inum(c, inode->inum, &inode_u);
+
+	if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if (!S_ISREG(inode_u.bi_mode))
+			ret = -EINVAL;
+		else if (attr->st_size != inode_u.bi_size)
+			ret = fuse_truncate(c, &inode_u, attr->st_size);
+	}
+
+	if (!ret)
+		ret = __fuse_inode_update(c, inode->inum, &inode_u,
+					  fuse_setattr_fn, &s);
+	mutex_unlock(&inode->lock);
+
+	fuse_inode_put(f, inode);
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	new_attr = inode_to_stat(c, &inode_u);
+	fuse_reply_attr(req, &new_attr, FUSE_TIMEOUT);
+}
+
+static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked inode_u;
+	char *buf = NULL;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, map_root_ino(inum), &inode_u);
+	if (ret)
+		goto err;
+
+	ret = -EINVAL;
+	if (!S_ISLNK(inode_u.bi_mode) || inode_u.bi_size > PATH_MAX)
+		goto err;
+
+	ret = -ENOMEM;
+	buf = fuse_buf_alloc(round_up(inode_u.bi_size + 1, block_bytes(c)));
+	if (!buf)
+		goto err;
+
+	ret = fuse_read_range(c, &inode_u, buf, 0,
+			      round_up(inode_u.bi_size, block_bytes(c)));
+	if (ret)
+		goto err;
+
+	buf[inode_u.bi_size] = '\0';
+	fuse_reply_readlink(req, buf);
+	free(buf);
+	return;
+err:
+	free(buf);
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
+				const char *name, mode_t mode,
+				dev_t rdev)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_inode_unpacked new_inode;
+	int ret;
+
+	ret = fuse_create(f, req, map_root_ino(dir), name, mode, rdev,
+			  &new_inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_entry_ref(req, f, &new_inode);
+}
+
+static void bcachefs_fuse_mkdir(fuse_req_t req, fuse_ino_t dir,
+				const char *name, mode_t mode)
+{
+	bcachefs_fuse_mknod(req, dir, name, mode|S_IFDIR, 0);
+}
+
+static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
+				 const char *name)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+
+	fuse_reply_err(req, -fuse_unlink(f, map_root_ino(dir), name, false));
+}
+
+static void bcachefs_fuse_rmdir(fuse_req_t req, fuse_ino_t dir,
+				const char *name)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+
+	fuse_reply_err(req, -fuse_unlink(f, map_root_ino(dir), name, true));
+}
+
+static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
+				  fuse_ino_t dir, const char *name)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bcachefs_fuse_inode *inode = NULL;
+	struct bch_inode_unpacked new_inode;
+	size_t len = strlen(link);
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+	int ret;
+
+	ret = fuse_create(f, req, map_root_ino(dir), name,
+			  S_IFLNK|S_IRWXUGO, 0, &new_inode);
+	if (ret)
+		goto err;
+
+	inode = fuse_inode_get(f, new_inode.bi_inum);
+	if (!inode) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/* Same layout as migrate: the target, zero padded to a block: */
+	src.buf[0].mem = (void *) link;
+
+	mutex_lock(&inode->lock);
+	ret = fuse_write(c, &new_inode, &src, 0, len);
+	mutex_unlock(&inode->lock);
+
+	fuse_inode_put(f, inode);
+	if (ret)
+		goto err;
+
+	fuse_reply_entry_ref(req, f, &new_inode);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_rename(fuse_req_t req,
+				 fuse_ino_t src_dir, const char *src_name,
+				 fuse_ino_t dst_dir, const char *dst_name,
+				 unsigned flags)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_info src_dir_i, dst_dir_i;
+	struct bch_inode_unpacked src_dir_u, dst_dir_u;
+	struct bch_inode_unpacked src_inode_u, dst_inode_u;
+	struct fuse_inodes l = { .nr = 0 };
+	struct qstr src_qstr, dst_qstr;
+	enum bch_rename_mode mode;
+	u64 src_inum, dst_inum;
+	int src_nlink_delta = 0, dst_nlink_delta = 0;
+	int ret;
+
+	src_dir = map_root_ino(src_dir);
+	dst_dir = map_root_ino(dst_dir);
+	fuse_qstr_init(&src_qstr, src_name);
+	fuse_qstr_init(&dst_qstr, dst_name);
+
+	ret = -EINVAL;
+	if (flags & ~(RENAME_NOREPLACE|RENAME_EXCHANGE))
+		goto err;
+
+	ret = bch2_inode_find_by_inum(c, src_dir, &src_dir_u) ?:
+		bch2_inode_find_by_inum(c, dst_dir, &dst_dir_u);
+	if (ret)
+		goto err;
+
+	/* bch2_dirent_rename() only needs the inode number and hash info: */
+	memset(&src_dir_i, 0, sizeof(src_dir_i));
+	memset(&dst_dir_i, 0, sizeof(dst_dir_i));
+	src_dir_i.v.i_ino	= src_dir;
+	src_dir_i.ei_str_hash	= bch2_hash_info_init(c, &src_dir_u);
+	dst_dir_i.v.i_ino	= dst_dir;
+	dst_dir_i.ei_str_hash	= bch2_hash_info_init(c, &dst_dir_u);
+
+	ret = -ENOENT;
+	src_inum = bch2_dirent_lookup(c, src_dir, &src_dir_i.ei_str_hash,
+				      &src_qstr);
+	if (!src_inum)
+		goto err;
+
+	dst_inum = bch2_dirent_lookup(c, dst_dir, &dst_dir_i.ei_str_hash,
+				      &dst_qstr);
+
+	ret = bch2_inode_find_by_inum(c, src_inum, &src_inode_u);
+	if (!ret && dst_inum)
+		ret = bch2_inode_find_by_inum(c, dst_inum, &dst_inode_u);
+	if (ret)
+		goto err;
+
+	/* Both names are links to the same inode - there's nothing to do: */
+	if (src_inum == dst_inum && !(flags & RENAME_NOREPLACE))
+		goto err;
+
+	if (flags & RENAME_EXCHANGE) {
+		ret = -ENOENT;
+		if (!dst_inum)
+			goto err;
+
+		mode = BCH_RENAME_EXCHANGE;
+
+		src_nlink_delta = (int) S_ISDIR(dst_inode_u.bi_mode) -
+			(int) S_ISDIR(src_inode_u.bi_mode);
+		dst_nlink_delta = -src_nlink_delta;
+	} else if (dst_inum) {
+		ret = -EEXIST;
+		if (flags & RENAME_NOREPLACE)
+			goto err;
+
+		ret = -ENOTDIR;
+		if (S_ISDIR(src_inode_u.bi_mode) &&
+		    !S_ISDIR(dst_inode_u.bi_mode))
+			goto err;
+
+		ret = -EISDIR;
+		if (!S_ISDIR(src_inode_u.bi_mode) &&
+		    S_ISDIR(dst_inode_u.bi_mode))
+			goto err;
+
+		if (S_ISDIR(dst_inode_u.bi_mode)) {
+			ret = bch2_empty_dir(c, dst_inum);
+			if (ret)
+				goto err;
+		}
+
+		mode = BCH_RENAME_OVERWRITE;
+
+		src_nlink_delta = -(int) S_ISDIR(src_inode_u.bi_mode);
+		dst_nlink_delta = 0;
+	} else {
+		mode = BCH_RENAME;
+
+		src_nlink_delta = -(int) S_ISDIR(src_inode_u.bi_mode);
+		dst_nlink_delta = S_ISDIR(src_inode_u.bi_mode);
+	}
+
+	if (src_dir == dst_dir)
+		src_nlink_delta += dst_nlink_delta;
+
+	fuse_inodes_add(&l, src_dir);
+	fuse_inodes_add(&l, dst_dir);
+	if (mode == BCH_RENAME_OVERWRITE)
+		fuse_inodes_add(&l, dst_inum);
+
+	ret = fuse_inodes_lock(f, &l);
+	if (ret)
+		goto err;
+
+	ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
+		bch2_dirent_rename(&trans,
+				   &src_dir_i, &src_qstr,
+				   &dst_dir_i, &dst_qstr,
+				   mode) ?:
+		fuse_inode_update_trans(&trans, src_dir, &src_dir_u,
+					fuse_dir_update_fn, &src_nlink_delta) ?:
+		(src_dir != dst_dir
+		 ? fuse_inode_update_trans(&trans, dst_dir, &dst_dir_u,
+					fuse_dir_update_fn, &dst_nlink_delta)
+		 : 0) ?:
+		(mode == BCH_RENAME_OVERWRITE
+		 ? fuse_inode_update_trans(&trans, dst_inum, &dst_inode_u,
+					fuse_unlink_fn, NULL)
+		 : 0));
+
+	fuse_inodes_unlock(f, &l, l.nr);
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
+			       fuse_ino_t dir, const char *name)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked dir_u, inode_u;
+	struct bch_hash_info hash_info;
+	struct qstr qstr;
+	int nlink_delta = 0;
+	int ret;
+
+	inum = map_root_ino(inum);
+	dir = map_root_ino(dir);
+	fuse_qstr_init(&qstr, name);
+
+	ret = bch2_inode_find_by_inum(c, dir, &dir_u);
+	if (ret)
+		goto err;
+
+	hash_info = bch2_hash_info_init(c, &dir_u);
+
+	ret = fuse_inode_update(f, inum, &inode_u, fuse_link_fn, NULL);
+	if (ret)
+		goto err;
+
+	ret = bch2_dirent_create(c, dir, &hash_info,
+				 mode_to_type(inode_u.bi_mode),
+				 &qstr, inum, NULL,
+				 BCH_HASH_SET_MUST_CREATE);
+	if (ret) {
+		fuse_inode_update(f, inum, &inode_u, fuse_unlink_fn, NULL);
+		goto err;
+	}
+
+	ret = fuse_inode_update(f, dir, &dir_u,
+				fuse_dir_update_fn, &nlink_delta);
+	if (ret)
+		goto err;
+
+	fuse_reply_entry_ref(req, f, &inode_u);
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
+			       size_t size, off_t offset,
+			       struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bch_inode_unpacked inode_u;
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+	u64 start, end;
+	void *buf;
+	int ret;
+
+	ret = bch2_inode_find_by_inum(c, map_root_ino(inum), &inode_u);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	if (offset >= inode_u.bi_size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	size	= min_t(u64, size, inode_u.bi_size - offset);
+	start	= round_down(offset, 512);
+	end	= round_up(offset + size, 512);
+
+	buf = fuse_buf_alloc(end - start);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = fuse_read_range(c, &inode_u, buf, start, end - start);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto out;
+	}
+
+	/*
+	 * Replying from memory goes out with a single writev: splicing it
+	 * would mean gifting the pages to the pipe, and we free them below:
+	 */
+	bufv.buf[0].size	= size;
+	bufv.buf[0].mem		= buf + offset - start;
+	fuse_reply_data(req, &bufv, 0);
+out:
+	free(buf);
+}
+
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct bcachefs_fuse_inode *inode;
+	struct bch_inode_unpacked inode_u;
+	size_t size = fuse_buf_size(bufv);
+	int ret;
+
+	inode = fuse_inode_get(f, map_root_ino(inum));
+	if (!inode) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	mutex_lock(&inode->lock);
+	ret = bch2_inode_find_by_inum(c, inode->inum, &inode_u) ?:
+		fuse_write(c, &inode_u, bufv, offset, size);
+	mutex_unlock(&inode->lock);
+
+	fuse_inode_put(f, inode);
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, size);
+}
+
+static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum,
+				int datasync, struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+
+	fuse_reply_err(req, -bch2_journal_flush(&f->c->journal));
+}
+
+static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
+				  size_t size, off_t offset,
+				  struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent dirent;
+	char name[BCH_NAME_MAX + 1];
+	struct stat attr;
+	size_t used = 0, entry;
+	unsigned len;
+	char *buf;
+
+	dir = map_root_ino(dir);
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	/*
+	 * Offsets are dirent hash positions, so the kernel can resume a
+	 * listing with just the offset it got back. No dots: the kernel
+	 * resolves those itself, and we don't have parent pointers.
+	 */
+	memset(&attr, 0, sizeof(attr));
+
+	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS,
+			   POS(dir, offset), 0, k) {
+		if (k.k->p.inode > dir)
+			break;
+
+		if (k.k->type != BCH_DIRENT)
+			continue;
+
+		dirent = bkey_s_c_to_dirent(k);
+
+		len = bch2_dirent_name_bytes(dirent);
+		memcpy(name, dirent.v->d_name, len);
+		name[len] = '\0';
+
+		attr.st_ino	= unmap_root_ino(le64_to_cpu(dirent.v->d_inum));
+		attr.st_mode	= dirent.v->d_type << 12;
+
+		entry = fuse_add_direntry(req, buf + used, size - used,
+					  name, &attr, k.k->p.offset + 1);
+		if (entry > size - used)
+			break;
+
+		used += entry;
+	}
+	bch2_btree_iter_unlock(&iter);
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_fs *c = f->c;
+	unsigned shift = ilog2(c->opts.block_size);
+	struct statvfs buf = {
+		.f_bsize	= block_bytes(c),
+		.f_frsize	= block_bytes(c),
+		.f_blocks	= c->capacity >> shift,
+		.f_bfree	= bch2_fs_sectors_free(c,
+					bch2_fs_usage_read(c)) >> shift,
+		.f_files	= 0,
+		.f_ffree	= U32_MAX,
+		.f_namemax	= BCH_NAME_MAX,
+	};
+
+	buf.f_bavail = buf.f_bfree;
+
+	fuse_reply_statfs(req, &buf);
+}
+
+static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
+				 const char *name, mode_t mode,
+				 struct fuse_file_info *fi)
+{
+	struct bcachefs_fuse *f = fuse_req_fs(req);
+	struct bch_inode_unpacked new_inode;
+	struct fuse_entry_param e;
+	int ret;
+
+	ret = fuse_create(f, req, map_root_ino(dir), name, mode, 0,
+			  &new_inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	e = inode_to_entry(f->c, &new_inode);
+
+	fuse_inode_nlookup_add(f, new_inode.bi_inum, 1);
+
+	if (fuse_reply_create(req, &e, fi))
+		fuse_inode_nlookup_add(f, new_inode.bi_inum, -1);
+}
+
+static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
+	.init		= bcachefs_fuse_init,
+	.destroy	= bcachefs_fuse_destroy,
+	.lookup		= bcachefs_fuse_lookup,
+	.forget		= bcachefs_fuse_forget,
+	.getattr	= bcachefs_fuse_getattr,
+	.setattr	= bcachefs_fuse_setattr,
+	.readlink	= bcachefs_fuse_readlink,
+	.mknod		= bcachefs_fuse_mknod,
+	.mkdir		= bcachefs_fuse_mkdir,
+	.unlink		= bcachefs_fuse_unlink,
+	.rmdir		= bcachefs_fuse_rmdir,
+	.symlink	= bcachefs_fuse_symlink,
+	.rename		= bcachefs_fuse_rename,
+	.link		= bcachefs_fuse_link,
+	.read		= bcachefs_fuse_read,
+	.write_buf	= bcachefs_fuse_write_buf,
+	.fsync		= bcachefs_fuse_fsync,
+	.readdir	= bcachefs_fuse_readdir,
+	.fsyncdir	= bcachefs_fuse_fsync,
+	.statfs		= bcachefs_fuse_statfs,
+	.create		= bcachefs_fuse_create,
+};
+
+static void usage(void)
+{
+	puts("bcachefs fusemount - mount a filesystem with FUSE\n"
+	     "Usage: bcachefs fusemount [OPTION]... <devices> <mountpoint>\n"
+	     "\n"
+	     "Runs the filesystem in this process, in the foreground, until it's\n"
+	     "unmounted with fusermount3 -u or interrupted.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -o options                  FUSE mount options\n"
+	     "  -s                          Single threaded\n"
+	     "  -d                          Print FUSE requests\n"
+	     "  -h                          Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+int cmd_fusemount(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_loop_config config = {
+		.clone_fd		= 1,
+		.max_idle_threads	= 10,
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct bcachefs_fuse f;
+	struct fuse_session *se;
+	bool singlethread = false;
+	char *mountpoint, *fsname;
+	int opt, ret;
+
+	fuse_opt_add_arg(&args, "bcachefs");
+
+	while ((opt = getopt(argc, argv, "o:sdh")) != -1)
+		switch (opt) {
+		case 'o':
+			fuse_opt_add_arg(&args, "-o");
+			fuse_opt_add_arg(&args, optarg);
+			break;
+		case 's':
+			singlethread = true;
+			break;
+		case 'd':
+			fuse_opt_add_arg(&args, "-d");
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (argc < 2)
+		die("Please supply device(s) and a mountpoint");
+
+	mountpoint = argv[argc - 1];
+	argc--;
+
+	/* We don't do permission checks ourselves: */
+	fsname = mprintf("-osubtype=bcachefs,fsname=%s,default_permissions",
+			 argv[0]);
+	fuse_opt_add_arg(&args, fsname);
+	free(fsname);
+
+	if (pthread_key_create(&fuse_thread_key, fuse_thread_exit))
+		die("error creating thread key");
+
+	memset(&f, 0, sizeof(f));
+	mutex_init(&f.lock);
+	INIT_LIST_HEAD(&f.inodes_list);
+
+	if (rhashtable_init(&f.inodes, &bcachefs_fuse_inode_params))
+		die("error allocating inode table");
+
+	f.c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(f.c))
+		die("error opening %s: %s", argv[0],
+		    strerror(-PTR_ERR(f.c)));
+
+	/*
+	 * No fuse_daemonize(): forking now would leave the filesystem's
+	 * threads behind in the parent.
+	 */
+	se = fuse_session_new(&args, &bcachefs_fuse_ops,
+			      sizeof(bcachefs_fuse_ops), &f);
+	if (!se)
+		die("error creating FUSE session");
+
+	if (fuse_set_signal_handlers(se))
+		die("error setting signal handlers");
+
+	if (fuse_session_mount(se, mountpoint))
+		die("error mounting %s", mountpoint);
+
+	ret = singlethread
+		? fuse_session_loop(se)
+		: fuse_session_loop_mt(se, &config);
+
+	fuse_session_unmount(se);
+	fuse_remove_signal_handlers(se);
+	fuse_session_destroy(se);
+	fuse_opt_free_args(&args);
+
+	bch2_fs_stop(f.c);
+
+	while (!list_empty(&f.inodes_list)) {
+		struct bcachefs_fuse_inode *inode =
+			list_first_entry(&f.inodes_list,
+					 struct bcachefs_fuse_inode, list);
+
+		list_del(&inode->list);
+		kfree(inode);
+	}
+	rhashtable_destroy(&f.inodes);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif /* BCACHEFS_FUSE */
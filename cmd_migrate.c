@@ -20,6 +20,7 @@
 #include "cmds.h"
 #include "crypto.h"
 #include "libbcachefs.h"
+#include "posix_to_bcachefs.h"
 
 #include <linux/dcache.h>
 #include <linux/generic-radix-tree.h>
@@ -31,6 +32,7 @@
 #include "libbcachefs/fs.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io.h"
+#include "libbcachefs/keylist.h"
 #include "libbcachefs/replicas.h"
 #include "libbcachefs/str_hash.h"
 #include "libbcachefs/super.h"
@@ -113,198 +115,13 @@ static void mark_unreserved_space(struct bch_fs *c, ranges extents)
 	}
 }
 
-static void update_inode(struct bch_fs *c,
-			 struct bch_inode_unpacked *inode)
-{
-	struct bkey_inode_buf packed;
-	int ret;
-
-	bch2_inode_pack(&packed, inode);
-	ret = bch2_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
-				NULL, NULL, NULL, 0);
-	if (ret)
-		die("error creating file: %s", strerror(-ret));
-}
-
-static void create_dirent(struct bch_fs *c,
-			  struct bch_inode_unpacked *parent,
-			  const char *name, u64 inum, mode_t mode)
-{
-	struct bch_hash_info parent_hash_info = bch2_hash_info_init(c, parent);
-	struct qstr qname = { { { .len = strlen(name), } }, .name = name };
-
-	int ret = bch2_dirent_create(c, parent->bi_inum, &parent_hash_info,
-				     mode_to_type(mode), &qname,
-				     inum, NULL, BCH_HASH_SET_MUST_CREATE);
-	if (ret)
-		die("error creating file: %s", strerror(-ret));
-
-	if (S_ISDIR(mode))
-		parent->bi_nlink++;
-}
-
-static void create_link(struct bch_fs *c,
-			struct bch_inode_unpacked *parent,
-			const char *name, u64 inum, mode_t mode)
-{
-	struct bch_inode_unpacked inode;
-	int ret = bch2_inode_find_by_inum(c, inum, &inode);
-	if (ret)
-		die("error looking up hardlink: %s", strerror(-ret));
-
-	inode.bi_nlink++;
-	update_inode(c, &inode);
-
-	create_dirent(c, parent, name, inum, mode);
-}
-
-static struct bch_inode_unpacked create_file(struct bch_fs *c,
-					     struct bch_inode_unpacked *parent,
-					     const char *name,
-					     uid_t uid, gid_t gid,
-					     mode_t mode, dev_t rdev)
-{
-	struct bch_inode_unpacked new_inode;
-	int ret;
-
-	bch2_inode_init(c, &new_inode, uid, gid, mode, rdev, parent);
-
-	ret = bch2_inode_create(c, &new_inode, BLOCKDEV_INODE_MAX, 0,
-				&c->unused_inode_hint);
-	if (ret)
-		die("error creating file: %s", strerror(-ret));
-
-	create_dirent(c, parent, name, new_inode.bi_inum, mode);
-
-	return new_inode;
-}
-
-#define for_each_xattr_handler(handlers, handler)		\
-	if (handlers)						\
-		for ((handler) = *(handlers)++;			\
-			(handler) != NULL;			\
-			(handler) = *(handlers)++)
-
-static const struct xattr_handler *xattr_resolve_name(const char **name)
-{
-	const struct xattr_handler **handlers = bch2_xattr_handlers;
-	const struct xattr_handler *handler;
-
-	for_each_xattr_handler(handlers, handler) {
-		const char *n;
-
-		n = strcmp_prefix(*name, xattr_prefix(handler));
-		if (n) {
-			if (!handler->prefix ^ !*n) {
-				if (*n)
-					continue;
-				return ERR_PTR(-EINVAL);
-			}
-			*name = n;
-			return handler;
-		}
-	}
-	return ERR_PTR(-EOPNOTSUPP);
-}
-
-static void copy_times(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		       struct stat *src)
-{
-	dst->bi_atime = timespec_to_bch2_time(c, src->st_atim);
-	dst->bi_mtime = timespec_to_bch2_time(c, src->st_mtim);
-	dst->bi_ctime = timespec_to_bch2_time(c, src->st_ctim);
-}
-
-static void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
-			char *src)
-{
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, dst);
-
-	char attrs[XATTR_LIST_MAX];
-	ssize_t attrs_size = llistxattr(src, attrs, sizeof(attrs));
-	if (attrs_size < 0)
-		die("listxattr error: %m");
-
-	const char *next, *attr;
-	for (attr = attrs;
-	     attr < attrs + attrs_size;
-	     attr = next) {
-		next = attr + strlen(attr) + 1;
-
-		char val[XATTR_SIZE_MAX];
-		ssize_t val_size = lgetxattr(src, attr, val, sizeof(val));
-
-		if (val_size < 0)
-			die("error getting xattr val: %m");
-
-		const struct xattr_handler *h = xattr_resolve_name(&attr);
-
-		int ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
-				bch2_xattr_set(&trans, dst->bi_inum, &hash_info, attr,
-					       val, val_size, h->flags, 0));
-		if (ret < 0)
-			die("error creating xattr: %s", strerror(-ret));
-	}
-}
-
-static char buf[1 << 20] __aligned(PAGE_SIZE);
-static const size_t buf_pages = sizeof(buf) / PAGE_SIZE;
-
-static void write_data(struct bch_fs *c,
-		       struct bch_inode_unpacked *dst_inode,
-		       u64 dst_offset, void *buf, size_t len)
-{
-	struct {
-		struct bch_write_op op;
-		struct bio_vec bv[buf_pages];
-	} o;
-	struct closure cl;
-
-	BUG_ON(dst_offset	& (block_bytes(c) - 1));
-	BUG_ON(len		& (block_bytes(c) - 1));
-
-	closure_init_stack(&cl);
-
-	bio_init(&o.op.wbio.bio, o.bv, buf_pages);
-	o.op.wbio.bio.bi_iter.bi_size = len;
-	bch2_bio_map(&o.op.wbio.bio, buf);
-
-	bch2_write_op_init(&o.op, c, bch2_opts_to_inode_opts(c->opts));
-	o.op.write_point	= writepoint_hashed(0);
-	o.op.nr_replicas	= 1;
-	o.op.pos		= POS(dst_inode->bi_inum, dst_offset >> 9);
-
-	int ret = bch2_disk_reservation_get(c, &o.op.res, len >> 9,
-					    c->opts.data_replicas, 0);
-	if (ret)
-		die("error reserving space in new filesystem: %s", strerror(-ret));
-
-	closure_call(&o.op.cl, bch2_write, NULL, &cl);
-	closure_sync(&cl);
-
-	dst_inode->bi_sectors += len >> 9;
-}
-
-static void copy_data(struct bch_fs *c,
-		      struct bch_inode_unpacked *dst_inode,
-		      int src_fd, u64 start, u64 end)
-{
-	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
-		unsigned pad = round_up(len, block_bytes(c)) - len;
-
-		xpread(src_fd, buf, len, start);
-		memset(buf + len, 0, pad);
-
-		write_data(c, dst_inode, start, buf, len + pad);
-		start += len;
-	}
-}
-
 static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		      u64 logical, u64 physical, u64 length)
 {
 	struct bch_dev *ca = c->devs[0];
+	struct disk_reservation res;
+	struct keylist keys;
+	int ret;
 
 	BUG_ON(logical	& (block_bytes(c) - 1));
 	BUG_ON(physical & (block_bytes(c) - 1));
@@ -316,19 +133,27 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 
 	BUG_ON(physical + length > bucket_to_sector(ca, ca->mi.nbuckets));
 
+	ret = bch2_disk_reservation_get(c, &res, length, 1,
+					BCH_DISK_RESERVATION_NOFAIL);
+	if (ret)
+		die("error reserving space in new filesystem: %s",
+		    strerror(-ret));
+
+	bch2_keylist_init(&keys, NULL);
+
 	while (length) {
 		struct bkey_i_extent *e;
-		BKEY_PADDED(k) k;
 		u64 b = sector_to_bucket(ca, physical);
-		struct disk_reservation res;
 		unsigned sectors;
-		int ret;
 
 		sectors = min(ca->mi.bucket_size -
 			      (physical & (ca->mi.bucket_size - 1)),
 			      length);
 
-		e = bkey_extent_init(&k.k);
+		if (bch2_keylist_realloc(&keys, NULL, 0, BKEY_EXTENT_U64s_MAX))
+			die("%s", strerror(ENOMEM));
+
+		e = bkey_extent_init(keys.top);
 		e->k.p.inode	= dst->bi_inum;
 		e->k.p.offset	= logical + sectors;
 		e->k.size	= sectors;
@@ -340,37 +165,23 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 
 		set_bit(b, ca->buckets_dirty);
 
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
-						BCH_DISK_RESERVATION_NOFAIL);
-		if (ret)
-			die("error reserving space in new filesystem: %s",
-			    strerror(-ret));
-
 		bch2_mark_bkey_replicas(c, BCH_DATA_USER,
 					extent_i_to_s_c(e).s_c);
-
-		ret = bch2_btree_insert(c, BTREE_ID_EXTENTS, &e->k_i,
-					&res, NULL, NULL, 0);
-		if (ret)
-			die("btree insert error %s", strerror(-ret));
-
-		bch2_disk_reservation_put(c, &res);
+		bch2_keylist_push(&keys);
 
 		dst->bi_sectors	+= sectors;
 		logical		+= sectors;
 		physical	+= sectors;
 		length		-= sectors;
 	}
-}
 
-static void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		      char *src)
-{
-	ssize_t ret = readlink(src, buf, sizeof(buf));
-	if (ret < 0)
-		die("readlink error: %m");
+	/* A large file's extents get packed straight into new leaves: */
+	ret = bch2_btree_bulk_load(c, BTREE_ID_EXTENTS, &keys, &res, 0);
+	if (ret)
+		die("btree insert error %s", strerror(-ret));
 
-	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+	bch2_keylist_free(&keys, NULL);
+	bch2_disk_reservation_put(c, &res);
 }
 
 static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
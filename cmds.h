@@ -20,6 +20,7 @@ int cmd_stop(int argc, char *argv[]);
 #endif
 
 int cmd_fs_usage(int argc, char *argv[]);
+int cmd_fs_top(int argc, char *argv[]);
 
 int cmd_device_add(int argc, char *argv[]);
 int cmd_device_remove(int argc, char *argv[]);
@@ -39,6 +40,9 @@ int cmd_fsck(int argc, char *argv[]);
 
 int cmd_dump(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
+int cmd_bench(int argc, char *argv[]);
+
+int cmd_fusemount(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
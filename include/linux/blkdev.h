@@ -50,6 +50,7 @@ struct inode {
 
 struct file {
 	struct inode		*f_inode;
+	int			f_fd;
 };
 
 static inline struct inode *file_inode(const struct file *f)
@@ -85,6 +86,11 @@ struct block_device {
 
 	struct backing_dev_info	*bd_bdi;
 	struct backing_dev_info	__bd_bdi;
+
+	unsigned		bd_zone_sectors;
+	unsigned		bd_nr_zones;
+	/* write pointers, when a regular file is standing in for a zoned device: */
+	sector_t		*bd_zone_wp;
 };
 
 void generic_make_request(struct bio *);
@@ -98,8 +104,20 @@ static inline void submit_bio(struct bio *bio)
 int blkdev_issue_discard(struct block_device *, sector_t,
 			 sector_t, gfp_t, unsigned long);
 
+int blkdev_reset_zones(struct block_device *, sector_t, sector_t, gfp_t);
+
 #define bdev_get_queue(bdev)		(&((bdev)->queue))
 
+static inline bool bdev_is_zoned(struct block_device *bdev)
+{
+	return bdev->bd_zone_sectors != 0;
+}
+
+static inline sector_t bdev_zone_sectors(struct block_device *bdev)
+{
+	return bdev->bd_zone_sectors;
+}
+
 #define blk_queue_discard(q)		((void) (q), 0)
 #define blk_queue_nonrot(q)		((void) (q), 0)
 
@@ -6,9 +6,11 @@
 #ifndef _LINUX_RANDOM_H
 #define _LINUX_RANDOM_H
 
+#include <string.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <linux/bug.h>
+#include <linux/types.h>
 
 #ifdef __NR_getrandom
 static inline int getrandom(void *buf, size_t buflen, unsigned int flags)
@@ -29,9 +31,38 @@ static inline void get_random_bytes(void *buf, int nbytes)
 	BUG_ON(getrandom(buf, nbytes, 0) != nbytes);
 }
 
+/*
+ * prandom is a per thread xorshift64* generator seeded from getrandom(), so
+ * that it's as cheap as the kernel's and doesn't take a syscall per call:
+ */
+static inline u64 __prandom_u64(void)
+{
+	static __thread u64 state;
+
+	while (unlikely(!state))
+		get_random_bytes(&state, sizeof(state));
+
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline u32 prandom_u32(void)
+{
+	return __prandom_u64() >> 32;
+}
+
 static inline void prandom_bytes(void *buf, int nbytes)
 {
-	return get_random_bytes(buf, nbytes);
+	while (nbytes > 0) {
+		u64 v = __prandom_u64();
+		int n = nbytes < sizeof(v) ? nbytes : sizeof(v);
+
+		memcpy(buf, &v, n);
+		buf	+= n;
+		nbytes	-= n;
+	}
 }
 
 #define get_random_type(type)				\
@@ -0,0 +1,14 @@
+#ifndef __TOOLS_LINUX_SHMEM_FS_H
+#define __TOOLS_LINUX_SHMEM_FS_H
+
+#include <linux/blkdev.h>
+#include <linux/types.h>
+
+#define VM_NORESERVE		0x00200000
+
+struct file *shmem_file_setup(const char *, loff_t, unsigned long);
+ssize_t kernel_read(struct file *, void *, size_t, loff_t *);
+ssize_t kernel_write(struct file *, const void *, size_t, loff_t *);
+void fput(struct file *);
+
+#endif /* __TOOLS_LINUX_SHMEM_FS_H */
@@ -39,10 +39,16 @@ static inline void *krealloc(void *old, size_t size, gfp_t flags)
 	if (flags & __GFP_ZERO)
 		memset(new, 0, size);
 
-	memcpy(new, old,
-	       min(malloc_usable_size(old),
-		   malloc_usable_size(new)));
-	free(old);
+	/*
+	 * krealloc(NULL) is kmalloc(): don't pass NULL to memcpy(), the
+	 * compiler is allowed to assume @old is non NULL afterwards
+	 */
+	if (old) {
+		memcpy(new, old,
+		       min(malloc_usable_size(old),
+			   malloc_usable_size(new)));
+		free(old);
+	}
 
 	return new;
 }
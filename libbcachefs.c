@@ -75,6 +75,8 @@ static void init_layout(struct bch_sb_layout *l, unsigned block_size,
 
 void bch2_pick_bucket_size(struct format_opts opts, struct dev_opts *dev)
 {
+	unsigned zone_sectors;
+
 	if (!dev->sb_offset) {
 		dev->sb_offset	= BCH_SB_SECTOR;
 		dev->sb_end	= BCH_SB_SECTOR + 256;
@@ -83,6 +85,31 @@ void bch2_pick_bucket_size(struct format_opts opts, struct dev_opts *dev)
 	if (!dev->size)
 		dev->size = get_size(dev->path, dev->fd) >> 9;
 
+	zone_sectors = get_zone_sectors(dev->path, dev->fd);
+	if (zone_sectors) {
+		/* Buckets map to zones: */
+		if (zone_sectors > U16_MAX)
+			die("%s: zone size too large (%u sectors, max bucket size %u)",
+			    dev->path, zone_sectors, U16_MAX);
+
+		if (dev->bucket_size && dev->bucket_size != zone_sectors)
+			die("%s: bucket size must match zone size (%u sectors)",
+			    dev->path, zone_sectors);
+
+		dev->bucket_size = zone_sectors;
+
+		/* Metadata has to go on a conventional device: */
+		dev->data_allowed &= BCH_DATA_ALLOWED_ZONED;
+		if (!dev->data_allowed)
+			die("%s: zoned devices can only hold user data",
+			    dev->path);
+
+		if (!zone_is_conventional(dev->path, dev->fd, dev->sb_offset) ||
+		    !zone_is_conventional(dev->path, dev->fd, dev->sb_end - 1))
+			die("%s: superblock must be in a conventional zone",
+			    dev->path);
+	}
+
 	if (!dev->bucket_size) {
 		if (dev->size < min_size(opts.block_size))
 			die("cannot format %s, too small (%llu sectors, min %llu)",
@@ -221,6 +248,18 @@ struct bch_sb *bch2_format(struct format_opts opts,
 	if (clock_gettime(CLOCK_REALTIME, &now))
 		die("error getting current time: %m");
 
+	/* Reproducible builds convention, for images built with --source: */
+	char *epoch = opts.source_date_epoch
+		? getenv("SOURCE_DATE_EPOCH") : NULL;
+	if (epoch) {
+		long secs;
+
+		if (kstrtol(epoch, 10, &secs))
+			die("invalid SOURCE_DATE_EPOCH %s", epoch);
+		now.tv_sec	= secs;
+		now.tv_nsec	= 0;
+	}
+
 	sb.sb->time_base_lo	= cpu_to_le64(now.tv_sec * NSEC_PER_SEC + now.tv_nsec);
 	sb.sb->time_precision	= cpu_to_le32(1);
 
@@ -36,6 +36,9 @@ struct format_opts {
 
 	bool		encrypted;
 	char		*passphrase;
+
+	/* take the superblock time base from SOURCE_DATE_EPOCH, if set: */
+	bool		source_date_epoch;
 };
 
 static inline struct format_opts format_opts_default()
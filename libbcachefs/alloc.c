@@ -32,6 +32,12 @@
  * If we've got discards enabled, that happens when a bucket moves from the
  * free_inc list to the free list.
  *
+ * On zoned devices (host managed SMR, ZNS) buckets are zones, and instead of a
+ * discard the zone is reset at the same point. Zones can only be written at
+ * their write pointer: this works because open buckets are only ever written
+ * through a single write point at a time, which allocates sectors from the
+ * bucket in order and submits each write before dropping its lock.
+ *
  * It's important to ensure that gens don't wrap around - with respect to
  * either the oldest gen in the btree or the gen on disk. This is quite
  * difficult to do in practice, but we explicitly guard against it anyways - if
@@ -57,6 +63,7 @@
 #include "alloc.h"
 #include "btree_cache.h"
 #include "btree_io.h"
+#include "btree_key_cache.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_gc.h"
@@ -286,53 +293,48 @@ int bch2_alloc_read(struct bch_fs *c, struct list_head *journal_replay_list)
 	return 0;
 }
 
+/*
+ * Alloc keys go through the btree key cache: the allocator rewrites them for
+ * every bucket it invalidates, and they only need to hit the btree when the
+ * journal needs the space back.
+ */
 static int __bch2_alloc_write_key(struct bch_fs *c, struct bch_dev *ca,
-				  size_t b, struct btree_iter *iter,
-				  u64 *journal_seq, bool nowait)
+				  size_t b, u64 *journal_seq)
 {
 	struct bucket_mark m;
 	__BKEY_PADDED(k, DIV_ROUND_UP(sizeof(struct bch_alloc), 8)) alloc_key;
+	struct bkey_cached *ck;
 	struct bucket *g;
 	struct bkey_i_alloc *a;
 	u8 *d;
 	int ret;
-	unsigned flags = BTREE_INSERT_ATOMIC|
-		BTREE_INSERT_NOFAIL|
-		BTREE_INSERT_USE_RESERVE|
-		BTREE_INSERT_USE_ALLOC_RESERVE;
 
-	if (nowait)
-		flags |= BTREE_INSERT_NOWAIT;
-
-	bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, b));
-
-	do {
-		ret = btree_iter_err(bch2_btree_iter_peek_slot(iter));
-		if (ret)
-			break;
+	ck = bch2_btree_key_cache_lock(c, BTREE_ID_ALLOC, POS(ca->dev_idx, b));
+	if (IS_ERR(ck))
+		return PTR_ERR(ck);
 
-		percpu_down_read_preempt_disable(&c->usage_lock);
-		g = bucket(ca, b);
-
-		/* read mark under btree node lock: */
-		m = READ_ONCE(g->mark);
-		a = bkey_alloc_init(&alloc_key.k);
-		a->k.p		= iter->pos;
-		a->v.fields	= 0;
-		a->v.gen	= m.gen;
-		set_bkey_val_u64s(&a->k, bch_alloc_val_u64s(&a->v));
-
-		d = a->v.data;
-		if (a->v.fields & (1 << BCH_ALLOC_FIELD_READ_TIME))
-			put_alloc_field(&d, 2, g->io_time[READ]);
-		if (a->v.fields & (1 << BCH_ALLOC_FIELD_WRITE_TIME))
-			put_alloc_field(&d, 2, g->io_time[WRITE]);
-		percpu_up_read_preempt_enable(&c->usage_lock);
+	percpu_down_read_preempt_disable(&c->usage_lock);
+	g = bucket(ca, b);
+
+	/* read mark under key cache lock: */
+	m = READ_ONCE(g->mark);
+	a = bkey_alloc_init(&alloc_key.k);
+	a->k.p		= POS(ca->dev_idx, b);
+	a->v.fields	= 0;
+	a->v.gen	= m.gen;
+	set_bkey_val_u64s(&a->k, bch_alloc_val_u64s(&a->v));
+
+	d = a->v.data;
+	if (a->v.fields & (1 << BCH_ALLOC_FIELD_READ_TIME))
+		put_alloc_field(&d, 2, g->io_time[READ]);
+	if (a->v.fields & (1 << BCH_ALLOC_FIELD_WRITE_TIME))
+		put_alloc_field(&d, 2, g->io_time[WRITE]);
+	percpu_up_read_preempt_enable(&c->usage_lock);
 
-		ret = bch2_btree_insert_at(c, NULL, NULL, journal_seq, flags,
-					   BTREE_INSERT_ENTRY(iter, &a->k_i));
-		bch2_btree_iter_cond_resched(iter);
-	} while (ret == -EINTR);
+	ret = bch2_btree_key_cache_update(c, ck, &a->k_i, journal_seq,
+					  BTREE_INSERT_NOCHECK_RW|
+					  BTREE_INSERT_JOURNAL_RESERVED);
+	bch2_btree_key_cache_unlock(c, ck);
 
 	return ret;
 }
@@ -340,8 +342,6 @@ static int __bch2_alloc_write_key(struct bch_fs *c, struct bch_dev *ca,
 int bch2_alloc_replay_key(struct bch_fs *c, struct bpos pos)
 {
 	struct bch_dev *ca;
-	struct btree_iter iter;
-	int ret;
 
 	if (pos.inode >= c->sb.nr_devices || !c->devs[pos.inode])
 		return 0;
@@ -351,13 +351,7 @@ int bch2_alloc_replay_key(struct bch_fs *c, struct bpos pos)
 	if (pos.offset >= ca->mi.nbuckets)
 		return 0;
 
-	bch2_btree_iter_init(&iter, c, BTREE_ID_ALLOC, POS_MIN,
-			     BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
-
-	ret = __bch2_alloc_write_key(c, ca, pos.offset, &iter,
-				     NULL, false);
-	bch2_btree_iter_unlock(&iter);
-	return ret;
+	return __bch2_alloc_write_key(c, ca, pos.offset, NULL);
 }
 
 int bch2_alloc_write(struct bch_fs *c)
@@ -367,23 +361,17 @@ int bch2_alloc_write(struct bch_fs *c)
 	int ret = 0;
 
 	for_each_rw_member(ca, c, i) {
-		struct btree_iter iter;
 		unsigned long bucket;
 
-		bch2_btree_iter_init(&iter, c, BTREE_ID_ALLOC, POS_MIN,
-				     BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
-
 		down_read(&ca->bucket_lock);
 		for_each_set_bit(bucket, ca->buckets_dirty, ca->mi.nbuckets) {
-			ret = __bch2_alloc_write_key(c, ca, bucket, &iter,
-						     NULL, false);
+			ret = __bch2_alloc_write_key(c, ca, bucket, NULL);
 			if (ret)
 				break;
 
 			clear_bit(bucket, ca->buckets_dirty);
 		}
 		up_read(&ca->bucket_lock);
-		bch2_btree_iter_unlock(&iter);
 
 		if (ret) {
 			percpu_ref_put(&ca->io_ref);
@@ -821,30 +809,21 @@ static void sort_free_inc(struct bch_fs *c, struct bch_dev *ca)
 }
 
 static int bch2_invalidate_free_inc(struct bch_fs *c, struct bch_dev *ca,
-				    u64 *journal_seq, size_t nr,
-				    bool nowait)
+				    u64 *journal_seq, size_t nr)
 {
-	struct btree_iter iter;
 	int ret = 0;
 
-	bch2_btree_iter_init(&iter, c, BTREE_ID_ALLOC, POS(ca->dev_idx, 0),
-			     BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
-
-	/* Only use nowait if we've already invalidated at least one bucket: */
 	while (ca->nr_invalidated < min(nr, fifo_used(&ca->free_inc))) {
 		size_t b = fifo_idx_entry(&ca->free_inc, ca->nr_invalidated);
 
-		ret = __bch2_alloc_write_key(c, ca, b, &iter, journal_seq,
-					     nowait && ca->nr_invalidated);
+		ret = __bch2_alloc_write_key(c, ca, b, journal_seq);
 		if (ret)
 			break;
 
 		ca->nr_invalidated++;
 	}
 
-	bch2_btree_iter_unlock(&iter);
-
-	/* If we used NOWAIT, don't return the error: */
+	/* If we made progress, don't return the error: */
 	return ca->nr_invalidated ? 0 : ret;
 }
 
@@ -894,6 +873,33 @@ static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t
 	return ret;
 }
 
+static void discard_one_bucket(struct bch_fs *c, struct bch_dev *ca,
+			       size_t bucket)
+{
+	struct block_device *bdev = ca->disk_sb.bdev;
+	int ret;
+
+	/* Nothing's been invalidated on disk, the bucket's contents are live: */
+	if (c->opts.nochanges)
+		return;
+
+	if (bdev_is_zoned(bdev)) {
+		/*
+		 * If this fails, writes to the bucket will fail too - and be
+		 * handled as write errors:
+		 */
+		ret = blkdev_reset_zones(bdev, bucket_to_sector(ca, bucket),
+					 ca->mi.bucket_size, GFP_NOIO);
+		if (ret)
+			bch_err(ca, "error %i resetting zone for bucket %zu",
+				ret, bucket);
+	} else if (ca->mi.discard &&
+		   blk_queue_discard(bdev_get_queue(bdev))) {
+		blkdev_issue_discard(bdev, bucket_to_sector(ca, bucket),
+				     ca->mi.bucket_size, GFP_NOIO, 0);
+	}
+}
+
 /*
  * Given an invalidated, ready to use bucket: issue a discard to it if enabled,
  * then add it to the freelist, waiting until there's room if necessary:
@@ -905,11 +911,7 @@ static int discard_invalidated_buckets(struct bch_fs *c, struct bch_dev *ca)
 
 		BUG_ON(fifo_empty(&ca->free_inc) || !ca->nr_invalidated);
 
-		if (ca->mi.discard &&
-		    blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev)))
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bucket),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
+		discard_one_bucket(c, ca, bucket);
 
 		if (push_invalidated_bucket(c, ca, bucket))
 			return 1;
@@ -954,7 +956,7 @@ static int bch2_allocator_thread(void *arg)
 
 			journal_seq = 0;
 			ret = bch2_invalidate_free_inc(c, ca, &journal_seq,
-						       SIZE_MAX, true);
+						       SIZE_MAX);
 			if (ret) {
 				bch_err(ca, "error invalidating buckets: %i", ret);
 				goto stop;
@@ -1268,7 +1270,8 @@ void bch2_wp_rescale(struct bch_fs *c, struct bch_dev *ca,
 		     struct write_point *wp)
 {
 	u64 *v = wp->next_alloc + ca->dev_idx;
-	u64 free_space = dev_buckets_free(c, ca);
+	u64 free_space = __dev_buckets_free(ca,
+				bch2_dev_usage_read_approx(c, ca));
 	u64 free_space_inv = free_space
 		? div64_u64(1ULL << 48, free_space)
 		: 1ULL << 48;
@@ -1708,6 +1711,33 @@ void bch2_alloc_sectors_append_ptrs(struct bch_fs *c, struct write_point *wp,
 	}
 }
 
+/*
+ * Give up on the space left in the buckets we just allocated from, for a write
+ * that can't be split and doesn't fit - bch2_alloc_sectors_done() then drops
+ * them from the write point, and the next allocation gets new buckets.
+ *
+ * Returns false if they're all new buckets, i.e. new buckets won't help:
+ */
+bool bch2_alloc_sectors_skip(struct bch_fs *c, struct write_point *wp)
+{
+	struct open_bucket *ob;
+	unsigned i;
+	bool ret = false;
+
+	writepoint_for_each_ptr(wp, ob, i)
+		if (ob->sectors_free <
+		    bch_dev_bkey_exists(c, ob->ptr.dev)->mi.bucket_size)
+			ret = true;
+
+	if (ret) {
+		writepoint_for_each_ptr(wp, ob, i)
+			ob->sectors_free = 0;
+		wp->sectors_free = 0;
+	}
+
+	return ret;
+}
+
 /*
  * Append pointers to the space we just allocated to @k, and mark @sectors space
  * as allocated out of @ob
@@ -1959,9 +1989,7 @@ static void allocator_start_issue_discards(struct bch_fs *c)
 			if (done == ca->nr_invalidated)
 				break;
 
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bu),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
+			discard_one_bucket(c, ca, bu);
 			done++;
 		}
 	}
@@ -2068,8 +2096,7 @@ not_enough:
 
 	for_each_rw_member(ca, c, dev_iter) {
 		ret = bch2_invalidate_free_inc(c, ca, &journal_seq,
-					       ca->free[RESERVE_BTREE].size,
-					       false);
+					       ca->free[RESERVE_BTREE].size);
 		if (ret) {
 			percpu_ref_put(&ca->io_ref);
 			return ret;
@@ -96,6 +96,7 @@ struct write_point *bch2_alloc_sectors_start(struct bch_fs *,
 
 void bch2_alloc_sectors_append_ptrs(struct bch_fs *, struct write_point *,
 				    struct bkey_i_extent *, unsigned);
+bool bch2_alloc_sectors_skip(struct bch_fs *, struct write_point *);
 void bch2_alloc_sectors_done(struct bch_fs *, struct write_point *);
 
 static inline void bch2_wake_allocator(struct bch_dev *ca)
@@ -304,6 +304,7 @@ enum bch_time_stats {
 #include "btree_types.h"
 #include "buckets_types.h"
 #include "clock_types.h"
+#include "inode_types.h"
 #include "journal_types.h"
 #include "keylist_types.h"
 #include "quota_types.h"
@@ -313,8 +314,12 @@ enum bch_time_stats {
 /* Number of nodes btree coalesce will try to coalesce at once */
 #define GC_MERGE_NODES		4U
 
-/* Maximum number of nodes we might need to allocate atomically: */
-#define BTREE_RESERVE_MAX	(BTREE_MAX_DEPTH + (BTREE_MAX_DEPTH - 1))
+/*
+ * Maximum number of nodes we might need to allocate atomically: a split all the
+ * way up to the root, plus one more for bulk loads, which replace a leaf with
+ * up to three new nodes:
+ */
+#define BTREE_RESERVE_MAX	(BTREE_MAX_DEPTH + BTREE_MAX_DEPTH)
 
 /* Size of the freelist we allocate btree nodes from: */
 #define BTREE_NODE_RESERVE	(BTREE_RESERVE_MAX * 4)
@@ -385,6 +390,12 @@ struct bch_dev {
 	struct bch_dev_usage __percpu *usage_percpu;
 	struct bch_dev_usage	usage_cached;
 
+	/* see bch2_dev_usage_read_approx(): */
+	spinlock_t		usage_approx_lock;
+	seqcount_t		usage_approx_seq;
+	u64			usage_approx_time;
+	struct bch_dev_usage	usage_approx;
+
 	/* Allocator: */
 	struct task_struct __rcu *alloc_thread;
 
@@ -439,6 +450,11 @@ struct bch_dev {
 	atomic_t		congested;
 	u64			congested_last;
 
+	/* Data moves: sectors in flight, and the limit - see move.c */
+	atomic_t		move_sectors[2];
+	unsigned		move_depth[2];
+	u64			move_depth_decreased[2];
+
 	struct io_count __percpu *io_done;
 };
 
@@ -557,6 +573,9 @@ struct bch_fs {
 	struct mutex		btree_root_lock;
 
 	struct btree_cache	btree_cache;
+	struct btree_key_cache	btree_key_cache;
+	struct btree_insert_batch
+				btree_insert_batch[BTREE_INSERT_BATCH_QUEUES];
 
 	mempool_t		btree_reserve_pool;
 
@@ -579,6 +598,11 @@ struct bch_fs {
 	struct workqueue_struct	*wq;
 	/* copygc needs its own workqueue for index updates.. */
 	struct workqueue_struct	*copygc_wq;
+	/*
+	 * journal reclaim blocks on interior updates and journal writes, which
+	 * complete on system_freezable_wq - so it can't run there:
+	 */
+	struct workqueue_struct	*journal_reclaim_wq;
 
 	/* ALLOCATION */
 	struct delayed_work	pd_controllers_update;
@@ -600,6 +624,7 @@ struct bch_fs {
 	struct bch_fs_usage __percpu *usage_percpu;
 	struct bch_fs_usage	usage_cached;
 	struct percpu_rw_semaphore usage_lock;
+	struct disk_reservation_pcpu __percpu *disk_res_pcpu;
 
 	struct closure_waitlist	freelist_wait;
 
@@ -705,6 +730,7 @@ struct bch_fs {
 #endif
 
 	u64			unused_inode_hint;
+	struct inode_nr_alloc	inode_nr_alloc;
 
 	/*
 	 * A btree node on disk could have too many bsets for an iterator to fit
@@ -722,9 +748,12 @@ struct bch_fs {
 	atomic_long_t		read_realloc_races;
 	atomic_long_t		extent_migrate_done;
 	atomic_long_t		extent_migrate_raced;
+	atomic_long_t		extent_migrate_passthrough;
 
 	unsigned		btree_gc_periodic:1;
 	unsigned		copy_gc_enabled:1;
+	unsigned		move_sort_window;
+	unsigned		data_job_shards;
 	bool			promote_whole_extents;
 
 #define BCH_DEBUG_PARAM(name, description) bool name;
@@ -987,6 +987,72 @@ int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 	return (void *) out - _out;
 }
 
+/*
+ * Emit a comparison of two packed keys, both in @format: this is
+ * __bkey_cmp_bits() with the loop unrolled and the shift for the last partial
+ * word known at compile time:
+ */
+int bch2_compile_bkey_cmp(const struct bkey_format *format, void *_out)
+{
+	unsigned nr_key_bits = bkey_format_key_bits(format);
+	unsigned word = high_word_offset(format);
+	u8 *out = _out, *jumps[BKEY_U64s], **j = jumps;
+
+	/*
+	 * rdi: l - packed key
+	 * rsi: r - packed key
+	 */
+
+	/* xor eax, eax */
+	I2(0x31, 0xc0);
+
+	if (!nr_key_bits)
+		goto done;
+
+	while (nr_key_bits > 64) {
+		/* mov rdx, [rdi + imm8] */
+		I4(0x48, 0x8b, 0x57, word * 8);
+		/* cmp rdx, [rsi + imm8] */
+		I4(0x48, 0x3b, 0x56, word * 8);
+		/* jne rel8 - patched below */
+		I2(0x75, 0);
+		*j++ = out;
+
+		nr_key_bits -= 64;
+		word--;
+	}
+
+	/* mov rdx, [rdi + imm8] */
+	I4(0x48, 0x8b, 0x57, word * 8);
+	/* mov rcx, [rsi + imm8] */
+	I4(0x48, 0x8b, 0x4e, word * 8);
+
+	if (nr_key_bits < 64) {
+		/* shr rdx, imm8 */
+		I4(0x48, 0xc1, 0xea, 64 - nr_key_bits);
+		/* shr rcx, imm8 */
+		I4(0x48, 0xc1, 0xe9, 64 - nr_key_bits);
+	}
+
+	/* cmp rdx, rcx */
+	I3(0x48, 0x39, 0xca);
+
+	while (j != jumps) {
+		j--;
+		(*j)[-1] = out - *j;
+	}
+
+	/* seta al */
+	I3(0x0f, 0x97, 0xc0);
+	/* sbb eax, 0 */
+	I3(0x83, 0xd8, 0x00);
+done:
+	/* retq */
+	I1(0xc3);
+
+	return (void *) out - _out;
+}
+
 #else
 static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 				  unsigned nr_key_bits)
@@ -1036,9 +1102,22 @@ int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *l,
 	EBUG_ON(!bkey_packed(l) || !bkey_packed(r));
 	EBUG_ON(b->nr_key_bits != bkey_format_key_bits(f));
 
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	{
+		compiled_cmp_fn cmp_fn = btree_cmp_fn(b);
+
+		ret = cmp_fn(l, r);
+
+		if (btree_keys_expensive_checks(b))
+			BUG_ON(ret != __bkey_cmp_bits(high_word(f, l),
+						      high_word(f, r),
+						      b->nr_key_bits));
+	}
+#else
 	ret = __bkey_cmp_bits(high_word(f, l),
 			      high_word(f, r),
 			      b->nr_key_bits);
+#endif
 
 	EBUG_ON(ret != bkey_cmp(bkey_unpack_pos(b, l),
 				bkey_unpack_pos(b, r)));
@@ -379,11 +379,14 @@ static inline u64 bkey_field_max(const struct bkey_format *f,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 
 int bch2_compile_bkey_format(const struct bkey_format *, void *);
+int bch2_compile_bkey_cmp(const struct bkey_format *, void *);
 
 #else
 
 static inline int bch2_compile_bkey_format(const struct bkey_format *format,
 					  void *out) { return 0; }
+static inline int bch2_compile_bkey_cmp(const struct bkey_format *format,
+					void *out) { return 0; }
 
 #endif
 
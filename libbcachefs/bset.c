@@ -373,7 +373,7 @@ static unsigned bset_aux_tree_buf_start(const struct btree *b,
 					const struct bset_tree *t)
 {
 	return t == b->set
-		? DIV_ROUND_UP(b->unpack_fn_len, 8)
+		? DIV_ROUND_UP(btree_compiled_fns_bytes(b), 8)
 		: bset_aux_tree_buf_end(t - 1);
 }
 
@@ -184,6 +184,27 @@ static inline enum bset_aux_tree_type bset_aux_tree_type(const struct bset_tree
 }
 
 typedef void (*compiled_unpack_fn)(struct bkey *, const struct bkey_packed *);
+typedef int (*compiled_cmp_fn)(const struct bkey_packed *,
+			       const struct bkey_packed *);
+
+/*
+ * aux_data starts with the compiled unpack function, followed by the compiled
+ * comparison function, followed by the auxiliary search trees:
+ */
+static inline unsigned btree_cmp_fn_offset(const struct btree *b)
+{
+	return round_up(b->unpack_fn_len, 16);
+}
+
+static inline unsigned btree_compiled_fns_bytes(const struct btree *b)
+{
+	return btree_cmp_fn_offset(b) + b->cmp_fn_len;
+}
+
+static inline compiled_cmp_fn btree_cmp_fn(const struct btree *b)
+{
+	return b->aux_data + btree_cmp_fn_offset(b);
+}
 
 static inline void
 __bkey_unpack_key_format_checked(const struct btree *b,
@@ -321,6 +342,12 @@ static inline void btree_node_set_format(struct btree *b,
 
 	b->unpack_fn_len = len;
 
+	len = bch2_compile_bkey_cmp(&b->format,
+				    b->aux_data + btree_cmp_fn_offset(b));
+	BUG_ON(len < 0 || len > U8_MAX);
+
+	b->cmp_fn_len = len;
+
 	bch2_bset_set_no_aux_tree(b, b->set);
 }
 
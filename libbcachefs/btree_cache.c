@@ -904,6 +904,7 @@ int bch2_print_btree_node(struct bch_fs *c, struct btree *b,
 			 "    ptrs: %s\n"
 			 "    format: u64s %u fields %u %u %u %u %u\n"
 			 "    unpack fn len: %u\n"
+			 "    cmp fn len: %u\n"
 			 "    bytes used %zu/%zu (%zu%% full)\n"
 			 "    sib u64s: %u, %u (merge threshold %zu)\n"
 			 "    nr packed keys %u\n"
@@ -925,6 +926,7 @@ int bch2_print_btree_node(struct bch_fs *c, struct btree *b,
 			 f->bits_per_field[3],
 			 f->bits_per_field[4],
 			 b->unpack_fn_len,
+			 b->cmp_fn_len,
 			 b->nr.live_u64s * sizeof(u64),
 			 btree_bytes(c) - sizeof(struct btree_node),
 			 b->nr.live_u64s * 100 / btree_max_u64s(c),
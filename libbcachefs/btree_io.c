@@ -1417,6 +1417,9 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 
 	trace_btree_read(c, b);
 
+	/* we don't know which nodes its keys went through before: */
+	b->range_journal_seq = journal_cur_seq(&c->journal);
+
 	ret = bch2_btree_pick_ptr(c, b, NULL, &pick);
 	if (bch2_fs_fatal_err_on(ret <= 0, c,
 			"btree node read error: no device to read from")) {
@@ -0,0 +1,375 @@
+
+#include "bcachefs.h"
+#include "btree_iter.h"
+#include "btree_key_cache.h"
+#include "btree_update.h"
+#include "error.h"
+#include "journal.h"
+#include "journal_reclaim.h"
+
+static const struct rhashtable_params bch2_btree_key_cache_params = {
+	.head_offset	= offsetof(struct bkey_cached, hash),
+	.key_offset	= offsetof(struct bkey_cached, key),
+	.key_len	= sizeof(struct bkey_cached_key),
+};
+
+static void bkey_cached_free(struct btree_key_cache *kc,
+			     struct bkey_cached *ck)
+{
+	lockdep_assert_held(&kc->lock);
+	EBUG_ON(ck->ref || journal_pin_active(&ck->journal));
+
+	BUG_ON(rhashtable_remove_fast(&kc->table, &ck->hash,
+				      bch2_btree_key_cache_params));
+	list_move(&ck->list, &kc->freed);
+	kc->nr--;
+	kc->nr_freed++;
+}
+
+static struct bkey_cached *bkey_cached_alloc(struct btree_key_cache *kc)
+{
+	struct bkey_cached *ck;
+
+	lockdep_assert_held(&kc->lock);
+
+	ck = list_first_entry_or_null(&kc->freed, struct bkey_cached, list);
+	if (ck) {
+		list_del(&ck->list);
+		kc->nr_freed--;
+		memset(ck, 0, sizeof(*ck));
+		return ck;
+	}
+
+	return kzalloc(sizeof(*ck), GFP_NOFS);
+}
+
+/*
+ * Journal pin flush callback: write the cached key back to the btree. We don't
+ * hold the key's lock here - an update might be waiting on journal reclaim for
+ * a journal reservation - so we insert a copy, and go again if it raced with
+ * an update.
+ *
+ * Doesn't need a journal reservation: the key was already journalled, so the
+ * btree node write is pinned with our pin instead. Any btree nodes we have to
+ * allocate come from the reserve, and the allocator's alloc key updates get
+ * their journal reservations from the journal's reserve - so reclaim doesn't
+ * wait on the allocator waiting on a full journal.
+ */
+static void bkey_cached_journal_flush(struct journal *j,
+				      struct journal_entry_pin *pin, u64 seq)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct btree_key_cache *kc = &c->btree_key_cache;
+	struct bkey_cached *ck = container_of(pin, struct bkey_cached, journal);
+	__BKEY_PADDED(k, BKEY_CACHED_VAL_U64s_MAX) tmp;
+	struct btree_insert_entry entry;
+	struct btree_insert trans;
+	struct btree_iter iter;
+	unsigned flags = BTREE_INSERT_NOFAIL|
+		BTREE_INSERT_USE_RESERVE|
+		BTREE_INSERT_NOCHECK_RW;
+	u32 gen;
+	int ret;
+
+	if (ck->key.btree_id == BTREE_ID_ALLOC)
+		flags |= BTREE_INSERT_USE_ALLOC_RESERVE;
+
+	bch2_btree_iter_init(&iter, c, ck->key.btree_id, ck->key.pos,
+			     BTREE_ITER_INTENT);
+
+	mutex_lock(&kc->lock);
+	do {
+		BUG_ON(!ck->valid);
+
+		bkey_copy(&tmp.k, &ck->k);
+		gen = ck->gen;
+
+		memset(&trans, 0, sizeof(trans));
+		trans.c			= c;
+		trans.journal_res.seq	= ck->seq;
+		trans.journal_pin	= &ck->journal;
+		trans.flags		= flags;
+		trans.nr		= 1;
+		trans.entries		= &entry;
+		entry			= BTREE_INSERT_ENTRY(&iter, &tmp.k);
+		mutex_unlock(&kc->lock);
+
+		ret = __bch2_btree_insert_at(&trans);
+
+		mutex_lock(&kc->lock);
+	} while (!ret && ck->gen != gen);
+
+	if (ret)
+		bch2_fs_fatal_error(c, "error %i writing back cached key", ret);
+
+	/*
+	 * No updates since our last insert, and new updates take a new pin if
+	 * this one isn't active - so the btree is now current:
+	 */
+	bch2_journal_pin_drop(j, &ck->journal);
+	ck->valid = false;
+
+	if (!ck->ref)
+		bkey_cached_free(kc, ck);
+	mutex_unlock(&kc->lock);
+
+	bch2_btree_iter_unlock(&iter);
+}
+
+/**
+ * bch2_btree_key_cache_lock - get and lock the cached key at @pos
+ *
+ * Creates the cache entry if it doesn't exist: the key it holds is then
+ * invalid until the first bch2_btree_key_cache_update(). Holding the lock
+ * serializes against other updates, for read-modify-write.
+ */
+struct bkey_cached *bch2_btree_key_cache_lock(struct bch_fs *c,
+					      enum btree_id btree_id,
+					      struct bpos pos)
+{
+	struct btree_key_cache *kc = &c->btree_key_cache;
+	struct bkey_cached_key key = {
+		.btree_id	= btree_id,
+		.pos		= pos,
+	};
+	struct bkey_cached *ck;
+
+	BUG_ON(btree_id == BTREE_ID_EXTENTS);
+
+	mutex_lock(&kc->lock);
+	ck = rhashtable_lookup_fast(&kc->table, &key,
+				    bch2_btree_key_cache_params);
+	if (!ck) {
+		ck = bkey_cached_alloc(kc);
+		if (!ck) {
+			mutex_unlock(&kc->lock);
+			return ERR_PTR(-ENOMEM);
+		}
+
+		ck->key = key;
+		mutex_init(&ck->lock);
+
+		if (rhashtable_lookup_insert_fast(&kc->table, &ck->hash,
+						  bch2_btree_key_cache_params)) {
+			list_add(&ck->list, &kc->freed);
+			kc->nr_freed++;
+			mutex_unlock(&kc->lock);
+			return ERR_PTR(-ENOMEM);
+		}
+
+		list_add(&ck->list, &kc->list);
+		kc->nr++;
+	}
+
+	ck->ref++;
+	mutex_unlock(&kc->lock);
+
+	mutex_lock(&ck->lock);
+	return ck;
+}
+
+void bch2_btree_key_cache_unlock(struct bch_fs *c, struct bkey_cached *ck)
+{
+	struct btree_key_cache *kc = &c->btree_key_cache;
+
+	mutex_unlock(&ck->lock);
+
+	mutex_lock(&kc->lock);
+	if (!--ck->ref && !journal_pin_active(&ck->journal))
+		bkey_cached_free(kc, ck);
+	mutex_unlock(&kc->lock);
+}
+
+/**
+ * bch2_btree_key_cache_update - update a locked cached key
+ *
+ * Journals @k, and then updates the cache: the btree isn't touched until
+ * journal reclaim needs the journal entry back.
+ *
+ * @flags: only BTREE_INSERT_NOCHECK_RW and BTREE_INSERT_JOURNAL_RESERVED are
+ * meaningful here - the allocator has to keep updating alloc keys until it's
+ * stopped when going read only, and while journal reclaim is waiting on it.
+ */
+int bch2_btree_key_cache_update(struct bch_fs *c, struct bkey_cached *ck,
+				struct bkey_i *k, u64 *journal_seq,
+				unsigned flags)
+{
+	struct btree_key_cache *kc = &c->btree_key_cache;
+	struct journal *j = &c->journal;
+	struct journal_res res;
+	unsigned u64s = jset_u64s(k->k.u64s);
+	int ret;
+
+	BUG_ON(bkey_cmp(k->k.p, ck->key.pos));
+	BUG_ON(k->k.u64s > BKEY_U64s + BKEY_CACHED_VAL_U64s_MAX);
+
+	if (!(flags & BTREE_INSERT_NOCHECK_RW) &&
+	    unlikely(!percpu_ref_tryget(&c->writes)))
+		return -EROFS;
+
+	memset(&res, 0, sizeof(res));
+
+	ret = bch2_journal_res_get(j, &res, u64s, u64s,
+				   flags & BTREE_INSERT_JOURNAL_RESERVED
+				   ? JOURNAL_RES_GET_RESERVED : 0);
+	if (ret)
+		goto out;
+
+	bch2_journal_add_keys(j, &res, ck->key.btree_id, k);
+	bch2_journal_set_has_inode(j, &res, k->k.p.inode);
+
+	mutex_lock(&kc->lock);
+	bkey_copy(&ck->k, k);
+	ck->valid	= true;
+	ck->seq		= res.seq;
+	ck->gen++;
+
+	if (!journal_pin_active(&ck->journal))
+		bch2_journal_pin_add(j, res.seq, &ck->journal,
+				     bkey_cached_journal_flush);
+	mutex_unlock(&kc->lock);
+
+	if (journal_seq)
+		*journal_seq = res.seq;
+
+	bch2_journal_res_put(j, &res);
+out:
+	if (!(flags & BTREE_INSERT_NOCHECK_RW))
+		percpu_ref_put(&c->writes);
+	return ret;
+}
+
+/* Update a key that doesn't need read-modify-write: */
+int bch2_btree_key_cache_insert(struct bch_fs *c, enum btree_id btree_id,
+				struct bkey_i *k, u64 *journal_seq,
+				unsigned flags)
+{
+	struct bkey_cached *ck;
+	int ret;
+
+	ck = bch2_btree_key_cache_lock(c, btree_id, k->k.p);
+	if (IS_ERR(ck))
+		return PTR_ERR(ck);
+
+	ret = bch2_btree_key_cache_update(c, ck, k, journal_seq, flags);
+	bch2_btree_key_cache_unlock(c, ck);
+
+	return ret;
+}
+
+/*
+ * A cached key was updated directly in the btree, by a transaction that had to
+ * update it atomically with other keys: the cached copy has to match, or
+ * writeback would overwrite the btree with the older version.
+ *
+ * Called with the leaf write locked - we never take btree locks while holding
+ * kc->lock, so that's safe.
+ */
+void bch2_btree_key_cache_btree_updated(struct bch_fs *c,
+					enum btree_id btree_id,
+					struct bkey_i *k, u64 seq)
+{
+	struct btree_key_cache *kc = &c->btree_key_cache;
+	struct bkey_cached_key key = {
+		.btree_id	= btree_id,
+		.pos		= k->k.p,
+	};
+	struct bkey_cached *ck;
+
+	mutex_lock(&kc->lock);
+	ck = rhashtable_lookup_fast(&kc->table, &key,
+				    bch2_btree_key_cache_params);
+	if (ck && ck->valid) {
+		BUG_ON(k->k.u64s > BKEY_U64s + BKEY_CACHED_VAL_U64s_MAX);
+
+		bkey_copy(&ck->k, k);
+		ck->seq = max(ck->seq, seq);
+		ck->gen++;
+	}
+	mutex_unlock(&kc->lock);
+}
+
+/*
+ * Returns true and copies out the key at @pos if it's in the cache - if not,
+ * the btree is current:
+ */
+bool bch2_btree_key_cache_read(struct bch_fs *c, enum btree_id btree_id,
+			       struct bpos pos, struct bkey_i *dst,
+			       unsigned dst_u64s)
+{
+	struct btree_key_cache *kc = &c->btree_key_cache;
+	struct bkey_cached_key key = {
+		.btree_id	= btree_id,
+		.pos		= pos,
+	};
+	struct bkey_cached *ck;
+	bool ret = false;
+
+	mutex_lock(&kc->lock);
+	ck = rhashtable_lookup_fast(&kc->table, &key,
+				    bch2_btree_key_cache_params);
+	if (ck && ck->valid) {
+		BUG_ON(ck->k.k.u64s > dst_u64s);
+		bkey_copy(dst, &ck->k);
+		ret = true;
+	}
+	mutex_unlock(&kc->lock);
+
+	return ret;
+}
+
+/*
+ * For updates that go to the btree directly, with @iter: returns the key at
+ * @iter's position, from the cache if it's there, since that's newer:
+ */
+struct bkey_s_c bch2_btree_key_cache_peek_slot(struct btree_iter *iter,
+					       struct bkey_i *buf,
+					       unsigned buf_u64s)
+{
+	struct bkey_s_c k = bch2_btree_iter_peek_slot(iter);
+
+	if (!btree_iter_err(k) &&
+	    bch2_btree_key_cache_read(iter->c, iter->btree_id, iter->pos,
+				      buf, buf_u64s))
+		k = bkey_i_to_s_c(buf);
+
+	return k;
+}
+
+void bch2_fs_btree_key_cache_exit(struct btree_key_cache *kc)
+{
+	struct bkey_cached *ck, *n;
+
+	/*
+	 * Normally empty by now, since going read only flushes all journal
+	 * pins - but not if the journal errored:
+	 */
+	list_splice_init(&kc->list, &kc->freed);
+
+	list_for_each_entry_safe(ck, n, &kc->freed, list) {
+		list_del(&ck->list);
+		kfree(ck);
+	}
+
+	if (kc->table_init_done)
+		rhashtable_destroy(&kc->table);
+}
+
+int bch2_fs_btree_key_cache_init(struct btree_key_cache *kc)
+{
+	int ret;
+
+	ret = rhashtable_init(&kc->table, &bch2_btree_key_cache_params);
+	if (ret)
+		return ret;
+
+	kc->table_init_done = true;
+	return 0;
+}
+
+void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *kc)
+{
+	mutex_init(&kc->lock);
+	INIT_LIST_HEAD(&kc->list);
+	INIT_LIST_HEAD(&kc->freed);
+}
@@ -0,0 +1,49 @@
+#ifndef _BCACHEFS_BTREE_KEY_CACHE_H
+#define _BCACHEFS_BTREE_KEY_CACHE_H
+
+/*
+ * Btree key cache - write back cache for frequently updated keys (inodes and
+ * alloc keys):
+ *
+ * Updates are journalled and then applied to the cached key, they only go to
+ * the btree when journal reclaim flushes the cached key's journal pin - so a
+ * key that's updated many times per journal cycle is written to its leaf once.
+ *
+ * Keys updated through the cache must also be read through it: the cache is
+ * newer than the btree. Cached keys always exist in the btree already (for
+ * inodes, bch2_inode_create() still inserts directly), so code iterating over
+ * the btree still sees the key, just possibly an older version of it.
+ *
+ * Transactions that have to update an inode atomically with other keys (link,
+ * rename) still update the btree directly: the commit path then updates the
+ * cached copy to match, with bch2_btree_key_cache_btree_updated().
+ */
+
+struct bkey_cached *bch2_btree_key_cache_lock(struct bch_fs *, enum btree_id,
+					      struct bpos);
+void bch2_btree_key_cache_unlock(struct bch_fs *, struct bkey_cached *);
+
+/* Only valid with the key locked: */
+static inline struct bkey_i *bch2_btree_key_cache_peek(struct bkey_cached *ck)
+{
+	return READ_ONCE(ck->valid) ? &ck->k : NULL;
+}
+
+int bch2_btree_key_cache_update(struct bch_fs *, struct bkey_cached *,
+				struct bkey_i *, u64 *, unsigned);
+int bch2_btree_key_cache_insert(struct bch_fs *, enum btree_id,
+				struct bkey_i *, u64 *, unsigned);
+
+void bch2_btree_key_cache_btree_updated(struct bch_fs *, enum btree_id,
+					struct bkey_i *, u64);
+
+bool bch2_btree_key_cache_read(struct bch_fs *, enum btree_id, struct bpos,
+			       struct bkey_i *, unsigned);
+struct bkey_s_c bch2_btree_key_cache_peek_slot(struct btree_iter *,
+					       struct bkey_i *, unsigned);
+
+void bch2_fs_btree_key_cache_exit(struct btree_key_cache *);
+int bch2_fs_btree_key_cache_init(struct btree_key_cache *);
+void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *);
+
+#endif /* _BCACHEFS_BTREE_KEY_CACHE_H */
@@ -99,6 +99,7 @@ struct btree {
 	u16			uncompacted_whiteout_u64s;
 	u8			page_order;
 	u8			unpack_fn_len;
+	u8			cmp_fn_len;
 
 	/*
 	 * XXX: add a delete sequence number, so when bch2_btree_node_relock()
@@ -126,6 +127,14 @@ struct btree {
 	 */
 	unsigned long		will_make_reachable;
 
+	/*
+	 * Newest journal entry that may have keys in this node's range, besides
+	 * what its bsets' journal_seq say - inherited from the nodes it
+	 * replaced, for bch2_btree_bulk_load(). Only kept in memory: a node
+	 * that's read in gets the current sequence number.
+	 */
+	u64			range_journal_seq;
+
 	struct btree_ob_ref	ob;
 
 	/* lru list */
@@ -174,6 +183,66 @@ struct btree_cache {
 	struct closure_waitlist	alloc_wait;
 };
 
+/* Big enough for any inode or alloc key: */
+#define BKEY_CACHED_VAL_U64s_MAX	32
+
+struct bkey_cached_key {
+	u32			btree_id;
+	struct bpos		pos;
+} __attribute__((packed, aligned(4)));
+
+/*
+ * A key in the btree key cache: updates are journalled and then only applied
+ * here, the journal pin is held until the key has been written back to the
+ * btree by journal reclaim.
+ */
+struct bkey_cached {
+	struct rhash_head	hash;
+	struct list_head	list;
+	struct bkey_cached_key	key;
+
+	/* Serializes updates, see bch2_btree_key_cache_lock(): */
+	struct mutex		lock;
+	unsigned		ref;
+
+	/* Pins the oldest update that hasn't been written to the btree: */
+	struct journal_entry_pin journal;
+	/* Journal sequence number of the newest update: */
+	u64			seq;
+	/* Incremented on every update, so writeback can tell if it raced: */
+	u32			gen;
+	/* If false, the btree is current and k is stale: */
+	bool			valid;
+
+	__BKEY_PADDED(k, BKEY_CACHED_VAL_U64s_MAX);
+};
+
+struct btree_key_cache {
+	struct mutex		lock;
+	struct rhashtable	table;
+	bool			table_init_done;
+	struct list_head	list;
+	size_t			nr;
+
+	/* entries are recycled, cached keys come and go at a high rate: */
+	struct list_head	freed;
+	size_t			nr_freed;
+};
+
+/*
+ * Group commit for bch2_btree_insert_batched(): inserts that arrive while
+ * another thread is committing to the same leaf are queued here, and committed
+ * together by the next leader - sharing one journal reservation and one write
+ * lock. Queues are hashed by leaf and flags:
+ */
+#define BTREE_INSERT_BATCH_QUEUES	64
+
+struct btree_insert_batch {
+	struct mutex		lock;
+	struct list_head	pending;
+	bool			leader;
+};
+
 struct btree_node_iter {
 	u8		is_extents;
 
@@ -26,6 +26,14 @@ struct btree_insert {
 	unsigned		flags;
 	bool			did_work;
 
+	/*
+	 * For keys that have already been journalled, by the btree key cache:
+	 * instead of journalling them again, the btree node write is pinned at
+	 * least as far back as @journal_pin, and journal_res.seq is the
+	 * sequence number of the newest journal entry they were written to:
+	 */
+	struct journal_entry_pin *journal_pin;
+
 	unsigned short		nr;
 	struct btree_insert_entry  *entries;
 };
@@ -85,6 +93,8 @@ enum {
 	__BTREE_INSERT_JOURNAL_REPLAY,
 	__BTREE_INSERT_NOWAIT,
 	__BTREE_INSERT_GC_LOCK_HELD,
+	__BTREE_INSERT_NOCHECK_RW,
+	__BTREE_INSERT_JOURNAL_RESERVED,
 	__BCH_HASH_SET_MUST_CREATE,
 	__BCH_HASH_SET_MUST_REPLACE,
 };
@@ -117,6 +127,19 @@ enum {
 #define BTREE_INSERT_NOWAIT		(1 << __BTREE_INSERT_NOWAIT)
 #define BTREE_INSERT_GC_LOCK_HELD	(1 << __BTREE_INSERT_GC_LOCK_HELD)
 
+/*
+ * Don't check c->writes: for writing back keys that were already journalled,
+ * and for the allocator's alloc key updates, which have to work while we're
+ * going read only
+ */
+#define BTREE_INSERT_NOCHECK_RW		(1 << __BTREE_INSERT_NOCHECK_RW)
+
+/*
+ * Journal reservation may come out of the journal's reserve: for updates
+ * journal reclaim may be waiting on, i.e. the allocator's alloc keys
+ */
+#define BTREE_INSERT_JOURNAL_RESERVED	(1 << __BTREE_INSERT_JOURNAL_RESERVED)
+
 #define BCH_HASH_SET_MUST_CREATE	(1 << __BCH_HASH_SET_MUST_CREATE)
 #define BCH_HASH_SET_MUST_REPLACE	(1 << __BCH_HASH_SET_MUST_REPLACE)
 
@@ -130,11 +153,19 @@ int bch2_btree_insert(struct bch_fs *, enum btree_id, struct bkey_i *,
 		     struct disk_reservation *,
 		     struct extent_insert_hook *, u64 *, int flags);
 
+int bch2_btree_insert_batched(struct bch_fs *, enum btree_id, struct bkey_i *,
+			      u64 *, unsigned);
+
+void bch2_fs_btree_insert_batch_init_early(struct bch_fs *);
+
 int bch2_btree_delete_range(struct bch_fs *, enum btree_id,
 			   struct bpos, struct bpos, struct bversion,
 			   struct disk_reservation *,
 			   struct extent_insert_hook *, u64 *);
 
+int bch2_btree_bulk_load(struct bch_fs *, enum btree_id, struct keylist *,
+			 struct disk_reservation *, unsigned);
+
 int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *,
 			    __le64, unsigned);
 int bch2_btree_node_update_key(struct bch_fs *, struct btree_iter *,
@@ -395,6 +395,7 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned lev
 
 	set_btree_node_accessed(b);
 	set_btree_node_dirty(b);
+	b->range_journal_seq = as->range_journal_seq;
 
 	bch2_bset_init_first(b, &b->data->keys);
 	memset(&b->nr, 0, sizeof(b->nr));
@@ -587,9 +588,11 @@ static void bch2_btree_update_free(struct btree_update *as)
 	mutex_lock(&c->btree_interior_update_lock);
 	list_del(&as->list);
 
+	if (!(as->flags & BTREE_INSERT_NOCHECK_RW))
+		percpu_ref_put(&c->writes);
+
 	closure_debug_destroy(&as->cl);
 	mempool_free(as, &c->btree_interior_update_pool);
-	percpu_ref_put(&c->writes);
 
 	closure_wake_up(&c->btree_interior_update_wait);
 	mutex_unlock(&c->btree_interior_update_lock);
@@ -953,6 +956,7 @@ void bch2_btree_interior_update_will_free_node(struct btree_update *as,
 	struct btree_update *p, *n;
 	struct btree_write *w;
 	struct bset_tree *t;
+	unsigned i;
 
 	set_btree_node_dying(b);
 
@@ -973,6 +977,12 @@ void bch2_btree_interior_update_will_free_node(struct btree_update *as,
 		as->journal_seq = max(as->journal_seq,
 				      le64_to_cpu(bset(b, t)->journal_seq));
 
+	/* The new nodes take over @b's range: */
+	as->range_journal_seq = max(as->range_journal_seq,
+				    btree_node_range_journal_seq(b));
+	for (i = 0; i < as->nr_new_nodes; i++)
+		as->new_nodes[i]->range_journal_seq = as->range_journal_seq;
+
 	mutex_lock(&c->btree_interior_update_lock);
 
 	/*
@@ -1039,12 +1049,14 @@ bch2_btree_update_start(struct bch_fs *c, enum btree_id id,
 	struct btree_reserve *reserve;
 	struct btree_update *as;
 
-	if (unlikely(!percpu_ref_tryget(&c->writes)))
+	if (!(flags & BTREE_INSERT_NOCHECK_RW) &&
+	    unlikely(!percpu_ref_tryget(&c->writes)))
 		return ERR_PTR(-EROFS);
 
 	reserve = bch2_btree_reserve_get(c, nr_nodes, flags, cl);
 	if (IS_ERR(reserve)) {
-		percpu_ref_put(&c->writes);
+		if (!(flags & BTREE_INSERT_NOCHECK_RW))
+			percpu_ref_put(&c->writes);
 		return ERR_CAST(reserve);
 	}
 
@@ -1053,6 +1065,7 @@ bch2_btree_update_start(struct bch_fs *c, enum btree_id id,
 	closure_init(&as->cl, NULL);
 	as->c		= c;
 	as->mode	= BTREE_INTERIOR_NO_UPDATE;
+	as->flags	= flags;
 	as->btree_id	= id;
 	as->reserve	= reserve;
 	INIT_LIST_HEAD(&as->write_blocked_list);
@@ -1206,15 +1219,37 @@ static void bch2_insert_fixup_btree_ptr(struct btree_update *as, struct btree *b
 	set_btree_node_need_write(b);
 }
 
+/*
+ * A bulk load appends to interior nodes: when @keys replace the node's last
+ * child, splitting in the usual place would leave every node behind the insert
+ * point 60% full. Ordinary inserts split nodes all over the keyspace, and keep
+ * the usual split point:
+ */
+static bool btree_split_is_append(struct btree_update *as, struct btree *b,
+				  struct keylist *keys)
+{
+	struct bkey_i *insert, *last_insert = NULL;
+
+	if (!as->bulk_load || !b->level || !keys)
+		return false;
+
+	for_each_keylist_key(keys, insert)
+		last_insert = insert;
+
+	return last_insert &&
+		!bkey_cmp(last_insert->k.p, b->key.k.p);
+}
+
 /*
  * Move keys from n1 (original replacement node, now lower node) to n2 (higher
  * node)
  */
 static struct btree *__btree_split_node(struct btree_update *as,
 					struct btree *n1,
-					struct btree_iter *iter)
+					bool append)
 {
 	size_t nr_packed = 0, nr_unpacked = 0;
+	unsigned split_u64s;
 	struct btree *n2;
 	struct bset *set1, *set2;
 	struct bkey_packed *k, *prev = NULL;
@@ -1231,6 +1266,10 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	set1 = btree_bset_first(n1);
 	set2 = btree_bset_first(n2);
 
+	split_u64s = append
+		? (le16_to_cpu(set1->u64s) * 15) / 16
+		: (le16_to_cpu(set1->u64s) * 3) / 5;
+
 	/*
 	 * Has to be a linear search because we don't have an auxiliary
 	 * search tree yet
@@ -1239,7 +1278,7 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	while (1) {
 		if (bkey_next(k) == vstruct_last(set1))
 			break;
-		if (k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
+		if (k->_data - set1->_data >= split_u64s)
 			break;
 
 		if (bkey_packed(k))
@@ -1362,6 +1401,7 @@ static void btree_split(struct btree_update *as, struct btree *b,
 	struct btree *parent = btree_node_parent(iter, b);
 	struct btree *n1, *n2 = NULL, *n3 = NULL;
 	u64 start_time = local_clock();
+	bool append;
 
 	BUG_ON(!parent && (b != btree_node_root(c, b)));
 	BUG_ON(!btree_node_intent_locked(iter, btree_node_root(c, b)->level));
@@ -1369,6 +1409,7 @@ static void btree_split(struct btree_update *as, struct btree *b,
 	bch2_btree_interior_update_will_free_node(as, b);
 
 	n1 = bch2_btree_node_alloc_replacement(as, b);
+	append = btree_split_is_append(as, n1, keys);
 
 	if (keys)
 		btree_split_insert_keys(as, n1, iter, keys);
@@ -1376,7 +1417,7 @@ static void btree_split(struct btree_update *as, struct btree *b,
 	if (vstruct_blocks(n1->data, c->block_bits) > BTREE_SPLIT_THRESHOLD(c)) {
 		trace_btree_split(c, b);
 
-		n2 = __btree_split_node(as, n1, iter);
+		n2 = __btree_split_node(as, n1, append);
 
 		bch2_btree_build_aux_trees(n2);
 		bch2_btree_build_aux_trees(n1);
@@ -2083,6 +2124,617 @@ err_free_update:
 	goto err;
 }
 
+/* Bulk loading: */
+
+/*
+ * Bulk loads skip the leaf insert path: the keys going into a leaf are packed
+ * directly into new nodes, with a format computed for just those keys, and the
+ * new nodes then replace the leaf the same way a split does. Interior nodes are
+ * built by the usual updates to the parent, where append splits keep them
+ * packed too.
+ *
+ * Each update replaces one leaf with up to BTREE_BULK_LOAD_NODES new nodes. The
+ * keys already in the leaf, before and after the new keys, are rewritten. If
+ * new keys are left over for the leaf's range, we cover the rest of it with an
+ * empty node, so the next update doesn't have to rewrite anything.
+ */
+#define BTREE_BULK_LOAD_NODES	3
+
+enum bulk_load_run {
+	BULK_LOAD_BELOW,	/* keys already in the leaf, before the new keys */
+	BULK_LOAD_NEW,
+	BULK_LOAD_CUT,		/* front of an extent straddling the leaf's end */
+	BULK_LOAD_ABOVE,	/* keys already in the leaf, after the new keys */
+	BULK_LOAD_NR,
+};
+
+struct bulk_load_node {
+	struct bpos		min_key;
+	struct bpos		max_key;
+	struct bkey_format	format;
+
+	/* first key, and how many keys: */
+	enum bulk_load_run	run;
+	struct bkey_i		*k;
+	unsigned		nr_keys;
+};
+
+struct bulk_load {
+	struct btree		*b;
+
+	struct {
+		struct bkey_i	*start, *end;
+	}			runs[BULK_LOAD_NR];
+	BKEY_PADDED(cut);
+
+	struct bulk_load_node	nodes[BTREE_BULK_LOAD_NODES];
+	unsigned		nr_nodes;
+
+	/* format of the node being filled: */
+	struct bkey_format_state s;
+	unsigned		val_u64s;
+};
+
+static inline bool bulk_load_run_empty(struct bulk_load *l,
+				       enum bulk_load_run run)
+{
+	return l->runs[run].start == l->runs[run].end;
+}
+
+static void bulk_load_node_open(struct bulk_load *l, struct bpos min_key)
+{
+	struct bulk_load_node *n;
+	struct bkey_format_state s;
+
+	BUG_ON(l->nr_nodes >= BTREE_BULK_LOAD_NODES);
+
+	n = &l->nodes[l->nr_nodes++];
+	memset(n, 0, sizeof(*n));
+	n->min_key	= min_key;
+	n->max_key	= min_key;
+
+	bch2_bkey_format_init(&l->s);
+	bch2_bkey_format_add_pos(&l->s, min_key);
+	l->val_u64s	= 0;
+
+	s = l->s;
+	n->format = bch2_bkey_format_done(&s);
+}
+
+/* Adds @k to the node being filled, if it'll still be under @max_u64s: */
+static bool bulk_load_node_add(struct bulk_load *l, enum bulk_load_run run,
+			       struct bkey_i *k, size_t max_u64s)
+{
+	struct bulk_load_node *n = &l->nodes[l->nr_nodes - 1];
+	struct bkey_format_state s = l->s, tmp;
+	unsigned val_u64s = l->val_u64s + bkey_val_u64s(&k->k);
+	struct bkey_format f;
+
+	bch2_bkey_format_add_key(&s, &k->k);
+	tmp = s;
+	f = bch2_bkey_format_done(&tmp);
+
+	if (n->nr_keys &&
+	    (n->nr_keys + 1) * f.key_u64s + val_u64s > max_u64s)
+		return false;
+
+	if (!n->nr_keys) {
+		n->run	= run;
+		n->k	= k;
+	}
+
+	n->nr_keys++;
+	n->max_key	= k->k.p;
+	n->format	= f;
+	l->s		= s;
+	l->val_u64s	= val_u64s;
+	return true;
+}
+
+static void bulk_load_node_add_old(struct bulk_load *l, enum btree_id id,
+				   enum bulk_load_run run, struct bkey_i *k,
+				   size_t max_u64s)
+{
+	if (!bulk_load_node_add(l, run, k, max_u64s)) {
+		bulk_load_node_open(l, btree_type_successor(id,
+				l->nodes[l->nr_nodes - 1].max_key));
+		BUG_ON(!bulk_load_node_add(l, run, k, max_u64s));
+	}
+}
+
+/*
+ * Decides which keys go in which new node: new keys fill nodes to 15/16, nearly
+ * full but with room for a few inserts before the next split; keys we're
+ * rewriting can use all the space they had before.
+ */
+static void bulk_load_plan(struct bch_fs *c, struct bulk_load *l,
+			   enum btree_id id)
+{
+	struct btree *b = l->b;
+	size_t max_u64s = btree_max_u64s(c) - 1;
+	size_t new_u64s = btree_max_u64s(c) * 15 / 16;
+	bool above = !bulk_load_run_empty(l, BULK_LOAD_ABOVE);
+	unsigned new_nodes = BTREE_BULK_LOAD_NODES - (above ? 2 : 1);
+	enum bulk_load_run run;
+	struct bkey_i *k;
+
+	bulk_load_node_open(l, b->data->min_key);
+
+	for (k = l->runs[BULK_LOAD_BELOW].start;
+	     k != l->runs[BULK_LOAD_BELOW].end;
+	     k = bkey_next(k))
+		bulk_load_node_add_old(l, id, BULK_LOAD_BELOW, k, max_u64s);
+
+	for (run = BULK_LOAD_NEW; run <= BULK_LOAD_CUT; run++)
+		for (k = l->runs[run].start;
+		     k != l->runs[run].end;
+		     k = bkey_next(k)) {
+			if (bulk_load_node_add(l, run, k, new_u64s))
+				continue;
+
+			if (l->nr_nodes == new_nodes)
+				goto out_of_nodes;
+
+			bulk_load_node_open(l, btree_type_successor(id,
+					l->nodes[l->nr_nodes - 1].max_key));
+			BUG_ON(!bulk_load_node_add(l, run, k, new_u64s));
+		}
+
+	for (k = l->runs[BULK_LOAD_ABOVE].start;
+	     k != l->runs[BULK_LOAD_ABOVE].end;
+	     k = bkey_next(k))
+		bulk_load_node_add_old(l, id, BULK_LOAD_ABOVE, k, max_u64s);
+	goto out;
+out_of_nodes:
+	/* The rest of the new keys go in the next update: */
+	l->runs[run].end = k;
+	if (run == BULK_LOAD_NEW)
+		l->runs[BULK_LOAD_CUT].end = l->runs[BULK_LOAD_CUT].start;
+
+	bulk_load_node_open(l, btree_type_successor(id,
+				l->nodes[l->nr_nodes - 1].max_key));
+
+	if (above) {
+		k = l->runs[BULK_LOAD_ABOVE].start;
+
+		l->nodes[l->nr_nodes - 1].max_key = id == BTREE_ID_EXTENTS
+			? bkey_start_pos(&k->k)
+			: btree_type_predecessor(id, k->k.p);
+
+		bulk_load_node_open(l, btree_type_successor(id,
+				l->nodes[l->nr_nodes - 1].max_key));
+
+		for (;
+		     k != l->runs[BULK_LOAD_ABOVE].end;
+		     k = bkey_next(k))
+			bulk_load_node_add_old(l, id, BULK_LOAD_ABOVE,
+					       k, max_u64s);
+	}
+out:
+	l->nodes[l->nr_nodes - 1].max_key = b->data->max_key;
+}
+
+/* @old doesn't end before the new keys start - does it overlap them? */
+static bool bulk_load_overlaps(enum btree_id id, const struct bkey *old,
+			       const struct bkey *last)
+{
+	return id == BTREE_ID_EXTENTS
+		? bkey_cmp(bkey_start_pos(old), last->p) < 0
+		: bkey_cmp(old->p, last->p) <= 0;
+}
+
+/*
+ * Splits the keys for leaf @b into runs: @b's existing keys are unpacked into
+ * @buf, and the new keys are those from @k on that fall in @b's range:
+ */
+static void bulk_load_init(struct bulk_load *l, struct btree *b,
+			   struct bkey_i *k, struct bkey_i *end, u64 *buf)
+{
+	struct bpos start = bkey_start_pos(&k->k);
+	struct btree_node_iter node_iter;
+	struct bkey_packed *_k;
+	struct bkey_i *old = (struct bkey_i *) buf;
+	bool is_extents = btree_node_is_extents(b);
+
+	l->b		= b;
+	l->nr_nodes	= 0;
+
+	l->runs[BULK_LOAD_BELOW].start	= old;
+	l->runs[BULK_LOAD_BELOW].end	= NULL;
+
+	for_each_btree_node_key(b, _k, &node_iter, is_extents) {
+		bch2_bkey_unpack(b, old, _k);
+
+		if (!l->runs[BULK_LOAD_BELOW].end &&
+		    (is_extents
+		     ? bkey_cmp(old->k.p, start) > 0
+		     : bkey_cmp(old->k.p, start) >= 0))
+			l->runs[BULK_LOAD_BELOW].end = old;
+
+		old = bkey_next(old);
+	}
+
+	if (!l->runs[BULK_LOAD_BELOW].end)
+		l->runs[BULK_LOAD_BELOW].end = old;
+	l->runs[BULK_LOAD_ABOVE].start	= l->runs[BULK_LOAD_BELOW].end;
+	l->runs[BULK_LOAD_ABOVE].end	= old;
+
+	l->runs[BULK_LOAD_NEW].start	= k;
+	while (k != end &&
+	       bkey_cmp(k->k.p, b->data->max_key) <= 0)
+		k = bkey_next(k);
+	l->runs[BULK_LOAD_NEW].end	= k;
+
+	l->runs[BULK_LOAD_CUT].start	= &l->cut;
+	l->runs[BULK_LOAD_CUT].end	= &l->cut;
+
+	if (is_extents && k != end &&
+	    bkey_cmp(bkey_start_pos(&k->k), b->data->max_key) < 0) {
+		bkey_copy(&l->cut, k);
+		bch2_cut_back(b->data->max_key, &l->cut.k);
+		l->runs[BULK_LOAD_CUT].end = bkey_next(&l->cut);
+	}
+
+	BUG_ON(bulk_load_run_empty(l, BULK_LOAD_NEW) &&
+	       bulk_load_run_empty(l, BULK_LOAD_CUT));
+}
+
+/*
+ * The part of the range the new keys cover that's in @b has to be empty; the
+ * caller has @b intent locked, so nothing can be inserted there before the new
+ * nodes replace it:
+ */
+static bool bulk_load_range_empty(struct bulk_load *l, enum btree_id id)
+{
+	struct bkey_i *k, *last = NULL;
+	enum bulk_load_run run;
+
+	if (bulk_load_run_empty(l, BULK_LOAD_ABOVE))
+		return true;
+
+	for (run = BULK_LOAD_NEW; run <= BULK_LOAD_CUT; run++)
+		for (k = l->runs[run].start;
+		     k != l->runs[run].end;
+		     k = bkey_next(k))
+			last = k;
+
+	return !bulk_load_overlaps(id, &l->runs[BULK_LOAD_ABOVE].start->k,
+				   &last->k);
+}
+
+static struct btree *bulk_load_node_build(struct btree_update *as,
+					  struct bulk_load *l,
+					  struct bulk_load_node *plan,
+					  struct disk_reservation *disk_res)
+{
+	struct bch_fs *c = as->c;
+	struct btree *n = bch2_btree_node_alloc(as, 0);
+	struct bset *i = btree_bset_first(n);
+	struct bch_fs_usage stats = { 0 };
+	enum bulk_load_run run = plan->run;
+	struct bkey_i *k = plan->k;
+	struct bkey_packed *out;
+	unsigned nr;
+
+	n->data->min_key	= plan->min_key;
+	n->data->max_key	= plan->max_key;
+	n->data->format		= plan->format;
+	SET_BTREE_NODE_SEQ(n->data, BTREE_NODE_SEQ(l->b->data) + 1);
+	n->key.k.p		= plan->max_key;
+
+	btree_node_set_format(n, plan->format);
+
+	for (nr = 0; nr < plan->nr_keys; nr++) {
+		while (k == l->runs[run].end)
+			k = l->runs[++run].start;
+
+		out = vstruct_last(i);
+		if (bch2_bkey_pack(out, k, &n->format)) {
+			n->nr.packed_keys++;
+		} else {
+			bkey_copy(out, k);
+			n->nr.unpacked_keys++;
+		}
+		le16_add_cpu(&i->u64s, out->u64s);
+
+		/* Keys we're rewriting were accounted for when inserted: */
+		if ((run == BULK_LOAD_NEW || run == BULK_LOAD_CUT) &&
+		    btree_node_is_extents(n))
+			bch2_mark_key(c, bkey_i_to_s_c(k), k->k.size, false,
+				      gc_pos_btree_node(n), &stats, 0, 0);
+
+		k = bkey_next(k);
+	}
+
+	set_btree_bset_end(n, n->set);
+
+	n->nr.live_u64s		= le16_to_cpu(i->u64s);
+	n->nr.bset_u64s[0]	= le16_to_cpu(i->u64s);
+
+	btree_node_reset_sib_u64s(n);
+	bch2_verify_btree_nr_keys(n);
+
+	bch2_btree_build_aux_trees(n);
+	six_unlock_write(&n->lock);
+
+	if (btree_node_is_extents(n))
+		bch2_fs_usage_apply(c, &stats, disk_res, gc_pos_btree_node(n));
+
+	return n;
+}
+
+/*
+ * Replaces the leaf @iter points to with new nodes containing its keys and the
+ * new keys from *@k on in its range; advances *@k past the keys loaded:
+ */
+static int btree_bulk_load_leaf(struct bch_fs *c, struct btree_iter *iter,
+				struct bkey_i **k, struct bkey_i *end,
+				u64 *buf, struct disk_reservation *disk_res,
+				unsigned flags, u64 *journal_seq,
+				struct closure *cl)
+{
+	struct btree *b = iter->l[0].b;
+	struct btree *parent = btree_node_parent(iter, b);
+	struct btree *n[BTREE_BULK_LOAD_NODES], *root = NULL;
+	struct btree_update *as;
+	struct bulk_load l;
+	unsigned i;
+
+	bulk_load_init(&l, b, *k, end, buf);
+	if (!bulk_load_range_empty(&l, iter->btree_id))
+		return -EEXIST;
+
+	/*
+	 * The new keys aren't journalled: journal replay would apply older
+	 * updates to this range - the deletes that emptied it - on top of the
+	 * new leaves. Those have to be in the btree, and journal entries written
+	 * that don't need them replayed, before the new leaves are visible:
+	 */
+	*journal_seq = btree_node_range_journal_seq(b);
+	if (*journal_seq >= READ_ONCE(c->journal.replay_seq_ondisk))
+		return -EAGAIN;
+	*journal_seq = 0;
+
+	as = bch2_btree_update_start(c, iter->btree_id,
+			btree_update_reserve_required(c, b) +
+			BTREE_BULK_LOAD_NODES - 2,
+			flags, cl);
+	if (IS_ERR(as))
+		return PTR_ERR(as);
+
+	as->bulk_load = true;
+
+	bulk_load_plan(c, &l, iter->btree_id);
+
+	bch2_btree_interior_update_will_free_node(as, b);
+
+	for (i = 0; i < l.nr_nodes; i++) {
+		n[i] = bulk_load_node_build(as, &l, &l.nodes[i], disk_res);
+		bch2_btree_node_write(c, n[i], SIX_LOCK_intent);
+	}
+
+	*k = l.runs[BULK_LOAD_NEW].end;
+	if (!bulk_load_run_empty(&l, BULK_LOAD_CUT))
+		bch2_cut_front(b->data->max_key, *k);
+
+	if (!parent && l.nr_nodes == 1) {
+		/* Root filled up but didn't need to be split */
+		bch2_btree_set_root(as, n[0], iter);
+		goto out;
+	}
+
+	for (i = 0; i < l.nr_nodes; i++)
+		bch2_keylist_add(&as->parent_keys, &n[i]->key);
+
+	if (parent) {
+		bch2_btree_insert_node(as, parent, iter, &as->parent_keys, flags);
+	} else {
+		/* Depth increases, make a new root */
+		root = __btree_root_alloc(as, 1);
+
+		root->sib_u64s[0] = U16_MAX;
+		root->sib_u64s[1] = U16_MAX;
+
+		btree_split_insert_keys(as, root, iter, &as->parent_keys);
+		bch2_btree_node_write(c, root, SIX_LOCK_intent);
+		bch2_btree_set_root(as, root, iter);
+	}
+out:
+
+	for (i = 0; i < l.nr_nodes; i++)
+		bch2_btree_open_bucket_put(c, n[i]);
+	if (root)
+		bch2_btree_open_bucket_put(c, root);
+
+	bch2_btree_node_free_inmem(c, b, iter);
+
+	if (root)
+		bch2_btree_iter_node_replace(iter, root);
+	for (i = l.nr_nodes; i--;)
+		bch2_btree_iter_node_replace(iter, n[i]);
+
+	bch2_btree_update_done(as);
+	return 0;
+}
+
+/*
+ * Get everything journalled up to @seq into the btree, and write a journal
+ * entry that doesn't need any of it replayed:
+ */
+static int bulk_load_flush_journal(struct bch_fs *c, u64 seq)
+{
+	struct journal *j = &c->journal;
+	int ret;
+
+	ret = bch2_journal_flush_seq(j, seq);
+	if (ret)
+		return ret;
+
+	bch2_journal_flush_pins(j, seq);
+
+	return READ_ONCE(j->replay_seq_ondisk) <= seq
+		? bch2_journal_meta(j)
+		: bch2_journal_error(j);
+}
+
+/* Keys must be sorted and not overlap: */
+static int bulk_load_check(enum btree_id id, struct keylist *keys)
+{
+	struct bkey_i *k, *last = NULL;
+
+	for_each_keylist_key(keys, k) {
+		if (last &&
+		    (id == BTREE_ID_EXTENTS
+		     ? bkey_cmp(bkey_start_pos(&k->k), last->k.p) < 0
+		     : bkey_cmp(k->k.p, last->k.p) <= 0))
+			return -EINVAL;
+		last = k;
+	}
+
+	return 0;
+}
+
+/* Inserts @k through the normal path, if its range is empty: */
+static int __bulk_load_insert(struct btree_trans *trans, enum btree_id id,
+			      struct bkey_i *k)
+{
+	struct btree_iter *iter, *peek;
+	struct bkey_s_c old;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, id, bkey_start_pos(&k->k),
+				   BTREE_ITER_INTENT);
+	if (IS_ERR(iter))
+		return PTR_ERR(iter);
+
+	peek = bch2_trans_copy_iter(trans, iter);
+	if (IS_ERR(peek))
+		return PTR_ERR(peek);
+
+	old = bch2_btree_iter_peek(peek);
+	ret = btree_iter_err(old);
+	if (ret)
+		return ret;
+
+	if (old.k && bulk_load_overlaps(id, old.k, &k->k))
+		return -EEXIST;
+
+	bch2_trans_update(trans, iter, k, 0);
+	return 0;
+}
+
+static int bulk_load_insert(struct bch_fs *c, enum btree_id id,
+			    struct bkey_i *k,
+			    struct disk_reservation *disk_res,
+			    unsigned flags)
+{
+	struct btree_trans trans;
+	int ret;
+
+	bch2_trans_init(&trans, c);
+
+	do {
+		bch2_trans_begin(&trans);
+
+		ret = __bulk_load_insert(&trans, id, k) ?:
+			bch2_trans_commit(&trans, disk_res, NULL, NULL,
+					  flags|BTREE_INSERT_ATOMIC);
+	} while (ret == -EINTR);
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/**
+ * bch2_btree_bulk_load - insert a sorted run of keys into an empty range
+ *
+ * Returns -EEXIST if the range @keys cover isn't empty, -EINVAL if @keys aren't
+ * sorted or overlap. Emptiness is checked a leaf at a time, as keys are loaded:
+ * on -EEXIST, the keys before the one that collided may have been loaded.
+ *
+ * Less than half a node's worth of keys go through the normal insert path;
+ * otherwise keys are packed directly into new leaf nodes. Those keys aren't
+ * journalled: like a btree split, they're persistent once the interior update
+ * that makes the new nodes reachable completes. If the journal still has
+ * updates to a leaf's range that replay would apply, they're flushed first.
+ * Updates racing with the load in the range it covers aren't ordered against
+ * it. As with
+ * bch2_btree_insert(), the caller marks replicas for extents, and @disk_res
+ * must cover them.
+ *
+ * @keys isn't consumed, but an extent straddling a leaf boundary is left trimmed
+ * to the part loaded last.
+ */
+int bch2_btree_bulk_load(struct bch_fs *c, enum btree_id id,
+			 struct keylist *keys,
+			 struct disk_reservation *disk_res,
+			 unsigned flags)
+{
+	struct btree_iter iter;
+	struct bkey_i *k;
+	struct closure cl;
+	size_t buf_bytes = btree_max_u64s(c) * BKEY_U64s * sizeof(u64);
+	u64 *buf, journal_seq;
+	int ret;
+
+	if (bch2_keylist_empty(keys))
+		return 0;
+
+	ret = bulk_load_check(id, keys);
+	if (ret)
+		return ret;
+
+	if (bch_keylist_u64s(keys) < btree_max_u64s(c) / 2) {
+		for_each_keylist_key(keys, k) {
+			ret = bulk_load_insert(c, id, k, disk_res, flags);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	buf = kvpmalloc(buf_bytes, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	closure_init_stack(&cl);
+
+	__bch2_btree_iter_init(&iter, c, id, POS_MIN, BTREE_MAX_DEPTH, 0,
+			       (id == BTREE_ID_EXTENTS
+				? BTREE_ITER_IS_EXTENTS : 0)|
+			       BTREE_ITER_INTENT);
+
+	down_read(&c->gc_lock);
+
+	k = keys->keys;
+	while (k != keys->top) {
+		bch2_btree_iter_set_pos(&iter, bkey_start_pos(&k->k));
+
+		journal_seq = 0;
+		ret = bch2_btree_iter_traverse(&iter) ?:
+			btree_bulk_load_leaf(c, &iter, &k, keys->top, buf,
+					     disk_res, flags, &journal_seq, &cl);
+		bch2_btree_iter_unlock(&iter);
+
+		if (ret == -EAGAIN || ret == -EINTR) {
+			up_read(&c->gc_lock);
+			closure_sync(&cl);
+			ret = journal_seq
+				? bulk_load_flush_journal(c, journal_seq)
+				: 0;
+			down_read(&c->gc_lock);
+		}
+		if (ret)
+			break;
+	}
+
+	up_read(&c->gc_lock);
+	closure_sync(&cl);
+
+	kvpfree(buf, buf_bytes);
+	return ret;
+}
+
 /* Init code: */
 
 /*
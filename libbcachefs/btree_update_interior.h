@@ -65,6 +65,8 @@ struct btree_update {
 
 	unsigned			must_rewrite:1;
 	unsigned			nodes_written:1;
+	unsigned			bulk_load:1;
+	unsigned			flags;
 
 	enum btree_id			btree_id;
 
@@ -103,6 +105,9 @@ struct btree_update {
 
 	u64				journal_seq;
 
+	/* Newest journal entry that may have keys in the freed nodes' range: */
+	u64				range_journal_seq;
+
 	/*
 	 * Nodes being freed:
 	 * Protected by c->btree_node_pending_free_lock
@@ -212,6 +217,20 @@ static inline unsigned btree_update_reserve_required(struct bch_fs *c,
 		return (depth - b->level) * 2 - 1;
 }
 
+/*
+ * Newest journal entry that may have keys in @b's range - replay applies
+ * everything from replay_seq_ondisk on:
+ */
+static inline u64 btree_node_range_journal_seq(struct btree *b)
+{
+	struct bset_tree *t;
+	u64 seq = b->range_journal_seq;
+
+	for_each_bset(b, t)
+		seq = max(seq, le64_to_cpu(bset(b, t)->journal_seq));
+	return seq;
+}
+
 static inline void btree_node_reset_sib_u64s(struct btree *b)
 {
 	b->sib_u64s[0] = b->nr.live_u64s;
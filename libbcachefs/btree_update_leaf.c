@@ -4,6 +4,7 @@
 #include "btree_update_interior.h"
 #include "btree_io.h"
 #include "btree_iter.h"
+#include "btree_key_cache.h"
 #include "btree_locking.h"
 #include "debug.h"
 #include "extents.h"
@@ -136,9 +137,10 @@ void bch2_btree_journal_key(struct btree_insert *trans,
 
 	EBUG_ON(iter->level || b->level);
 	EBUG_ON(trans->journal_res.ref !=
-		!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY));
+		(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY) &&
+		 !trans->journal_pin));
 
-	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
+	if (likely(trans->journal_res.ref)) {
 		u64 seq = trans->journal_res.seq;
 		bool needs_whiteout = insert->k.needs_whiteout;
 
@@ -154,6 +156,20 @@ void bch2_btree_journal_key(struct btree_insert *trans,
 		if (trans->journal_seq)
 			*trans->journal_seq = seq;
 		btree_bset_last(b)->journal_seq = cpu_to_le64(seq);
+	} else if (trans->journal_pin) {
+		u64 seq = max(trans->journal_res.seq,
+			      le64_to_cpu(btree_bset_last(b)->journal_seq));
+
+		btree_bset_last(b)->journal_seq = cpu_to_le64(seq);
+
+		/*
+		 * The node might already be pinned by a newer journal entry
+		 * than the one the key was journalled in:
+		 */
+		bch2_journal_pin_add_if_older(j, trans->journal_pin, &w->journal,
+					      btree_node_write_idx(b) == 0
+					      ? btree_node_flush0
+					      : btree_node_flush1);
 	}
 
 	if (unlikely(!journal_pin_active(&w->journal))) {
@@ -295,6 +311,20 @@ static inline int btree_trans_cmp(struct btree_insert_entry l,
 	return btree_iter_cmp(l.iter, r.iter);
 }
 
+/*
+ * Inodes may also be in the key cache - keep the cached copy in sync with
+ * updates that go to the btree directly. Key cache writeback is the one update
+ * that mustn't do this:
+ */
+static inline void btree_insert_key_cache_update(struct btree_insert *trans,
+						 struct btree_insert_entry *i)
+{
+	if (i->iter->btree_id == BTREE_ID_INODES && !trans->journal_pin)
+		bch2_btree_key_cache_btree_updated(trans->c,
+				i->iter->btree_id, i->k,
+				trans->journal_res.seq);
+}
+
 /* Normal update interface: */
 
 /*
@@ -307,7 +337,7 @@ static inline int do_btree_insert_at(struct btree_insert *trans,
 	struct bch_fs *c = trans->c;
 	struct btree_insert_entry *i;
 	unsigned u64s;
-	int ret;
+	int ret = 0;
 
 	trans_for_each_entry(trans, i) {
 		BUG_ON(i->done);
@@ -318,15 +348,19 @@ static inline int do_btree_insert_at(struct btree_insert *trans,
 	trans_for_each_entry(trans, i)
 		u64s += jset_u64s(i->k->k.u64s + i->extra_res);
 
-	memset(&trans->journal_res, 0, sizeof(trans->journal_res));
+	if (!trans->journal_pin) {
+		memset(&trans->journal_res, 0, sizeof(trans->journal_res));
 
-	ret = !(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)
-		? bch2_journal_res_get(&c->journal,
-				      &trans->journal_res,
-				      u64s, u64s)
-		: 0;
-	if (ret)
-		return ret;
+		ret = !(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)
+			? bch2_journal_res_get(&c->journal,
+					      &trans->journal_res,
+					      u64s, u64s,
+					      trans->flags & BTREE_INSERT_JOURNAL_RESERVED
+					      ? JOURNAL_RES_GET_RESERVED : 0)
+			: 0;
+		if (ret)
+			return ret;
+	}
 
 	multi_lock_write(c, trans);
 
@@ -357,7 +391,7 @@ static inline int do_btree_insert_at(struct btree_insert *trans,
 		}
 	}
 
-	if (!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)) {
+	if (trans->journal_res.ref) {
 		if (journal_seq_verify(c))
 			trans_for_each_entry(trans, i)
 				i->k->k.version.lo = trans->journal_res.seq;
@@ -398,6 +432,10 @@ static inline int do_btree_insert_at(struct btree_insert *trans,
 		if (!trans->did_work && (ret || *split))
 			break;
 	}
+
+	trans_for_each_entry(trans, i)
+		if (i->done)
+			btree_insert_key_cache_update(trans, i);
 out:
 	multi_unlock_write(trans);
 	bch2_journal_res_put(&c->journal, &trans->journal_res);
@@ -449,7 +487,8 @@ int __bch2_btree_insert_at(struct btree_insert *trans)
 
 	bubble_sort(trans->entries, trans->nr, btree_trans_cmp);
 
-	if (unlikely(!percpu_ref_tryget(&c->writes)))
+	if (unlikely(!(trans->flags & BTREE_INSERT_NOCHECK_RW) &&
+		     !percpu_ref_tryget(&c->writes)))
 		return -EROFS;
 retry:
 	split = NULL;
@@ -482,7 +521,8 @@ retry:
 	trans_for_each_entry(trans, i)
 		bch2_btree_iter_downgrade(i->iter);
 out:
-	percpu_ref_put(&c->writes);
+	if (!(trans->flags & BTREE_INSERT_NOCHECK_RW))
+		percpu_ref_put(&c->writes);
 
 	if (IS_ENABLED(CONFIG_BCACHEFS_DEBUG)) {
 		/* make sure we didn't drop or screw up locks: */
@@ -581,6 +621,360 @@ err:
 	goto out;
 }
 
+/* Batched inserts: */
+
+/* Max keys committed together, by one leader: */
+#define BTREE_INSERT_BATCH_MAX		32
+
+/*
+ * Insert a sorted run of keys (not extents) with one journal reservation,
+ * taking the leaf's write lock once - all the entries point to the same
+ * iterator, which is moved from key to key within the leaf.
+ *
+ * Stops at the first key that goes in a different leaf, or doesn't fit in this
+ * one or the journal reservation: returns the number of keys inserted, and the
+ * caller uses __bch2_btree_insert_at() for the next key if that was 0, to
+ * split, get errors returned and so on.
+ */
+static unsigned btree_insert_leaf_batch(struct btree_insert *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *iter = trans->entries[0].iter;
+	struct btree_insert_entry *i, *end;
+	struct btree *b;
+	unsigned u64s = 0, nr = 0;
+
+	EBUG_ON(iter->flags & BTREE_ITER_IS_EXTENTS);
+	EBUG_ON(trans->flags & BTREE_INSERT_ATOMIC);
+
+	if (unlikely(!(trans->flags & BTREE_INSERT_NOCHECK_RW) &&
+		     !percpu_ref_tryget(&c->writes)))
+		return 0;
+
+	bch2_btree_iter_set_pos(iter, trans->entries[0].k->k.p);
+
+	if (bch2_btree_iter_traverse(iter) ||
+	    !bch2_btree_iter_upgrade(iter, 1, true))
+		goto out;
+
+	b = iter->l[0].b;
+
+	trans_for_each_entry(trans, i) {
+		if (bkey_cmp(i->k->k.p, b->key.k.p) > 0)
+			break;
+		u64s += jset_u64s(i->k->k.u64s);
+	}
+	end = i;
+
+	memset(&trans->journal_res, 0, sizeof(trans->journal_res));
+
+	if (!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY) &&
+	    bch2_journal_res_get(&c->journal, &trans->journal_res,
+				 jset_u64s(trans->entries[0].k->k.u64s), u64s,
+				 trans->flags & BTREE_INSERT_JOURNAL_RESERVED
+				 ? JOURNAL_RES_GET_RESERVED : 0))
+		goto out;
+
+	bch2_btree_node_lock_for_insert(c, b, iter);
+
+	for (i = trans->entries; i < end; i++) {
+		if (trans->journal_res.ref &&
+		    trans->journal_res.u64s < jset_u64s(i->k->k.u64s))
+			break;
+
+		if (!bch2_btree_node_insert_fits(c, b, i->k->k.u64s))
+			break;
+
+		bch2_btree_iter_set_pos_same_leaf(iter, i->k->k.p);
+		btree_insert_entry_checks(c, i);
+
+		if (trans->journal_res.ref) {
+			if (journal_seq_verify(c))
+				i->k->k.version.lo = trans->journal_res.seq;
+			else if (inject_invalid_keys(c))
+				i->k->k.version = MAX_VERSION;
+		}
+
+		if (btree_insert_key_leaf(trans, i) != BTREE_INSERT_OK)
+			break;
+
+		btree_insert_key_cache_update(trans, i);
+		i->done = true;
+		nr++;
+	}
+
+	bch2_btree_node_unlock_write(b, iter);
+	bch2_journal_res_put(&c->journal, &trans->journal_res);
+
+	if (nr)
+		bch2_foreground_maybe_merge(c, iter, 0, trans->flags);
+	bch2_btree_iter_downgrade(iter);
+out:
+	if (!(trans->flags & BTREE_INSERT_NOCHECK_RW))
+		percpu_ref_put(&c->writes);
+	return nr;
+}
+
+struct btree_insert_waiter {
+	struct list_head	list;
+	struct task_struct	*task;
+	enum btree_id		btree_id;
+	unsigned		flags;
+	struct bkey_i		*k;
+	unsigned		seq;
+	u64			journal_seq;
+	int			ret;
+	bool			done;
+	bool			lead;
+};
+
+static int btree_insert_waiter_cmp(const void *_l, const void *_r)
+{
+	const struct btree_insert_waiter *l =
+		*((const struct btree_insert_waiter **) _l);
+	const struct btree_insert_waiter *r =
+		*((const struct btree_insert_waiter **) _r);
+
+	if (l->btree_id != r->btree_id)
+		return l->btree_id < r->btree_id ? -1 : 1;
+	if (l->flags != r->flags)
+		return l->flags < r->flags ? -1 : 1;
+
+	return bkey_cmp(l->k->k.p, r->k->k.p) ?: (int) l->seq - (int) r->seq;
+}
+
+/*
+ * Commit a batch of queued inserts: sorted, so that keys for the same leaf are
+ * adjacent (and keys at the same position are inserted in the order they were
+ * queued), then each run of keys with the same btree and flags goes through
+ * btree_insert_leaf_batch():
+ */
+static void btree_insert_batch_commit(struct bch_fs *c,
+				      struct btree_insert_waiter **w,
+				      unsigned nr)
+{
+	struct btree_insert_entry entries[BTREE_INSERT_BATCH_MAX];
+	struct btree_iter iter;
+	unsigned i, j, run, done;
+	u64 journal_seq;
+
+	for (i = 0; i < nr; i++)
+		w[i]->seq = i;
+
+	sort(w, nr, sizeof(w[0]), btree_insert_waiter_cmp, NULL);
+
+	for (run = 0; run < nr; run = j) {
+		for (j = run + 1;
+		     j < nr &&
+		     w[j]->btree_id == w[run]->btree_id &&
+		     w[j]->flags == w[run]->flags;
+		     j++)
+			;
+
+		bch2_btree_iter_init(&iter, c, w[run]->btree_id,
+				     w[run]->k->k.p, BTREE_ITER_INTENT);
+
+		for (i = run; i < j; i++)
+			entries[i] = BTREE_INSERT_ENTRY(&iter, w[i]->k);
+
+		i = run;
+		while (i < j) {
+			struct btree_insert trans = {
+				.c		= c,
+				.journal_seq	= &journal_seq,
+				.flags		= w[run]->flags,
+				.nr		= j - i,
+				.entries	= entries + i,
+			};
+
+			journal_seq = 0;
+			done = btree_insert_leaf_batch(&trans);
+
+			if (!done) {
+				bch2_btree_iter_set_pos(&iter, w[i]->k->k.p);
+
+				trans.nr = 1;
+				w[i]->ret = __bch2_btree_insert_at(&trans);
+				done = 1;
+			}
+
+			while (done--) {
+				w[i]->journal_seq = journal_seq;
+				i++;
+			}
+		}
+
+		bch2_btree_iter_unlock(&iter);
+	}
+}
+
+/* How long a queued insert waits for a leader before committing itself: */
+#define BTREE_INSERT_BATCH_WAIT		msecs_to_jiffies(1)
+
+static struct btree_insert_batch *btree_insert_batch_queue(struct bch_fs *c,
+						struct btree *b, unsigned flags)
+{
+	unsigned hash = hash_long((unsigned long) b ^ flags,
+				  ilog2(ARRAY_SIZE(c->btree_insert_batch)));
+
+	return &c->btree_insert_batch[hash];
+}
+
+/* Returns false if we timed out: */
+static bool btree_insert_waiter_wait(struct btree_insert_waiter *w,
+				     long timeout)
+{
+	bool ret = true;
+
+	while (1) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		if (smp_load_acquire(&w->done) ||
+		    READ_ONCE(w->lead))
+			break;
+
+		if (!timeout) {
+			ret = false;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return ret;
+}
+
+/**
+ * bch2_btree_insert_batched - insert a key, possibly along with other threads'
+ * @c:			pointer to struct bch_fs
+ * @id:			btree to insert into (not extents)
+ * @k:			key to insert
+ *
+ * Group commit: the first thread to queue an insert for a leaf becomes the
+ * leader, and commits everything that gets queued for that leaf while it's
+ * working - each run of keys with the same flags with one journal reservation
+ * and one write lock. The leader only stays leader for one batch after its own
+ * key is in - then it hands off to the next queued thread.
+ *
+ * The caller mustn't hold btree locks, so the leader can't be waiting on it.
+ * A queued key waits at most BTREE_INSERT_BATCH_WAIT for a leader to pick it
+ * up; then the caller takes it back and inserts it itself.
+ */
+int bch2_btree_insert_batched(struct bch_fs *c, enum btree_id id,
+			      struct bkey_i *k, u64 *journal_seq,
+			      unsigned flags)
+{
+	struct btree_insert_batch *g;
+	struct btree_insert_waiter *batch[BTREE_INSERT_BATCH_MAX];
+	struct btree_insert_waiter w = {
+		.task		= current,
+		.btree_id	= id,
+		.flags		= flags,
+		.k		= k,
+	}, *i, *n;
+	struct btree_iter iter;
+	unsigned nr = 0;
+
+	EBUG_ON(id == BTREE_ID_EXTENTS || (flags & BTREE_INSERT_ATOMIC));
+
+	/*
+	 * Find the leaf, to find its queue - if we end up inserting our key
+	 * ourselves, the iterator only has to be relocked:
+	 */
+	bch2_btree_iter_init(&iter, c, id, k->k.p, BTREE_ITER_INTENT);
+	if (bch2_btree_iter_traverse(&iter))
+		goto insert;
+
+	g = btree_insert_batch_queue(c, iter.l[0].b, flags);
+	bch2_btree_iter_unlock(&iter);
+
+	mutex_lock(&g->lock);
+	list_add_tail(&w.list, &g->pending);
+
+	if (g->leader) {
+		mutex_unlock(&g->lock);
+
+		if (!btree_insert_waiter_wait(&w, BTREE_INSERT_BATCH_WAIT)) {
+			mutex_lock(&g->lock);
+			if (!w.lead && !list_empty(&w.list)) {
+				/* No one picked us up - do it ourselves: */
+				list_del(&w.list);
+				mutex_unlock(&g->lock);
+				goto insert;
+			}
+			mutex_unlock(&g->lock);
+
+			/* We're in a batch that's being committed, or leading: */
+			btree_insert_waiter_wait(&w, MAX_SCHEDULE_TIMEOUT);
+		}
+
+		if (w.done)
+			goto out;
+
+		mutex_lock(&g->lock);
+	}
+
+	g->leader = true;
+
+	/* We're at the head of the list, so we're always in the batch: */
+	list_for_each_entry_safe(i, n, &g->pending, list) {
+		if (nr == BTREE_INSERT_BATCH_MAX)
+			break;
+
+		list_del_init(&i->list);
+		batch[nr++] = i;
+	}
+	mutex_unlock(&g->lock);
+
+	if (nr == 1) {
+		w.ret = bch2_btree_insert_at(c, NULL, NULL, &w.journal_seq,
+					     flags, BTREE_INSERT_ENTRY(&iter, k));
+		bch2_btree_iter_unlock(&iter);
+	} else {
+		btree_insert_batch_commit(c, batch, nr);
+	}
+
+	/* Once done is set they can return, so get the task first: */
+	while (nr--)
+		if (batch[nr] != &w) {
+			struct task_struct *task = batch[nr]->task;
+
+			smp_store_release(&batch[nr]->done, true);
+			wake_up_process(task);
+		}
+
+	/* Hand off to the next thread in line, which can't go away until then: */
+	mutex_lock(&g->lock);
+	i = list_first_entry_or_null(&g->pending,
+				     struct btree_insert_waiter, list);
+	if (i)
+		WRITE_ONCE(i->lead, true);
+	else
+		g->leader = false;
+	mutex_unlock(&g->lock);
+
+	if (i)
+		wake_up_process(i->task);
+out:
+	if (journal_seq && w.journal_seq)
+		*journal_seq = w.journal_seq;
+	return w.ret;
+insert:
+	w.ret = bch2_btree_insert_at(c, NULL, NULL, journal_seq, flags,
+				     BTREE_INSERT_ENTRY(&iter, k));
+	bch2_btree_iter_unlock(&iter);
+	return w.ret;
+}
+
+void bch2_fs_btree_insert_batch_init_early(struct bch_fs *c)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(c->btree_insert_batch); i++) {
+		mutex_init(&c->btree_insert_batch[i].lock);
+		INIT_LIST_HEAD(&c->btree_insert_batch[i].pending);
+	}
+}
+
 void bch2_trans_update(struct btree_trans *trans,
 		       struct btree_iter *iter,
 		       struct bkey_i *k,
@@ -648,7 +1042,38 @@ int bch2_btree_insert_list_at(struct btree_iter *iter,
 	bch2_verify_keylist_sorted(keys);
 
 	while (!bch2_keylist_empty(keys)) {
-		int ret = bch2_btree_insert_at(iter->c, disk_res, hook,
+		int ret;
+
+		if (!(iter->flags & BTREE_ITER_IS_EXTENTS)) {
+			struct btree_insert_entry entries[BTREE_INSERT_BATCH_MAX];
+			struct btree_insert trans = {
+				.c		= iter->c,
+				.disk_res	= disk_res,
+				.journal_seq	= journal_seq,
+				.hook		= hook,
+				.flags		= flags,
+				.entries	= entries,
+			};
+			struct bkey_i *k;
+			unsigned done;
+
+			for (k = bch2_keylist_front(keys);
+			     k != keys->top && trans.nr < ARRAY_SIZE(entries);
+			     k = bkey_next(k))
+				entries[trans.nr++] = BTREE_INSERT_ENTRY(iter, k);
+
+			done = btree_insert_leaf_batch(&trans);
+			if (done) {
+				while (done--)
+					bch2_keylist_pop_front(keys);
+				continue;
+			}
+
+			bch2_btree_iter_set_pos(iter,
+					bch2_keylist_front(keys)->k.p);
+		}
+
+		ret = bch2_btree_insert_at(iter->c, disk_res, hook,
 				journal_seq, flags,
 				BTREE_INSERT_ENTRY(iter, bch2_keylist_front(keys)));
 		if (ret)
@@ -217,6 +217,51 @@ struct bch_dev_usage bch2_dev_usage_read(struct bch_fs *c, struct bch_dev *ca)
 	return bch2_usage_read_cached(c, ca->usage_cached, ca->usage_percpu);
 }
 
+#define USAGE_APPROX_MAX_AGE	(10 * NSEC_PER_MSEC)
+
+/*
+ * For callers that don't need an exact answer, and read often - e.g. for
+ * weighting devices by free space on every bucket allocation: reading the
+ * usage counters means summing every cpu's copy, so this returns a snapshot
+ * that's at most USAGE_APPROX_MAX_AGE old.
+ *
+ * Whoever finds the snapshot stale refreshes it, other readers meanwhile get
+ * the old one:
+ */
+struct bch_dev_usage bch2_dev_usage_read_approx(struct bch_fs *c,
+						struct bch_dev *ca)
+{
+	struct bch_dev_usage ret;
+	u64 now = local_clock();
+	unsigned seq;
+
+	if (time_after64(now, READ_ONCE(ca->usage_approx_time) +
+			 USAGE_APPROX_MAX_AGE)) {
+		if (spin_trylock(&ca->usage_approx_lock)) {
+			ret = bch2_dev_usage_read(c, ca);
+
+			write_seqcount_begin(&ca->usage_approx_seq);
+			ca->usage_approx = ret;
+			write_seqcount_end(&ca->usage_approx_seq);
+
+			WRITE_ONCE(ca->usage_approx_time, now);
+			spin_unlock(&ca->usage_approx_lock);
+			return ret;
+		}
+
+		/* no snapshot yet: */
+		if (!READ_ONCE(ca->usage_approx_time))
+			return bch2_dev_usage_read(c, ca);
+	}
+
+	do {
+		seq = read_seqcount_begin(&ca->usage_approx_seq);
+		ret = ca->usage_approx;
+	} while (read_seqcount_retry(&ca->usage_approx_seq, seq));
+
+	return ret;
+}
+
 struct bch_fs_usage
 __bch2_fs_usage_read(struct bch_fs *c)
 {
@@ -694,12 +739,31 @@ void bch2_mark_key(struct bch_fs *c, struct bkey_s_c k,
 
 /* Disk reservations: */
 
+/*
+ * Each cpu keeps a cache of sectors taken from c->sectors_available
+ * (bch_fs_usage.available_cache), so that most reservations don't touch shared
+ * cachelines. The amount a cpu takes when its cache runs dry adapts: it doubles
+ * every time the cache is refilled, and goes back to the minimum when we've
+ * had to go to the slowpath - and it's limited to a fraction of what's left in
+ * sectors_available, so that as the filesystem fills up cpus don't strand
+ * space in their caches that other cpus need.
+ *
+ * When sectors_available can't satisfy a reservation, we first steal back
+ * everything cached by other cpus - this only needs usage_lock - and only
+ * recalculate sectors_available from the usage counters, under gc_lock, if
+ * that wasn't enough.
+ */
+#define SECTORS_CACHE_MIN	1024
+#define SECTORS_CACHE_MAX	(1024 * 64)
+
 static u64 __recalc_sectors_available(struct bch_fs *c)
 {
 	int cpu;
 
-	for_each_possible_cpu(cpu)
+	for_each_possible_cpu(cpu) {
 		per_cpu_ptr(c->usage_percpu, cpu)->available_cache = 0;
+		per_cpu_ptr(c->disk_res_pcpu, cpu)->batch = SECTORS_CACHE_MIN;
+	}
 
 	return bch2_fs_sectors_free(c, bch2_fs_usage_read(c));
 }
@@ -724,36 +788,73 @@ void __bch2_disk_reservation_put(struct bch_fs *c, struct disk_reservation *res)
 	res->sectors = 0;
 }
 
-#define SECTORS_CACHE	1024
+static u64 disk_res_batch(struct disk_reservation_pcpu *r, u64 available)
+{
+	u64 batch = clamp_t(u64, r->batch, SECTORS_CACHE_MIN, SECTORS_CACHE_MAX);
+
+	return min(batch, div_u64(available, num_possible_cpus() * 4));
+}
+
+/* Returns sectors_available, after pulling back every cpu's cache: */
+static u64 disk_res_steal(struct bch_fs *c)
+{
+	struct bch_fs_usage *stats;
+	u64 stolen = 0;
+	int cpu;
+
+	percpu_rwsem_assert_held(&c->usage_lock);
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(c->usage_percpu, cpu);
+		stolen += stats->available_cache;
+		stats->available_cache = 0;
+
+		per_cpu_ptr(c->disk_res_pcpu, cpu)->batch = SECTORS_CACHE_MIN;
+	}
+
+	return atomic64_add_return(stolen, &c->sectors_available);
+}
+
+struct disk_reservation_pcpu bch2_disk_reservation_stats(struct bch_fs *c)
+{
+	return bch2_usage_read_raw(c->disk_res_pcpu);
+}
 
 int bch2_disk_reservation_add(struct bch_fs *c, struct disk_reservation *res,
 			      unsigned sectors, int flags)
 {
 	struct bch_fs_usage *stats;
+	struct disk_reservation_pcpu *r;
 	u64 old, v, get;
 	s64 sectors_available;
 	int ret;
 
 	percpu_down_read_preempt_disable(&c->usage_lock);
-	stats = this_cpu_ptr(c->usage_percpu);
+	stats	= this_cpu_ptr(c->usage_percpu);
+	r	= this_cpu_ptr(c->disk_res_pcpu);
 
-	if (sectors <= stats->available_cache)
+	if (sectors <= stats->available_cache) {
+		r->nr_fast++;
 		goto out;
+	}
 
 	v = atomic64_read(&c->sectors_available);
 	do {
 		old = v;
-		get = min((u64) sectors + SECTORS_CACHE, old);
+		get = min((u64) sectors + disk_res_batch(r, old), old);
 
 		if (get < sectors) {
 			percpu_up_read_preempt_enable(&c->usage_lock);
-			goto recalculate;
+			goto steal;
 		}
 	} while ((v = atomic64_cmpxchg(&c->sectors_available,
 				       old, old - get)) != old);
 
 	stats->available_cache	+= get;
-
+	r->batch		= min_t(u64, max_t(u64, r->batch,
+						   SECTORS_CACHE_MIN) * 2,
+					SECTORS_CACHE_MAX);
+	r->nr_refill++;
 out:
 	stats->available_cache	-= sectors;
 	stats->online_reserved	+= sectors;
@@ -764,7 +865,21 @@ out:
 	percpu_up_read_preempt_enable(&c->usage_lock);
 	return 0;
 
-recalculate:
+steal:
+	percpu_down_write(&c->usage_lock);
+	sectors_available = disk_res_steal(c);
+
+	if (sectors <= sectors_available) {
+		atomic64_sub(sectors, &c->sectors_available);
+		this_cpu_add(c->usage_percpu->online_reserved, sectors);
+		this_cpu_inc(c->disk_res_pcpu->nr_steal);
+		res->sectors		+= sectors;
+		ret = 0;
+
+		bch2_disk_reservations_verify(c, flags);
+		goto out_write;
+	}
+
 	/*
 	 * GC recalculates sectors_available when it starts, so that hopefully
 	 * we don't normally end up blocking here:
@@ -772,39 +887,45 @@ recalculate:
 
 	/*
 	 * Piss fuck, we can be called from extent_insert_fixup() with btree
-	 * locks held:
+	 * locks held.
+	 *
+	 * gc_lock is taken before usage_lock, so only a trylock is safe here;
+	 * if that fails, drop usage_lock and take them in order:
 	 */
+	if (!(flags & BCH_DISK_RESERVATION_GC_LOCK_HELD) &&
+	    !down_read_trylock(&c->gc_lock)) {
+		percpu_up_write(&c->usage_lock);
 
-	if (!(flags & BCH_DISK_RESERVATION_GC_LOCK_HELD)) {
-		if (!(flags & BCH_DISK_RESERVATION_BTREE_LOCKS_HELD))
-			down_read(&c->gc_lock);
-		else if (!down_read_trylock(&c->gc_lock))
+		if (flags & BCH_DISK_RESERVATION_BTREE_LOCKS_HELD)
 			return -EINTR;
+
+		down_read(&c->gc_lock);
+		percpu_down_write(&c->usage_lock);
 	}
 
-	percpu_down_write(&c->usage_lock);
 	sectors_available = __recalc_sectors_available(c);
+	this_cpu_inc(c->disk_res_pcpu->nr_recalc);
 
 	if (sectors <= sectors_available ||
 	    (flags & BCH_DISK_RESERVATION_NOFAIL)) {
 		atomic64_set(&c->sectors_available,
 			     max_t(s64, 0, sectors_available - sectors));
-		stats->online_reserved	+= sectors;
+		this_cpu_add(c->usage_percpu->online_reserved, sectors);
 		res->sectors		+= sectors;
 		ret = 0;
 
 		bch2_disk_reservations_verify(c, flags);
 	} else {
 		atomic64_set(&c->sectors_available, sectors_available);
+		this_cpu_inc(c->disk_res_pcpu->nr_enospc);
 		ret = -ENOSPC;
 	}
 
-	bch2_fs_stats_verify(c);
-	percpu_up_write(&c->usage_lock);
-
 	if (!(flags & BCH_DISK_RESERVATION_GC_LOCK_HELD))
 		up_read(&c->gc_lock);
-
+out_write:
+	bch2_fs_stats_verify(c);
+	percpu_up_write(&c->usage_lock);
 	return ret;
 }
 
@@ -963,6 +1084,9 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 
 int bch2_dev_buckets_alloc(struct bch_fs *c, struct bch_dev *ca)
 {
+	spin_lock_init(&ca->usage_approx_lock);
+	seqcount_init(&ca->usage_approx_seq);
+
 	if (!(ca->usage_percpu = alloc_percpu(struct bch_dev_usage)))
 		return -ENOMEM;
 
@@ -135,6 +135,8 @@ static inline bool bucket_unused(struct bucket_mark mark)
 
 struct bch_dev_usage __bch2_dev_usage_read(struct bch_dev *);
 struct bch_dev_usage bch2_dev_usage_read(struct bch_fs *, struct bch_dev *);
+struct bch_dev_usage bch2_dev_usage_read_approx(struct bch_fs *,
+						struct bch_dev *);
 
 static inline u64 __dev_buckets_available(struct bch_dev *ca,
 					  struct bch_dev_usage stats)
@@ -243,6 +245,7 @@ static inline void bch2_disk_reservation_put(struct bch_fs *c,
 int bch2_disk_reservation_add(struct bch_fs *,
 			     struct disk_reservation *,
 			     unsigned, int);
+struct disk_reservation_pcpu bch2_disk_reservation_stats(struct bch_fs *);
 
 static inline struct disk_reservation
 bch2_disk_reservation_init(struct bch_fs *c, unsigned nr_replicas)
@@ -75,6 +75,27 @@ struct bch_fs_usage {
 	}			s[BCH_REPLICAS_MAX];
 };
 
+#define BCH_DISK_RES_COUNTERS()		\
+	x(fast)				\
+	x(refill)			\
+	x(steal)			\
+	x(recalc)			\
+	x(enospc)
+
+/*
+ * Per cpu disk reservation state, see bch2_disk_reservation_add() - the cpu's
+ * cache of sectors is bch_fs_usage.available_cache:
+ */
+struct disk_reservation_pcpu {
+	/* how much to take from sectors_available when the cache runs dry: */
+	u64			batch;
+
+	/* which path reservations were satisfied from: */
+#define x(_n)	u64		nr_##_n;
+	BCH_DISK_RES_COUNTERS()
+#undef x
+};
+
 /*
  * A reservation for space on disk:
  */
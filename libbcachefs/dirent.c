@@ -30,13 +30,8 @@ static unsigned dirent_val_u64s(unsigned len)
 static u64 bch2_dirent_hash(const struct bch_hash_info *info,
 			    const struct qstr *name)
 {
-	struct bch_str_hash_ctx ctx;
-
-	bch2_str_hash_init(&ctx, info);
-	bch2_str_hash_update(&ctx, info, name->name, name->len);
-
 	/* [0,2) reserved for dots */
-	return max_t(u64, bch2_str_hash_end(&ctx, info), 2);
+	return max_t(u64, bch2_str_hash(info, name->name, name->len), 2);
 }
 
 static u64 dirent_hash_key(const struct bch_hash_info *info, const void *key)
@@ -141,23 +136,17 @@ void bch2_dirent_to_text(struct bch_fs *c, char *buf,
 	}
 }
 
-static struct bkey_i_dirent *dirent_create_key(struct btree_trans *trans,
-				u8 type, const struct qstr *name, u64 dst)
+unsigned bch2_dirent_u64s(unsigned name_len)
 {
-	struct bkey_i_dirent *dirent;
-	unsigned u64s = BKEY_U64s + dirent_val_u64s(name->len);
-
-	if (name->len > BCH_NAME_MAX)
-		return ERR_PTR(-ENAMETOOLONG);
-
-	BUG_ON(u64s > U8_MAX);
-
-	dirent = bch2_trans_kmalloc(trans, u64s * sizeof(u64));
-	if (IS_ERR(dirent))
-		return dirent;
+	return BKEY_U64s + dirent_val_u64s(name_len);
+}
 
+/* @dirent must have room for bch2_dirent_u64s(name->len) u64s: */
+void bch2_dirent_init(struct bkey_i_dirent *dirent, u8 type,
+		      const struct qstr *name, u64 dst)
+{
 	bkey_dirent_init(&dirent->k_i);
-	dirent->k.u64s = u64s;
+	dirent->k.u64s = bch2_dirent_u64s(name->len);
 	dirent->v.d_inum = cpu_to_le64(dst);
 	dirent->v.d_type = type;
 
@@ -168,7 +157,24 @@ static struct bkey_i_dirent *dirent_create_key(struct btree_trans *trans,
 	       name->len);
 
 	EBUG_ON(bch2_dirent_name_bytes(dirent_i_to_s_c(dirent)) != name->len);
+}
+
+static struct bkey_i_dirent *dirent_create_key(struct btree_trans *trans,
+				u8 type, const struct qstr *name, u64 dst)
+{
+	struct bkey_i_dirent *dirent;
+	unsigned u64s = bch2_dirent_u64s(name->len);
+
+	if (name->len > BCH_NAME_MAX)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	BUG_ON(u64s > U8_MAX);
+
+	dirent = bch2_trans_kmalloc(trans, u64s * sizeof(u64));
+	if (IS_ERR(dirent))
+		return dirent;
 
+	bch2_dirent_init(dirent, type, name, dst);
 	return dirent;
 }
 
@@ -21,6 +21,8 @@ struct bch_hash_info;
 struct bch_inode_info;
 
 unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent);
+unsigned bch2_dirent_u64s(unsigned);
+void bch2_dirent_init(struct bkey_i_dirent *, u8, const struct qstr *, u64);
 
 int __bch2_dirent_create(struct btree_trans *, u64,
 			 const struct bch_hash_info *, u8,
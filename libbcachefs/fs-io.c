@@ -1,6 +1,7 @@
 #ifndef NO_BCACHEFS_FS
 
 #include "bcachefs.h"
+#include "btree_key_cache.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "clock.h"
@@ -424,6 +425,7 @@ static int bchfs_write_index_update(struct bch_write_op *wop)
 			goto err;
 
 		if (hook.need_inode_update) {
+			struct bkey_inode_buf cached;
 			struct bkey_s_c inode;
 
 			if (!inode_iter) {
@@ -434,7 +436,9 @@ static int bchfs_write_index_update(struct bch_write_op *wop)
 				BUG_ON(IS_ERR(inode_iter));
 			}
 
-			inode = bch2_btree_iter_peek_slot(inode_iter);
+			inode = bch2_btree_key_cache_peek_slot(inode_iter,
+					&cached.inode.k_i,
+					sizeof(cached) / sizeof(u64));
 			if ((ret = btree_iter_err(inode)))
 				goto err;
 
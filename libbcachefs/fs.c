@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "acl.h"
+#include "btree_key_cache.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "chardev.h"
@@ -105,7 +106,7 @@ int __must_check bch2_write_inode_trans(struct btree_trans *trans,
 				void *p)
 {
 	struct btree_iter *iter;
-	struct bkey_inode_buf *inode_p;
+	struct bkey_inode_buf *inode_p, cached;
 	struct bkey_s_c k;
 	u64 inum = inode->v.i_ino;
 	int ret;
@@ -117,7 +118,8 @@ int __must_check bch2_write_inode_trans(struct btree_trans *trans,
 	if (IS_ERR(iter))
 		return PTR_ERR(iter);
 
-	k = bch2_btree_iter_peek_slot(iter);
+	k = bch2_btree_key_cache_peek_slot(iter, &cached.inode.k_i,
+					   sizeof(cached) / sizeof(u64));
 	if ((ret = btree_iter_err(k)))
 		return ret;
 
@@ -151,37 +153,54 @@ int __must_check bch2_write_inode_trans(struct btree_trans *trans,
 	return 0;
 }
 
+/*
+ * Updates that only touch the inode go through the btree key cache - an inode
+ * is often updated many times in quick succession:
+ */
 int __must_check __bch2_write_inode(struct bch_fs *c,
 				    struct bch_inode_info *inode,
 				    inode_set_fn set,
 				    void *p, unsigned fields)
 {
-	struct btree_trans trans;
 	struct bch_inode_unpacked inode_u;
+	struct bkey_inode_buf inode_p;
+	struct bkey_cached *ck;
+	u64 inum = inode->v.i_ino;
 	int ret;
 
-	bch2_trans_init(&trans, c);
-retry:
-	bch2_trans_begin(&trans);
+	lockdep_assert_held(&inode->ei_update_lock);
 
-	ret = bch2_write_inode_trans(&trans, inode, &inode_u, set, p) ?:
-		bch2_trans_commit(&trans, NULL, NULL,
-				  &inode->ei_journal_seq,
-				  BTREE_INSERT_ATOMIC|
-				  BTREE_INSERT_NOUNLOCK|
-				  BTREE_INSERT_NOFAIL);
-	if (ret == -EINTR)
-		goto retry;
+	ck = bch2_btree_key_cache_lock(c, BTREE_ID_INODES, POS(inum, 0));
+	if (IS_ERR(ck))
+		return PTR_ERR(ck);
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode_u);
+	if (WARN_ONCE(ret,
+		      "error %i looking up inode %llu when updating", ret, inum))
+		goto err;
+
+	BUG_ON(inode_u.bi_size != inode->ei_inode.bi_size);
+
+	if (set) {
+		ret = set(inode, &inode_u, p);
+		if (ret)
+			goto err;
+	}
+
+	bch2_inode_pack(&inode_p, &inode_u);
+
+	ret = bch2_btree_key_cache_update(c, ck, &inode_p.inode.k_i,
+					  &inode->ei_journal_seq, 0);
 
 	/*
-	 * the btree node lock protects inode->ei_inode, not ei_update_lock;
+	 * the cached key's lock protects inode->ei_inode, not ei_update_lock;
 	 * this is important for inode updates via bchfs_write_index_update
 	 */
 	if (!ret)
 		bch2_inode_update_after_write(c, inode, &inode_u, fields);
-
-	bch2_trans_exit(&trans);
-	return ret < 0 ? ret : 0;
+err:
+	bch2_btree_key_cache_unlock(c, ck);
+	return ret;
 }
 
 static struct inode *bch2_vfs_inode_get(struct bch_fs *c, u64 inum)
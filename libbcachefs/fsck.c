@@ -1,5 +1,7 @@
 
 #include "bcachefs.h"
+#include "btree_key_cache.h"
+#include "btree_locking.h"
 #include "btree_update.h"
 #include "dirent.h"
 #include "error.h"
@@ -11,7 +13,8 @@
 #include "xattr.h"
 
 #include <linux/dcache.h> /* struct qstr */
-#include <linux/generic-radix-tree.h>
+#include <linux/shmem_fs.h>
+#include <linux/sort.h>
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
@@ -59,7 +62,6 @@ static int reattach_inode(struct bch_fs *c,
 {
 	struct bch_hash_info lostfound_hash_info =
 		bch2_hash_info_init(c, lostfound_inode);
-	struct bkey_inode_buf packed;
 	char name_buf[20];
 	struct qstr name;
 	int ret;
@@ -69,11 +71,7 @@ static int reattach_inode(struct bch_fs *c,
 
 	lostfound_inode->bi_nlink++;
 
-	bch2_inode_pack(&packed, lostfound_inode);
-
-	ret = bch2_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
-			       NULL, NULL, NULL,
-			       BTREE_INSERT_NOFAIL);
+	ret = bch2_inode_write(c, lostfound_inode, NULL);
 	if (ret) {
 		bch_err(c, "error %i reattaching inode %llu while updating lost+found",
 			ret, inum);
@@ -92,36 +90,70 @@ static int reattach_inode(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * The btrees fsck checks against the inodes btree are all keyed by inode
+ * number, so instead of a lookup for each inode we walk an iterator over the
+ * inodes btree in lockstep (a merge join). It's only locked while we read from
+ * it, so that repairs can update the inodes btree:
+ */
 struct inode_walker {
 	bool			first_this_inode;
 	bool			have_inode;
 	u64			cur_inum;
 	struct bch_inode_unpacked inode;
+	struct btree_iter	iter;
 };
 
-static struct inode_walker inode_walker_init(void)
+static void inode_walker_init(struct bch_fs *c, struct inode_walker *w)
 {
-	return (struct inode_walker) {
-		.cur_inum	= -1,
-		.have_inode	= false,
-	};
+	w->first_this_inode	= false;
+	w->have_inode		= false;
+	w->cur_inum		= -1;
+
+	bch2_btree_iter_init(&w->iter, c, BTREE_ID_INODES, POS_MIN,
+			     BTREE_ITER_SLOTS);
+}
+
+static int inode_walker_exit(struct inode_walker *w)
+{
+	return bch2_btree_iter_unlock(&w->iter);
 }
 
 static int walk_inode(struct bch_fs *c, struct inode_walker *w, u64 inum)
 {
+	struct bkey_inode_buf cached;
+	struct bkey_s_c k;
+	int ret = 0;
+
 	w->first_this_inode	= inum != w->cur_inum;
 	w->cur_inum		= inum;
 
-	if (w->first_this_inode) {
-		int ret = bch2_inode_find_by_inum(c, inum, &w->inode);
-
-		if (ret && ret != -ENOENT)
-			return ret;
+	if (!w->first_this_inode)
+		return 0;
 
-		w->have_inode = !ret;
+	/* repairs go through the key cache, which is newer than the btree: */
+	if (bch2_btree_key_cache_read(c, BTREE_ID_INODES, POS(inum, 0),
+				      &cached.inode.k_i,
+				      sizeof(cached) / sizeof(u64))) {
+		k = bkey_i_to_s_c(&cached.inode.k_i);
+		goto found;
 	}
 
-	return 0;
+	/* if the inodes btree hasn't changed, this is just a node iter advance: */
+	bch2_btree_iter_relock(&w->iter);
+	bch2_btree_iter_set_pos(&w->iter, POS(inum, 0));
+
+	k = bch2_btree_iter_peek_slot(&w->iter);
+	ret = btree_iter_err(k);
+	if (ret)
+		goto out;
+found:
+	w->have_inode = k.k->type == BCH_INODE_FS;
+	if (w->have_inode)
+		ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &w->inode);
+out:
+	bch2_btree_iter_unlock(&w->iter);
+	return ret;
 }
 
 struct hash_check {
@@ -289,23 +321,64 @@ fsck_err:
 	return ret;
 }
 
+static int fix_i_sectors(struct bch_fs *c, struct btree_iter *iter,
+			 struct inode_walker *w, u64 i_sectors)
+{
+	int ret = 0;
+
+	if (fsck_err_on(w->inode.bi_sectors != i_sectors, c,
+			"i_sectors wrong: got %llu, should be %llu",
+			w->inode.bi_sectors, i_sectors)) {
+		w->inode.bi_sectors = i_sectors;
+
+		bch2_btree_iter_unlock(iter);
+
+		ret = bch2_inode_write(c, &w->inode, NULL);
+		if (ret)
+			bch_err(c, "error in fs gc: error %i "
+				"updating inode", ret);
+	}
+fsck_err:
+	return ret;
+}
+
 /*
  * Walk extents: verify that extents have a corresponding S_ISREG inode, and
  * that i_size an i_sectors are consistent
+ *
+ * i_sectors is summed as we go and checked when we get to the next inode, so
+ * each extent is only read once:
  */
 noinline_for_stack
 static int check_extents(struct bch_fs *c)
 {
-	struct inode_walker w = inode_walker_init();
+	struct inode_walker w;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	u64 i_sectors;
+	u64 i_sectors = 0;
+	bool check_i_sectors = false;
 	int ret = 0;
 
 	bch_verbose(c, "checking extents");
 
+	inode_walker_init(c, &w);
+
 	for_each_btree_key(&iter, c, BTREE_ID_EXTENTS,
 			   POS(BCACHEFS_ROOT_INO, 0), 0, k) {
+		if (check_i_sectors &&
+		    k.k->p.inode != w.cur_inum) {
+			check_i_sectors = false;
+
+			ret = fix_i_sectors(c, &iter, &w, i_sectors);
+			if (ret)
+				goto err;
+
+			/* revalidate iterator: */
+			k = bch2_btree_iter_peek(&iter);
+			if (IS_ERR_OR_NULL(k.k))
+				break;
+		}
+
 		ret = walk_inode(c, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -325,35 +398,10 @@ static int check_extents(struct bch_fs *c)
 			continue;
 		}
 
-		if (fsck_err_on(w.first_this_inode &&
-			w.have_inode &&
-			!(w.inode.bi_flags & BCH_INODE_I_SECTORS_DIRTY) &&
-			w.inode.bi_sectors !=
-			(i_sectors = bch2_count_inode_sectors(c, w.cur_inum)),
-			c, "i_sectors wrong: got %llu, should be %llu",
-			w.inode.bi_sectors, i_sectors)) {
-			struct bkey_inode_buf p;
-
-			w.inode.bi_sectors = i_sectors;
-
-			bch2_btree_iter_unlock(&iter);
-
-			bch2_inode_pack(&p, &w.inode);
-
-			ret = bch2_btree_insert(c, BTREE_ID_INODES,
-						&p.inode.k_i,
-						NULL,
-						NULL,
-						NULL,
-						BTREE_INSERT_NOFAIL);
-			if (ret) {
-				bch_err(c, "error in fs gc: error %i "
-					"updating inode", ret);
-				goto err;
-			}
-
-			/* revalidate iterator: */
-			k = bch2_btree_iter_peek(&iter);
+		if (w.first_this_inode) {
+			check_i_sectors = w.have_inode &&
+				!(w.inode.bi_flags & BCH_INODE_I_SECTORS_DIRTY);
+			i_sectors = 0;
 		}
 
 		if (fsck_err_on(w.have_inode &&
@@ -362,19 +410,32 @@ static int check_extents(struct bch_fs *c)
 			k.k->p.offset > round_up(w.inode.bi_size, PAGE_SIZE) >> 9, c,
 			"extent type %u offset %llu past end of inode %llu, i_size %llu",
 			k.k->type, k.k->p.offset, k.k->p.inode, w.inode.bi_size)) {
+			u64 end = round_up(w.inode.bi_size, PAGE_SIZE) >> 9;
+
+			/* the part of this extent before the new end stays: */
+			if (bkey_extent_is_allocation(k.k) &&
+			    bkey_start_offset(k.k) < end)
+				i_sectors += end - bkey_start_offset(k.k);
+
 			bch2_btree_iter_unlock(&iter);
 
-			ret = bch2_inode_truncate(c, k.k->p.inode,
-					round_up(w.inode.bi_size, PAGE_SIZE) >> 9,
-					NULL, NULL);
+			ret = bch2_inode_truncate(c, k.k->p.inode, end,
+						  NULL, NULL);
 			if (ret)
 				goto err;
 			continue;
 		}
+
+		if (bkey_extent_is_allocation(k.k))
+			i_sectors += k.k->size;
 	}
+
+	ret = bch2_btree_iter_unlock(&iter) ?: ret;
+	if (!ret && check_i_sectors)
+		ret = fix_i_sectors(c, &iter, &w, i_sectors);
 err:
 fsck_err:
-	return bch2_btree_iter_unlock(&iter) ?: ret;
+	return inode_walker_exit(&w) ?: bch2_btree_iter_unlock(&iter) ?: ret;
 }
 
 /*
@@ -384,7 +445,7 @@ fsck_err:
 noinline_for_stack
 static int check_dirents(struct bch_fs *c)
 {
-	struct inode_walker w = inode_walker_init();
+	struct inode_walker w;
 	struct hash_check h;
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -403,6 +464,7 @@ static int check_dirents(struct bch_fs *c)
 				   POS(BCACHEFS_ROOT_INO, 0), 0);
 
 	hash_check_init(bch2_dirent_hash_desc, &trans, &h);
+	inode_walker_init(c, &w);
 
 	for_each_btree_key_continue(iter, 0, k) {
 		struct bkey_s_c_dirent d;
@@ -518,7 +580,7 @@ static int check_dirents(struct bch_fs *c)
 	}
 err:
 fsck_err:
-	return bch2_trans_exit(&trans) ?: ret;
+	return inode_walker_exit(&w) ?: bch2_trans_exit(&trans) ?: ret;
 }
 
 /*
@@ -527,7 +589,7 @@ fsck_err:
 noinline_for_stack
 static int check_xattrs(struct bch_fs *c)
 {
-	struct inode_walker w = inode_walker_init();
+	struct inode_walker w;
 	struct hash_check h;
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -544,6 +606,7 @@ static int check_xattrs(struct bch_fs *c)
 				   POS(BCACHEFS_ROOT_INO, 0), 0);
 
 	hash_check_init(bch2_xattr_hash_desc, &trans, &h);
+	inode_walker_init(c, &w);
 
 	for_each_btree_key_continue(iter, 0, k) {
 		ret = walk_inode(c, &w, k.k->p.inode);
@@ -568,7 +631,7 @@ static int check_xattrs(struct bch_fs *c)
 	}
 err:
 fsck_err:
-	return bch2_trans_exit(&trans) ?: ret;
+	return inode_walker_exit(&w) ?: bch2_trans_exit(&trans) ?: ret;
 }
 
 /* Get root directory, create if it doesn't exist: */
@@ -598,6 +661,7 @@ create_root:
 			0, NULL);
 	root_inode->bi_inum = BCACHEFS_ROOT_INO;
 
+	/* creates, like bch2_inode_create(), go straight to the btree: */
 	bch2_inode_pack(&packed, root_inode);
 
 	return bch2_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
@@ -612,7 +676,6 @@ static int check_lostfound(struct bch_fs *c,
 	struct qstr lostfound = QSTR("lost+found");
 	struct bch_hash_info root_hash_info =
 		bch2_hash_info_init(c, root_inode);
-	struct bkey_inode_buf packed;
 	u64 inum;
 	int ret;
 
@@ -642,10 +705,7 @@ fsck_err:
 create_lostfound:
 	root_inode->bi_nlink++;
 
-	bch2_inode_pack(&packed, root_inode);
-
-	ret = bch2_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
-				NULL, NULL, NULL, BTREE_INSERT_NOFAIL);
+	ret = bch2_inode_write(c, root_inode, NULL);
 	if (ret)
 		return ret;
 
@@ -863,72 +923,338 @@ fsck_err:
 	goto out;
 }
 
+/*
+ * Link counting is done in a single pass over the dirents btree, which emits a
+ * (target inode, is_dir) pair for every link. Pairs are accumulated in a
+ * buffer bounded by the fsck_memory option: when it fills up it's sorted and
+ * coalesced, and if that didn't free up enough space it's written out as a
+ * sorted run to a shmem file. The runs are then merged, and the merged stream
+ * is joined against the inodes btree in a single pass.
+ */
+
 struct nlink {
+	u64	inum;
 	u32	count;
 	u32	dir_count;
 };
 
-typedef GENRADIX(struct nlink) nlink_table;
+struct nlink_run {
+	loff_t		pos;
+	loff_t		end;
+	struct nlink	*buf;
+	size_t		buf_size;
+	size_t		nr;
+	size_t		idx;
+};
+
+struct nlinks {
+	struct nlink		*buf;
+	size_t			nr;
+	size_t			size;
+	size_t			max;
+
+	struct file		*file;
+	loff_t			file_size;
+
+	struct nlink_run	*runs;
+	unsigned		nr_runs;
+
+	HEAP(struct nlink_run *) heap;
+};
+
+static int nlinks_init(struct bch_fs *c, struct nlinks *l)
+{
+	memset(l, 0, sizeof(*l));
+
+	l->size	= PAGE_SIZE / sizeof(struct nlink);
+	l->max	= max_t(size_t, l->size,
+			((size_t) c->opts.fsck_memory << 20) /
+			sizeof(struct nlink));
+	l->buf	= kvpmalloc(l->size * sizeof(struct nlink), GFP_KERNEL);
+
+	return l->buf ? 0 : -ENOMEM;
+}
 
-static void inc_link(struct bch_fs *c, nlink_table *links,
-		     u64 range_start, u64 *range_end,
-		     u64 inum, bool dir)
+static void nlinks_exit(struct nlinks *l)
 {
-	struct nlink *link;
+	free_heap(&l->heap);
+	kfree(l->runs);
+	if (l->file)
+		fput(l->file);
+	kvpfree(l->buf, l->size * sizeof(struct nlink));
+}
 
-	if (inum < range_start || inum >= *range_end)
-		return;
+static int nlink_cmp(const void *_l, const void *_r)
+{
+	const struct nlink *l = _l, *r = _r;
 
-	link = genradix_ptr_alloc(links, inum - range_start, GFP_KERNEL);
-	if (!link) {
-		bch_verbose(c, "allocation failed during fs gc - will need another pass");
-		*range_end = inum;
+	return (l->inum > r->inum) - (l->inum < r->inum);
+}
+
+/* Sort the buffer, and coalesce entries for the same inode: */
+static void nlinks_sort(struct nlinks *l)
+{
+	struct nlink *src, *dst = l->buf;
+
+	if (!l->nr)
 		return;
+
+	sort(l->buf, l->nr, sizeof(l->buf[0]), nlink_cmp, NULL);
+
+	for (src = l->buf + 1; src < l->buf + l->nr; src++)
+		if (src->inum == dst->inum) {
+			dst->count	+= src->count;
+			dst->dir_count	+= src->dir_count;
+		} else {
+			*++dst = *src;
+		}
+
+	l->nr = dst + 1 - l->buf;
+}
+
+static int nlinks_grow(struct nlinks *l)
+{
+	size_t new_size = min(l->size * 2, l->max);
+	struct nlink *n;
+
+	n = kvpmalloc(new_size * sizeof(struct nlink), GFP_KERNEL);
+	if (!n) {
+		/* Not fatal, we'll just start spilling sooner: */
+		l->max = l->size;
+		return 0;
 	}
 
-	if (dir)
-		link->dir_count++;
-	else
-		link->count++;
+	memcpy(n, l->buf, l->nr * sizeof(struct nlink));
+	kvpfree(l->buf, l->size * sizeof(struct nlink));
+	l->buf	= n;
+	l->size	= new_size;
+	return 0;
+}
+
+/* Write out the buffer as a sorted run: */
+static int nlinks_spill(struct bch_fs *c, struct nlinks *l)
+{
+	size_t bytes = l->nr * sizeof(struct nlink);
+	struct nlink_run *runs;
+	loff_t pos;
+	ssize_t ret;
+
+	if (!l->file) {
+		struct file *file = shmem_file_setup("bcachefs-fsck-nlinks",
+						     0, VM_NORESERVE);
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+
+		bch_verbose(c, "nlink table exceeds %u MB, spilling to disk",
+			    c->opts.fsck_memory);
+		l->file = file;
+	}
+
+	runs = krealloc(l->runs, (l->nr_runs + 1) * sizeof(l->runs[0]),
+			GFP_KERNEL);
+	if (!runs)
+		return -ENOMEM;
+	l->runs = runs;
+
+	pos = l->file_size;
+	ret = kernel_write(l->file, l->buf, bytes, &pos);
+	if (ret != bytes)
+		return ret < 0 ? ret : -EIO;
+
+	l->runs[l->nr_runs++] = (struct nlink_run) {
+		.pos	= l->file_size,
+		.end	= pos,
+	};
+	l->file_size	= pos;
+	l->nr		= 0;
+	return 0;
+}
+
+static int inc_link(struct bch_fs *c, struct nlinks *l, u64 inum, bool dir)
+{
+	int ret;
+
+	if (l->nr == l->size) {
+		ret = l->size < l->max
+			? nlinks_grow(l)
+			: 0;
+		if (ret)
+			return ret;
+	}
+
+	if (l->nr == l->size) {
+		nlinks_sort(l);
+
+		/* Coalescing didn't free up much space: */
+		if (l->nr > l->size / 2) {
+			ret = nlinks_spill(c, l);
+			if (ret)
+				return ret;
+		}
+	}
+
+	l->buf[l->nr++] = (struct nlink) {
+		.inum		= inum,
+		.count		= !dir,
+		.dir_count	= dir,
+	};
+	return 0;
 }
 
 noinline_for_stack
-static int bch2_gc_walk_dirents(struct bch_fs *c, nlink_table *links,
-			       u64 range_start, u64 *range_end)
+static int bch2_gc_walk_dirents(struct bch_fs *c, struct nlinks *l)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bkey_s_c_dirent d;
-	u64 d_inum;
 	int ret;
 
-	inc_link(c, links, range_start, range_end, BCACHEFS_ROOT_INO, false);
+	ret = inc_link(c, l, BCACHEFS_ROOT_INO, false);
+	if (ret)
+		return ret;
 
 	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS_MIN, 0, k) {
 		switch (k.k->type) {
 		case BCH_DIRENT:
 			d = bkey_s_c_to_dirent(k);
-			d_inum = le64_to_cpu(d.v->d_inum);
 
 			if (d.v->d_type == DT_DIR)
-				inc_link(c, links, range_start, range_end,
-					 d.k->p.inode, true);
-
-			inc_link(c, links, range_start, range_end,
-				 d_inum, false);
+				ret = inc_link(c, l, d.k->p.inode, true);
 
+			ret = ret ?: inc_link(c, l,
+					      le64_to_cpu(d.v->d_inum), false);
 			break;
 		}
 
+		if (ret)
+			break;
+
 		bch2_btree_iter_cond_resched(&iter);
 	}
-	ret = bch2_btree_iter_unlock(&iter);
+	ret = bch2_btree_iter_unlock(&iter) ?: ret;
 	if (ret)
-		bch_err(c, "error in fs gc: btree error %i while walking dirents", ret);
+		bch_err(c, "error in fs gc: error %i while walking dirents", ret);
 
 	return ret;
 }
 
+static int nlink_run_fill(struct nlinks *l, struct nlink_run *r)
+{
+	size_t bytes = min_t(loff_t, r->end - r->pos,
+			     r->buf_size * sizeof(struct nlink));
+	ssize_t ret;
+
+	r->idx	= 0;
+	r->nr	= 0;
+
+	if (!bytes)
+		return 0;
+
+	ret = kernel_read(l->file, r->buf, bytes, &r->pos);
+	if (ret != bytes)
+		return ret < 0 ? ret : -EIO;
+
+	r->nr = bytes / sizeof(struct nlink);
+	return 0;
+}
+
+#define nlink_run_cmp(h, l, r)						\
+	(((l)->buf[(l)->idx].inum > (r)->buf[(r)->idx].inum) -		\
+	 ((l)->buf[(l)->idx].inum < (r)->buf[(r)->idx].inum))
+
+/*
+ * Done walking dirents: if nothing was spilled the buffer is the only run,
+ * otherwise spill what's left and split the buffer up into read buffers for
+ * the merge:
+ */
+static int nlinks_merge_init(struct nlinks *l, struct bch_fs *c)
+{
+	struct nlink_run *r;
+	size_t per_run;
+	int ret;
+
+	nlinks_sort(l);
+
+	if (!l->nr_runs) {
+		l->runs = kzalloc(sizeof(l->runs[0]), GFP_KERNEL);
+		if (!l->runs)
+			return -ENOMEM;
+
+		l->runs[0] = (struct nlink_run) {
+			.buf	= l->buf,
+			.nr	= l->nr,
+		};
+		l->nr_runs = 1;
+	} else if (l->nr) {
+		ret = nlinks_spill(c, l);
+		if (ret)
+			return ret;
+	}
+
+	per_run = l->size / l->nr_runs;
+	if (!per_run)
+		return -ENOMEM;
+
+	if (!init_heap(&l->heap, l->nr_runs, GFP_KERNEL))
+		return -ENOMEM;
+
+	for (r = l->runs; r < l->runs + l->nr_runs; r++) {
+		if (l->file) {
+			r->buf		= l->buf + (r - l->runs) * per_run;
+			r->buf_size	= per_run;
+
+			ret = nlink_run_fill(l, r);
+			if (ret)
+				return ret;
+		}
+
+		if (r->nr)
+			__heap_add(&l->heap, r, nlink_run_cmp);
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the next inode's link counts, summed across runs - 1 if there was
+ * one, 0 if we're done:
+ */
+static int nlinks_next(struct nlinks *l, struct nlink *link)
+{
+	struct nlink_run *r;
+	bool found = false;
+	int ret;
+
+	while (l->heap.used) {
+		r = heap_peek(&l->heap);
+
+		if (!found) {
+			*link = r->buf[r->idx];
+			found = true;
+		} else if (r->buf[r->idx].inum == link->inum) {
+			link->count	+= r->buf[r->idx].count;
+			link->dir_count	+= r->buf[r->idx].dir_count;
+		} else {
+			break;
+		}
+
+		if (++r->idx == r->nr) {
+			ret = nlink_run_fill(l, r);
+			if (ret)
+				return ret;
+
+			if (!r->nr) {
+				heap_del(&l->heap, 0, nlink_run_cmp);
+				continue;
+			}
+		}
+
+		heap_sift_down(&l->heap, 0, nlink_run_cmp);
+	}
+
+	return found;
+}
+
 s64 bch2_count_inode_sectors(struct bch_fs *c, u64 inum)
 {
 	struct btree_iter iter;
@@ -1049,15 +1375,31 @@ fsck_err:
 
 static int check_inode(struct bch_fs *c,
 		       struct bch_inode_unpacked *lostfound_inode,
-		       struct btree_iter *iter,
 		       struct bkey_s_c_inode inode,
 		       struct nlink *link)
 {
+	struct bkey_inode_buf cached;
 	struct bch_inode_unpacked u;
 	bool do_update = false;
+	u32 nlink, flags;
 	int ret = 0;
 
-	ret = bch2_inode_unpack(inode, &u);
+	/* earlier passes may have repaired it, through the key cache: */
+	if (bch2_btree_key_cache_read(c, BTREE_ID_INODES, inode.k->p,
+				      &cached.inode.k_i,
+				      sizeof(cached) / sizeof(u64))) {
+		if (cached.inode.k.type != BCH_INODE_FS)
+			return 0;
+
+		inode = bkey_s_c_to_inode(bkey_i_to_s_c(&cached.inode.k_i));
+	}
+
+	/*
+	 * Most inodes don't need anything done - only unpack what the nlink
+	 * check needs until we know otherwise:
+	 */
+	ret = bch2_inode_unpack_fields(inode, &u,
+				       BCH_INODE_FIELD_BIT(bi_nlink));
 	if (bch2_fs_inconsistent_on(ret, c,
 			 "error unpacking inode %llu in fsck",
 			 inode.k->p.inode))
@@ -1070,6 +1412,24 @@ static int check_inode(struct bch_fs *c,
 			return ret;
 	}
 
+	if (!do_update &&
+	    !(u.bi_flags & (BCH_INODE_UNLINKED|
+			    BCH_INODE_I_SIZE_DIRTY|
+			    BCH_INODE_I_SECTORS_DIRTY)))
+		return 0;
+
+	nlink	= u.bi_nlink;
+	flags	= u.bi_flags;
+
+	ret = bch2_inode_unpack(inode, &u);
+	if (bch2_fs_inconsistent_on(ret, c,
+			 "error unpacking inode %llu in fsck",
+			 inode.k->p.inode))
+		return ret;
+
+	u.bi_nlink	= nlink;
+	u.bi_flags	= flags;
+
 	if (u.bi_flags & BCH_INODE_UNLINKED) {
 		bch_verbose(c, "deleting inode %llu", u.bi_inum);
 
@@ -1137,14 +1497,8 @@ static int check_inode(struct bch_fs *c,
 	}
 
 	if (do_update) {
-		struct bkey_inode_buf p;
-
-		bch2_inode_pack(&p, &u);
-
-		ret = bch2_btree_insert_at(c, NULL, NULL, NULL,
-					  BTREE_INSERT_NOFAIL,
-					  BTREE_INSERT_ENTRY(iter, &p.inode.k_i));
-		if (ret && ret != -EINTR)
+		ret = bch2_inode_write(c, &u, NULL);
+		if (ret)
 			bch_err(c, "error in fs gc: error %i "
 				"updating inode", ret);
 	}
@@ -1155,47 +1509,43 @@ fsck_err:
 noinline_for_stack
 static int bch2_gc_walk_inodes(struct bch_fs *c,
 			       struct bch_inode_unpacked *lostfound_inode,
-			       nlink_table *links,
-			       u64 range_start, u64 range_end)
+			       struct nlinks *l)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	struct nlink *link, zero_links = { 0, 0 };
-	struct genradix_iter nlinks_iter;
-	int ret = 0, ret2 = 0;
-	u64 nlinks_pos;
+	struct nlink *link, next_link, zero_links = { 0, 0, 0 };
+	int ret = 0, ret2 = 0, have_link;
+
+	bch2_btree_iter_init(&iter, c, BTREE_ID_INODES, POS_MIN, 0);
 
-	bch2_btree_iter_init(&iter, c, BTREE_ID_INODES, POS(range_start, 0), 0);
-	nlinks_iter = genradix_iter_init(links, 0);
+	have_link = nlinks_next(l, &next_link);
+	if (have_link < 0)
+		goto err;
 
 	while ((k = bch2_btree_iter_peek(&iter)).k &&
 	       !btree_iter_err(k)) {
-peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
-
-		if (!link && (!k.k || iter.pos.inode >= range_end))
-			break;
-
-		nlinks_pos = range_start + nlinks_iter.pos;
-		if (iter.pos.inode > nlinks_pos) {
+		while (have_link > 0 && next_link.inum < iter.pos.inode) {
 			/* Should have been caught by dirents pass: */
-			need_fsck_err_on(link && link->count, c,
+			need_fsck_err_on(next_link.count, c,
 				"missing inode %llu (nlink %u)",
-				nlinks_pos, link->count);
-			genradix_iter_advance(&nlinks_iter, links);
-			goto peek_nlinks;
+				next_link.inum, next_link.count);
+			have_link = nlinks_next(l, &next_link);
 		}
+		if (have_link < 0)
+			goto err;
 
-		if (iter.pos.inode < nlinks_pos || !link)
-			link = &zero_links;
+		link = have_link && next_link.inum == iter.pos.inode
+			? &next_link
+			: &zero_links;
 
-		if (k.k && k.k->type == BCH_INODE_FS) {
+		if (k.k->type == BCH_INODE_FS) {
 			/*
 			 * Avoid potential deadlocks with iter for
 			 * truncate/rm/etc.:
 			 */
 			bch2_btree_iter_unlock(&iter);
 
-			ret = check_inode(c, lostfound_inode, &iter,
+			ret = check_inode(c, lostfound_inode,
 					  bkey_s_c_to_inode(k), link);
 			BUG_ON(ret == -EINTR);
 			if (ret)
@@ -1207,15 +1557,30 @@ peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
 			/* Should have been caught by dirents pass: */
 			need_fsck_err_on(link->count, c,
 				"missing inode %llu (nlink %u)",
-				nlinks_pos, link->count);
+				iter.pos.inode, link->count);
 		}
 
-		if (nlinks_pos == iter.pos.inode)
-			genradix_iter_advance(&nlinks_iter, links);
+		if (link == &next_link) {
+			have_link = nlinks_next(l, &next_link);
+			if (have_link < 0)
+				goto err;
+		}
 
 		bch2_btree_iter_next(&iter);
 		bch2_btree_iter_cond_resched(&iter);
 	}
+
+	while (!ret && have_link > 0) {
+		need_fsck_err_on(next_link.count, c,
+			"missing inode %llu (nlink %u)",
+			next_link.inum, next_link.count);
+		have_link = nlinks_next(l, &next_link);
+	}
+err:
+	if (have_link < 0) {
+		bch_err(c, "error in fs gc: error %i reading nlinks", have_link);
+		ret = have_link;
+	}
 fsck_err:
 	ret2 = bch2_btree_iter_unlock(&iter);
 	if (ret2)
@@ -1228,35 +1593,17 @@ noinline_for_stack
 static int check_inode_nlinks(struct bch_fs *c,
 			      struct bch_inode_unpacked *lostfound_inode)
 {
-	nlink_table links;
-	u64 this_iter_range_start, next_iter_range_start = 0;
-	int ret = 0;
+	struct nlinks links;
+	int ret;
 
 	bch_verbose(c, "checking inode nlinks");
 
-	genradix_init(&links);
-
-	do {
-		this_iter_range_start = next_iter_range_start;
-		next_iter_range_start = U64_MAX;
-
-		ret = bch2_gc_walk_dirents(c, &links,
-					  this_iter_range_start,
-					  &next_iter_range_start);
-		if (ret)
-			break;
-
-		ret = bch2_gc_walk_inodes(c, lostfound_inode, &links,
-					 this_iter_range_start,
-					 next_iter_range_start);
-		if (ret)
-			break;
-
-		genradix_free(&links);
-	} while (next_iter_range_start != U64_MAX);
-
-	genradix_free(&links);
+	ret = nlinks_init(c, &links) ?:
+		bch2_gc_walk_dirents(c, &links) ?:
+		nlinks_merge_init(&links, c) ?:
+		bch2_gc_walk_inodes(c, lostfound_inode, &links);
 
+	nlinks_exit(&links);
 	return ret;
 }
 
@@ -1285,7 +1632,14 @@ static int check_inodes_fast(struct bch_fs *c)
 			fsck_err_on(c->sb.clean, c,
 				"filesystem marked clean but found inode %llu with flags %x",
 				inode.k->p.inode, inode.v->bi_flags);
-			ret = check_inode(c, NULL, &iter, inode, NULL);
+
+			/*
+			 * The update goes through the key cache and may wait on
+			 * journal reclaim, which may need this leaf:
+			 */
+			bch2_btree_iter_unlock(&iter);
+
+			ret = check_inode(c, NULL, inode, NULL);
 			BUG_ON(ret == -EINTR);
 			if (ret)
 				break;
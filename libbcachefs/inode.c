@@ -1,6 +1,7 @@
 
 #include "bcachefs.h"
 #include "bkey_methods.h"
+#include "btree_key_cache.h"
 #include "btree_update.h"
 #include "error.h"
 #include "extents.h"
@@ -49,40 +50,70 @@ got_shift:
 	return bytes;
 }
 
-static int inode_decode_field(const u8 *in, const u8 *end,
-			      u64 out[2], unsigned *out_bits)
+/*
+ * Reads the first @bytes (at most 8) bytes at @in as a big endian integer -
+ * with a single unaligned load, if that won't read past @end:
+ */
+static inline u64 inode_field_read_be(const u8 *in, const u8 *end,
+				      unsigned bytes)
 {
-	__be64 be[2] = { 0, 0 };
-	unsigned bytes, shift;
-	u8 *p;
+	u64 v = 0;
 
-	if (in >= end)
-		return -1;
+	if (likely(in + 8 <= end))
+		return get_unaligned_be64(in) >> (64 - bytes * 8);
+
+	while (bytes--)
+		v = (v << 8) | *in++;
+	return v;
+}
 
-	if (!*in)
+/*
+ * Decodes a field into @hi and @lo, returning the number of bytes it took up:
+ * the number of leading zeroes in the first byte gives the field's size, and
+ * the first set bit is a marker that isn't part of the value.
+ */
+static inline int inode_decode_field(const u8 *in, const u8 *end,
+				     u64 *hi, u64 *lo)
+{
+	unsigned bytes, shift, hi_bytes;
+
+	if (unlikely(in >= end || !*in))
 		return -1;
 
-	/*
-	 * position of highest set bit indicates number of bytes:
-	 * shift = number of bits to remove in high byte:
-	 */
 	shift	= 8 - __fls(*in); /* 1 <= shift <= 8 */
 	bytes	= byte_table[shift - 1];
 
-	if (in + bytes > end)
+	if (unlikely(in + bytes > end))
 		return -1;
 
-	p = (u8 *) be + 16 - bytes;
-	memcpy(p, in, bytes);
-	*p ^= (1 << 8) >> shift;
+	if (likely(bytes <= 8)) {
+		*hi = 0;
+		*lo = inode_field_read_be(in, end, bytes) ^
+			(1ULL << bits_table[shift - 1]);
+	} else {
+		hi_bytes = bytes - 8;
 
-	out[0] = be64_to_cpu(be[0]);
-	out[1] = be64_to_cpu(be[1]);
-	*out_bits = out[0] ? 64 + fls64(out[0]) : fls64(out[1]);
+		*hi = inode_field_read_be(in, end, hi_bytes) ^
+			(1ULL << (bits_table[shift - 1] - 64));
+		*lo = get_unaligned_be64(in + hi_bytes);
+	}
 
 	return bytes;
 }
 
+/* Length of the field at @in, without decoding it: */
+static inline int inode_skip_field(const u8 *in, const u8 *end)
+{
+	unsigned bytes;
+
+	if (unlikely(in >= end || !*in))
+		return -1;
+
+	bytes = byte_table[7 - __fls(*in)];
+
+	return likely(in + bytes <= end) ? bytes : -1;
+}
+
 void bch2_inode_pack(struct bkey_inode_buf *packed,
 		     const struct bch_inode_unpacked *inode)
 {
@@ -135,37 +166,57 @@ void bch2_inode_pack(struct bkey_inode_buf *packed,
 	}
 }
 
-int bch2_inode_unpack(struct bkey_s_c_inode inode,
-		      struct bch_inode_unpacked *unpacked)
+/**
+ * bch2_inode_unpack_fields - unpack some of an inode's variable length fields
+ *
+ * @fields is a mask of BCH_INODE_FIELD_BIT()s: the fixed fields (bi_inum,
+ * bi_hash_seed, bi_flags, bi_mode) are always unpacked, variable length fields
+ * not in @fields are left untouched. Fields after the last one requested aren't
+ * looked at at all, and fields before it are skipped without being decoded.
+ */
+int bch2_inode_unpack_fields(struct bkey_s_c_inode inode,
+			     struct bch_inode_unpacked *unpacked,
+			     u64 fields)
 {
 	const u8 *in = inode.v->fields;
 	const u8 *end = (void *) inode.v + bkey_val_bytes(inode.k);
-	u64 field[2];
-	unsigned fieldnr = 0, field_bits;
+	unsigned nr_fields = INODE_NR_FIELDS(inode.v);
+	u64 hi, lo;
 	int ret;
 
+	BUILD_BUG_ON(BCH_INODE_FIELD_NR > 64);
+
 	unpacked->bi_inum	= inode.k->p.inode;
 	unpacked->bi_hash_seed	= inode.v->bi_hash_seed;
 	unpacked->bi_flags	= le32_to_cpu(inode.v->bi_flags);
 	unpacked->bi_mode	= le16_to_cpu(inode.v->bi_mode);
 
 #define BCH_INODE_FIELD(_name, _bits)					\
-	if (fieldnr++ == INODE_NR_FIELDS(inode.v)) {			\
-		memset(&unpacked->_name, 0,				\
-		       sizeof(*unpacked) -				\
-		       offsetof(struct bch_inode_unpacked, _name));	\
+	if (!fields)							\
 		return 0;						\
-	}								\
 									\
-	ret = inode_decode_field(in, end, field, &field_bits);		\
-	if (ret < 0)							\
-		return ret;						\
+	if (BCH_INODE_FIELD_##_name >= nr_fields) {			\
+		if (fields & BCH_INODE_FIELD_BIT(_name))		\
+			unpacked->_name = 0;				\
+	} else if (fields & BCH_INODE_FIELD_BIT(_name)) {		\
+		ret = inode_decode_field(in, end, &hi, &lo);		\
+		if (ret < 0)						\
+			return ret;					\
 									\
-	if (field_bits > sizeof(unpacked->_name) * 8)			\
-		return -1;						\
+		if (hi || lo > (U64_MAX >> (64 - _bits)))		\
+			return -1;					\
 									\
-	unpacked->_name = field[1];					\
-	in += ret;
+		unpacked->_name = lo;					\
+		in += ret;						\
+	} else {							\
+		ret = inode_skip_field(in, end);			\
+		if (ret < 0)						\
+			return ret;					\
+									\
+		in += ret;						\
+	}								\
+									\
+	fields &= ~BCH_INODE_FIELD_BIT(_name);
 
 	BCH_INODE_FIELDS()
 #undef  BCH_INODE_FIELD
@@ -293,6 +344,259 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
+/* Inode number allocation: */
+
+/*
+ * Inode numbers in use are indexed with a bitmap, built from the inodes btree
+ * the first time we create an inode - so that finding a free inode number
+ * doesn't mean probing the btree a slot at a time through dense ranges of
+ * inodes. Each cpu takes a batch of numbers from the bitmap at a time.
+ *
+ * The index is only a hint - the btree slot is still checked when creating an
+ * inode, since inodes that are inserted directly (format, fsck) don't go
+ * through it. Numbers that get lost (e.g. if the transaction creating an inode
+ * fails) come back the next time the index is built.
+ */
+
+#define INODE_NR_ALLOC_BATCH	64
+
+/* Past this, the index isn't used and we just scan the btree: */
+#define INODE_NR_ALLOC_MAX_BITS	(1ULL << 28)
+
+static int inode_nr_alloc_resize(struct inode_nr_alloc *a, u64 nr)
+{
+	u64 new_bits = max_t(u64, a->nr_bits, 1 << 16);
+	unsigned long *n;
+
+	while (new_bits < nr)
+		new_bits *= 2;
+
+	if (new_bits == a->nr_bits)
+		return 0;
+
+	if (new_bits > INODE_NR_ALLOC_MAX_BITS)
+		return -ENOSPC;
+
+	n = kvpmalloc(BITS_TO_LONGS(new_bits) * sizeof(long),
+		      GFP_NOFS|__GFP_ZERO);
+	if (!n)
+		return -ENOMEM;
+
+	if (a->used) {
+		memcpy(n, a->used, BITS_TO_LONGS(a->nr_bits) * sizeof(long));
+		kvpfree(a->used, BITS_TO_LONGS(a->nr_bits) * sizeof(long));
+	}
+
+	a->used		= n;
+	a->nr_bits	= new_bits;
+	return 0;
+}
+
+/* Returns numbers taken with inode_nr_range_alloc() to the index: */
+static void inode_nr_range_free(struct inode_nr_alloc *a,
+				struct inode_nr_range r)
+{
+	lockdep_assert_held(&a->lock);
+
+	for (; r.start < min(r.end, a->nr_bits); r.start++)
+		__clear_bit(r.start, a->used);
+}
+
+/*
+ * Takes up to @nr consecutive free numbers in [@min, @max), from the first
+ * free number at or after @start - wrapping around to @min:
+ */
+static int inode_nr_range_alloc(struct inode_nr_alloc *a,
+				u64 min, u64 max, u64 start, u64 nr,
+				struct inode_nr_range *ret)
+{
+	u64 s, end;
+	int err;
+
+	lockdep_assert_held(&a->lock);
+
+	if (start >= max || start < min)
+		start = min;
+again:
+	/* everything past the end of the bitmap is free: */
+	s = start < a->nr_bits
+		? find_next_zero_bit(a->used, a->nr_bits, start)
+		: start;
+
+	if (s >= max) {
+		if (start != min) {
+			start = min;
+			goto again;
+		}
+
+		return -ENOSPC;
+	}
+
+	end = s + min(nr, max - s);
+
+	err = inode_nr_alloc_resize(a, end);
+	if (err)
+		return err;
+
+	for (ret->start = ret->end = s;
+	     ret->end < end && !test_bit(ret->end, a->used);
+	     ret->end++)
+		__set_bit(ret->end, a->used);
+
+	return 0;
+}
+
+static int inode_nr_alloc_init(struct bch_fs *c)
+{
+	struct inode_nr_alloc *a = &c->inode_nr_alloc;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	lockdep_assert_held(&a->lock);
+
+	for_each_btree_key(&iter, c, BTREE_ID_INODES, POS_MIN, 0, k) {
+		if (k.k->type != BCH_INODE_FS &&
+		    k.k->type != BCH_INODE_BLOCKDEV)
+			continue;
+
+		if (k.k->p.inode >= a->nr_bits) {
+			ret = inode_nr_alloc_resize(a, k.k->p.inode + 1);
+			if (ret)
+				break;
+		}
+
+		__set_bit(k.k->p.inode, a->used);
+	}
+	ret = bch2_btree_iter_unlock(&iter) ?: ret;
+
+	if (ret && ret != -ENOSPC) {
+		memset(a->used, 0, BITS_TO_LONGS(a->nr_bits) * sizeof(long));
+		return ret;
+	}
+
+	/* -ENOSPC: inode numbers too big for the index, don't use it */
+	a->disabled	= ret == -ENOSPC;
+	a->initialized	= true;
+	return 0;
+}
+
+/*
+ * Gets a free inode number in [@min, @max) - from this cpu's batch if it has
+ * one, otherwise from the index, starting from @hint:
+ */
+static int inode_nr_get(struct bch_fs *c, u64 min, u64 max,
+			u64 *hint, u64 *inum)
+{
+	struct inode_nr_alloc *a = &c->inode_nr_alloc;
+	struct inode_nr_alloc_pcpu *pc = raw_cpu_ptr(a->pcpu);
+	struct inode_nr_range old, r;
+	int ret;
+
+	spin_lock(&pc->lock);
+	if (pc->batch.start < pc->batch.end &&
+	    pc->batch.start >= min &&
+	    pc->batch.start < max) {
+		*inum = pc->batch.start++;
+		spin_unlock(&pc->lock);
+		return 0;
+	}
+
+	/* empty, or not in the range we want: */
+	old = pc->batch;
+	pc->batch.start = pc->batch.end = 0;
+	spin_unlock(&pc->lock);
+
+	mutex_lock(&a->lock);
+	inode_nr_range_free(a, old);
+
+	ret = a->initialized ? 0 : inode_nr_alloc_init(c);
+	if (!ret && a->disabled)
+		ret = -ENOSPC;
+	if (!ret)
+		ret = inode_nr_range_alloc(a, min, max, READ_ONCE(*hint),
+					   INODE_NR_ALLOC_BATCH, &r);
+	if (!ret)
+		WRITE_ONCE(*hint, r.end);
+	mutex_unlock(&a->lock);
+
+	if (ret)
+		return ret;
+
+	*inum = r.start++;
+
+	spin_lock(&pc->lock);
+	if (pc->batch.start == pc->batch.end) {
+		pc->batch = r;
+		r.start = r.end;
+	}
+	spin_unlock(&pc->lock);
+
+	if (r.start < r.end) {
+		mutex_lock(&a->lock);
+		inode_nr_range_free(a, r);
+		mutex_unlock(&a->lock);
+	}
+
+	return 0;
+}
+
+static void inode_nr_put(struct bch_fs *c, u64 inum)
+{
+	struct inode_nr_alloc *a = &c->inode_nr_alloc;
+
+	mutex_lock(&a->lock);
+	inode_nr_range_free(a, (struct inode_nr_range) {
+		.start	= inum,
+		.end	= inum + 1,
+	});
+	mutex_unlock(&a->lock);
+}
+
+/*
+ * An inode that's been deleted might still be in the btree, with the delete in
+ * the key cache - that slot can't be reused until the delete is flushed:
+ */
+static bool inode_nr_delete_pending(struct bch_fs *c, u64 inum)
+{
+	struct bkey_inode_buf cached;
+
+	return bch2_btree_key_cache_read(c, BTREE_ID_INODES, POS(inum, 0),
+					 &cached.inode.k_i,
+					 sizeof(cached) / sizeof(u64));
+}
+
+void bch2_fs_inode_exit(struct bch_fs *c)
+{
+	struct inode_nr_alloc *a = &c->inode_nr_alloc;
+
+	free_percpu(a->pcpu);
+	kvpfree(a->used, BITS_TO_LONGS(a->nr_bits) * sizeof(long));
+}
+
+int bch2_fs_inode_init(struct bch_fs *c)
+{
+	struct inode_nr_alloc *a = &c->inode_nr_alloc;
+	int cpu;
+
+	mutex_init(&a->lock);
+
+	a->pcpu = alloc_percpu(struct inode_nr_alloc_pcpu);
+	if (!a->pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(a->pcpu, cpu)->lock);
+
+	return 0;
+}
+
+/*
+ * Number of inode numbers we'll try from the index before falling back to
+ * scanning the btree:
+ */
+#define INODE_NR_GET_TRIES	16
+
 int __bch2_inode_create(struct btree_trans *trans,
 			struct bch_inode_unpacked *inode_u,
 			u64 min, u64 max, u64 *hint)
@@ -300,7 +604,9 @@ int __bch2_inode_create(struct btree_trans *trans,
 	struct bch_fs *c = trans->c;
 	struct bkey_inode_buf *inode_p;
 	struct btree_iter *iter;
-	u64 start;
+	struct bkey_s_c k;
+	unsigned tries = 0;
+	u64 start, inum;
 	int ret;
 
 	if (!max)
@@ -309,23 +615,70 @@ int __bch2_inode_create(struct btree_trans *trans,
 	if (c->opts.inodes_32bit)
 		max = min_t(u64, max, U32_MAX);
 
-	start = READ_ONCE(*hint);
-
-	if (start >= max || start < min)
-		start = min;
-
 	inode_p = bch2_trans_kmalloc(trans, sizeof(*inode_p));
 	if (IS_ERR(inode_p))
 		return PTR_ERR(inode_p);
 
+	ret = inode_nr_get(c, min, max, hint, &inum);
+	if (ret && ret != -ENOSPC)
+		return ret;
+
+	start = !ret ? inum : READ_ONCE(*hint);
+
+	if (start >= max || start < min)
+		start = min;
+
 	iter = bch2_trans_get_iter(trans,
 			BTREE_ID_INODES, POS(start, 0),
 			BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
-	if (IS_ERR(iter))
+	if (IS_ERR(iter)) {
+		if (!ret)
+			inode_nr_put(c, inum);
 		return PTR_ERR(iter);
+	}
+
+	/* Inode numbers from the index: */
+	while (!ret) {
+		if (inode_nr_delete_pending(c, inum)) {
+			/*
+			 * Goes back in the index behind the hint, so we won't
+			 * see it again until we wrap around:
+			 */
+			inode_nr_put(c, inum);
+		} else {
+			bch2_btree_iter_set_pos(iter, POS(inum, 0));
+
+			k = bch2_btree_iter_peek_slot(iter);
+			ret = btree_iter_err(k);
+			if (ret) {
+				inode_nr_put(c, inum);
+				return ret;
+			}
+
+			/* if the slot is in use, it wasn't created via the index: */
+			if (k.k->type != BCH_INODE_FS &&
+			    k.k->type != BCH_INODE_BLOCKDEV)
+				goto found;
+		}
+
+		if (++tries >= INODE_NR_GET_TRIES)
+			break;
+
+		ret = inode_nr_get(c, min, max, hint, &inum);
+		if (ret && ret != -ENOSPC)
+			return ret;
+	}
+
+	/* Index didn't work out, scan the btree: */
+	start = READ_ONCE(*hint);
+
+	if (start >= max || start < min)
+		start = min;
+
+	bch2_btree_iter_set_pos(iter, POS(start, 0));
 again:
 	while (1) {
-		struct bkey_s_c k = bch2_btree_iter_peek_slot(iter);
+		k = bch2_btree_iter_peek_slot(iter);
 
 		ret = btree_iter_err(k);
 		if (ret)
@@ -342,13 +695,8 @@ again:
 			break;
 
 		default:
-			*hint			= k.k->p.inode;
-			inode_u->bi_inum	= k.k->p.inode;
-			inode_u->bi_generation	= bkey_generation(k);
-
-			bch2_inode_pack(inode_p, inode_u);
-			bch2_trans_update(trans, iter, &inode_p->inode.k_i, 0);
-			return 0;
+			*hint = k.k->p.inode;
+			goto found;
 		}
 	}
 out:
@@ -360,6 +708,13 @@ out:
 	}
 
 	return -ENOSPC;
+found:
+	inode_u->bi_inum	= k.k->p.inode;
+	inode_u->bi_generation	= bkey_generation(k);
+
+	bch2_inode_pack(inode_p, inode_u);
+	bch2_trans_update(trans, iter, &inode_p->inode.k_i, 0);
+	return 0;
 }
 
 int bch2_inode_create(struct bch_fs *c, struct bch_inode_unpacked *inode_u,
@@ -383,6 +738,9 @@ int bch2_inode_rm(struct bch_fs *c, u64 inode_nr)
 {
 	struct btree_iter iter;
 	struct bkey_i_inode_generation delete;
+	struct bkey_cached *ck;
+	struct bkey_s_c k;
+	u32 bi_generation = 0;
 	int ret;
 
 	ret = bch2_inode_truncate(c, inode_nr, 0, NULL, NULL);
@@ -411,64 +769,84 @@ int bch2_inode_rm(struct bch_fs *c, u64 inode_nr)
 	if (ret < 0)
 		return ret;
 
+	/*
+	 * The inode might have updates in the key cache that haven't been
+	 * written to the btree yet - so the delete has to go through the cache
+	 * too, or writeback would bring the inode back:
+	 */
+	ck = bch2_btree_key_cache_lock(c, BTREE_ID_INODES, POS(inode_nr, 0));
+	if (IS_ERR(ck))
+		return PTR_ERR(ck);
+
 	bch2_btree_iter_init(&iter, c, BTREE_ID_INODES, POS(inode_nr, 0),
-			     BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
-	do {
-		struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
-		u32 bi_generation = 0;
+			     BTREE_ITER_SLOTS);
 
-		ret = btree_iter_err(k);
-		if (ret) {
-			bch2_btree_iter_unlock(&iter);
-			return ret;
-		}
+	k = bch2_btree_key_cache_peek(ck)
+		? bkey_i_to_s_c(bch2_btree_key_cache_peek(ck))
+		: bch2_btree_iter_peek_slot(&iter);
 
-		bch2_fs_inconsistent_on(k.k->type != BCH_INODE_FS, c,
-					"inode %llu not found when deleting",
-					inode_nr);
+	ret = btree_iter_err(k);
+	if (ret) {
+		bch2_btree_iter_unlock(&iter);
+		goto err;
+	}
 
-		switch (k.k->type) {
-		case BCH_INODE_FS: {
-			struct bch_inode_unpacked inode_u;
+	bch2_fs_inconsistent_on(k.k->type != BCH_INODE_FS, c,
+				"inode %llu not found when deleting",
+				inode_nr);
 
-			if (!bch2_inode_unpack(bkey_s_c_to_inode(k), &inode_u))
-				bi_generation = inode_u.bi_generation + 1;
-			break;
-		}
-		case BCH_INODE_GENERATION: {
-			struct bkey_s_c_inode_generation g =
-				bkey_s_c_to_inode_generation(k);
-			bi_generation = le32_to_cpu(g.v->bi_generation);
-			break;
-		}
-		}
-
-		if (!bi_generation) {
-			bkey_init(&delete.k);
-			delete.k.p.inode = inode_nr;
-		} else {
-			bkey_inode_generation_init(&delete.k_i);
-			delete.k.p.inode = inode_nr;
-			delete.v.bi_generation = cpu_to_le32(bi_generation);
-		}
+	switch (k.k->type) {
+	case BCH_INODE_FS: {
+		struct bch_inode_unpacked inode_u;
 
-		ret = bch2_btree_insert_at(c, NULL, NULL, NULL,
-				BTREE_INSERT_ATOMIC|
-				BTREE_INSERT_NOFAIL,
-				BTREE_INSERT_ENTRY(&iter, &delete.k_i));
-	} while (ret == -EINTR);
+		if (!bch2_inode_unpack(bkey_s_c_to_inode(k), &inode_u))
+			bi_generation = inode_u.bi_generation + 1;
+		break;
+	}
+	case BCH_INODE_GENERATION: {
+		struct bkey_s_c_inode_generation g =
+			bkey_s_c_to_inode_generation(k);
+		bi_generation = le32_to_cpu(g.v->bi_generation);
+		break;
+	}
+	}
 
 	bch2_btree_iter_unlock(&iter);
+
+	if (!bi_generation) {
+		bkey_init(&delete.k);
+		delete.k.p.inode = inode_nr;
+	} else {
+		bkey_inode_generation_init(&delete.k_i);
+		delete.k.p.inode = inode_nr;
+		delete.v.bi_generation = cpu_to_le32(bi_generation);
+	}
+
+	ret = bch2_btree_key_cache_update(c, ck, &delete.k_i, NULL, 0);
+err:
+	bch2_btree_key_cache_unlock(c, ck);
+
+	if (!ret)
+		inode_nr_put(c, inode_nr);
 	return ret;
 }
 
 int bch2_inode_find_by_inum(struct bch_fs *c, u64 inode_nr,
 			    struct bch_inode_unpacked *inode)
 {
+	struct bkey_inode_buf cached;
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret = -ENOENT;
 
+	if (bch2_btree_key_cache_read(c, BTREE_ID_INODES, POS(inode_nr, 0),
+				      &cached.inode.k_i,
+				      sizeof(cached) / sizeof(u64)))
+		return cached.inode.k.type == BCH_INODE_FS
+			? bch2_inode_unpack(bkey_s_c_to_inode(
+					bkey_i_to_s_c(&cached.inode.k_i)), inode)
+			: -ENOENT;
+
 	for_each_btree_key(&iter, c, BTREE_ID_INODES,
 			   POS(inode_nr, 0),
 			   BTREE_ITER_SLOTS, k) {
@@ -488,6 +866,24 @@ int bch2_inode_find_by_inum(struct bch_fs *c, u64 inode_nr,
 	return bch2_btree_iter_unlock(&iter) ?: ret;
 }
 
+/*
+ * Update an existing inode: goes through the btree key cache, since inodes
+ * are often updated many times in quick succession
+ */
+int bch2_inode_write(struct bch_fs *c, struct bch_inode_unpacked *inode,
+		     u64 *journal_seq)
+{
+	struct bkey_inode_buf packed;
+
+	BUILD_BUG_ON(sizeof(packed) >
+		     (BKEY_U64s + BKEY_CACHED_VAL_U64s_MAX) * sizeof(u64));
+
+	bch2_inode_pack(&packed, inode);
+
+	return bch2_btree_key_cache_insert(c, BTREE_ID_INODES,
+					   &packed.inode.k_i, journal_seq, 0);
+}
+
 #ifdef CONFIG_BCACHEFS_DEBUG
 void bch2_inode_pack_test(void)
 {
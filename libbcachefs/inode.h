@@ -32,8 +32,25 @@ struct bkey_inode_buf {
 #undef  BCH_INODE_FIELD
 } __attribute__((packed, aligned(8)));
 
+enum bch_inode_field {
+#define BCH_INODE_FIELD(_name, _bits)	BCH_INODE_FIELD_##_name,
+	BCH_INODE_FIELDS()
+#undef  BCH_INODE_FIELD
+	BCH_INODE_FIELD_NR
+};
+
+#define BCH_INODE_FIELD_BIT(_name)	(1ULL << BCH_INODE_FIELD_##_name)
+#define BCH_INODE_FIELDS_ALL		(~0ULL >> (64 - BCH_INODE_FIELD_NR))
+
 void bch2_inode_pack(struct bkey_inode_buf *, const struct bch_inode_unpacked *);
-int bch2_inode_unpack(struct bkey_s_c_inode, struct bch_inode_unpacked *);
+int bch2_inode_unpack_fields(struct bkey_s_c_inode,
+			     struct bch_inode_unpacked *, u64);
+
+static inline int bch2_inode_unpack(struct bkey_s_c_inode inode,
+				    struct bch_inode_unpacked *unpacked)
+{
+	return bch2_inode_unpack_fields(inode, unpacked, BCH_INODE_FIELDS_ALL);
+}
 
 void bch2_inode_init(struct bch_fs *, struct bch_inode_unpacked *,
 		     uid_t, gid_t, umode_t, dev_t,
@@ -52,6 +69,10 @@ int bch2_inode_rm(struct bch_fs *, u64);
 int bch2_inode_find_by_inum(struct bch_fs *, u64,
 			   struct bch_inode_unpacked *);
 
+void bch2_fs_inode_exit(struct bch_fs *);
+int bch2_fs_inode_init(struct bch_fs *);
+int bch2_inode_write(struct bch_fs *, struct bch_inode_unpacked *, u64 *);
+
 static inline struct timespec bch2_time_to_timespec(struct bch_fs *c, u64 time)
 {
 	return ns_to_timespec(time * c->sb.time_precision + c->sb.time_base_lo);
@@ -0,0 +1,34 @@
+#ifndef _BCACHEFS_INODE_TYPES_H
+#define _BCACHEFS_INODE_TYPES_H
+
+#include <linux/spinlock.h>
+
+/* A range of inode numbers, [start, end): */
+struct inode_nr_range {
+	u64			start;
+	u64			end;
+};
+
+struct inode_nr_alloc_pcpu {
+	spinlock_t		lock;
+	struct inode_nr_range	batch;
+};
+
+/*
+ * Index of inode numbers in use, so that creating an inode doesn't have to
+ * probe the inodes btree for an empty slot:
+ */
+struct inode_nr_alloc {
+	struct mutex		lock;
+	bool			initialized;
+	bool			disabled;
+
+	/* set if in use or in a cpu's batch; past nr_bits, everything's free: */
+	unsigned long		*used;
+	u64			nr_bits;
+
+	/* numbers taken from the index by each cpu, handed out one at a time: */
+	struct inode_nr_alloc_pcpu __percpu *pcpu;
+};
+
+#endif /* _BCACHEFS_INODE_TYPES_H */
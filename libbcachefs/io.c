@@ -62,13 +62,17 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 	return bch2_rand_range(nr * CONGESTED_MAX) < total;
 }
 
-static inline void bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
+static inline bool bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
 				       u64 now, int rw)
 {
-	u64 latency_capable =
-		ca->io_latency[rw].quantiles.entries[QUANTILE_IDX(1)].m;
-	/* ideally we'd be taking into account the device's variance here: */
-	u64 latency_threshold = latency_capable << (rw == READ ? 2 : 3);
+	/*
+	 * An io is slow if it took longer than the device's p99 latency, or
+	 * more than a few times the median, whichever is larger - the median
+	 * alone doesn't capture the device's variance:
+	 */
+	u64 latency_threshold =
+		max(READ_ONCE(ca->io_latency[rw].p99),
+		    READ_ONCE(ca->io_latency[rw].p50) << (rw == READ ? 2 : 3));
 	s64 latency_over = io_latency - latency_threshold;
 
 	if (latency_threshold && latency_over > 0) {
@@ -83,9 +87,37 @@ static inline void bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
 				   &ca->congested);
 
 		ca->congested_last = now;
+		return true;
 	} else if (atomic_read(&ca->congested) > 0) {
 		atomic_dec(&ca->congested);
 	}
+
+	return false;
+}
+
+/*
+ * The limit on data moves in flight to a device is AIMD: halved when an io is
+ * slow - at most once per io latency, since ios already in flight will be slow
+ * too - and otherwise grown by a fraction of an io, so by about an io per
+ * depth's worth of ios:
+ */
+static inline void bch2_move_depth_acct(struct bch_dev *ca, bool slow,
+					u64 io_latency, u64 now, int rw)
+{
+	unsigned depth = READ_ONCE(ca->move_depth[rw]);
+
+	if (slow) {
+		if (time_after64(now, ca->move_depth_decreased[rw] + io_latency)) {
+			WRITE_ONCE(ca->move_depth[rw],
+				   max_t(unsigned, depth >> 1, MOVE_DEPTH_MIN));
+			ca->move_depth_decreased[rw] = now;
+		}
+	} else if (depth < MOVE_DEPTH_MAX) {
+		WRITE_ONCE(ca->move_depth[rw],
+			   min_t(unsigned, depth +
+				 max(MOVE_DEPTH_MIN * MOVE_DEPTH_MIN / depth, 1U),
+				 MOVE_DEPTH_MAX));
+	}
 }
 
 void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
@@ -112,7 +144,8 @@ void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
 		new = ewma_add(old, io_latency, 5);
 	} while ((v = atomic64_cmpxchg(latency, old, new)) != old);
 
-	bch2_congested_acct(ca, io_latency, now, rw);
+	bch2_move_depth_acct(ca, bch2_congested_acct(ca, io_latency, now, rw),
+			     io_latency, now, rw);
 
 	__bch2_time_stats_update(&ca->io_latency[rw], submit_time, now);
 }
@@ -226,6 +259,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			n->bounce		= false;
 			n->put_bio		= true;
 			n->bio.bi_opf		= wbio->bio.bi_opf;
+			n->move_sectors		= wbio->move_sectors;
 			bio_inc_remaining(&wbio->bio);
 		} else {
 			n = wbio;
@@ -245,6 +279,10 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			this_cpu_add(ca->io_done->sectors[WRITE][type],
 				     bio_sectors(&n->bio));
 
+			if (n->move_sectors)
+				atomic_add(n->move_sectors,
+					   &ca->move_sectors[WRITE]);
+
 			bio_set_dev(&n->bio, ca->disk_sb.bdev);
 			submit_bio(&n->bio);
 		} else {
@@ -390,6 +428,10 @@ static void bch2_write_endio(struct bio *bio)
 		set_bit(wbio->dev, op->failed.d);
 
 	if (wbio->have_ioref) {
+		if (wbio->move_sectors)
+			atomic_sub(wbio->move_sectors,
+				   &ca->move_sectors[WRITE]);
+
 		bch2_latency_acct(ca, wbio->submit_time, WRITE);
 		percpu_ref_put(&ca->io_ref);
 	}
@@ -532,6 +574,7 @@ static enum prep_encoded_ret {
 	PREP_ENCODED_ERR,
 	PREP_ENCODED_CHECKSUM_ERR,
 	PREP_ENCODED_DO_WRITE,
+	PREP_ENCODED_NEED_SPACE,
 } bch2_write_prep_encoded_data(struct bch_write_op *op, struct write_point *wp)
 {
 	struct bch_fs *c = op->c;
@@ -542,6 +585,20 @@ static enum prep_encoded_ret {
 
 	BUG_ON(bio_sectors(bio) != op->crc.compressed_size);
 
+	/*
+	 * Passthrough: the caller checked that the extent is written as is - if
+	 * it's checksummed or compressed and doesn't fit, we need more space
+	 * instead of splitting it, which would mean decoding it:
+	 */
+	if ((op->flags & BCH_WRITE_PASSTHROUGH) &&
+	    (op->crc.csum_type || op->crc.compression_type) &&
+	    op->crc.compressed_size > wp->sectors_free) {
+		EBUG_ON(op->crc.uncompressed_size != op->crc.live_size ||
+			op->crc.compression_type != op->compression_type ||
+			op->crc.csum_type != op->csum_type);
+		return PREP_ENCODED_NEED_SPACE;
+	}
+
 	/* Can we just write the entire extent as is? */
 	if (op->crc.uncompressed_size == op->crc.live_size &&
 	    op->crc.compressed_size <= wp->sectors_free &&
@@ -614,7 +671,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 	int ret, more = 0;
 
 	BUG_ON(!bio_sectors(src));
-
+retry:
 	switch (bch2_write_prep_encoded_data(op, wp)) {
 	case PREP_ENCODED_OK:
 		break;
@@ -626,6 +683,13 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 	case PREP_ENCODED_DO_WRITE:
 		init_append_extent(op, wp, op->version, op->crc);
 		goto do_write;
+	case PREP_ENCODED_NEED_SPACE:
+		if (bch2_alloc_sectors_skip(c, wp))
+			return 1;
+
+		/* Doesn't fit in a whole bucket, passthrough isn't possible: */
+		op->flags &= ~BCH_WRITE_PASSTHROUGH;
+		goto retry;
 	}
 
 	if (op->compression_type ||
@@ -771,6 +835,9 @@ do_write:
 	dst->bi_private	= &op->cl;
 	bio_set_op_attrs(dst, REQ_OP_WRITE, 0);
 
+	to_wbio(dst)->move_sectors = op->flags & BCH_WRITE_MOVE
+		? bio_sectors(dst) : 0;
+
 	closure_get(dst->bi_private);
 
 	bch2_submit_wbio_replicas(to_wbio(dst), c, BCH_DATA_USER,
@@ -77,6 +77,8 @@ struct bch_write_bio {
 	struct bch_devs_list	failed;
 	u8			order;
 	u8			dev;
+	/* data moves in flight to this device, see move.c: */
+	u16			move_sectors;
 
 	unsigned		split:1,
 				bounce:1,
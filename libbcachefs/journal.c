@@ -22,24 +22,64 @@ static bool journal_entry_is_open(struct journal *j)
 	return j->reservations.cur_entry_offset < JOURNAL_ENTRY_CLOSED_VAL;
 }
 
+/*
+ * Returns the next closed journal entry to write, if its reservations have all
+ * been released - journal writes are started in order, and by one thread at a
+ * time, since bch2_journal_write() allocates space on disk for them:
+ */
+static struct journal_buf *journal_next_write(struct journal *j)
+{
+	union journal_res_state s = READ_ONCE(j->reservations);
+	unsigned i;
+
+	lockdep_assert_held(&j->lock);
+
+	if (j->write_submitting ||
+	    s.cur_entry_offset == JOURNAL_ENTRY_ERROR_VAL)
+		return NULL;
+
+	for (i = s.unwritten_idx; i != s.idx; i = (i + 1) & JOURNAL_BUF_MASK) {
+		struct journal_buf *w = j->buf + i;
+
+		if (w->write_started)
+			continue;
+
+		if (journal_state_count(s, i))
+			return NULL;
+
+		w->write_started	= true;
+		j->write_submitting	= true;
+		return w;
+	}
+
+	return NULL;
+}
+
 void bch2_journal_buf_put_slowpath(struct journal *j, bool need_write_just_set)
 {
-	struct journal_buf *w = journal_prev_buf(j);
+	struct journal_buf *w;
 
-	atomic_dec_bug(&journal_seq_pin(j, le64_to_cpu(w->data->seq))->count);
+	spin_lock(&j->lock);
+	while ((w = journal_next_write(j))) {
+		atomic_dec_bug(&journal_seq_pin(j, le64_to_cpu(w->data->seq))->count);
+		spin_unlock(&j->lock);
 
-	if (!need_write_just_set &&
-	    test_bit(JOURNAL_NEED_WRITE, &j->flags))
-		bch2_time_stats_update(j->delay_time,
-				       j->need_write_time);
+		if (!need_write_just_set &&
+		    test_bit(JOURNAL_NEED_WRITE, &j->flags))
+			bch2_time_stats_update(j->delay_time,
+					       j->need_write_time);
 #if 0
-	closure_call(&j->io, bch2_journal_write, NULL, NULL);
+		closure_call(&w->io, bch2_journal_write, NULL, NULL);
 #else
-	/* Shut sparse up: */
-	closure_init(&j->io, NULL);
-	set_closure_fn(&j->io, bch2_journal_write, NULL);
-	bch2_journal_write(&j->io);
+		/* Shut sparse up: */
+		closure_init(&w->io, NULL);
+		set_closure_fn(&w->io, bch2_journal_write, NULL);
+		bch2_journal_write(&w->io);
 #endif
+		spin_lock(&j->lock);
+		j->write_submitting = false;
+	}
+	spin_unlock(&j->lock);
 }
 
 static void journal_pin_new_entry(struct journal *j, int count)
@@ -110,7 +150,7 @@ static enum {
 		if (old.cur_entry_offset == JOURNAL_ENTRY_ERROR_VAL)
 			return JOURNAL_ENTRY_ERROR;
 
-		if (new.prev_buf_unwritten)
+		if (journal_state_nr_unwritten(old) >= j->max_in_flight)
 			return JOURNAL_ENTRY_INUSE;
 
 		/*
@@ -121,22 +161,31 @@ static enum {
 
 		new.cur_entry_offset = JOURNAL_ENTRY_CLOSED_VAL;
 		new.idx++;
-		new.prev_buf_unwritten = 1;
 
+		BUG_ON(new.idx == new.unwritten_idx);
 		BUG_ON(journal_state_count(new, new.idx));
 	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
 				       old.v, new.v)) != old.v);
 
 	clear_bit(JOURNAL_NEED_WRITE, &j->flags);
 
+	if (j->flush_batch_nr) {
+		j->nr_flush_writes++;
+		j->nr_flush_writes_held += j->flush_batch_held;
+		j->flush_batch_avg = ewma_add(j->flush_batch_avg,
+					      j->flush_batch_nr << 4, 3);
+		j->flush_batch_nr	= 0;
+		j->flush_batch_held	= false;
+	}
+
 	buf = &j->buf[old.idx];
 	buf->data->u64s		= cpu_to_le32(old.cur_entry_offset);
 
-	j->prev_buf_sectors =
+	buf->sectors =
 		vstruct_blocks_plus(buf->data, c->block_bits,
 				    journal_entry_u64s_reserve(buf)) *
 		c->opts.block_size;
-	BUG_ON(j->prev_buf_sectors > j->cur_buf_sectors);
+	BUG_ON(buf->sectors > j->cur_buf_sectors);
 
 	bch2_journal_reclaim_fast(j);
 	/* XXX: why set this here, and not in bch2_journal_write()? */
@@ -172,6 +221,7 @@ void bch2_journal_halt(struct journal *j)
 {
 	union journal_res_state old, new;
 	u64 v = atomic64_read(&j->reservations.counter);
+	unsigned i;
 
 	do {
 		old.v = new.v = v;
@@ -183,8 +233,9 @@ void bch2_journal_halt(struct journal *j)
 				       old.v, new.v)) != old.v);
 
 	journal_wake(j);
-	closure_wake_up(&journal_cur_buf(j)->wait);
-	closure_wake_up(&journal_prev_buf(j)->wait);
+
+	for (i = 0; i < JOURNAL_BUF_NR; i++)
+		closure_wake_up(&j->buf[i].wait);
 }
 
 /*
@@ -197,21 +248,28 @@ void bch2_journal_halt(struct journal *j)
  * -EROFS:	insufficient rw devices
  * -EIO:	journal error
  */
-static int journal_entry_open(struct journal *j)
+static int journal_entry_open(struct journal *j, unsigned flags)
 {
 	struct journal_buf *buf = journal_cur_buf(j);
 	union journal_res_state old, new;
+	bool reserved = false;
 	ssize_t u64s;
-	int sectors;
+	int sectors = 0;
 	u64 v;
 
 	lockdep_assert_held(&j->lock);
 	BUG_ON(journal_entry_is_open(j));
 
-	if (!fifo_free(&j->pin))
-		return 0;
+	if (fifo_free(&j->pin) > JOURNAL_RESERVE_PIN)
+		sectors = bch2_journal_entry_sectors(j, JOURNAL_RESERVE_BUCKETS);
+
+	if (!sectors &&
+	    (flags & JOURNAL_RES_GET_RESERVED) &&
+	    fifo_free(&j->pin)) {
+		sectors = bch2_journal_entry_sectors(j, 0);
+		reserved = true;
+	}
 
-	sectors = bch2_journal_entry_sectors(j);
 	if (sectors <= 0)
 		return sectors;
 
@@ -241,6 +299,11 @@ static int journal_entry_open(struct journal *j)
 	 */
 	j->cur_entry_u64s = u64s;
 
+	if (reserved)
+		set_bit(JOURNAL_ENTRY_RESERVED, &j->flags);
+	else
+		clear_bit(JOURNAL_ENTRY_RESERVED, &j->flags);
+
 	v = atomic64_read(&j->reservations.counter);
 	do {
 		old.v = new.v = v;
@@ -273,7 +336,7 @@ static bool journal_flush_write(struct journal *j)
 	bool ret;
 
 	spin_lock(&j->lock);
-	ret = !j->reservations.prev_buf_unwritten;
+	ret = !journal_nr_unwritten(j);
 
 	if (!journal_entry_is_open(j)) {
 		spin_unlock(&j->lock);
@@ -295,6 +358,81 @@ static void journal_write_work(struct work_struct *work)
 	journal_flush_write(j);
 }
 
+/* Group commit: */
+
+/* Flushes per write needed before we start holding off writes, << 4: */
+#define JOURNAL_FLUSH_BATCH_MIN		(3 << 3)
+#define JOURNAL_FLUSH_BATCH_MAX_NS	(10 * NSEC_PER_MSEC)
+
+/*
+ * How long a flush that finds the journal idle waits for others to join it, in
+ * jiffies: half the recent journal write latency - waiting any longer than a
+ * write takes would cost more than it saves.
+ *
+ * Only when flushes have been arriving concurrently, though: a single thread
+ * doing fsyncs never has anyone to batch with, and when writes stop picking
+ * up more than one flush each the average drops back down and we stop
+ * waiting. That's also measured when we aren't waiting, since flushes that
+ * arrive while a write is in flight are batched into the next write anyway.
+ *
+ * Windows shorter than a jiffy round down to not waiting at all.
+ */
+static unsigned long journal_flush_batch_delay(struct journal *j)
+{
+	if (j->flush_batch_avg < JOURNAL_FLUSH_BATCH_MIN)
+		return 0;
+
+	return nsecs_to_jiffies(min_t(u64, j->write_latency_avg / 2,
+				      JOURNAL_FLUSH_BATCH_MAX_NS));
+}
+
+/* A new flush request for the current journal entry: */
+static void journal_flush_batch_add(struct journal *j)
+{
+	lockdep_assert_held(&j->lock);
+
+	j->nr_flush_requests++;
+
+	if (!j->flush_batch_nr++)
+		j->flush_batch_start = jiffies;
+}
+
+/*
+ * Returns true if a flush of the current journal entry should wait for more
+ * flushes to batch with, instead of writing now - write_work does the write
+ * when the window closes, or when the writes in flight complete.
+ *
+ * Flushes don't pipeline journal writes: waiting for the write in flight
+ * batches every flush that arrives meanwhile into the next one, which has
+ * always been the cheaper option. The ring of journal bufs is so that
+ * reservations don't stall when the current entry fills up.
+ */
+static bool journal_flush_batch_wait(struct journal *j)
+{
+	unsigned long delay, end, now = jiffies;
+
+	lockdep_assert_held(&j->lock);
+
+	/* A write is in flight, journal_write_done() kicks write_work: */
+	if (journal_nr_unwritten(j)) {
+		if (!test_and_set_bit(JOURNAL_NEED_WRITE, &j->flags))
+			j->need_write_time = local_clock();
+		return true;
+	}
+
+	delay = journal_flush_batch_delay(j);
+	if (!delay)
+		return false;
+
+	end = j->flush_batch_start + delay;
+	if (time_after_eq(now, end))
+		return false;
+
+	j->flush_batch_held = true;
+	mod_delayed_work(system_freezable_wq, &j->write_work, end - now);
+	return true;
+}
+
 /*
  * Given an inode number, if that inode number has data in the journal that
  * hasn't yet been flushed, return the journal sequence number that needs to be
@@ -303,30 +441,37 @@ static void journal_write_work(struct work_struct *work)
 u64 bch2_inode_journal_seq(struct journal *j, u64 inode)
 {
 	size_t h = hash_64(inode, ilog2(sizeof(j->buf[0].has_inode) * 8));
-	u64 seq = 0;
+	u64 seq, ret = 0;
+	unsigned i;
 
-	if (!test_bit(h, j->buf[0].has_inode) &&
-	    !test_bit(h, j->buf[1].has_inode))
+	for (i = 0; i < JOURNAL_BUF_NR; i++)
+		if (test_bit(h, j->buf[i].has_inode))
+			break;
+	if (i == JOURNAL_BUF_NR)
 		return 0;
 
 	spin_lock(&j->lock);
-	if (test_bit(h, journal_cur_buf(j)->has_inode))
-		seq = journal_cur_seq(j);
-	else if (test_bit(h, journal_prev_buf(j)->has_inode))
-		seq = journal_cur_seq(j) - 1;
+	for (seq = journal_cur_seq(j);
+	     seq + journal_nr_unwritten(j) >= journal_cur_seq(j);
+	     --seq)
+		if (test_bit(h, journal_seq_to_buf(j, seq)->has_inode)) {
+			ret = seq;
+			break;
+		}
 	spin_unlock(&j->lock);
 
-	return seq;
+	return ret;
 }
 
 static int __journal_res_get(struct journal *j, struct journal_res *res,
-			      unsigned u64s_min, unsigned u64s_max)
+			      unsigned u64s_min, unsigned u64s_max,
+			      unsigned flags)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct journal_buf *buf;
 	int ret;
 retry:
-	ret = journal_res_get_fast(j, res, u64s_min, u64s_max);
+	ret = journal_res_get_fast(j, res, u64s_min, u64s_max, flags);
 	if (ret)
 		return ret;
 
@@ -336,12 +481,20 @@ retry:
 	 * that just did journal_entry_open() and call journal_entry_close()
 	 * unnecessarily
 	 */
-	ret = journal_res_get_fast(j, res, u64s_min, u64s_max);
+	ret = journal_res_get_fast(j, res, u64s_min, u64s_max, flags);
 	if (ret) {
 		spin_unlock(&j->lock);
 		return 1;
 	}
 
+	/* Don't close an entry opened from the reserve, we can't use it: */
+	if (journal_entry_is_open(j) &&
+	    test_bit(JOURNAL_ENTRY_RESERVED, &j->flags) &&
+	    !(flags & JOURNAL_RES_GET_RESERVED)) {
+		spin_unlock(&j->lock);
+		goto blocked;
+	}
+
 	/*
 	 * If we couldn't get a reservation because the current buf filled up,
 	 * and we had room for a bigger entry on disk, signal that we want to
@@ -373,7 +526,7 @@ retry:
 	}
 
 	/* We now have a new, closed journal buf - see if we can open it: */
-	ret = journal_entry_open(j);
+	ret = journal_entry_open(j, flags);
 	spin_unlock(&j->lock);
 
 	if (ret < 0)
@@ -407,13 +560,14 @@ blocked:
  * btree node write locks.
  */
 int bch2_journal_res_get_slowpath(struct journal *j, struct journal_res *res,
-				 unsigned u64s_min, unsigned u64s_max)
+				 unsigned u64s_min, unsigned u64s_max,
+				 unsigned flags)
 {
 	int ret;
 
 	wait_event(j->wait,
 		   (ret = __journal_res_get(j, res, u64s_min,
-					    u64s_max)));
+					    u64s_max, flags)));
 	return ret < 0 ? ret : 0;
 }
 
@@ -422,9 +576,7 @@ u64 bch2_journal_last_unwritten_seq(struct journal *j)
 	u64 seq;
 
 	spin_lock(&j->lock);
-	seq = journal_cur_seq(j);
-	if (j->reservations.prev_buf_unwritten)
-		seq--;
+	seq = journal_cur_seq(j) - journal_nr_unwritten(j);
 	spin_unlock(&j->lock);
 
 	return seq;
@@ -451,7 +603,8 @@ int bch2_journal_open_seq_async(struct journal *j, u64 seq, struct closure *pare
 		return 1;
 	}
 
-	ret = journal_entry_open(j);
+	/* writing a new btree root may be what journal reclaim is waiting on: */
+	ret = journal_entry_open(j, JOURNAL_RES_GET_RESERVED);
 	if (!ret)
 		closure_wait(&j->async_wait, parent);
 	spin_unlock(&j->lock);
@@ -472,6 +625,8 @@ int bch2_journal_open_seq_async(struct journal *j, u64 seq, struct closure *pare
  */
 void bch2_journal_wait_on_seq(struct journal *j, u64 seq, struct closure *parent)
 {
+	struct journal_buf *buf;
+
 	spin_lock(&j->lock);
 
 	BUG_ON(seq > journal_cur_seq(j));
@@ -481,20 +636,17 @@ void bch2_journal_wait_on_seq(struct journal *j, u64 seq, struct closure *parent
 		return;
 	}
 
-	if (seq == journal_cur_seq(j)) {
-		if (!closure_wait(&journal_cur_buf(j)->wait, parent))
-			BUG();
-	} else if (seq + 1 == journal_cur_seq(j) &&
-		   j->reservations.prev_buf_unwritten) {
-		if (!closure_wait(&journal_prev_buf(j)->wait, parent))
+	buf = journal_seq_to_buf(j, seq);
+	if (buf) {
+		if (!closure_wait(&buf->wait, parent))
 			BUG();
 
 		smp_mb();
 
 		/* check if raced with write completion (or failure) */
-		if (!j->reservations.prev_buf_unwritten ||
+		if (journal_seq_to_buf(j, seq) != buf ||
 		    bch2_journal_error(j))
-			closure_wake_up(&journal_prev_buf(j)->wait);
+			closure_wake_up(&buf->wait);
 	}
 
 	spin_unlock(&j->lock);
@@ -527,6 +679,10 @@ void bch2_journal_flush_seq_async(struct journal *j, u64 seq, struct closure *pa
 		if (parent && !closure_wait(&buf->wait, parent))
 			BUG();
 
+		journal_flush_batch_add(j);
+		if (journal_flush_batch_wait(j))
+			goto out;
+
 		if (!test_and_set_bit(JOURNAL_NEED_WRITE, &j->flags)) {
 			j->need_write_time = local_clock();
 			set_need_write = true;
@@ -549,21 +705,18 @@ void bch2_journal_flush_seq_async(struct journal *j, u64 seq, struct closure *pa
 			return;
 		}
 	} else if (parent &&
-		   seq + 1 == journal_cur_seq(j) &&
-		   j->reservations.prev_buf_unwritten) {
-		buf = journal_prev_buf(j);
-
+		   (buf = journal_seq_to_buf(j, seq))) {
 		if (!closure_wait(&buf->wait, parent))
 			BUG();
 
 		smp_mb();
 
 		/* check if raced with write completion (or failure) */
-		if (!j->reservations.prev_buf_unwritten ||
+		if (journal_seq_to_buf(j, seq) != buf ||
 		    bch2_journal_error(j))
 			closure_wake_up(&buf->wait);
 	}
-
+out:
 	spin_unlock(&j->lock);
 }
 
@@ -582,6 +735,9 @@ static int journal_seq_flushed(struct journal *j, u64 seq)
 
 		buf = journal_cur_buf(j);
 
+		if (journal_flush_batch_wait(j))
+			goto out;
+
 		if (!test_and_set_bit(JOURNAL_NEED_WRITE, &j->flags)) {
 			j->need_write_time = local_clock();
 			set_need_write = true;
@@ -602,11 +758,10 @@ static int journal_seq_flushed(struct journal *j, u64 seq)
 		case JOURNAL_UNLOCKED:
 			return 0;
 		}
-	} else if (seq + 1 == journal_cur_seq(j) &&
-		   j->reservations.prev_buf_unwritten) {
+	} else if (journal_seq_to_buf(j, seq)) {
 		ret = bch2_journal_error(j);
 	}
-
+out:
 	spin_unlock(&j->lock);
 
 	return ret;
@@ -617,6 +772,11 @@ int bch2_journal_flush_seq(struct journal *j, u64 seq)
 	u64 start_time = local_clock();
 	int ret, ret2;
 
+	spin_lock(&j->lock);
+	if (seq == journal_cur_seq(j))
+		journal_flush_batch_add(j);
+	spin_unlock(&j->lock);
+
 	ret = wait_event_killable(j->wait, (ret2 = journal_seq_flushed(j, seq)));
 
 	bch2_time_stats_update(j->flush_seq_time, start_time);
@@ -634,7 +794,7 @@ void bch2_journal_meta_async(struct journal *j, struct closure *parent)
 
 	memset(&res, 0, sizeof(res));
 
-	bch2_journal_res_get(j, &res, u64s, u64s);
+	bch2_journal_res_get(j, &res, u64s, u64s, 0);
 	bch2_journal_res_put(j, &res);
 
 	bch2_journal_flush_seq_async(j, res.seq, parent);
@@ -648,7 +808,7 @@ int bch2_journal_meta(struct journal *j)
 
 	memset(&res, 0, sizeof(res));
 
-	ret = bch2_journal_res_get(j, &res, u64s, u64s);
+	ret = bch2_journal_res_get(j, &res, u64s, u64s, 0);
 	if (ret)
 		return ret;
 
@@ -877,15 +1037,18 @@ int bch2_dev_journal_alloc(struct bch_dev *ca)
 static bool bch2_journal_writing_to_device(struct journal *j, unsigned dev_idx)
 {
 	union journal_res_state state;
-	struct journal_buf *w;
-	bool ret;
+	unsigned i;
+	bool ret = false;
 
 	spin_lock(&j->lock);
 	state = READ_ONCE(j->reservations);
-	w = j->buf + !state.idx;
 
-	ret = state.prev_buf_unwritten &&
-		bch2_extent_has_device(bkey_i_to_s_c_extent(&w->key), dev_idx);
+	for (i = state.unwritten_idx;
+	     i != state.idx && !ret;
+	     i = (i + 1) & JOURNAL_BUF_MASK)
+		ret = j->buf[i].write_allocated &&
+			bch2_extent_has_device(bkey_i_to_s_c_extent(&j->buf[i].key),
+					       dev_idx);
 	spin_unlock(&j->lock);
 
 	return ret;
@@ -920,6 +1083,7 @@ void bch2_fs_journal_stop(struct journal *j)
 
 void bch2_fs_journal_start(struct journal *j)
 {
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct journal_seq_blacklist *bl;
 	u64 blacklist = 0;
 
@@ -950,18 +1114,23 @@ void bch2_fs_journal_start(struct journal *j)
 	 */
 	bch2_journal_seq_blacklist_write(j);
 
-	queue_delayed_work(system_freezable_wq, &j->reclaim_work, 0);
+	queue_delayed_work(c->journal_reclaim_wq, &j->reclaim_work, 0);
 }
 
 /* init/exit: */
 
 void bch2_dev_journal_exit(struct bch_dev *ca)
 {
-	kfree(ca->journal.bio);
+	unsigned i;
+
+	for (i = 0; i < JOURNAL_BUF_NR; i++) {
+		kfree(ca->journal.bio[i]);
+		ca->journal.bio[i] = NULL;
+	}
+
 	kfree(ca->journal.buckets);
 	kfree(ca->journal.bucket_seq);
 
-	ca->journal.bio		= NULL;
 	ca->journal.buckets	= NULL;
 	ca->journal.bucket_seq	= NULL;
 }
@@ -979,10 +1148,12 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 	if (!ja->bucket_seq)
 		return -ENOMEM;
 
-	ca->journal.bio = bio_kmalloc(GFP_KERNEL,
-			DIV_ROUND_UP(JOURNAL_ENTRY_SIZE_MAX, PAGE_SIZE));
-	if (!ca->journal.bio)
-		return -ENOMEM;
+	for (i = 0; i < JOURNAL_BUF_NR; i++) {
+		ja->bio[i] = bio_kmalloc(GFP_KERNEL,
+				DIV_ROUND_UP(JOURNAL_ENTRY_SIZE_MAX, PAGE_SIZE));
+		if (!ja->bio[i])
+			return -ENOMEM;
+	}
 
 	ja->buckets = kcalloc(ja->nr, sizeof(u64), GFP_KERNEL);
 	if (!ja->buckets)
@@ -996,8 +1167,10 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 
 void bch2_fs_journal_exit(struct journal *j)
 {
-	kvpfree(j->buf[1].data, j->buf[1].size);
-	kvpfree(j->buf[0].data, j->buf[0].size);
+	unsigned i;
+
+	for (i = 0; i < JOURNAL_BUF_NR; i++)
+		kvpfree(j->buf[i].data, j->buf[i].size);
 	free_fifo(&j->pin);
 }
 
@@ -1005,6 +1178,7 @@ int bch2_fs_journal_init(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	static struct lock_class_key res_key;
+	unsigned i;
 	int ret = 0;
 
 	pr_verbose_init(c->opts, "");
@@ -1020,10 +1194,15 @@ int bch2_fs_journal_init(struct journal *j)
 
 	lockdep_init_map(&j->res_map, "journal res", &res_key, 0);
 
-	j->buf[0].size		= JOURNAL_ENTRY_SIZE_MIN;
-	j->buf[1].size		= JOURNAL_ENTRY_SIZE_MIN;
+	for (i = 0; i < JOURNAL_BUF_NR; i++) {
+		j->buf[i].idx	= i;
+		j->buf[i].size	= JOURNAL_ENTRY_SIZE_MIN;
+	}
+
+	j->max_in_flight	= JOURNAL_BUF_NR - 1;
 	j->write_delay_ms	= 1000;
 	j->reclaim_delay_ms	= 100;
+	j->flush_batch_avg	= 1 << 4;
 
 	bkey_extent_init(&j->key);
 
@@ -1031,13 +1210,17 @@ int bch2_fs_journal_init(struct journal *j)
 		((union journal_res_state)
 		 { .cur_entry_offset = JOURNAL_ENTRY_CLOSED_VAL }).v);
 
-	if (!(init_fifo(&j->pin, JOURNAL_PIN, GFP_KERNEL)) ||
-	    !(j->buf[0].data = kvpmalloc(j->buf[0].size, GFP_KERNEL)) ||
-	    !(j->buf[1].data = kvpmalloc(j->buf[1].size, GFP_KERNEL))) {
+	if (!(init_fifo(&j->pin, JOURNAL_PIN, GFP_KERNEL))) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
+	for (i = 0; i < JOURNAL_BUF_NR; i++)
+		if (!(j->buf[i].data = kvpmalloc(j->buf[i].size, GFP_KERNEL))) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
 	j->pin.front = j->pin.back = 1;
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
@@ -1068,7 +1251,13 @@ ssize_t bch2_journal_print_debug(struct journal *j, char *buf)
 			 "io in flight:\t\t%i\n"
 			 "need write:\t\t%i\n"
 			 "dirty:\t\t\t%i\n"
-			 "replay done:\t\t%i\n",
+			 "replay done:\t\t%i\n"
+			 "write latency avg:\t%llu us\n"
+			 "flush requests:\t\t%llu\n"
+			 "flush writes:\t\t%llu\n"
+			 "flush writes held:\t%llu\n"
+			 "flushes per write:\t%u.%02u\n"
+			 "flush batch window:\t%u ms\n",
 			 fifo_used(&j->pin),
 			 journal_cur_seq(j),
 			 journal_last_seq(j),
@@ -1076,10 +1265,17 @@ ssize_t bch2_journal_print_debug(struct journal *j, char *buf)
 			 journal_state_count(*s, s->idx),
 			 s->cur_entry_offset,
 			 j->cur_entry_u64s,
-			 s->prev_buf_unwritten,
+			 journal_state_nr_unwritten(*s),
 			 test_bit(JOURNAL_NEED_WRITE,	&j->flags),
 			 journal_entry_is_open(j),
-			 test_bit(JOURNAL_REPLAY_DONE,	&j->flags));
+			 test_bit(JOURNAL_REPLAY_DONE,	&j->flags),
+			 div_u64(j->write_latency_avg, NSEC_PER_USEC),
+			 j->nr_flush_requests,
+			 j->nr_flush_writes,
+			 j->nr_flush_writes_held,
+			 j->flush_batch_avg >> 4,
+			 (j->flush_batch_avg & 15) * 100 / 16,
+			 jiffies_to_msecs(journal_flush_batch_delay(j)));
 
 	for_each_member_device_rcu(ca, c, iter,
 				   &c->rw_devs[BCH_DATA_JOURNAL]) {
@@ -125,9 +125,21 @@ static inline struct journal_buf *journal_cur_buf(struct journal *j)
 	return j->buf + j->reservations.idx;
 }
 
-static inline struct journal_buf *journal_prev_buf(struct journal *j)
+/* Oldest journal entry that hasn't finished being written, if any: */
+static inline struct journal_buf *journal_last_unwritten_buf(struct journal *j)
 {
-	return j->buf + !j->reservations.idx;
+	return j->buf + j->reservations.unwritten_idx;
+}
+
+/* Number of journal entries that have been closed but not yet written: */
+static inline unsigned journal_state_nr_unwritten(union journal_res_state s)
+{
+	return (s.idx - s.unwritten_idx) & JOURNAL_BUF_MASK;
+}
+
+static inline unsigned journal_nr_unwritten(struct journal *j)
+{
+	return journal_state_nr_unwritten(READ_ONCE(j->reservations));
 }
 
 /* Sequence number of oldest dirty journal entry */
@@ -144,17 +156,42 @@ static inline u64 journal_cur_seq(struct journal *j)
 	return j->pin.back - 1;
 }
 
+/*
+ * The journal buf for @seq, if it's still in memory - the current entry, or one
+ * that hasn't finished being written:
+ */
+static inline struct journal_buf *journal_seq_to_buf(struct journal *j, u64 seq)
+{
+	union journal_res_state s = READ_ONCE(j->reservations);
+	u64 cur_seq = journal_cur_seq(j);
+
+	EBUG_ON(seq > cur_seq);
+
+	if (cur_seq - seq > journal_state_nr_unwritten(s))
+		return NULL;
+
+	return j->buf + ((s.idx - (cur_seq - seq)) & JOURNAL_BUF_MASK);
+}
+
 u64 bch2_inode_journal_seq(struct journal *, u64);
 
 static inline int journal_state_count(union journal_res_state s, int idx)
 {
-	return idx == 0 ? s.buf0_count : s.buf1_count;
+	switch (idx) {
+	case 0: return s.buf0_count;
+	case 1: return s.buf1_count;
+	case 2: return s.buf2_count;
+	case 3: return s.buf3_count;
+	}
+	BUG();
 }
 
 static inline void journal_state_inc(union journal_res_state *s)
 {
 	s->buf0_count += s->idx == 0;
 	s->buf1_count += s->idx == 1;
+	s->buf2_count += s->idx == 2;
+	s->buf3_count += s->idx == 3;
 }
 
 static inline void bch2_journal_set_has_inode(struct journal *j,
@@ -232,9 +269,12 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx,
 	s.v = atomic64_sub_return(((union journal_res_state) {
 				    .buf0_count = idx == 0,
 				    .buf1_count = idx == 1,
+				    .buf2_count = idx == 2,
+				    .buf3_count = idx == 3,
 				    }).v, &j->reservations.counter);
 
-	EBUG_ON(s.idx != idx && !s.prev_buf_unwritten);
+	EBUG_ON(((s.idx - idx) & JOURNAL_BUF_MASK) >
+		journal_state_nr_unwritten(s));
 
 	/*
 	 * Do not initiate a journal write if the journal is in an error state
@@ -268,17 +308,34 @@ static inline void bch2_journal_res_put(struct journal *j,
 	res->ref = 0;
 }
 
+/*
+ * Journal reclaim may have to allocate btree nodes, and the allocator needs
+ * journal reservations for the alloc keys it writes: those come out of a
+ * reserve, so that reclaim can still make progress when the journal is
+ * otherwise full. While a journal entry opened from the reserve is open, only
+ * reserved reservations may use it:
+ */
+#define JOURNAL_RES_GET_RESERVED	(1 << 0)
+
+#define JOURNAL_RESERVE_BUCKETS		1
+#define JOURNAL_RESERVE_PIN		64
+
 int bch2_journal_res_get_slowpath(struct journal *, struct journal_res *,
-				 unsigned, unsigned);
+				 unsigned, unsigned, unsigned);
 
 static inline int journal_res_get_fast(struct journal *j,
 				       struct journal_res *res,
 				       unsigned u64s_min,
-				       unsigned u64s_max)
+				       unsigned u64s_max,
+				       unsigned flags)
 {
 	union journal_res_state old, new;
 	u64 v = atomic64_read(&j->reservations.counter);
 
+	if (unlikely(test_bit(JOURNAL_ENTRY_RESERVED, &j->flags)) &&
+	    !(flags & JOURNAL_RES_GET_RESERVED))
+		return 0;
+
 	do {
 		old.v = new.v = v;
 
@@ -305,7 +362,8 @@ static inline int journal_res_get_fast(struct journal *j,
 }
 
 static inline int bch2_journal_res_get(struct journal *j, struct journal_res *res,
-				      unsigned u64s_min, unsigned u64s_max)
+				      unsigned u64s_min, unsigned u64s_max,
+				      unsigned flags)
 {
 	int ret;
 
@@ -313,10 +371,10 @@ static inline int bch2_journal_res_get(struct journal *j, struct journal_res *re
 	EBUG_ON(u64s_max < u64s_min);
 	EBUG_ON(!test_bit(JOURNAL_STARTED, &j->flags));
 
-	if (journal_res_get_fast(j, res, u64s_min, u64s_max))
+	if (journal_res_get_fast(j, res, u64s_min, u64s_max, flags))
 		goto out;
 
-	ret = bch2_journal_res_get_slowpath(j, res, u64s_min, u64s_max);
+	ret = bch2_journal_res_get_slowpath(j, res, u64s_min, u64s_max, flags);
 	if (ret)
 		return ret;
 out:
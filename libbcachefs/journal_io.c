@@ -23,6 +23,22 @@ struct journal_list {
 #define JOURNAL_ENTRY_ADD_OK		0
 #define JOURNAL_ENTRY_ADD_OUT_OF_RANGE	5
 
+/*
+ * Entries older than the newest entry's last_seq aren't needed - but the newest
+ * entries may yet be dropped as torn, see journal_drop_torn_entries(), so go by
+ * the newest entry that can't be:
+ */
+static u64 journal_entries_last_seq(struct list_head *head, u64 end_seq)
+{
+	struct journal_replay *i;
+
+	list_for_each_entry_reverse(i, head, list)
+		if (le64_to_cpu(i->j.seq) + JOURNAL_BUF_NR <= end_seq + 1)
+			return le64_to_cpu(i->j.last_seq);
+
+	return 0;
+}
+
 /*
  * Given a journal entry we just read, add it to the list of journal entries to
  * be replayed:
@@ -33,23 +49,24 @@ static int journal_entry_add(struct bch_fs *c, struct bch_dev *ca,
 	struct journal_replay *i, *pos;
 	struct list_head *where;
 	size_t bytes = vstruct_bytes(j);
-	__le64 last_seq;
+	u64 last_seq, end_seq = le64_to_cpu(j->seq);
 	int ret;
 
-	last_seq = !list_empty(jlist->head)
-		? list_last_entry(jlist->head, struct journal_replay,
-				  list)->j.last_seq
-		: 0;
+	if (!list_empty(jlist->head))
+		end_seq = max(end_seq, le64_to_cpu(list_last_entry(jlist->head,
+					struct journal_replay, list)->j.seq));
+
+	last_seq = journal_entries_last_seq(jlist->head, end_seq);
 
 	/* Is this entry older than the range we need? */
-	if (le64_to_cpu(j->seq) < le64_to_cpu(last_seq)) {
+	if (le64_to_cpu(j->seq) < last_seq) {
 		ret = JOURNAL_ENTRY_ADD_OUT_OF_RANGE;
 		goto out;
 	}
 
 	/* Drop entries we don't need anymore */
 	list_for_each_entry_safe(i, pos, jlist->head, list) {
-		if (le64_to_cpu(i->j.seq) >= le64_to_cpu(j->last_seq))
+		if (le64_to_cpu(i->j.seq) >= last_seq)
 			break;
 		list_del(&i->list);
 		kvpfree(i, offsetof(struct journal_replay, j) +
@@ -428,7 +445,7 @@ static int journal_read_bucket(struct bch_dev *ca,
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct bio *bio = ja->bio;
+	struct bio *bio = ja->bio[0];
 	struct jset *j = NULL;
 	unsigned sectors, sectors_read = 0;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
@@ -703,6 +720,7 @@ int bch2_journal_set_seq(struct bch_fs *c, u64 last_seq, u64 end_seq)
 
 	atomic64_set(&j->seq, end_seq);
 	j->last_seq_ondisk = last_seq;
+	j->replay_seq_ondisk = last_seq;
 
 	j->pin.front	= last_seq;
 	j->pin.back	= end_seq + 1;
@@ -717,6 +735,110 @@ int bch2_journal_set_seq(struct bch_fs *c, u64 last_seq, u64 end_seq)
 	return 0;
 }
 
+static bool jset_blacklists_seq(struct jset *jset, u64 seq)
+{
+	struct jset_entry *entry;
+
+	vstruct_for_each(jset, entry)
+		switch (entry->type) {
+		case BCH_JSET_ENTRY_blacklist: {
+			struct jset_entry_blacklist *bl_entry =
+				container_of(entry, struct jset_entry_blacklist, entry);
+
+			if (le64_to_cpu(bl_entry->seq) == seq)
+				return true;
+			break;
+		}
+		case BCH_JSET_ENTRY_blacklist_v2: {
+			struct jset_entry_blacklist_v2 *bl_entry =
+				container_of(entry, struct jset_entry_blacklist_v2, entry);
+
+			if (le64_to_cpu(bl_entry->start) <= seq &&
+			    le64_to_cpu(bl_entry->end) >= seq)
+				return true;
+			break;
+		}
+		}
+
+	return false;
+}
+
+static void journal_replay_free(struct journal_replay *i)
+{
+	list_del(&i->list);
+	kvpfree(i, offsetof(struct journal_replay, j) +
+		vstruct_bytes(&i->j));
+}
+
+/*
+ * Journal writes can complete out of order: if we crashed with several in
+ * flight, we may find entries after one that never made it to disk. Those were
+ * never reported as persistent, and may depend on the missing entry - drop them,
+ * and blacklist their sequence numbers.
+ *
+ * They'll still be on disk until their buckets are reused, so also drop entries
+ * that a previous mount dropped: those are blacklisted by the first entry
+ * written after them. Otherwise, the only missing entries we expect are ones
+ * blacklisted by the next entry.
+ */
+static int journal_drop_torn_entries(struct bch_fs *c, struct list_head *list)
+{
+	struct journal_replay *i, *n, *next = NULL, *prev = NULL;
+	u64 seq, end_seq;
+	int ret;
+
+	list_for_each_entry_safe_reverse(i, n, list, list)
+		if (next && jset_blacklists_seq(&next->j, le64_to_cpu(i->j.seq))) {
+			bch_verbose(c, "dropping blacklisted journal entry %llu",
+				    le64_to_cpu(i->j.seq));
+			journal_replay_free(i);
+		} else {
+			next = i;
+		}
+
+	end_seq = le64_to_cpu(list_last_entry(list,
+				struct journal_replay, list)->j.seq);
+
+	list_for_each_entry(i, list, list) {
+		seq = le64_to_cpu(i->j.seq);
+
+		if (prev &&
+		    seq != le64_to_cpu(prev->j.seq) + 1 &&
+		    le64_to_cpu(prev->j.seq) + JOURNAL_BUF_NR > end_seq &&
+		    !jset_blacklists_seq(&i->j, seq - 1))
+			goto torn;
+		prev = i;
+	}
+
+	ret = 0;
+	goto out;
+torn:
+	seq = le64_to_cpu(prev->j.seq);
+
+	bch_info(c, "journal entry %llu missing, dropping entries %llu-%llu written after it",
+		 seq + 1, le64_to_cpu(i->j.seq), end_seq);
+
+	list_for_each_entry_safe_reverse(i, n, list, list) {
+		if (le64_to_cpu(i->j.seq) <= seq)
+			break;
+		journal_replay_free(i);
+	}
+
+	ret = bch2_journal_seq_blacklist_torn(&c->journal, seq + 1, end_seq);
+out:
+	/* now we know which entry is last, drop the ones it doesn't need: */
+	seq = le64_to_cpu(list_last_entry(list,
+				struct journal_replay, list)->j.last_seq);
+
+	list_for_each_entry_safe(i, n, list, list) {
+		if (le64_to_cpu(i->j.seq) >= seq)
+			break;
+		journal_replay_free(i);
+	}
+
+	return ret;
+}
+
 int bch2_journal_read(struct bch_fs *c, struct list_head *list)
 {
 	struct journal *j = &c->journal;
@@ -760,6 +882,10 @@ int bch2_journal_read(struct bch_fs *c, struct list_head *list)
 		return BCH_FSCK_REPAIR_IMPOSSIBLE;
 	}
 
+	ret = journal_drop_torn_entries(c, list);
+	if (ret)
+		return ret;
+
 	list_for_each_entry(i, list, list) {
 		ret = jset_validate_entries(c, &i->j, READ);
 		if (ret)
@@ -977,8 +1103,44 @@ static unsigned journal_dev_buckets_available(struct journal *j,
 	return available;
 }
 
-/* returns number of sectors available for next journal entry: */
-int bch2_journal_entry_sectors(struct journal *j)
+/*
+ * Buckets we need on @ca for the journal entries that have been closed but not
+ * yet allocated space on disk, plus a new entry of @sectors - the same way
+ * journal_write_alloc() will allocate them:
+ */
+static unsigned journal_dev_buckets_required(struct journal *j,
+					     struct bch_dev *ca,
+					     bool cur_bucket, unsigned sectors)
+{
+	union journal_res_state s = READ_ONCE(j->reservations);
+	unsigned i, nr = 0, sectors_free = cur_bucket
+		? ca->journal.sectors_free : 0;
+
+	for (i = s.unwritten_idx; i != s.idx; i = (i + 1) & JOURNAL_BUF_MASK) {
+		struct journal_buf *w = j->buf + i;
+
+		if (w->write_allocated)
+			continue;
+
+		if (sectors_free <= w->sectors) {
+			sectors_free = ca->mi.bucket_size;
+			nr++;
+		}
+
+		sectors_free -= w->sectors;
+	}
+
+	if (sectors_free <= sectors)
+		nr++;
+
+	return nr;
+}
+
+/*
+ * returns number of sectors available for next journal entry, keeping
+ * @reserve_buckets free on each device:
+ */
+int bch2_journal_entry_sectors(struct journal *j, unsigned reserve_buckets)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
@@ -992,7 +1154,7 @@ int bch2_journal_entry_sectors(struct journal *j)
 	for_each_member_device_rcu(ca, c, i,
 				   &c->rw_devs[BCH_DATA_JOURNAL]) {
 		struct journal_device *ja = &ca->journal;
-		unsigned buckets_required = 0;
+		unsigned buckets_required;
 
 		if (!ja->nr)
 			continue;
@@ -1002,26 +1164,16 @@ int bch2_journal_entry_sectors(struct journal *j)
 
 		/*
 		 * Note that we don't allocate the space for a journal entry
-		 * until we write it out - thus, if we haven't started the write
-		 * for the previous entry we have to make sure we have space for
-		 * it too:
+		 * until we write it out - thus, if we haven't started the
+		 * writes for the entries that have been closed we have to make
+		 * sure we have space for them too:
 		 */
-		if (bch2_extent_has_device(e.c, ca->dev_idx)) {
-			if (j->prev_buf_sectors > ja->sectors_free)
-				buckets_required++;
-
-			if (j->prev_buf_sectors + sectors_available >
-			    ja->sectors_free)
-				buckets_required++;
-		} else {
-			if (j->prev_buf_sectors + sectors_available >
-			    ca->mi.bucket_size)
-				buckets_required++;
-
-			buckets_required++;
-		}
+		buckets_required = journal_dev_buckets_required(j, ca,
+				bch2_extent_has_device(e.c, ca->dev_idx),
+				sectors_available);
 
-		if (journal_dev_buckets_available(j, ca) >= buckets_required)
+		if (journal_dev_buckets_available(j, ca) >=
+		    buckets_required + reserve_buckets)
 			nr_devs++;
 		nr_online++;
 	}
@@ -1121,7 +1273,7 @@ static int journal_write_alloc(struct journal *j, struct journal_buf *w,
 	}
 	rcu_read_unlock();
 
-	j->prev_buf_sectors = 0;
+	w->write_allocated = true;
 
 	bkey_copy(&w->key, &j->key);
 	spin_unlock(&j->lock);
@@ -1198,12 +1350,13 @@ static void journal_buf_realloc(struct journal *j, struct journal_buf *buf)
 
 static void journal_write_done(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
-	struct journal_buf *w = journal_prev_buf(j);
 	struct bch_devs_list devs =
 		bch2_extent_devs(bkey_i_to_s_c_extent(&w->key));
-	u64 seq = le64_to_cpu(w->data->seq);
+	union journal_res_state old, new;
+	u64 v;
 
 	if (!devs.nr) {
 		bch_err(c, "unable to write journal to sufficient devices");
@@ -1213,12 +1366,11 @@ static void journal_write_done(struct closure *cl)
 	if (bch2_mark_replicas(c, BCH_DATA_JOURNAL, devs))
 		goto err;
 out:
-	bch2_time_stats_update(j->write_time, j->write_start_time);
+	bch2_time_stats_update(j->write_time, w->write_start_time);
 
 	spin_lock(&j->lock);
-	j->last_seq_ondisk = seq;
-	if (seq >= j->pin.front)
-		journal_seq_pin(j, seq)->devs = devs;
+	j->write_latency_avg = ewma_add(j->write_latency_avg,
+				local_clock() - w->write_start_time, 3);
 
 	/*
 	 * Updating last_seq_ondisk may let bch2_journal_reclaim_work() discard
@@ -1227,16 +1379,41 @@ out:
 	 * Must come before signaling write completion, for
 	 * bch2_fs_journal_stop():
 	 */
-	mod_delayed_work(system_freezable_wq, &j->reclaim_work, 0);
+	mod_delayed_work(c->journal_reclaim_wq, &j->reclaim_work, 0);
 
 	/* also must come before signalling write completion: */
 	closure_debug_destroy(cl);
 
-	BUG_ON(!j->reservations.prev_buf_unwritten);
-	atomic64_sub(((union journal_res_state) { .prev_buf_unwritten = 1 }).v,
-		     &j->reservations.counter);
+	w->write_done = true;
+
+	/*
+	 * Writes can complete out of order, but a journal entry isn't done until
+	 * the ones before it are:
+	 */
+	while (journal_nr_unwritten(j) &&
+	       (w = journal_last_unwritten_buf(j))->write_done) {
+		u64 seq = le64_to_cpu(w->data->seq);
+
+		j->last_seq_ondisk = seq;
+		j->replay_seq_ondisk = le64_to_cpu(w->data->last_seq);
+		if (seq >= j->pin.front)
+			journal_seq_pin(j, seq)->devs =
+				bch2_extent_devs(bkey_i_to_s_c_extent(&w->key));
+
+		w->write_started	= false;
+		w->write_allocated	= false;
+		w->write_done		= false;
+
+		v = atomic64_read(&j->reservations.counter);
+		do {
+			old.v = new.v = v;
+			new.unwritten_idx++;
+		} while ((v = atomic64_cmpxchg(&j->reservations.counter,
+					       old.v, new.v)) != old.v);
+
+		closure_wake_up(&w->wait);
+	}
 
-	closure_wake_up(&w->wait);
 	journal_wake(j);
 
 	if (test_bit(JOURNAL_NEED_WRITE, &j->flags))
@@ -1253,10 +1430,16 @@ static void journal_write_endio(struct bio *bio)
 {
 	struct bch_dev *ca = bio->bi_private;
 	struct journal *j = &ca->fs->journal;
+	struct journal_buf *w = NULL;
+	unsigned i;
+
+	for (i = 0; i < JOURNAL_BUF_NR; i++)
+		if (ca->journal.bio[i] == bio)
+			w = j->buf + i;
+	BUG_ON(!w);
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "journal write") ||
 	    bch2_meta_write_fault("journal")) {
-		struct journal_buf *w = journal_prev_buf(j);
 		unsigned long flags;
 
 		spin_lock_irqsave(&j->err_lock, flags);
@@ -1264,16 +1447,16 @@ static void journal_write_endio(struct bio *bio)
 		spin_unlock_irqrestore(&j->err_lock, flags);
 	}
 
-	closure_put(&j->io);
+	closure_put(&w->io);
 	percpu_ref_put(&ca->io_ref);
 }
 
 void bch2_journal_write(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_prev_buf(j);
 	struct jset *jset;
 	struct bio *bio;
 	struct bch_extent_ptr *ptr;
@@ -1282,7 +1465,7 @@ void bch2_journal_write(struct closure *cl)
 	journal_buf_realloc(j, w);
 	jset = w->data;
 
-	j->write_start_time = local_clock();
+	w->write_start_time = local_clock();
 	mutex_lock(&c->btree_root_lock);
 	for (i = 0; i < BTREE_ID_NR; i++) {
 		struct btree_root *r = &c->btree_roots[i];
@@ -1313,13 +1496,17 @@ void bch2_journal_write(struct closure *cl)
 
 	jset->csum = csum_vstruct(c, JSET_CSUM_TYPE(jset),
 				  journal_nonce(jset), jset);
+#ifdef CONFIG_BCACHEFS_TESTS
+	if (le64_to_cpu(jset->seq) == j->torn_write_seq)
+		jset->csum.lo ^= cpu_to_le64(1);
+#endif
 
 	if (!bch2_csum_type_is_encryption(JSET_CSUM_TYPE(jset)) &&
 	    jset_validate_entries(c, jset, WRITE))
 		goto err;
 
 	sectors = vstruct_sectors(jset, c->block_bits);
-	BUG_ON(sectors > j->prev_buf_sectors);
+	BUG_ON(sectors > w->sectors);
 
 	bytes = vstruct_bytes(w->data);
 	memset((void *) w->data + bytes, 0, (sectors << 9) - bytes);
@@ -1350,7 +1537,7 @@ void bch2_journal_write(struct closure *cl)
 		this_cpu_add(ca->io_done->sectors[WRITE][BCH_DATA_JOURNAL],
 			     sectors);
 
-		bio = ca->journal.bio;
+		bio = ca->journal.bio[w->idx];
 		bio_reset(bio);
 		bio_set_dev(bio, ca->disk_sb.bdev);
 		bio->bi_iter.bi_sector	= ptr->offset;
@@ -1372,7 +1559,7 @@ void bch2_journal_write(struct closure *cl)
 		    !bch2_extent_has_device(bkey_i_to_s_c_extent(&w->key), i)) {
 			percpu_ref_get(&ca->io_ref);
 
-			bio = ca->journal.bio;
+			bio = ca->journal.bio[w->idx];
 			bio_reset(bio);
 			bio_set_dev(bio, ca->disk_sb.bdev);
 			bio->bi_opf		= REQ_OP_FLUSH;
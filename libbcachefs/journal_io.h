@@ -37,7 +37,7 @@ static inline struct jset_entry *__jset_entry_type_next(struct jset *jset,
 int bch2_journal_set_seq(struct bch_fs *c, u64, u64);
 int bch2_journal_read(struct bch_fs *, struct list_head *);
 
-int bch2_journal_entry_sectors(struct journal *);
+int bch2_journal_entry_sectors(struct journal *, unsigned);
 void bch2_journal_write(struct closure *);
 
 #endif /* _BCACHEFS_JOURNAL_IO_H */
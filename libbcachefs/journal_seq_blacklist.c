@@ -270,6 +270,29 @@ fsck_err:
 	return ret;
 }
 
+/*
+ * Journal entries @start-@end were found on disk, but won't be replayed because
+ * an entry before them is missing - blacklist them so that future mounts ignore
+ * them too:
+ */
+int bch2_journal_seq_blacklist_torn(struct journal *j, u64 start, u64 end)
+{
+	int ret = 0;
+
+	mutex_lock(&j->blacklist_lock);
+	if (!j->new_blacklist)
+		j->new_blacklist = bch2_journal_seq_blacklisted_new(j,
+							start, end);
+
+	if (j->new_blacklist)
+		j->new_blacklist->end = max(j->new_blacklist->end, end);
+	else
+		ret = -ENOMEM;
+	mutex_unlock(&j->blacklist_lock);
+
+	return ret;
+}
+
 static int __bch2_journal_seq_blacklist_read(struct journal *j,
 					     struct journal_replay *i,
 					     u64 start, u64 end)
@@ -11,18 +11,37 @@
 struct journal_res;
 
 /*
- * We put two of these in struct journal; we used them for writes to the
- * journal that are being staged or in flight.
+ * Ring of journal bufs: one is open for new reservations, the ones behind it
+ * have been closed and are being written - JOURNAL_BUF_NR - 1 journal writes
+ * may be in flight at once:
  */
+#define JOURNAL_BUF_BITS	2
+#define JOURNAL_BUF_NR		(1U << JOURNAL_BUF_BITS)
+#define JOURNAL_BUF_MASK	(JOURNAL_BUF_NR - 1)
+
 struct journal_buf {
 	struct jset		*data;
 
 	BKEY_PADDED(key);
 
+	struct closure		io;
 	struct closure_waitlist	wait;
 
 	unsigned		size;
 	unsigned		disk_sectors;
+	/* space we need on disk, from when the entry is closed: */
+	unsigned		sectors;
+	u8			idx;
+
+	/*
+	 * Writes are started and allocated space in order, but may complete
+	 * out of order - they're only signalled as done in order:
+	 */
+	bool			write_started;
+	bool			write_allocated;
+	bool			write_done;
+	u64			write_start_time;
+
 	/* bloom filter: */
 	unsigned long		has_inode[1024 / sizeof(unsigned long)];
 };
@@ -85,12 +104,18 @@ union journal_res_state {
 		u64		v;
 	};
 
+	/*
+	 * Bufs from unwritten_idx up to (not including) idx are closed and
+	 * haven't finished being written:
+	 */
 	struct {
 		u64		cur_entry_offset:20,
-				idx:1,
-				prev_buf_unwritten:1,
-				buf0_count:21,
-				buf1_count:21;
+				idx:JOURNAL_BUF_BITS,
+				unwritten_idx:JOURNAL_BUF_BITS,
+				buf0_count:10,
+				buf1_count:10,
+				buf2_count:10,
+				buf3_count:10;
 	};
 };
 
@@ -118,6 +143,7 @@ enum {
 	JOURNAL_STARTED,
 	JOURNAL_NEED_WRITE,
 	JOURNAL_NOT_EMPTY,
+	JOURNAL_ENTRY_RESERVED,
 };
 
 /* Embedded in struct bch_fs */
@@ -128,15 +154,10 @@ struct journal {
 
 	union journal_res_state reservations;
 	unsigned		cur_entry_u64s;
-	unsigned		prev_buf_sectors;
 	unsigned		cur_buf_sectors;
 	unsigned		buf_size_want;
 
-	/*
-	 * Two journal entries -- one is currently open for new entries, the
-	 * other is possibly being written out.
-	 */
-	struct journal_buf	buf[2];
+	struct journal_buf	buf[JOURNAL_BUF_NR];
 
 	spinlock_t		lock;
 
@@ -144,14 +165,20 @@ struct journal {
 	wait_queue_head_t	wait;
 	struct closure_waitlist	async_wait;
 
-	struct closure		io;
 	struct delayed_work	write_work;
 
+	/* Max journal entries closed and not yet written, < JOURNAL_BUF_NR: */
+	unsigned		max_in_flight;
+	/* Writes are started by one thread at a time, in order: */
+	bool			write_submitting;
+
 	/* Sequence number of most recent journal entry (last entry in @pin) */
 	atomic64_t		seq;
 
-	/* last_seq from the most recent journal entry written */
+	/* seq of the most recent journal entry written */
 	u64			last_seq_ondisk;
+	/* last_seq from the most recent journal entry written - replay starts here */
+	u64			replay_seq_ondisk;
 
 	/*
 	 * FIFO of journal entries whose btree updates have not yet been
@@ -193,13 +220,33 @@ struct journal {
 
 	u64			res_get_blocked_start;
 	u64			need_write_time;
-	u64			write_start_time;
 
 	struct time_stats	*write_time;
 	struct time_stats	*delay_time;
 	struct time_stats	*blocked_time;
 	struct time_stats	*flush_seq_time;
 
+	/*
+	 * Group commit - a flush request that finds the journal idle may hold
+	 * off the write briefly, so that concurrent flushes share it; see
+	 * journal_flush_batch_delay():
+	 */
+	u64			write_latency_avg;	/* ns */
+	unsigned long		flush_batch_start;	/* jiffies */
+	unsigned		flush_batch_nr;
+	bool			flush_batch_held;
+	/* flush requests per journal write that had any, << 4: */
+	unsigned		flush_batch_avg;
+
+	u64			nr_flush_requests;
+	u64			nr_flush_writes;
+	u64			nr_flush_writes_held;
+
+#ifdef CONFIG_BCACHEFS_TESTS
+	/* write this entry with a bad checksum, as if it had torn: */
+	u64			torn_write_seq;
+#endif
+
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	struct lockdep_map	res_map;
 #endif
@@ -231,8 +278,8 @@ struct journal_device {
 	unsigned		nr;
 	u64			*buckets;
 
-	/* Bio for journal reads/writes to this device */
-	struct bio		*bio;
+	/* Bios for journal writes, one per journal buf - reads use the first: */
+	struct bio		*bio[JOURNAL_BUF_NR];
 
 	/* for bch_journal_read_device */
 	struct closure		read;
@@ -3,6 +3,7 @@
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "buckets.h"
+#include "disk_groups.h"
 #include "inode.h"
 #include "io.h"
 #include "journal_reclaim.h"
@@ -13,16 +14,28 @@
 
 #include <linux/ioprio.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
 
 #include <trace/events/bcachefs.h>
 
-#define SECTORS_IN_FLIGHT_PER_DEVICE	2048
+/*
+ * Throttling: moves are limited per device - the device we read from, and the
+ * devices we might write to - to the device's move_depth, which is adapted to
+ * its latency by bch2_latency_acct(). So moves between fast devices aren't held
+ * up by a slow device that other moves are using.
+ *
+ * moving_ios for extents up to encoded_extent_max come from a pool allocated
+ * when the move starts, instead of allocating an io and its pages per extent.
+ */
 
 struct moving_io {
 	struct list_head	list;
 	struct closure		cl;
 	bool			read_completed;
+	bool			pooled;
+	void			*pool_buf;
 
+	unsigned		read_dev;
 	unsigned		read_sectors;
 	unsigned		write_sectors;
 
@@ -46,6 +59,38 @@ struct moving_context {
 	atomic_t		write_sectors;
 
 	wait_queue_head_t	wait;
+
+	spinlock_t		pool_lock;
+	struct list_head	pool;
+	unsigned		pool_nr;
+	unsigned		pool_sectors;
+
+	/* where the last read was issued, for bch_move_stats.read_seeks: */
+	unsigned		last_read_dev;
+	u64			last_read_end;
+};
+
+/*
+ * Extents to move are collected into a window of up to c->move_sort_window
+ * entries, and their reads issued sorted by the device and offset we expect to
+ * read from - in key order, reads for copygc and evacuate are scattered all
+ * over the device:
+ */
+struct move_window_entry {
+	unsigned		dev;
+	u64			offset;
+	unsigned		sectors;
+
+	struct bch_io_opts	io_opts;
+	enum data_cmd		data_cmd;
+	struct data_opts	data_opts;
+	BKEY_PADDED(k);
+};
+
+struct move_window {
+	size_t			nr;
+	size_t			size;
+	struct move_window_entry *entries;
 };
 
 static int bch2_migrate_index_update(struct bch_write_op *op)
@@ -164,8 +209,15 @@ static int bch2_migrate_index_update(struct bch_write_op *op)
 				BTREE_INSERT_USE_RESERVE|
 				m->data_opts.btree_insert_flags,
 				BTREE_INSERT_ENTRY(&iter, &insert->k_i));
-		if (!ret)
+		if (!ret) {
 			atomic_long_inc(&c->extent_migrate_done);
+
+			if (op->flags & BCH_WRITE_PASSTHROUGH) {
+				atomic_long_inc(&c->extent_migrate_passthrough);
+				if (m->ctxt)
+					atomic64_inc(&m->ctxt->stats->keys_passthrough);
+			}
+		}
 		if (ret == -EINTR)
 			ret = 0;
 		if (ret)
@@ -211,6 +263,19 @@ void bch2_migrate_read_done(struct migrate_write *m, struct bch_read_bio *rbio)
 		m->op.csum_type = m->op.crc.csum_type;
 	}
 
+	/*
+	 * If the options match what the extent was written with, copygc and
+	 * evacuate copy the encoded data as is, without decompressing or
+	 * rechecksumming - even if that means starting a new bucket. Plain
+	 * extents don't need that, they can just be split:
+	 */
+	if (m->data_cmd != DATA_PROMOTE &&
+	    (m->op.crc.csum_type || m->op.crc.compression_type) &&
+	    m->op.crc.live_size == m->op.crc.uncompressed_size &&
+	    m->op.crc.compression_type == m->op.compression_type &&
+	    m->op.crc.csum_type == m->op.csum_type)
+		m->op.flags |= BCH_WRITE_PASSTHROUGH;
+
 	if (m->data_cmd == DATA_REWRITE)
 		bch2_dev_list_drop_dev(&m->op.devs_have, m->data_opts.rewrite_dev);
 }
@@ -276,6 +341,87 @@ int bch2_migrate_write_init(struct bch_fs *c, struct migrate_write *m,
 	return 0;
 }
 
+static struct moving_io *moving_io_alloc(struct moving_context *ctxt,
+					  unsigned sectors)
+{
+	unsigned pages = DIV_ROUND_UP(sectors, PAGE_SECTORS);
+	struct moving_io *io = NULL;
+	void *buf;
+
+	if (sectors <= ctxt->pool_sectors) {
+		spin_lock(&ctxt->pool_lock);
+		io = list_first_entry_or_null(&ctxt->pool,
+					      struct moving_io, list);
+		if (io)
+			list_del(&io->list);
+		spin_unlock(&ctxt->pool_lock);
+	}
+
+	if (!io)
+		return kzalloc(sizeof(struct moving_io) +
+			       sizeof(struct bio_vec) * pages, GFP_KERNEL);
+
+	buf = io->pool_buf;
+	memset(io, 0, sizeof(*io));
+	io->pooled	= true;
+	io->pool_buf	= buf;
+	return io;
+}
+
+/* Pages of an io that isn't pooled are freed by the caller: */
+static void moving_io_free(struct moving_context *ctxt, struct moving_io *io)
+{
+	if (io->pooled) {
+		spin_lock(&ctxt->pool_lock);
+		list_add(&io->list, &ctxt->pool);
+		spin_unlock(&ctxt->pool_lock);
+	} else {
+		kfree(io);
+	}
+}
+
+static void move_pool_init(struct bch_fs *c, struct moving_context *ctxt)
+{
+	unsigned sectors = c->sb.encoded_extent_max;
+	unsigned pages = DIV_ROUND_UP(sectors, PAGE_SECTORS);
+	struct moving_io *io;
+
+	/* If we can't allocate the whole pool, we make do with what we got: */
+	while (ctxt->pool_nr < MOVE_POOL_SECTORS / sectors) {
+		io = kzalloc(sizeof(struct moving_io) +
+			     sizeof(struct bio_vec) * pages, GFP_KERNEL);
+		if (!io)
+			break;
+
+		io->pool_buf = kvpmalloc(sectors << 9, GFP_KERNEL);
+		if (!io->pool_buf) {
+			kfree(io);
+			break;
+		}
+
+		io->pooled = true;
+		list_add(&io->list, &ctxt->pool);
+		ctxt->pool_nr++;
+	}
+
+	if (ctxt->pool_nr)
+		ctxt->pool_sectors = sectors;
+}
+
+static void move_pool_exit(struct moving_context *ctxt)
+{
+	struct moving_io *io, *n;
+	unsigned nr = 0;
+
+	list_for_each_entry_safe(io, n, &ctxt->pool, list) {
+		kvpfree(io->pool_buf, ctxt->pool_sectors << 9);
+		kfree(io);
+		nr++;
+	}
+
+	BUG_ON(nr != ctxt->pool_nr);
+}
+
 static void move_free(struct closure *cl)
 {
 	struct moving_io *io = container_of(cl, struct moving_io, cl);
@@ -285,13 +431,13 @@ static void move_free(struct closure *cl)
 
 	bch2_disk_reservation_put(io->write.op.c, &io->write.op.res);
 
-	bio_for_each_segment_all(bv, &io->write.op.wbio.bio, i)
-		if (bv->bv_page)
-			__free_page(bv->bv_page);
+	if (!io->pooled)
+		bio_for_each_segment_all(bv, &io->write.op.wbio.bio, i)
+			if (bv->bv_page)
+				__free_page(bv->bv_page);
 
+	moving_io_free(ctxt, io);
 	wake_up(&ctxt->wait);
-
-	kfree(io);
 }
 
 static void move_write_done(struct closure *cl)
@@ -331,11 +477,15 @@ static void move_read_endio(struct bio *bio)
 	struct moving_io *io = container_of(bio, struct moving_io, rbio.bio);
 	struct moving_context *ctxt = io->write.ctxt;
 
+	if (io->read_dev != UINT_MAX)
+		atomic_sub(io->read_sectors,
+			   &bch_dev_bkey_exists(io->write.op.c,
+					io->read_dev)->move_sectors[READ]);
+
 	atomic_sub(io->read_sectors, &ctxt->read_sectors);
 	io->read_completed = true;
 
-	if (next_pending_write(ctxt))
-		wake_up(&ctxt->wait);
+	wake_up(&ctxt->wait);
 
 	closure_put(&ctxt->cl);
 }
@@ -369,11 +519,67 @@ static void bch2_move_ctxt_wait_for_io(struct moving_context *ctxt)
 		atomic_read(&ctxt->write_sectors) != sectors_pending);
 }
 
+static bool move_dev_has_room(struct bch_dev *ca, int rw)
+{
+	return atomic_read(&ca->move_sectors[rw]) <
+		READ_ONCE(ca->move_depth[rw]);
+}
+
+/* Writes are throttled only if every device we might write to is full: */
+static bool move_target_has_room(struct bch_fs *c, unsigned target)
+{
+	const struct bch_devs_mask *devs;
+	struct bch_dev *ca;
+	unsigned i, nr = 0;
+	bool ret = false;
+
+	rcu_read_lock();
+	devs = bch2_target_to_mask(c, target) ?: &c->rw_devs[BCH_DATA_USER];
+
+	for_each_set_bit(i, devs->d, BCH_SB_MEMBERS_MAX) {
+		ca = rcu_dereference(c->devs[i]);
+		if (!ca)
+			continue;
+
+		nr++;
+		if (move_dev_has_room(ca, WRITE)) {
+			ret = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return ret || !nr;
+}
+
+static bool move_ctxt_can_issue(struct bch_fs *c,
+				struct moving_context *ctxt,
+				unsigned read_dev, unsigned sectors,
+				unsigned target)
+{
+	/*
+	 * We're only woken up by our own ios completing - if we have none in
+	 * flight, devices are busy with other moves and we go anyways:
+	 */
+	if (list_empty(&ctxt->reads) &&
+	    !atomic_read(&ctxt->write_sectors))
+		return true;
+
+	if (sectors <= ctxt->pool_sectors &&
+	    list_empty_careful(&ctxt->pool))
+		return false;
+
+	return (read_dev == UINT_MAX ||
+		move_dev_has_room(bch_dev_bkey_exists(c, read_dev), READ)) &&
+		move_target_has_room(c, target);
+}
+
 static int bch2_move_extent(struct bch_fs *c,
 			    struct moving_context *ctxt,
 			    struct write_point_specifier wp,
 			    struct bch_io_opts io_opts,
 			    struct bkey_s_c_extent e,
+			    unsigned read_dev,
 			    enum data_cmd data_cmd,
 			    struct data_opts data_opts)
 {
@@ -383,25 +589,21 @@ static int bch2_move_extent(struct bch_fs *c,
 	unsigned sectors = e.k->size, pages;
 	int ret = -ENOMEM;
 
-	move_ctxt_wait_event(ctxt,
-		atomic_read(&ctxt->write_sectors) <
-		SECTORS_IN_FLIGHT_PER_DEVICE);
-
-	move_ctxt_wait_event(ctxt,
-		atomic_read(&ctxt->read_sectors) <
-		SECTORS_IN_FLIGHT_PER_DEVICE);
-
 	/* write path might have to decompress data: */
 	extent_for_each_ptr_crc(e, ptr, crc)
 		sectors = max_t(unsigned, sectors, crc.uncompressed_size);
 
+	move_ctxt_wait_event(ctxt,
+		move_ctxt_can_issue(c, ctxt, read_dev, sectors,
+				    data_opts.target));
+
 	pages = DIV_ROUND_UP(sectors, PAGE_SECTORS);
-	io = kzalloc(sizeof(struct moving_io) +
-		     sizeof(struct bio_vec) * pages, GFP_KERNEL);
+	io = moving_io_alloc(ctxt, sectors);
 	if (!io)
 		goto err;
 
 	io->write.ctxt		= ctxt;
+	io->read_dev		= read_dev;
 	io->read_sectors	= e.k->size;
 	io->write_sectors	= e.k->size;
 
@@ -410,8 +612,9 @@ static int bch2_move_extent(struct bch_fs *c,
 		     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
 	io->write.op.wbio.bio.bi_iter.bi_size = sectors << 9;
 
-	bch2_bio_map(&io->write.op.wbio.bio, NULL);
-	if (bch2_bio_alloc_pages(&io->write.op.wbio.bio, GFP_KERNEL))
+	bch2_bio_map(&io->write.op.wbio.bio, io->pool_buf);
+	if (!io->pooled &&
+	    bch2_bio_alloc_pages(&io->write.op.wbio.bio, GFP_KERNEL))
 		goto err_free;
 
 	io->rbio.opts = io_opts;
@@ -429,11 +632,17 @@ static int bch2_move_extent(struct bch_fs *c,
 	if (ret)
 		goto err_free_pages;
 
+	io->write.op.flags |= BCH_WRITE_MOVE;
+
 	atomic64_inc(&ctxt->stats->keys_moved);
 	atomic64_add(e.k->size, &ctxt->stats->sectors_moved);
 
 	trace_move_extent(e.k);
 
+	if (read_dev != UINT_MAX)
+		atomic_add(io->read_sectors,
+			   &bch_dev_bkey_exists(c, read_dev)->move_sectors[READ]);
+
 	atomic_add(io->read_sectors, &ctxt->read_sectors);
 	list_add_tail(&io->list, &ctxt->reads);
 
@@ -447,39 +656,146 @@ static int bch2_move_extent(struct bch_fs *c,
 			 BCH_READ_LAST_FRAGMENT);
 	return 0;
 err_free_pages:
-	bio_free_pages(&io->write.op.wbio.bio);
+	if (!io->pooled)
+		bio_free_pages(&io->write.op.wbio.bio);
 err_free:
-	kfree(io);
+	moving_io_free(ctxt, io);
 err:
 	trace_move_alloc_fail(e.k);
 	return ret;
 }
 
-int bch2_move_data(struct bch_fs *c,
-		   struct bch_ratelimit *rate,
-		   struct write_point_specifier wp,
-		   struct bpos start,
-		   struct bpos end,
-		   move_pred_fn pred, void *arg,
-		   struct bch_move_stats *stats)
+static int move_window_entry_cmp(const void *_l, const void *_r)
+{
+	const struct move_window_entry *l = _l, *r = _r;
+
+	if (l->dev != r->dev)
+		return l->dev < r->dev ? -1 : 1;
+	if (l->offset != r->offset)
+		return l->offset < r->offset ? -1 : 1;
+	return 0;
+}
+
+static void move_window_add(struct bch_fs *c, struct move_window *w,
+			    struct bkey_s_c_extent e,
+			    struct bch_io_opts io_opts,
+			    enum data_cmd data_cmd,
+			    struct data_opts data_opts)
+{
+	struct move_window_entry *i = &w->entries[w->nr++];
+	struct extent_pick_ptr pick;
+
+	BUG_ON(w->nr > w->size);
+
+	bkey_reassemble(&i->k, e.s_c);
+	i->io_opts	= io_opts;
+	i->data_cmd	= data_cmd;
+	i->data_opts	= data_opts;
+
+	/*
+	 * The read path makes its own choice of replica when the read is
+	 * issued - this is only used for ordering reads, so if it guesses
+	 * differently it only costs a seek:
+	 */
+	if (bch2_extent_pick_ptr(c, e.s_c, NULL, &pick) > 0) {
+		i->dev		= pick.ptr.dev;
+		i->offset	= pick.ptr.offset;
+		i->sectors	= pick.crc.compressed_size;
+	} else {
+		/* nothing to read - sort to the end: */
+		i->dev		= UINT_MAX;
+		i->offset	= 0;
+		i->sectors	= 0;
+	}
+}
+
+static void move_window_issue(struct bch_fs *c,
+			      struct moving_context *ctxt,
+			      struct bch_ratelimit *rate,
+			      struct write_point_specifier wp,
+			      struct move_window *w)
+{
+	struct move_window_entry *i;
+	int ret;
+
+	if (!w->nr)
+		return;
+
+	sort(w->entries, w->nr, sizeof(w->entries[0]),
+	     move_window_entry_cmp, NULL);
+
+	for (i = w->entries; i < w->entries + w->nr; i++) {
+		if (i->dev != UINT_MAX) {
+			if (i->dev != ctxt->last_read_dev ||
+			    i->offset != ctxt->last_read_end) {
+				atomic64_inc(&ctxt->stats->read_seeks);
+				if (i->dev == ctxt->last_read_dev)
+					atomic64_add(abs((s64) (i->offset -
+							ctxt->last_read_end)),
+						&ctxt->stats->read_seek_sectors);
+			}
+
+			ctxt->last_read_dev = i->dev;
+			ctxt->last_read_end = i->offset + i->sectors;
+		}
+
+		while ((ret = bch2_move_extent(c, ctxt, wp, i->io_opts,
+					bkey_s_c_to_extent(bkey_i_to_s_c(&i->k)),
+					i->dev, i->data_cmd,
+					i->data_opts)) == -ENOMEM)
+			/* memory allocation failure, wait for some IO to finish */
+			bch2_move_ctxt_wait_for_io(ctxt);
+
+		/* XXX signal failure */
+
+		if (!ret && rate)
+			bch2_ratelimit_increment(rate, i->k.k.size);
+	}
+
+	atomic64_inc(&ctxt->stats->windows);
+	w->nr = 0;
+}
+
+/* Moves extents that start in [start, end): */
+static int __bch2_move_data(struct bch_fs *c,
+			    struct bch_ratelimit *rate,
+			    struct write_point_specifier wp,
+			    struct bpos start,
+			    struct bpos end,
+			    move_pred_fn pred, void *arg,
+			    struct bch_move_stats *stats,
+			    struct btree_iter *iter)
 {
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
-	struct moving_context ctxt = { .stats = stats };
+	struct moving_context ctxt = {
+		.stats		= stats,
+		.last_read_dev	= UINT_MAX,
+	};
+	struct move_window w = {
+		.size		= clamp_t(unsigned, READ_ONCE(c->move_sort_window),
+					  1, MOVE_SORT_WINDOW_MAX),
+	};
 	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
-	BKEY_PADDED(k) tmp;
 	struct bkey_s_c k;
 	struct bkey_s_c_extent e;
 	struct data_opts data_opts;
 	enum data_cmd data_cmd;
 	u64 cur_inum = U64_MAX;
-	int ret = 0, ret2;
+	int ret = 0;
+
+	w.entries = kvpmalloc(w.size * sizeof(w.entries[0]), GFP_KERNEL);
+	if (!w.entries)
+		return -ENOMEM;
 
 	closure_init_stack(&ctxt.cl);
 	INIT_LIST_HEAD(&ctxt.reads);
 	init_waitqueue_head(&ctxt.wait);
+	spin_lock_init(&ctxt.pool_lock);
+	INIT_LIST_HEAD(&ctxt.pool);
+	move_pool_init(c, &ctxt);
 
 	stats->data_type = BCH_DATA_USER;
-	bch2_btree_iter_init(&stats->iter, c, BTREE_ID_EXTENTS, start,
+	bch2_btree_iter_init(iter, c, BTREE_ID_EXTENTS, start,
 			     BTREE_ITER_PREFETCH);
 
 	if (rate)
@@ -488,11 +804,11 @@ int bch2_move_data(struct bch_fs *c,
 	while (!kthread || !(ret = kthread_should_stop())) {
 		if (rate &&
 		    bch2_ratelimit_delay(rate) &&
-		    (bch2_btree_iter_unlock(&stats->iter),
+		    (bch2_btree_iter_unlock(iter),
 		     (ret = bch2_ratelimit_wait_freezable_stoppable(rate))))
 			break;
 peek:
-		k = bch2_btree_iter_peek(&stats->iter);
+		k = bch2_btree_iter_peek(iter);
 		if (!k.k)
 			break;
 		ret = btree_iter_err(k);
@@ -500,6 +816,8 @@ peek:
 			break;
 		if (bkey_cmp(bkey_start_pos(k.k), end) >= 0)
 			break;
+		if (bkey_cmp(bkey_start_pos(k.k), start) < 0)
+			goto next_nondata;
 
 		if (!bkey_extent_is_data(k.k))
 			goto next_nondata;
@@ -510,7 +828,7 @@ peek:
 			struct bch_inode_unpacked inode;
 
 			/* don't hold btree locks while looking up inode: */
-			bch2_btree_iter_unlock(&stats->iter);
+			bch2_btree_iter_unlock(iter);
 
 			io_opts = bch2_opts_to_inode_opts(c->opts);
 			if (!bch2_inode_find_by_inum(c, k.k->p.inode, &inode))
@@ -533,42 +851,34 @@ peek:
 			BUG();
 		}
 
-		/* unlock before doing IO: */
-		bkey_reassemble(&tmp.k, k);
-		k = bkey_i_to_s_c(&tmp.k);
-		bch2_btree_iter_unlock(&stats->iter);
-
-		ret2 = bch2_move_extent(c, &ctxt, wp, io_opts,
-					bkey_s_c_to_extent(k),
-					data_cmd, data_opts);
-		if (ret2) {
-			if (ret2 == -ENOMEM) {
-				/* memory allocation failure, wait for some IO to finish */
-				bch2_move_ctxt_wait_for_io(&ctxt);
-				continue;
-			}
-
-			/* XXX signal failure */
-			goto next;
-		}
-
-		if (rate)
-			bch2_ratelimit_increment(rate, k.k->size);
+		move_window_add(c, &w, e, io_opts, data_cmd, data_opts);
 next:
 		atomic64_add(k.k->size * bch2_extent_nr_dirty_ptrs(k),
 			     &stats->sectors_seen);
+
+		if (w.nr == w.size) {
+			/* unlock before doing IO - @k is invalid after this: */
+			bch2_btree_iter_unlock(iter);
+			move_window_issue(c, &ctxt, rate, wp, &w);
+		}
 next_nondata:
-		bch2_btree_iter_next(&stats->iter);
-		bch2_btree_iter_cond_resched(&stats->iter);
+		bch2_btree_iter_next(iter);
+		bch2_btree_iter_cond_resched(iter);
 	}
 
-	bch2_btree_iter_unlock(&stats->iter);
+	bch2_btree_iter_unlock(iter);
+
+	if (!ret)
+		move_window_issue(c, &ctxt, rate, wp, &w);
+	kvpfree(w.entries, w.size * sizeof(w.entries[0]));
 
 	move_ctxt_wait_event(&ctxt, list_empty(&ctxt.reads));
 	closure_sync(&ctxt.cl);
 
 	EBUG_ON(atomic_read(&ctxt.write_sectors));
 
+	move_pool_exit(&ctxt);
+
 	trace_move_data(c,
 			atomic64_read(&stats->sectors_moved),
 			atomic64_read(&stats->keys_moved));
@@ -576,6 +886,224 @@ next_nondata:
 	return ret;
 }
 
+int bch2_move_data(struct bch_fs *c,
+		   struct bch_ratelimit *rate,
+		   struct write_point_specifier wp,
+		   struct bpos start,
+		   struct bpos end,
+		   move_pred_fn pred, void *arg,
+		   struct bch_move_stats *stats)
+{
+	return __bch2_move_data(c, rate, wp, start, end, pred, arg,
+				stats, &stats->iter);
+}
+
+/*
+ * Sharded moves: the range is split into shards at btree node boundaries, each
+ * moved by its own thread with its own moving_context, iterator and write
+ * point - a single walk of the extents btree is limited to one thread's worth
+ * of reads and index updates, which is a fraction of what a pool of devices can
+ * do. The shards share @stats, so progress is reported for the whole job.
+ */
+
+struct move_shards;
+
+struct move_shard {
+	struct move_shards	*s;
+	struct bpos		start;
+	struct bpos		end;
+	struct btree_iter	iter;
+	struct task_struct	*thread;
+	bool			done;
+	int			ret;
+};
+
+struct move_shards {
+	struct bch_fs		*c;
+	move_pred_fn		pred;
+	void			*arg;
+	struct bch_move_stats	*stats;
+
+	atomic_t		running;
+	wait_queue_head_t	wait;
+
+	unsigned		nr;
+	struct move_shard	shards[MOVE_SHARDS_MAX];
+};
+
+static unsigned move_nr_nodes(struct bch_fs *c, struct bpos start,
+			      struct bpos end, unsigned depth)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	unsigned nr = 0;
+
+	__for_each_btree_node(&iter, c, BTREE_ID_EXTENTS, start,
+			      0, depth, 0, b) {
+		if (bkey_cmp(b->key.k.p, end) >= 0)
+			break;
+		nr++;
+	}
+	bch2_btree_iter_unlock(&iter);
+
+	return nr;
+}
+
+/*
+ * Picks shard boundaries from the ends of btree nodes in the range - interior
+ * nodes if there's enough of them, leaves otherwise - so that shards have about
+ * the same number of keys. Returns the number of shards:
+ */
+static unsigned move_shards_init(struct move_shards *s,
+				 struct bpos start, struct bpos end,
+				 unsigned nr_shards)
+{
+	struct bch_fs *c = s->c;
+	struct btree_iter iter;
+	struct btree *b;
+	unsigned depth = 1, nr_nodes, i = 0, shard = 1;
+
+	nr_nodes = move_nr_nodes(c, start, end, depth);
+	if (nr_nodes + 1 < nr_shards)
+		nr_nodes = move_nr_nodes(c, start, end, --depth);
+
+	nr_shards = min(nr_shards, nr_nodes + 1);
+
+	s->shards[0].start = start;
+
+	__for_each_btree_node(&iter, c, BTREE_ID_EXTENTS, start,
+			      0, depth, 0, b) {
+		if (shard >= nr_shards ||
+		    bkey_cmp(b->key.k.p, end) >= 0)
+			break;
+
+		/* Shard @shard starts after node number i: */
+		if (++i >= (nr_nodes + 1) * shard / nr_shards) {
+			s->shards[shard - 1].end	= b->key.k.p;
+			s->shards[shard].start		= b->key.k.p;
+			shard++;
+		}
+	}
+	bch2_btree_iter_unlock(&iter);
+
+	/* the btree might have changed since we counted nodes: */
+	s->shards[shard - 1].end = end;
+	return shard;
+}
+
+static int move_shard_thread(void *arg)
+{
+	struct move_shard *shard = arg;
+	struct move_shards *s = shard->s;
+
+	shard->ret = __bch2_move_data(s->c, NULL,
+				writepoint_hashed((unsigned long) current),
+				shard->start, shard->end,
+				s->pred, s->arg, s->stats, &shard->iter);
+	WRITE_ONCE(shard->done, true);
+
+	if (atomic_dec_and_test(&s->running))
+		wake_up(&s->wait);
+	return 0;
+}
+
+/* For progress reporting: */
+static void move_shards_update_pos(struct move_shards *s)
+{
+	struct bpos pos = POS_MAX;
+	unsigned i;
+
+	for (i = 0; i < s->nr; i++)
+		if (!READ_ONCE(s->shards[i].done) &&
+		    bkey_cmp(s->shards[i].iter.pos, pos) < 0)
+			pos = s->shards[i].iter.pos;
+
+	s->stats->iter.btree_id	= BTREE_ID_EXTENTS;
+	s->stats->iter.pos	= pos;
+}
+
+int bch2_move_data_sharded(struct bch_fs *c,
+			   struct bpos start,
+			   struct bpos end,
+			   move_pred_fn pred, void *arg,
+			   struct bch_move_stats *stats,
+			   unsigned nr_shards)
+{
+	bool kthread = (current->flags & PF_KTHREAD) != 0;
+	struct move_shards *s;
+	struct move_shard *shard;
+	int ret = 0;
+
+	nr_shards = clamp_t(unsigned, nr_shards, 1, MOVE_SHARDS_MAX);
+	if (nr_shards == 1)
+		goto unsharded;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		goto unsharded;
+
+	s->c		= c;
+	s->pred		= pred;
+	s->arg		= arg;
+	s->stats	= stats;
+	init_waitqueue_head(&s->wait);
+
+	s->nr = move_shards_init(s, start, end, nr_shards);
+	if (s->nr == 1) {
+		kfree(s);
+		goto unsharded;
+	}
+
+	stats->data_type = BCH_DATA_USER;
+	atomic_set(&s->running, s->nr);
+
+	for (shard = s->shards; shard < s->shards + s->nr; shard++) {
+		shard->s	= s;
+		shard->iter.pos	= shard->start;
+		shard->thread	= kthread_create(move_shard_thread, shard,
+					"bch_move[%zu]", shard - s->shards);
+		if (IS_ERR(shard->thread)) {
+			/* run it here, after starting the rest: */
+			shard->thread = NULL;
+			continue;
+		}
+
+		get_task_struct(shard->thread);
+		wake_up_process(shard->thread);
+	}
+
+	for (shard = s->shards; shard < s->shards + s->nr; shard++)
+		if (!shard->thread)
+			move_shard_thread(shard);
+
+	do {
+		wait_event_timeout(s->wait,
+				   !atomic_read(&s->running) ||
+				   (kthread && kthread_should_stop()),
+				   HZ);
+		move_shards_update_pos(s);
+	} while (atomic_read(&s->running) &&
+		 !(kthread && kthread_should_stop()));
+
+	/* Stops the shards that are still running, if we were stopped: */
+	for (shard = s->shards; shard < s->shards + s->nr; shard++) {
+		if (shard->thread) {
+			kthread_stop(shard->thread);
+			put_task_struct(shard->thread);
+		}
+
+		ret = ret ?: shard->ret;
+	}
+
+	stats->iter.pos = end;
+	kfree(s);
+	return ret;
+unsharded:
+	return bch2_move_data(c, NULL,
+			      writepoint_hashed((unsigned long) current),
+			      start, end, pred, arg, stats);
+}
+
 static int bch2_gc_data_replicas(struct bch_fs *c)
 {
 	struct btree_iter iter;
@@ -716,6 +1244,13 @@ static enum data_cmd migrate_pred(struct bch_fs *c, void *arg,
 	return DATA_REWRITE;
 }
 
+/* By default, a thread per device we can write to: */
+static unsigned data_job_nr_shards(struct bch_fs *c)
+{
+	return READ_ONCE(c->data_job_shards) ?:
+		bitmap_weight(c->rw_devs[BCH_DATA_USER].d, BCH_SB_MEMBERS_MAX);
+}
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
@@ -730,11 +1265,9 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c, rereplicate_pred, c, stats) ?: ret;
 		ret = bch2_gc_btree_replicas(c) ?: ret;
 
-		ret = bch2_move_data(c, NULL,
-				     writepoint_hashed((unsigned long) current),
-				     op.start,
-				     op.end,
-				     rereplicate_pred, c, stats) ?: ret;
+		ret = bch2_move_data_sharded(c, op.start, op.end,
+					     rereplicate_pred, c, stats,
+					     data_job_nr_shards(c)) ?: ret;
 		ret = bch2_gc_data_replicas(c) ?: ret;
 		break;
 	case BCH_DATA_OP_MIGRATE:
@@ -747,11 +1280,9 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c, migrate_pred, &op, stats) ?: ret;
 		ret = bch2_gc_btree_replicas(c) ?: ret;
 
-		ret = bch2_move_data(c, NULL,
-				     writepoint_hashed((unsigned long) current),
-				     op.start,
-				     op.end,
-				     migrate_pred, &op, stats) ?: ret;
+		ret = bch2_move_data_sharded(c, op.start, op.end,
+					     migrate_pred, &op, stats,
+					     data_job_nr_shards(c)) ?: ret;
 		ret = bch2_gc_data_replicas(c) ?: ret;
 		break;
 	default:
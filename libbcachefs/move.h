@@ -6,6 +6,24 @@
 #include "io_types.h"
 #include "move_types.h"
 
+/* Max extents whose reads are sorted by physical offset before issuing: */
+#define MOVE_SORT_WINDOW_DEFAULT	64
+#define MOVE_SORT_WINDOW_MAX		1024
+
+/*
+ * Data moves in flight per device, in sectors: the limit starts at the default
+ * and is adapted to the device's latency, between min and max:
+ */
+#define MOVE_DEPTH_MIN			128
+#define MOVE_DEPTH_DEFAULT		2048
+#define MOVE_DEPTH_MAX			16384
+
+/* Max threads for a data job, see bch2_move_data_sharded(): */
+#define MOVE_SHARDS_MAX			16
+
+/* Preallocated buffers per bch2_move_data() call: */
+#define MOVE_POOL_SECTORS		8192
+
 struct bch_read_bio;
 struct moving_context;
 
@@ -54,6 +72,9 @@ int bch2_move_data(struct bch_fs *, struct bch_ratelimit *,
 		   struct bpos, struct bpos,
 		   move_pred_fn, void *,
 		   struct bch_move_stats *);
+int bch2_move_data_sharded(struct bch_fs *, struct bpos, struct bpos,
+			   move_pred_fn, void *,
+			   struct bch_move_stats *, unsigned);
 
 int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
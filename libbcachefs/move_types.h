@@ -9,6 +9,16 @@ struct bch_move_stats {
 	atomic64_t		sectors_moved;
 	atomic64_t		sectors_seen;
 	atomic64_t		sectors_raced;
+	/* keys written with the encoded data copied as is: */
+	atomic64_t		keys_passthrough;
+
+	/*
+	 * Batches of reads issued, and reads that didn't start where the
+	 * previous read ended - on the same device, how far the head moved:
+	 */
+	atomic64_t		windows;
+	atomic64_t		read_seeks;
+	atomic64_t		read_seek_sectors;
 };
 
 #endif /* _BCACHEFS_MOVE_TYPES_H */
@@ -155,6 +155,9 @@ enum opt_type {
 	BCH_OPT(fix_errors,		u8,	OPT_MOUNT,		\
 		OPT_BOOL(),						\
 		NO_SB_OPT,			false)			\
+	BCH_OPT(fsck_memory,		u32,	OPT_MOUNT,		\
+		OPT_UINT(1, U32_MAX),					\
+		NO_SB_OPT,			256)			\
 	BCH_OPT(nochanges,		u8,	OPT_MOUNT,		\
 		OPT_BOOL(),						\
 		NO_SB_OPT,			false)			\
@@ -448,7 +448,11 @@ int bch2_fs_quota_read(struct bch_fs *c)
 			   BTREE_ITER_PREFETCH, k) {
 		switch (k.k->type) {
 		case BCH_INODE_FS:
-			ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &u);
+			ret = bch2_inode_unpack_fields(bkey_s_c_to_inode(k), &u,
+					BCH_INODE_FIELD_BIT(bi_sectors)|
+					BCH_INODE_FIELD_BIT(bi_uid)|
+					BCH_INODE_FIELD_BIT(bi_gid)|
+					BCH_INODE_FIELD_BIT(bi_project));
 			if (ret)
 				return ret;
 
@@ -291,6 +291,11 @@ ssize_t bch2_rebalance_work_show(struct bch_fs *c, char *buf)
 		out += scnprintf(out, end - out, "pos %llu:%llu\n",
 				 r->move_stats.iter.pos.inode,
 				 r->move_stats.iter.pos.offset);
+		out += scnprintf(out, end - out,
+				 "read seeks %llu/%llu extents, %llu windows\n",
+				 atomic64_read(&r->move_stats.read_seeks),
+				 atomic64_read(&r->move_stats.keys_moved),
+				 atomic64_read(&r->move_stats.windows));
 		break;
 	}
 
@@ -3,6 +3,8 @@
 #include "replicas.h"
 #include "super-io.h"
 
+#include <linux/jhash.h>
+
 static int bch2_cpu_replicas_to_sb_replicas(struct bch_fs *,
 					    struct bch_replicas_cpu *);
 
@@ -19,9 +21,55 @@ cpu_replicas_entry(struct bch_replicas_cpu *r, unsigned i)
 	return (void *) r->entries + r->entry_size * i;
 }
 
+/*
+ * Entries are looked up for every write and every key gc marks, so besides the
+ * entries array (which is what goes in the superblock) a bch_replicas_cpu has a
+ * hash table of indices into it: since it's immutable once published, the
+ * common already-marked case is one hash and usually a single probe.
+ *
+ * The table is allocated along with the entries, with space for @nr entries:
+ */
+static struct bch_replicas_cpu *cpu_replicas_alloc(unsigned nr,
+						   unsigned entry_size)
+{
+	struct bch_replicas_cpu *r;
+	unsigned entries_bytes = round_up(nr * entry_size, sizeof(u16));
+	unsigned table_size = roundup_pow_of_two(max(nr, 1U) * 2);
+
+	r = kzalloc(sizeof(*r) + entries_bytes +
+		    table_size * sizeof(u16), GFP_NOIO);
+	if (!r)
+		return NULL;
+
+	r->entry_size	= entry_size;
+	r->table_mask	= table_size - 1;
+	r->table	= (void *) r->entries + entries_bytes;
+	return r;
+}
+
+static inline u32 cpu_replicas_hash(struct bch_replicas_cpu *r,
+				    struct bch_replicas_cpu_entry *e)
+{
+	return jhash(e, r->entry_size, 0);
+}
+
 static void bch2_cpu_replicas_sort(struct bch_replicas_cpu *r)
 {
+	unsigned i, j;
+
 	eytzinger0_sort(r->entries, r->nr, r->entry_size, memcmp, NULL);
+
+	/* sorting moved the entries, so (re)build the index: */
+	BUG_ON(r->nr > r->table_mask);
+	memset(r->table, 0, (r->table_mask + 1) * sizeof(u16));
+
+	for (i = 0; i < r->nr; i++) {
+		j = cpu_replicas_hash(r, cpu_replicas_entry(r, i));
+
+		while (r->table[j & r->table_mask])
+			j++;
+		r->table[j & r->table_mask] = i + 1;
+	}
 }
 
 static inline bool replicas_test_dev(struct bch_replicas_cpu_entry *e,
@@ -133,13 +181,11 @@ cpu_replicas_add_entry(struct bch_replicas_cpu *old,
 	entry_size = max(entry_size, old->entry_size);
 	nr = old->nr + 1;
 
-	new = kzalloc(sizeof(struct bch_replicas_cpu) +
-		      nr * entry_size, GFP_NOIO);
+	new = cpu_replicas_alloc(nr, entry_size);
 	if (!new)
 		return NULL;
 
 	new->nr		= nr;
-	new->entry_size	= entry_size;
 
 	for (i = 0; i < old->nr; i++)
 		memcpy(cpu_replicas_entry(new, i),
@@ -158,10 +204,19 @@ static bool replicas_has_entry(struct bch_replicas_cpu *r,
 				struct bch_replicas_cpu_entry search,
 				unsigned max_dev)
 {
-	return max_dev < replicas_dev_slots(r) &&
-		eytzinger0_find(r->entries, r->nr,
-				r->entry_size,
-				memcmp, &search) < r->nr;
+	unsigned i, idx;
+
+	if (max_dev >= replicas_dev_slots(r))
+		return false;
+
+	for (i = cpu_replicas_hash(r, &search);
+	     (idx = r->table[i & r->table_mask]);
+	     i++)
+		if (!memcmp(cpu_replicas_entry(r, idx - 1),
+			    &search, r->entry_size))
+			return true;
+
+	return false;
 }
 
 noinline
@@ -313,16 +368,12 @@ int bch2_replicas_gc_start(struct bch_fs *c, unsigned typemask)
 	src = rcu_dereference_protected(c->replicas,
 					lockdep_is_held(&c->sb_lock));
 
-	dst = kzalloc(sizeof(struct bch_replicas_cpu) +
-		      src->nr * src->entry_size, GFP_NOIO);
+	dst = cpu_replicas_alloc(src->nr, src->entry_size);
 	if (!dst) {
 		mutex_unlock(&c->sb_lock);
 		return -ENOMEM;
 	}
 
-	dst->nr		= 0;
-	dst->entry_size	= src->entry_size;
-
 	for_each_cpu_replicas_entry(src, e)
 		if (!((1 << e->data_type) & typemask))
 			memcpy(cpu_replicas_entry(dst, dst->nr++),
@@ -373,13 +424,11 @@ __bch2_sb_replicas_to_cpu_replicas(struct bch_sb_field_replicas *sb_r)
 	entry_size = offsetof(struct bch_replicas_cpu_entry, devs) +
 		DIV_ROUND_UP(max_dev + 1, 8);
 
-	cpu_r = kzalloc(sizeof(struct bch_replicas_cpu) +
-			nr * entry_size, GFP_NOIO);
+	cpu_r = cpu_replicas_alloc(nr, entry_size);
 	if (!cpu_r)
 		return NULL;
 
 	cpu_r->nr		= nr;
-	cpu_r->entry_size	= entry_size;
 
 	if (nr) {
 		struct bch_replicas_cpu_entry *dst =
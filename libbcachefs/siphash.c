@@ -50,27 +50,31 @@
 
 #include "siphash.h"
 
+#define SIPROUND(v0, v1, v2, v3)					\
+do {									\
+	v0 += v1;							\
+	v2 += v3;							\
+	v1 = rol64(v1, 13);						\
+	v3 = rol64(v3, 16);						\
+									\
+	v1 ^= v0;							\
+	v3 ^= v2;							\
+	v0 = rol64(v0, 32);						\
+									\
+	v2 += v1;							\
+	v0 += v3;							\
+	v1 = rol64(v1, 17);						\
+	v3 = rol64(v3, 21);						\
+									\
+	v1 ^= v2;							\
+	v3 ^= v0;							\
+	v2 = rol64(v2, 32);						\
+} while (0)
+
 static void SipHash_Rounds(SIPHASH_CTX *ctx, int rounds)
 {
-	while (rounds--) {
-		ctx->v[0] += ctx->v[1];
-		ctx->v[2] += ctx->v[3];
-		ctx->v[1] = rol64(ctx->v[1], 13);
-		ctx->v[3] = rol64(ctx->v[3], 16);
-
-		ctx->v[1] ^= ctx->v[0];
-		ctx->v[3] ^= ctx->v[2];
-		ctx->v[0] = rol64(ctx->v[0], 32);
-
-		ctx->v[2] += ctx->v[1];
-		ctx->v[0] += ctx->v[3];
-		ctx->v[1] = rol64(ctx->v[1], 17);
-		ctx->v[3] = rol64(ctx->v[3], 21);
-
-		ctx->v[1] ^= ctx->v[2];
-		ctx->v[3] ^= ctx->v[0];
-		ctx->v[2] = rol64(ctx->v[2], 32);
-	}
+	while (rounds--)
+		SIPROUND(ctx->v[0], ctx->v[1], ctx->v[2], ctx->v[3]);
 }
 
 static void SipHash_CRounds(SIPHASH_CTX *ctx, const void *ptr, int rounds)
@@ -162,11 +166,60 @@ u64 SipHash_End(SIPHASH_CTX *ctx, int rc, int rf)
 	return (r);
 }
 
+/*
+ * One shot version, for short inputs: keeps the state in registers, and
+ * doesn't go through the context's buffer. Same result as SipHash_Init(),
+ * SipHash_Update() and SipHash_End() - but only for a single update, see
+ * below:
+ */
+static __always_inline u64 __SipHash(const SIPHASH_KEY *key, int rc, int rf,
+				     const u8 *ptr, size_t len)
+{
+	const u8 *end = ptr + (len & ~7);
+	u64 k0 = le64_to_cpu(key->k0);
+	u64 k1 = le64_to_cpu(key->k1);
+	u64 v0 = 0x736f6d6570736575ULL ^ k0;
+	u64 v1 = 0x646f72616e646f6dULL ^ k1;
+	u64 v2 = 0x6c7967656e657261ULL ^ k0;
+	u64 v3 = 0x7465646279746573ULL ^ k1;
+	u64 m;
+	int i;
+
+	for (; ptr != end; ptr += 8) {
+		m = get_unaligned_le64(ptr);
+		v3 ^= m;
+		for (i = 0; i < rc; i++)
+			SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	m = (u64) len << 56;
+	for (i = 0; i < (len & 7); i++)
+		m |= (u64) ptr[i] << (i * 8);
+
+	v3 ^= m;
+	for (i = 0; i < rc; i++)
+		SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	for (i = 0; i < rf; i++)
+		SIPROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+/*
+ * Note that SipHash_Update() doesn't give the same result as this when called
+ * more than once with lengths that aren't a multiple of the block size - when
+ * the buffer was partially filled, the tail ends up at the wrong offset. Hashes
+ * computed that way are on disk (xattrs), so that has to stay as is:
+ */
 u64 SipHash(const SIPHASH_KEY *key, int rc, int rf, const void *src, size_t len)
 {
-	SIPHASH_CTX ctx;
+	/* constant rounds, so they get unrolled: */
+	if (rc == 2 && rf == 4)
+		return __SipHash(key, 2, 4, src, len);
 
-	SipHash_Init(&ctx, key);
-	SipHash_Update(&ctx, rc, rf, src, len);
-	return SipHash_End(&ctx, rc, rf);
+	return __SipHash(key, rc, rf, src, len);
 }
@@ -114,6 +114,20 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	}
 }
 
+/* Hash a single string - for siphash, faster than init/update/end: */
+static inline u64 bch2_str_hash(const struct bch_hash_info *info,
+				const void *data, size_t len)
+{
+	struct bch_str_hash_ctx ctx;
+
+	if (info->type == BCH_STR_HASH_SIPHASH)
+		return SipHash24(&info->siphash_key, data, len) >> 1;
+
+	bch2_str_hash_init(&ctx, info);
+	bch2_str_hash_update(&ctx, info, data, len);
+	return bch2_str_hash_end(&ctx, info);
+}
+
 struct bch_hash_desc {
 	enum btree_id	btree_id;
 	u8		key_type;
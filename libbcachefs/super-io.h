@@ -113,6 +113,13 @@ static inline bool bch2_dev_exists(struct bch_sb *sb,
 		bch2_member_exists(&mi->members[dev]);
 }
 
+/*
+ * Zoned devices can only be written to sequentially: that's only true of data
+ * written through write points, btree nodes and journal buckets get rewritten
+ * in place:
+ */
+#define BCH_DATA_ALLOWED_ZONED	((1 << BCH_DATA_USER)|(1 << BCH_DATA_CACHED))
+
 static inline struct bch_member_cpu bch2_mi_to_cpu(struct bch_member *mi)
 {
 	return (struct bch_member_cpu) {
@@ -10,6 +10,7 @@
 #include "alloc.h"
 #include "btree_cache.h"
 #include "btree_gc.h"
+#include "btree_key_cache.h"
 #include "btree_update_interior.h"
 #include "btree_io.h"
 #include "chardev.h"
@@ -393,14 +394,17 @@ static void bch2_fs_free(struct bch_fs *c)
 		bch2_time_stats_exit(&c->times[i]);
 
 	bch2_fs_quota_exit(c);
+	bch2_fs_inode_exit(c);
 	bch2_fs_fsio_exit(c);
 	bch2_fs_encryption_exit(c);
 	bch2_fs_io_exit(c);
+	bch2_fs_btree_key_cache_exit(&c->btree_key_cache);
 	bch2_fs_btree_cache_exit(c);
 	bch2_fs_journal_exit(&c->journal);
 	bch2_io_clock_exit(&c->io_clock[WRITE]);
 	bch2_io_clock_exit(&c->io_clock[READ]);
 	bch2_fs_compress_exit(c);
+	free_percpu(c->disk_res_pcpu);
 	percpu_free_rwsem(&c->usage_lock);
 	free_percpu(c->usage_percpu);
 	mempool_exit(&c->btree_bounce_pool);
@@ -412,6 +416,8 @@ static void bch2_fs_free(struct bch_fs *c)
 	kfree(rcu_dereference_protected(c->replicas, 1));
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 
+	if (c->journal_reclaim_wq)
+		destroy_workqueue(c->journal_reclaim_wq);
 	if (c->copygc_wq)
 		destroy_workqueue(c->copygc_wq);
 	if (c->wq)
@@ -548,7 +554,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	init_rwsem(&c->gc_lock);
 
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
-		bch2_time_stats_init(&c->times[i]);
+		if (bch2_time_stats_init(&c->times[i]))
+			goto err;
 
 	bch2_fs_allocator_init(c);
 	bch2_fs_rebalance_init(c);
@@ -572,6 +579,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	seqcount_init(&c->gc_pos_lock);
 
 	c->copy_gc_enabled		= 1;
+	c->move_sort_window		= MOVE_SORT_WINDOW_DEFAULT;
 	c->rebalance.enabled		= 1;
 	c->promote_whole_extents	= true;
 
@@ -581,6 +589,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	c->journal.flush_seq_time = &c->times[BCH_TIME_journal_flush_seq];
 
 	bch2_fs_btree_cache_init_early(&c->btree_cache);
+	bch2_fs_btree_key_cache_init_early(&c->btree_key_cache);
+	bch2_fs_btree_insert_batch_init_early(c);
 
 	mutex_lock(&c->sb_lock);
 
@@ -614,6 +624,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_HIGHPRI, 1)) ||
 	    !(c->copygc_wq = alloc_workqueue("bcache_copygc",
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_HIGHPRI, 1)) ||
+	    !(c->journal_reclaim_wq = alloc_workqueue("bcache_journal",
+				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_HIGHPRI, 1)) ||
 	    percpu_ref_init(&c->writes, bch2_writes_disabled, 0, GFP_KERNEL) ||
 	    mempool_init_kmalloc_pool(&c->btree_reserve_pool, 1,
 				      sizeof(struct btree_reserve)) ||
@@ -626,16 +638,19 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 			BIOSET_NEED_BVECS) ||
 	    !(c->usage_percpu = alloc_percpu(struct bch_fs_usage)) ||
 	    percpu_init_rwsem(&c->usage_lock) ||
+	    !(c->disk_res_pcpu = alloc_percpu(struct disk_reservation_pcpu)) ||
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
 	    bch2_io_clock_init(&c->io_clock[READ]) ||
 	    bch2_io_clock_init(&c->io_clock[WRITE]) ||
 	    bch2_fs_journal_init(&c->journal) ||
 	    bch2_fs_btree_cache_init(c) ||
+	    bch2_fs_btree_key_cache_init(&c->btree_key_cache) ||
 	    bch2_fs_io_init(c) ||
 	    bch2_fs_encryption_init(c) ||
 	    bch2_fs_compress_init(c) ||
-	    bch2_fs_fsio_init(c))
+	    bch2_fs_fsio_init(c) ||
+	    bch2_fs_inode_init(c))
 		goto err;
 
 	mi = bch2_sb_get_members(c->disk_sb.sb);
@@ -914,14 +929,14 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 
 	writepoint_init(&ca->copygc_write_point, BCH_DATA_USER);
 
+	ca->move_depth[READ]	= MOVE_DEPTH_DEFAULT;
+	ca->move_depth[WRITE]	= MOVE_DEPTH_DEFAULT;
+
 	spin_lock_init(&ca->freelist_lock);
 	bch2_dev_copygc_init(ca);
 
 	INIT_WORK(&ca->io_error_work, bch2_io_error_work);
 
-	bch2_time_stats_init(&ca->io_latency[READ]);
-	bch2_time_stats_init(&ca->io_latency[WRITE]);
-
 	ca->mi = bch2_mi_to_cpu(member);
 	ca->uuid = member->uuid;
 
@@ -932,6 +947,8 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 			    0, GFP_KERNEL) ||
 	    percpu_ref_init(&ca->io_ref, bch2_dev_io_ref_complete,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
+	    bch2_time_stats_init(&ca->io_latency[READ]) ||
+	    bch2_time_stats_init(&ca->io_latency[WRITE]) ||
 	    bch2_dev_buckets_alloc(c, ca) ||
 	    bioset_init(&ca->replica_set, 4,
 			offsetof(struct bch_write_bio, bio), 0) ||
@@ -1009,6 +1026,20 @@ static int __bch2_dev_attach_bdev(struct bch_dev *ca, struct bch_sb_handle *sb)
 		return -EINVAL;
 	}
 
+	if (bdev_is_zoned(sb->bdev)) {
+		if (ca->mi.bucket_size != bdev_zone_sectors(sb->bdev)) {
+			bch_err(ca, "cannot online: bucket size %u doesn't match zone size %llu",
+				ca->mi.bucket_size,
+				(u64) bdev_zone_sectors(sb->bdev));
+			return -EINVAL;
+		}
+
+		if (ca->mi.data_allowed & ~BCH_DATA_ALLOWED_ZONED) {
+			bch_err(ca, "cannot online: zoned devices can only hold user data");
+			return -EINVAL;
+		}
+	}
+
 	ret = bch2_dev_journal_init(ca, sb->sb);
 	if (ret)
 		return ret;
@@ -1277,6 +1308,12 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 		goto err;
 	}
 
+	/*
+	 * Cached alloc keys for this device have to be written out before
+	 * they're deleted:
+	 */
+	bch2_journal_flush_all_pins(&c->journal);
+
 	ret = bch2_btree_delete_range(c, BTREE_ID_ALLOC,
 				      POS(ca->dev_idx, 0),
 				      POS(ca->dev_idx + 1, 0),
@@ -43,6 +43,9 @@ struct bch_replicas_cpu {
 	struct rcu_head		rcu;
 	unsigned		nr;
 	unsigned		entry_size;
+	/* hash table of indices into @entries, see replicas.c: */
+	unsigned		table_mask;
+	u16			*table;
 	struct bch_replicas_cpu_entry entries[];
 };
 
@@ -149,6 +149,7 @@ read_attribute(io_latency_write);
 read_attribute(io_latency_stats_read);
 read_attribute(io_latency_stats_write);
 read_attribute(congested);
+read_attribute(move_depth);
 
 read_attribute(bucket_quantiles_last_read);
 read_attribute(bucket_quantiles_last_write);
@@ -172,15 +173,19 @@ write_attribute(wake_allocator);
 read_attribute(read_realloc_races);
 read_attribute(extent_migrate_done);
 read_attribute(extent_migrate_raced);
+read_attribute(extent_migrate_passthrough);
 
 rw_attribute(journal_write_delay_ms);
 rw_attribute(journal_reclaim_delay_ms);
+rw_attribute(journal_max_in_flight);
 
 rw_attribute(discard);
 rw_attribute(cache_replacement_policy);
 rw_attribute(label);
 
 rw_attribute(copy_gc_enabled);
+rw_attribute(move_sort_window);
+rw_attribute(data_job_shards);
 sysfs_pd_controller_attribute(copy_gc);
 
 rw_attribute(rebalance_enabled);
@@ -230,40 +235,52 @@ static size_t bch2_btree_cache_size(struct bch_fs *c)
 static ssize_t show_fs_alloc_debug(struct bch_fs *c, char *buf)
 {
 	struct bch_fs_usage stats = bch2_fs_usage_read(c);
+	struct disk_reservation_pcpu res = bch2_disk_reservation_stats(c);
+	ssize_t ret;
 
-	return scnprintf(buf, PAGE_SIZE,
-			 "capacity:\t\t%llu\n"
-			 "1 replicas:\n"
-			 "\tmeta:\t\t%llu\n"
-			 "\tdirty:\t\t%llu\n"
-			 "\treserved:\t%llu\n"
-			 "2 replicas:\n"
-			 "\tmeta:\t\t%llu\n"
-			 "\tdirty:\t\t%llu\n"
-			 "\treserved:\t%llu\n"
-			 "3 replicas:\n"
-			 "\tmeta:\t\t%llu\n"
-			 "\tdirty:\t\t%llu\n"
-			 "\treserved:\t%llu\n"
-			 "4 replicas:\n"
-			 "\tmeta:\t\t%llu\n"
-			 "\tdirty:\t\t%llu\n"
-			 "\treserved:\t%llu\n"
-			 "online reserved:\t%llu\n",
-			 c->capacity,
-			 stats.s[0].data[S_META],
-			 stats.s[0].data[S_DIRTY],
-			 stats.s[0].persistent_reserved,
-			 stats.s[1].data[S_META],
-			 stats.s[1].data[S_DIRTY],
-			 stats.s[1].persistent_reserved,
-			 stats.s[2].data[S_META],
-			 stats.s[2].data[S_DIRTY],
-			 stats.s[2].persistent_reserved,
-			 stats.s[3].data[S_META],
-			 stats.s[3].data[S_DIRTY],
-			 stats.s[3].persistent_reserved,
-			 stats.online_reserved);
+	ret = scnprintf(buf, PAGE_SIZE,
+			"capacity:\t\t%llu\n"
+			"1 replicas:\n"
+			"\tmeta:\t\t%llu\n"
+			"\tdirty:\t\t%llu\n"
+			"\treserved:\t%llu\n"
+			"2 replicas:\n"
+			"\tmeta:\t\t%llu\n"
+			"\tdirty:\t\t%llu\n"
+			"\treserved:\t%llu\n"
+			"3 replicas:\n"
+			"\tmeta:\t\t%llu\n"
+			"\tdirty:\t\t%llu\n"
+			"\treserved:\t%llu\n"
+			"4 replicas:\n"
+			"\tmeta:\t\t%llu\n"
+			"\tdirty:\t\t%llu\n"
+			"\treserved:\t%llu\n"
+			"online reserved:\t%llu\n",
+			c->capacity,
+			stats.s[0].data[S_META],
+			stats.s[0].data[S_DIRTY],
+			stats.s[0].persistent_reserved,
+			stats.s[1].data[S_META],
+			stats.s[1].data[S_DIRTY],
+			stats.s[1].persistent_reserved,
+			stats.s[2].data[S_META],
+			stats.s[2].data[S_DIRTY],
+			stats.s[2].persistent_reserved,
+			stats.s[3].data[S_META],
+			stats.s[3].data[S_DIRTY],
+			stats.s[3].persistent_reserved,
+			stats.online_reserved);
+
+	ret += scnprintf(buf + ret, PAGE_SIZE - ret,
+			 "disk reservations:\n");
+#define x(_n)								\
+	ret += scnprintf(buf + ret, PAGE_SIZE - ret,			\
+			 "\t" #_n ":\t\t%llu\n", res.nr_##_n);
+	BCH_DISK_RES_COUNTERS()
+#undef x
+
+	return ret;
 }
 
 static ssize_t bch2_compression_stats(struct bch_fs *c, char *buf)
@@ -326,6 +343,7 @@ SHOW(bch2_fs)
 
 	sysfs_print(journal_write_delay_ms,	c->journal.write_delay_ms);
 	sysfs_print(journal_reclaim_delay_ms,	c->journal.reclaim_delay_ms);
+	sysfs_print(journal_max_in_flight,	c->journal.max_in_flight);
 
 	sysfs_print(block_size,			block_bytes(c));
 	sysfs_print(btree_node_size,		btree_bytes(c));
@@ -337,10 +355,14 @@ SHOW(bch2_fs)
 		    atomic_long_read(&c->extent_migrate_done));
 	sysfs_print(extent_migrate_raced,
 		    atomic_long_read(&c->extent_migrate_raced));
+	sysfs_print(extent_migrate_passthrough,
+		    atomic_long_read(&c->extent_migrate_passthrough));
 
 	sysfs_printf(btree_gc_periodic, "%u",	(int) c->btree_gc_periodic);
 
 	sysfs_printf(copy_gc_enabled, "%i", c->copy_gc_enabled);
+	sysfs_print(move_sort_window,		c->move_sort_window);
+	sysfs_print(data_job_shards,		c->data_job_shards);
 
 	sysfs_print(pd_controllers_update_seconds,
 		    c->pd_controllers_update_seconds);
@@ -389,6 +411,8 @@ STORE(__bch2_fs)
 
 	sysfs_strtoul(journal_write_delay_ms, c->journal.write_delay_ms);
 	sysfs_strtoul(journal_reclaim_delay_ms, c->journal.reclaim_delay_ms);
+	sysfs_strtoul_clamp(journal_max_in_flight, c->journal.max_in_flight,
+			    1, JOURNAL_BUF_NR - 1);
 
 	if (attr == &sysfs_btree_gc_periodic) {
 		ssize_t ret = strtoul_safe(buf, c->btree_gc_periodic)
@@ -398,6 +422,11 @@ STORE(__bch2_fs)
 		return ret;
 	}
 
+	sysfs_strtoul_clamp(move_sort_window, c->move_sort_window,
+			    1, MOVE_SORT_WINDOW_MAX);
+	sysfs_strtoul_clamp(data_job_shards, c->data_job_shards,
+			    0, MOVE_SHARDS_MAX);
+
 	if (attr == &sysfs_copy_gc_enabled) {
 		struct bch_dev *ca;
 		unsigned i;
@@ -496,6 +525,7 @@ struct attribute *bch2_fs_files[] = {
 
 	&sysfs_journal_write_delay_ms,
 	&sysfs_journal_reclaim_delay_ms,
+	&sysfs_journal_max_in_flight,
 
 	&sysfs_promote_whole_extents,
 
@@ -532,6 +562,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_read_realloc_races,
 	&sysfs_extent_migrate_done,
 	&sysfs_extent_migrate_raced,
+	&sysfs_extent_migrate_passthrough,
 
 	&sysfs_trigger_journal_flush,
 	&sysfs_trigger_btree_coalesce,
@@ -539,6 +570,8 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_prune_cache,
 
 	&sysfs_copy_gc_enabled,
+	&sysfs_move_sort_window,
+	&sysfs_data_job_shards,
 
 	&sysfs_rebalance_enabled,
 	&sysfs_rebalance_work,
@@ -909,6 +942,14 @@ SHOW(bch2_dev)
 		     clamp(atomic_read(&ca->congested), 0, CONGESTED_MAX)
 		     * 100 / CONGESTED_MAX);
 
+	if (attr == &sysfs_move_depth)
+		return scnprintf(buf, PAGE_SIZE,
+				 "read:\t%i/%u\nwrite:\t%i/%u\n",
+				 atomic_read(&ca->move_sectors[READ]),
+				 READ_ONCE(ca->move_depth[READ]),
+				 atomic_read(&ca->move_sectors[WRITE]),
+				 READ_ONCE(ca->move_depth[WRITE]));
+
 	if (attr == &sysfs_bucket_quantiles_last_read)
 		return show_quantiles(c, ca, buf, bucket_last_io_fn, (void *) 0);
 	if (attr == &sysfs_bucket_quantiles_last_write)
@@ -1006,6 +1047,7 @@ struct attribute *bch2_dev_files[] = {
 	&sysfs_io_latency_stats_read,
 	&sysfs_io_latency_stats_write,
 	&sysfs_congested,
+	&sysfs_move_depth,
 
 	/* alloc info - other stats: */
 	&sysfs_bucket_quantiles_last_read,
@@ -1,8 +1,16 @@
 #ifdef CONFIG_BCACHEFS_TESTS
 
 #include "bcachefs.h"
+#include "btree_cache.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
+#include "inode.h"
+#include "io.h"
+#include "journal.h"
 #include "journal_reclaim.h"
+#include "keylist.h"
+#include "move.h"
+#include "replicas.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
@@ -25,7 +33,8 @@ static void delete_test_keys(struct bch_fs *c)
 
 /* unit tests */
 
-static void test_delete(struct bch_fs *c, u64 nr)
+static void test_delete(struct bch_fs *c, u64 nr,
+			struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_i_cookie k;
@@ -54,7 +63,8 @@ static void test_delete(struct bch_fs *c, u64 nr)
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void test_delete_written(struct bch_fs *c, u64 nr)
+static void test_delete_written(struct bch_fs *c, u64 nr,
+				struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_i_cookie k;
@@ -80,7 +90,8 @@ static void test_delete_written(struct bch_fs *c, u64 nr)
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void test_iterate(struct bch_fs *c, u64 nr)
+static void test_iterate(struct bch_fs *c, u64 nr,
+			 struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -121,7 +132,8 @@ static void test_iterate(struct bch_fs *c, u64 nr)
 	BUG_ON(i);
 }
 
-static void test_iterate_extents(struct bch_fs *c, u64 nr)
+static void test_iterate_extents(struct bch_fs *c, u64 nr,
+				 struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -167,7 +179,8 @@ static void test_iterate_extents(struct bch_fs *c, u64 nr)
 	BUG_ON(i);
 }
 
-static void test_iterate_slots(struct bch_fs *c, u64 nr)
+static void test_iterate_slots(struct bch_fs *c, u64 nr,
+			       struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -216,7 +229,8 @@ static void test_iterate_slots(struct bch_fs *c, u64 nr)
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void test_iterate_slots_extents(struct bch_fs *c, u64 nr)
+static void test_iterate_slots_extents(struct bch_fs *c, u64 nr,
+				       struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -270,6 +284,145 @@ static void test_iterate_slots_extents(struct bch_fs *c, u64 nr)
 	bch2_btree_iter_unlock(&iter);
 }
 
+/* crash tests */
+
+static u64 crash_test_seq;
+
+/*
+ * A journal write that completes before the one before it, with the earlier one
+ * torn by the crash: recovery has to drop the later entry and blacklist both.
+ */
+static void test_journal_torn_write_before(struct bch_fs *c, u64 nr)
+{
+	struct journal *j = &c->journal;
+	struct bkey_i_cookie k;
+	u64 i, journal_seq;
+	int ret;
+
+	delete_test_keys(c);
+
+	for (i = 0; i < 3; i++) {
+		bkey_cookie_init(&k.k_i);
+		k.k.p.offset = i;
+
+		journal_seq = 0;
+		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
+					NULL, NULL, &journal_seq, 0);
+		BUG_ON(ret);
+
+		if (i == 1)
+			j->torn_write_seq = crash_test_seq = journal_seq;
+		if (i == 2)
+			BUG_ON(journal_seq != crash_test_seq + 1);
+
+		/* the torn write reports success, like any other: */
+		ret = bch2_journal_flush_seq(j, journal_seq);
+		BUG_ON(ret);
+
+		/*
+		 * get the first key into the btree, so the others are in a
+		 * bset the blacklist can drop:
+		 */
+		if (!i)
+			bch2_journal_flush_all_pins(j);
+	}
+}
+
+static void test_journal_torn_write_after(struct bch_fs *c, u64 nr)
+{
+	struct journal *j = &c->journal;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 i = 0;
+
+	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS(0, 0), 0, k) {
+		if (k.k->p.inode)
+			break;
+		BUG_ON(k.k->p.offset != i++);
+	}
+	bch2_btree_iter_unlock(&iter);
+
+	BUG_ON(i != 1);
+
+	/* the dropped entries' sequence numbers mustn't be reused: */
+	BUG_ON(journal_cur_seq(j) <= crash_test_seq + 1);
+
+	delete_test_keys(c);
+}
+
+/* enough keys that they don't go through the normal insert path: */
+static u64 bulk_load_replay_nr(struct bch_fs *c, u64 nr)
+{
+	return max_t(u64, nr, btree_max_u64s(c));
+}
+
+/*
+ * Bulk loaded keys aren't journalled: the deletes that emptied the range they
+ * went into mustn't be replayed over them after a crash:
+ */
+static void test_bulk_load_replay_before(struct bch_fs *c, u64 nr)
+{
+	struct keylist keys;
+	u64 i;
+	int ret;
+
+	delete_test_keys(c);
+
+	nr = bulk_load_replay_nr(c, nr);
+
+	bch2_keylist_init(&keys, NULL);
+	ret = bch2_keylist_realloc(&keys, NULL, 0,
+				   nr * sizeof(struct bkey_i_cookie) / sizeof(u64));
+	BUG_ON(ret);
+
+	for (i = 0; i < nr; i++) {
+		bkey_cookie_init(keys.top);
+		keys.top->k.p.offset = i;
+		bch2_keylist_push(&keys);
+	}
+
+	ret = bch2_btree_bulk_load(c, BTREE_ID_DIRENTS, &keys, NULL, 0);
+	BUG_ON(ret);
+
+	ret = bch2_btree_bulk_load(c, BTREE_ID_DIRENTS, &keys, NULL, 0);
+	BUG_ON(ret != -EEXIST);
+
+	/* get them into the btree, so the deletes are only in the journal: */
+	bch2_journal_flush_all_pins(&c->journal);
+
+	delete_test_keys(c);
+
+	ret = bch2_journal_flush(&c->journal);
+	BUG_ON(ret);
+
+	ret = bch2_btree_bulk_load(c, BTREE_ID_DIRENTS, &keys, NULL, 0);
+	BUG_ON(ret);
+
+	/* the new leaves have to be reachable on disk when we crash: */
+	closure_wait_event(&c->btree_interior_update_wait,
+			   !bch2_btree_interior_updates_nr_pending(c));
+
+	bch2_keylist_free(&keys, NULL);
+}
+
+static void test_bulk_load_replay_after(struct bch_fs *c, u64 nr)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 i = 0;
+
+	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS(0, 0), 0, k) {
+		if (k.k->p.inode)
+			break;
+		BUG_ON(k.k->p.offset != i++);
+	}
+	bch2_btree_iter_unlock(&iter);
+
+	BUG_ON(i != bulk_load_replay_nr(c, nr));
+
+	delete_test_keys(c);
+}
+
 /* perf tests */
 
 static u64 test_rand(void)
@@ -283,25 +436,59 @@ static u64 test_rand(void)
 	return v;
 }
 
-static void rand_insert(struct bch_fs *c, u64 nr)
+/* Record the latency of one operation, and start timing the next: */
+static inline void test_op_done(struct time_stats *lat, u64 *start)
+{
+	u64 now = local_clock();
+
+	__bch2_time_stats_update(lat, *start, now);
+	*start = now;
+}
+
+static void rand_insert(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	struct bkey_i_cookie k;
 	int ret;
-	u64 i;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++) {
+		bkey_cookie_init(&k.k_i);
+		k.k.p.offset = test_rand();
+
+		ret = bch2_btree_insert_batched(c, BTREE_ID_DIRENTS, &k.k_i,
+						NULL, 0);
+		BUG_ON(ret);
+
+		test_op_done(lat, &start);
+	}
+}
+
+/* Each insert is flushed before the next, like a metadata update and fsync: */
+static void rand_insert_fsync(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	struct bkey_i_cookie k;
+	u64 i, journal_seq, start = local_clock();
+	int ret;
 
 	for (i = 0; i < nr; i++) {
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = test_rand();
 
+		journal_seq = 0;
 		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
-					NULL, NULL, NULL, 0);
+					NULL, NULL, &journal_seq, 0);
+		BUG_ON(ret);
+
+		ret = bch2_journal_flush_seq(&c->journal, journal_seq);
 		BUG_ON(ret);
+
+		test_op_done(lat, &start);
 	}
 }
 
-static void rand_lookup(struct bch_fs *c, u64 nr)
+static void rand_lookup(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		struct btree_iter iter;
@@ -312,13 +499,15 @@ static void rand_lookup(struct bch_fs *c, u64 nr)
 
 		k = bch2_btree_iter_peek(&iter);
 		bch2_btree_iter_unlock(&iter);
+
+		test_op_done(lat, &start);
 	}
 }
 
-static void rand_mixed(struct bch_fs *c, u64 nr)
+static void rand_mixed(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	int ret;
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		struct btree_iter iter;
@@ -341,15 +530,17 @@ static void rand_mixed(struct bch_fs *c, u64 nr)
 		}
 
 		bch2_btree_iter_unlock(&iter);
+
+		test_op_done(lat, &start);
 	}
 
 }
 
-static void rand_delete(struct bch_fs *c, u64 nr)
+static void rand_delete(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	struct bkey_i k;
 	int ret;
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		bkey_init(&k.k);
@@ -358,16 +549,18 @@ static void rand_delete(struct bch_fs *c, u64 nr)
 		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k,
 					NULL, NULL, NULL, 0);
 		BUG_ON(ret);
+
+		test_op_done(lat, &start);
 	}
 }
 
-static void seq_insert(struct bch_fs *c, u64 nr)
+static void seq_insert(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bkey_i_cookie insert;
 	int ret;
-	u64 i = 0;
+	u64 i = 0, start = local_clock();
 
 	bkey_cookie_init(&insert.k_i);
 
@@ -379,27 +572,66 @@ static void seq_insert(struct bch_fs *c, u64 nr)
 				BTREE_INSERT_ENTRY(&iter, &insert.k_i));
 		BUG_ON(ret);
 
+		test_op_done(lat, &start);
+
 		if (++i == nr)
 			break;
 	}
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void seq_lookup(struct bch_fs *c, u64 nr)
+/*
+ * Same keys as seq_insert, loaded 64k at a time - one latency sample per batch.
+ * Single threaded only:
+ */
+static void seq_bulk_load(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	struct keylist keys;
+	struct bkey_i_cookie *k;
+	u64 i = 0, batch_end, start = local_clock();
+	int ret;
+
+	bch2_keylist_init(&keys, NULL);
+	ret = bch2_keylist_realloc(&keys, NULL, 0,
+				   (1 << 16) * sizeof(*k) / sizeof(u64));
+	BUG_ON(ret);
+
+	while (i < nr) {
+		batch_end = min(nr, i + (1 << 16));
+		keys.top = keys.keys;
+
+		for (; i < batch_end; i++) {
+			k = bkey_cookie_init(keys.top);
+			k->k.p = POS(0, i);
+			bch2_keylist_push(&keys);
+		}
+
+		ret = bch2_btree_bulk_load(c, BTREE_ID_DIRENTS, &keys, NULL, 0);
+		BUG_ON(ret);
+
+		test_op_done(lat, &start);
+	}
+
+	bch2_keylist_free(&keys, NULL);
+}
+
+static void seq_lookup(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
+	u64 start = local_clock();
 
 	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS_MIN, 0, k)
-		;
+		test_op_done(lat, &start);
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void seq_overwrite(struct bch_fs *c, u64 nr)
+static void seq_overwrite(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret;
+	u64 start = local_clock();
 
 	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS_MIN,
 			   BTREE_ITER_INTENT, k) {
@@ -410,21 +642,279 @@ static void seq_overwrite(struct bch_fs *c, u64 nr)
 		ret = bch2_btree_insert_at(c, NULL, NULL, NULL, 0,
 					   BTREE_INSERT_ENTRY(&iter, &u.k_i));
 		BUG_ON(ret);
+
+		test_op_done(lat, &start);
 	}
 	bch2_btree_iter_unlock(&iter);
 }
 
-static void seq_delete(struct bch_fs *c, u64 nr)
+static void seq_delete(struct bch_fs *c, u64 nr, struct time_stats *lat)
 {
 	int ret;
+	u64 start = local_clock();
 
 	ret = bch2_btree_delete_range(c, BTREE_ID_DIRENTS,
 				      POS(0, 0), POS(0, U64_MAX),
 				      ZERO_VERSION, NULL, NULL, NULL);
 	BUG_ON(ret);
+
+	test_op_done(lat, &start);
 }
 
-typedef void (*perf_test_fn)(struct bch_fs *, u64);
+static void inode_create(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	struct bch_inode_unpacked inode_u;
+	int ret;
+	u64 i, start = local_clock();
+
+	for (i = 0; i < nr; i++) {
+		bch2_inode_init(c, &inode_u, 0, 0, S_IFREG|S_IRUGO, 0, NULL);
+
+		ret = bch2_inode_create(c, &inode_u, BLOCKDEV_INODE_MAX, 0,
+					&c->unused_inode_hint);
+		BUG_ON(ret);
+
+		test_op_done(lat, &start);
+	}
+}
+
+/*
+ * Deletes every other inode, so that inode_create has holes to fill - single
+ * threaded only:
+ */
+static void inode_rm_alternate(struct bch_fs *c, u64 nr,
+			       struct time_stats *lat)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	u64 inum, i = 0, pos = BLOCKDEV_INODE_MAX, start = local_clock();
+	int ret;
+
+	while (i < nr) {
+		inum = 0;
+
+		for_each_btree_key(&iter, c, BTREE_ID_INODES, POS(pos, 0), 0, k)
+			if (k.k->type == BCH_INODE_FS) {
+				inum = k.k->p.inode;
+				break;
+			}
+		bch2_btree_iter_unlock(&iter);
+
+		if (!inum)
+			break;
+
+		ret = bch2_inode_rm(c, inum);
+		BUG_ON(ret);
+
+		test_op_done(lat, &start);
+
+		/* skip one: */
+		pos = inum + 2;
+		i++;
+	}
+}
+
+/*
+ * Data tests: rand_write_data writes 4k extents at random offsets, so that key
+ * order and on disk order don't match - data_rewrite then moves all of them,
+ * like copygc or evacuate, and deletes them:
+ */
+
+#define TEST_DATA_SECTORS	PAGE_SECTORS
+
+static char test_data_buf[PAGE_SIZE] __aligned(PAGE_SIZE);
+
+static void rand_write_data(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	struct {
+		struct bch_write_op	op;
+		struct bio_vec		bv[1];
+	} o;
+	struct closure cl;
+	u64 i, start = local_clock();
+	int ret;
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr; i++) {
+		bio_init(&o.op.wbio.bio, o.bv, ARRAY_SIZE(o.bv));
+		o.op.wbio.bio.bi_iter.bi_size = sizeof(test_data_buf);
+		bch2_bio_map(&o.op.wbio.bio, test_data_buf);
+
+		bch2_write_op_init(&o.op, c, bch2_opts_to_inode_opts(c->opts));
+		o.op.write_point	= writepoint_hashed(0);
+		o.op.nr_replicas	= 1;
+		o.op.pos		= POS(0, (test_rand() % nr) *
+					      TEST_DATA_SECTORS);
+
+		ret = bch2_disk_reservation_get(c, &o.op.res,
+						TEST_DATA_SECTORS,
+						c->opts.data_replicas, 0);
+		if (ret == -ENOSPC)
+			break;
+		BUG_ON(ret);
+
+		closure_call(&o.op.cl, bch2_write, NULL, &cl);
+		closure_sync(&cl);
+		BUG_ON(o.op.error);
+
+		test_op_done(lat, &start);
+	}
+}
+
+#define TEST_LARGE_BYTES	(4 << 20)
+
+static void test_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+/*
+ * A single write big enough to be split into many extents, read back - the
+ * write path has to grow its keylist past the inline keys:
+ */
+static void test_write_read_large(struct bch_fs *c, u64 nr,
+				  struct time_stats *lat)
+{
+	unsigned nr_vecs = TEST_LARGE_BYTES / PAGE_SIZE;
+	struct {
+		struct bch_write_op	op;
+		struct bio_vec		bv[0];
+	} *o;
+	struct bio *bio;
+	struct closure cl;
+	u64 *src, *dst;
+	size_t i;
+	int ret;
+
+	delete_test_keys(c);
+
+	src = kvpmalloc(TEST_LARGE_BYTES, GFP_KERNEL);
+	dst = kvpmalloc(TEST_LARGE_BYTES, GFP_KERNEL);
+	o = kzalloc(sizeof(*o) + nr_vecs * sizeof(struct bio_vec), GFP_KERNEL);
+	BUG_ON(!src || !dst || !o);
+
+	for (i = 0; i < TEST_LARGE_BYTES / sizeof(u64); i++)
+		src[i] = i;
+
+	closure_init_stack(&cl);
+
+	pr_info("writing");
+
+	bio_init(&o->op.wbio.bio, o->bv, nr_vecs);
+	o->op.wbio.bio.bi_iter.bi_size = TEST_LARGE_BYTES;
+	bch2_bio_map(&o->op.wbio.bio, src);
+
+	bch2_write_op_init(&o->op, c, bch2_opts_to_inode_opts(c->opts));
+	o->op.write_point	= writepoint_hashed(0);
+	o->op.nr_replicas	= 1;
+	o->op.pos		= POS(0, 0);
+
+	ret = bch2_disk_reservation_get(c, &o->op.res,
+					TEST_LARGE_BYTES >> 9,
+					c->opts.data_replicas, 0);
+	BUG_ON(ret);
+
+	closure_call(&o->op.cl, bch2_write, NULL, &cl);
+	closure_sync(&cl);
+	BUG_ON(o->op.error);
+
+	pr_info("reading back");
+
+	bio = bio_alloc_bioset(GFP_KERNEL, nr_vecs, &c->bio_read);
+	bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
+	bio->bi_iter.bi_sector	= 0;
+	bio->bi_iter.bi_size	= TEST_LARGE_BYTES;
+	bio->bi_end_io		= test_read_endio;
+	bio->bi_private		= &cl;
+	bch2_bio_map(bio, dst);
+
+	closure_get(&cl);
+	bch2_read(c, rbio_init(bio, bch2_opts_to_inode_opts(c->opts)), 0);
+	closure_sync(&cl);
+	BUG_ON(bio->bi_status);
+	bio_put(bio);
+
+	BUG_ON(memcmp(src, dst, TEST_LARGE_BYTES));
+
+	kfree(o);
+	kvpfree(dst, TEST_LARGE_BYTES);
+	kvpfree(src, TEST_LARGE_BYTES);
+
+	delete_test_keys(c);
+}
+
+static enum data_cmd rewrite_pred(struct bch_fs *c, void *arg,
+				  enum bkey_type type,
+				  struct bkey_s_c_extent e,
+				  struct bch_io_opts *io_opts,
+				  struct data_opts *data_opts)
+{
+	const struct bch_extent_ptr *ptr;
+
+	extent_for_each_ptr(e, ptr) {
+		data_opts->target		= 0;
+		data_opts->rewrite_dev		= ptr->dev;
+		data_opts->btree_insert_flags	= 0;
+		return DATA_REWRITE;
+	}
+
+	return DATA_SKIP;
+}
+
+/* One op - the whole move: */
+static void __data_rewrite(struct bch_fs *c, struct time_stats *lat,
+			   unsigned nr_shards)
+{
+	struct bch_move_stats stats;
+	u64 start = local_clock();
+	int ret;
+
+	memset(&stats, 0, sizeof(stats));
+
+	ret = bch2_move_data_sharded(c, POS_MIN, POS_MAX,
+				     rewrite_pred, NULL, &stats, nr_shards);
+	BUG_ON(ret);
+
+	test_op_done(lat, &start);
+
+	pr_info("moved %llu extents (%llu passthrough): %llu read seeks (%llu sectors), %llu windows",
+		(u64) atomic64_read(&stats.keys_moved),
+		(u64) atomic64_read(&stats.keys_passthrough),
+		(u64) atomic64_read(&stats.read_seeks),
+		(u64) atomic64_read(&stats.read_seek_sectors),
+		(u64) atomic64_read(&stats.windows));
+
+	delete_test_keys(c);
+}
+
+static void data_rewrite(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	__data_rewrite(c, lat, 1);
+}
+
+static void data_rewrite_sharded(struct bch_fs *c, u64 nr,
+				 struct time_stats *lat)
+{
+	__data_rewrite(c, lat, 4);
+}
+
+/* the already marked case, that every write hits: */
+static void replicas_marked(struct bch_fs *c, u64 nr, struct time_stats *lat)
+{
+	struct bch_devs_list devs = bch2_dev_list_single(0);
+	u64 i, start = local_clock();
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = bch2_mark_replicas(c, BCH_DATA_USER, devs);
+		BUG_ON(ret);
+
+		test_op_done(lat, &start);
+	}
+}
+
+typedef void (*perf_test_fn)(struct bch_fs *, u64, struct time_stats *);
 
 struct test_job {
 	struct bch_fs			*c;
@@ -432,6 +922,9 @@ struct test_job {
 	unsigned			nr_threads;
 	perf_test_fn			fn;
 
+	/* per thread, so that threads don't contend on the lock: */
+	struct time_stats		*lat;
+
 	atomic_t			ready;
 	wait_queue_head_t		ready_wait;
 
@@ -445,15 +938,16 @@ struct test_job {
 static int btree_perf_test_thread(void *data)
 {
 	struct test_job *j = data;
+	unsigned idx = atomic_dec_return(&j->ready);
 
-	if (atomic_dec_and_test(&j->ready)) {
+	if (!idx) {
 		wake_up(&j->ready_wait);
 		j->start = sched_clock();
 	} else {
 		wait_event(j->ready_wait, !atomic_read(&j->ready));
 	}
 
-	j->fn(j->c, j->nr / j->nr_threads);
+	j->fn(j->c, j->nr / j->nr_threads, &j->lat[idx]);
 
 	if (atomic_dec_and_test(&j->done)) {
 		j->finish = sched_clock();
@@ -463,13 +957,21 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			  u64 nr, unsigned nr_threads)
+/*
+ * Runs @testname with @nr_threads threads, each doing @nr / @nr_threads
+ * iterations; the per operation latencies of all threads are summed into
+ * @r->latency:
+ */
+int __bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			   u64 nr, unsigned nr_threads,
+			   struct btree_perf_test_result *r)
 {
 	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20], nr_buf[20], per_sec_buf[20];
 	unsigned i;
-	u64 time;
+	int ret = 0;
+
+	if (!nr_threads)
+		return -EINVAL;
 
 	atomic_set(&j.ready, nr_threads);
 	init_waitqueue_head(&j.ready_wait);
@@ -481,15 +983,25 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	if (!strcmp(testname, #_test)) j.fn = _test
 
 	perf_test(rand_insert);
+	perf_test(rand_insert_fsync);
 	perf_test(rand_lookup);
 	perf_test(rand_mixed);
 	perf_test(rand_delete);
 
 	perf_test(seq_insert);
+	perf_test(seq_bulk_load);
 	perf_test(seq_lookup);
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(inode_create);
+	perf_test(inode_rm_alternate);
+
+	perf_test(rand_write_data);
+	perf_test(data_rewrite);
+	perf_test(data_rewrite_sharded);
+	perf_test(replicas_marked);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -497,10 +1009,19 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(test_iterate_extents);
 	perf_test(test_iterate_slots);
 	perf_test(test_iterate_slots_extents);
+	perf_test(test_write_read_large);
 
-	if (!j.fn) {
-		pr_err("unknown test %s", testname);
-		return;
+	if (!j.fn)
+		return -EINVAL;
+
+	j.lat = kcalloc(nr_threads, sizeof(j.lat[0]), GFP_KERNEL);
+	if (!j.lat)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = bch2_time_stats_init(&j.lat[i]);
+		if (ret)
+			goto out;
 	}
 
 	//pr_info("running test %s:", testname);
@@ -515,16 +1036,79 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	while (wait_for_completion_interruptible(&j.done_completion))
 		;
 
-	time = j.finish - j.start;
+	memset(r, 0, sizeof(*r));
+	r->nr		= nr;
+	r->nr_threads	= nr_threads;
+	r->duration	= j.finish - j.start;
+
+	for (i = 0; i < nr_threads; i++)
+		bch2_time_stats_hist_read(&j.lat[i], &r->latency);
+out:
+	for (i = 0; i < nr_threads; i++)
+		bch2_time_stats_exit(&j.lat[i]);
+	kfree(j.lat);
+	return ret;
+}
+
+/*
+ * Crash tests run in two phases: the caller crashes the filesystem after
+ * BTREE_CRASH_TEST_BEFORE - stops it without writing anything more - and runs
+ * BTREE_CRASH_TEST_AFTER after recovery, on the remounted filesystem:
+ */
+int bch2_btree_crash_test(struct bch_fs *c, const char *testname, u64 nr,
+			  enum btree_crash_test_phase phase)
+{
+	void (*fn[2])(struct bch_fs *, u64) = { NULL };
+
+#define crash_test(_test)						\
+	if (!strcmp(testname, #_test)) {				\
+		fn[BTREE_CRASH_TEST_BEFORE]	= _test##_before;	\
+		fn[BTREE_CRASH_TEST_AFTER]	= _test##_after;	\
+	}
+
+	crash_test(test_journal_torn_write);
+	crash_test(test_bulk_load_replay);
+
+	if (!fn[phase])
+		return -EINVAL;
+
+	fn[phase](c, nr);
+	return 0;
+}
+
+void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			  u64 nr, unsigned nr_threads)
+{
+	struct btree_perf_test_result *r;
+	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	u64 time;
+	int ret;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return;
+
+	ret = __bch2_btree_perf_test(c, testname, nr, nr_threads, r);
+	if (ret) {
+		if (ret == -EINVAL)
+			pr_err("unknown test %s", testname);
+		goto out;
+	}
+
+	time = max_t(u64, r->duration, 1);
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
 	bch2_hprint(nr_buf, nr);
 	bch2_hprint(per_sec_buf, nr * NSEC_PER_SEC / time);
-	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
+	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec, p50 %llu p99 %llu nsec\n",
 		name_buf, nr_buf, nr_threads,
 		time / NSEC_PER_SEC,
 		time * nr_threads / nr,
-		per_sec_buf);
+		per_sec_buf,
+		bch2_time_stats_hist_quantile(&r->latency, 50, 100),
+		bch2_time_stats_hist_quantile(&r->latency, 99, 100));
+out:
+	kfree(r);
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
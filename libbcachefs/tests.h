@@ -5,8 +5,29 @@ struct bch_fs;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
+#include "util.h"
+
+struct btree_perf_test_result {
+	u64			nr;
+	unsigned		nr_threads;
+	/* wall clock time, in nanoseconds: */
+	u64			duration;
+	/* per operation latency, summed over all threads: */
+	struct time_stats_hist	latency;
+};
+
+int __bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			   struct btree_perf_test_result *);
 void bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
 
+enum btree_crash_test_phase {
+	BTREE_CRASH_TEST_BEFORE,
+	BTREE_CRASH_TEST_AFTER,
+};
+
+int bch2_btree_crash_test(struct bch_fs *, const char *, u64,
+			  enum btree_crash_test_phase);
+
 #else
 
 #endif /* CONFIG_BCACHEFS_TESTS */
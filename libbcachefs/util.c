@@ -7,6 +7,7 @@
 
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/cpumask.h>
 #include <linux/ctype.h>
 #include <linux/debugfs.h>
 #include <linux/freezer.h>
@@ -202,37 +203,137 @@ bool bch2_is_zero(const void *_p, size_t n)
 	return true;
 }
 
-static void bch2_quantiles_update(struct quantiles *q, u64 v)
+/* time stats: */
+
+static inline unsigned time_stats_hist_idx(u64 v)
 {
-	unsigned i = 0;
+	unsigned shift;
 
-	while (i < ARRAY_SIZE(q->entries)) {
-		struct quantile_entry *e = q->entries + i;
+	if (v < (1ULL << TIME_STATS_HIST_SUB_BITS))
+		return v;
 
-		if (unlikely(!e->step)) {
-			e->m = v;
-			e->step = max_t(unsigned, v / 2, 1024);
-		} else if (e->m > v) {
-			e->m = e->m >= e->step
-				? e->m - e->step
-				: 0;
-		} else if (e->m < v) {
-			e->m = e->m + e->step > e->m
-				? e->m + e->step
-				: U32_MAX;
-		}
+	if (v >= (1ULL << TIME_STATS_HIST_MAX_SHIFT))
+		return TIME_STATS_HIST_NR - 1;
+
+	shift = fls64(v) - 1 - TIME_STATS_HIST_SUB_BITS;
+
+	return ((shift + 1) << TIME_STATS_HIST_SUB_BITS) +
+		((v >> shift) & ~(~0U << TIME_STATS_HIST_SUB_BITS));
+}
+
+/* Largest value that maps to bucket @idx: */
+static inline u64 time_stats_hist_bucket_max(unsigned idx)
+{
+	unsigned shift = idx >> TIME_STATS_HIST_SUB_BITS;
+	u64 sub = idx & ~(~0U << TIME_STATS_HIST_SUB_BITS);
+
+	if (!shift)
+		return idx;
+
+	shift--;
+	return (((1ULL << TIME_STATS_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/*
+ * Sums the per cpu histograms of @stats into @hist - callers may pass the
+ * same @hist for several time_stats (e.g. all devices) to merge them:
+ */
+void bch2_time_stats_hist_read(struct time_stats *stats,
+			       struct time_stats_hist *hist)
+{
+	struct time_stats_hist __percpu *pcpu = smp_load_acquire(&stats->hist);
+	int cpu;
+	unsigned i;
+
+	if (!pcpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct time_stats_hist *h = per_cpu_ptr(pcpu, cpu);
+
+		for (i = 0; i < TIME_STATS_HIST_NR; i++)
+			hist->buckets[i] += READ_ONCE(h->buckets[i]);
+	}
+}
+
+/*
+ * Returns the upper bound of the bucket containing the @num/@den quantile, or
+ * 0 if the histogram is empty:
+ */
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *hist,
+				  unsigned num, unsigned den)
+{
+	u64 nr = 0, target, seen = 0;
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		nr += hist->buckets[i];
+
+	if (!nr)
+		return 0;
 
-		if ((e->m > v ? e->m - v : v - e->m) < e->step)
-			e->step = max_t(unsigned, e->step / 2, 1);
+	target = div_u64(nr * num + den - 1, den) ?: 1;
 
-		if (v >= e->m)
+	for (i = 0; i < TIME_STATS_HIST_NR; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
 			break;
+	}
+
+	return time_stats_hist_bucket_max(min_t(unsigned, i,
+						TIME_STATS_HIST_NR - 1));
+}
+
+/*
+ * Summing the per cpu histograms isn't cheap, so it's not done under
+ * stats->lock, and if another update is already doing it we skip it:
+ */
+static void bch2_time_stats_update_quantiles(struct time_stats *stats)
+{
+	struct time_stats_hist *hist;
 
-		i = eytzinger0_child(i, v > e->m);
+	if (!smp_load_acquire(&stats->hist) ||
+	    READ_ONCE(stats->count) - READ_ONCE(stats->quantiles_count) <
+	    TIME_STATS_QUANTILES_UPDATE ||
+	    !spin_trylock(&stats->quantiles_lock))
+		return;
+
+	if (READ_ONCE(stats->count) - stats->quantiles_count >=
+	    TIME_STATS_QUANTILES_UPDATE) {
+		stats->quantiles_count = READ_ONCE(stats->count);
+
+		hist = stats->quantiles_hist;
+		memset(hist, 0, sizeof(*hist));
+		bch2_time_stats_hist_read(stats, hist);
+		WRITE_ONCE(stats->p50, bch2_time_stats_hist_quantile(hist, 50, 100));
+		WRITE_ONCE(stats->p99, bch2_time_stats_hist_quantile(hist, 99, 100));
 	}
+
+	spin_unlock(&stats->quantiles_lock);
 }
 
-/* time stats: */
+/*
+ * The histograms are most of the size of a time_stats, and most time_stats
+ * never see an event - so they're allocated on the first one. Called with
+ * stats->lock held:
+ */
+static void bch2_time_stats_hist_alloc(struct time_stats *stats)
+{
+	struct time_stats_hist __percpu *hist;
+
+	if (stats->hist)
+		return;
+
+	if (!stats->quantiles_hist)
+		stats->quantiles_hist = kzalloc(sizeof(*stats->quantiles_hist),
+						GFP_ATOMIC);
+	if (!stats->quantiles_hist)
+		return;
+
+	hist = alloc_percpu_gfp(struct time_stats_hist, GFP_ATOMIC);
+	if (hist)
+		smp_store_release(&stats->hist, hist);
+}
 
 static void bch2_time_stats_update_one(struct time_stats *stats,
 				       u64 start, u64 end)
@@ -257,17 +358,17 @@ static void bch2_time_stats_update_one(struct time_stats *stats,
 	stats->max_duration = max(stats->max_duration, duration);
 
 	stats->last_event = end;
-
-	bch2_quantiles_update(&stats->quantiles, duration);
 }
 
 void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 {
+	struct time_stats_hist __percpu *hist;
 	unsigned long flags;
 
 	if (!stats->buffer) {
 		spin_lock_irqsave(&stats->lock, flags);
 		bch2_time_stats_update_one(stats, start, end);
+		bch2_time_stats_hist_alloc(stats);
 
 		if (stats->average_frequency < 32 &&
 		    stats->count > 1024)
@@ -294,6 +395,7 @@ void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 			     i < b->entries + ARRAY_SIZE(b->entries);
 			     i++)
 				bch2_time_stats_update_one(stats, i->start, i->end);
+			bch2_time_stats_hist_alloc(stats);
 			spin_unlock_irqrestore(&stats->lock, flags);
 
 			b->nr = 0;
@@ -301,6 +403,14 @@ void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 
 		preempt_enable();
 	}
+
+	/* The histogram is per cpu, and always updated without the lock: */
+	hist = smp_load_acquire(&stats->hist);
+	if (hist)
+		this_cpu_inc(hist->buckets[time_stats_hist_idx(
+				time_after64(end, start) ? end - start : 0)]);
+
+	bch2_time_stats_update_quantiles(stats);
 }
 
 static const struct time_unit {
@@ -335,11 +445,19 @@ static size_t pr_time_units(char *buf, size_t len, u64 ns)
 
 size_t bch2_time_stats_print(struct time_stats *stats, char *buf, size_t len)
 {
+	static const struct {
+		const char	*name;
+		unsigned	num, den;
+	} quantiles[] = {
+		{ "p50",	50,	100	},
+		{ "p90",	90,	100	},
+		{ "p99",	99,	100	},
+		{ "p999",	999,	1000	},
+	};
 	char *out = buf, *end = buf + len;
-	const struct time_unit *u;
 	u64 freq = READ_ONCE(stats->average_frequency);
-	u64 q, last_q = 0;
-	int i;
+	struct time_stats_hist *hist;
+	unsigned i;
 
 	out += scnprintf(out, end - out, "count:\t\t%llu\n",
 			 stats->count);
@@ -354,33 +472,40 @@ size_t bch2_time_stats_print(struct time_stats *stats, char *buf, size_t len)
 
 	out += scnprintf(out, end - out, "\nmax duration:\t");
 	out += pr_time_units(out, end - out, stats->max_duration);
+	out += scnprintf(out, end - out, "\n");
 
-	i = eytzinger0_first(NR_QUANTILES);
-	u = pick_time_units(stats->quantiles.entries[i].m);
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return out - buf;
 
-	out += scnprintf(out, end - out, "\nquantiles (%s):\t", u->name);
-	eytzinger0_for_each(i, NR_QUANTILES) {
-		bool is_last = eytzinger0_next(i, NR_QUANTILES) == -1;
+	bch2_time_stats_hist_read(stats, hist);
 
-		q = max(stats->quantiles.entries[i].m, last_q);
-		out += scnprintf(out, end - out, "%llu%s",
-				 div_u64(q, u->nsecs),
-				 is_last ? "\n" : " ");
-		last_q = q;
+	for (i = 0; i < ARRAY_SIZE(quantiles); i++) {
+		out += scnprintf(out, end - out, "%s:\t\t", quantiles[i].name);
+		out += pr_time_units(out, end - out,
+			bch2_time_stats_hist_quantile(hist,
+					quantiles[i].num, quantiles[i].den));
+		out += scnprintf(out, end - out, "\n");
 	}
 
+	kfree(hist);
+
 	return out - buf;
 }
 
 void bch2_time_stats_exit(struct time_stats *stats)
 {
+	kfree(stats->quantiles_hist);
 	free_percpu(stats->buffer);
+	free_percpu(stats->hist);
 }
 
-void bch2_time_stats_init(struct time_stats *stats)
+int bch2_time_stats_init(struct time_stats *stats)
 {
 	memset(stats, 0, sizeof(*stats));
 	spin_lock_init(&stats->lock);
+	spin_lock_init(&stats->quantiles_lock);
+	return 0;
 }
 
 /* ratelimit: */
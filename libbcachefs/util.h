@@ -311,18 +311,26 @@ ssize_t bch2_scnprint_string_list(char *, size_t, const char * const[], size_t);
 ssize_t bch2_scnprint_flag_list(char *, size_t, const char * const[], u64);
 u64 bch2_read_flag_list(char *, const char * const[]);
 
-#define NR_QUANTILES	15
-#define QUANTILE_IDX(i)	inorder_to_eytzinger0(i, NR_QUANTILES)
-#define QUANTILE_FIRST	eytzinger0_first(NR_QUANTILES)
-#define QUANTILE_LAST	eytzinger0_last(NR_QUANTILES)
-
-struct quantiles {
-	struct quantile_entry {
-		u64	m;
-		u64	step;
-	}		entries[NR_QUANTILES];
+/*
+ * Log-linear latency histogram: durations below 1 << TIME_STATS_HIST_SUB_BITS
+ * nanoseconds get a bucket each, above that every power of two is split into
+ * 1 << TIME_STATS_HIST_SUB_BITS linear buckets - so the relative error of a
+ * bucket is at most 1 / (1 << TIME_STATS_HIST_SUB_BITS). Durations of
+ * 1 << TIME_STATS_HIST_MAX_SHIFT or more all land in the last bucket.
+ */
+#define TIME_STATS_HIST_SUB_BITS	3
+#define TIME_STATS_HIST_MAX_SHIFT	40
+#define TIME_STATS_HIST_NR					\
+	((TIME_STATS_HIST_MAX_SHIFT - TIME_STATS_HIST_SUB_BITS + 1) <<	\
+	 TIME_STATS_HIST_SUB_BITS)
+
+struct time_stats_hist {
+	u64		buckets[TIME_STATS_HIST_NR];
 };
 
+/* Cached quantiles are recomputed from the histogram this often: */
+#define TIME_STATS_QUANTILES_UPDATE	1024
+
 struct time_stat_buffer {
 	unsigned	nr;
 	struct time_stat_buffer_entry {
@@ -339,8 +347,17 @@ struct time_stats {
 	u64		average_frequency;
 	u64		max_duration;
 	u64		last_event;
-	struct quantiles quantiles;
 
+	/* updated every TIME_STATS_QUANTILES_UPDATE events: */
+	u64		quantiles_count;
+	u64		p50;
+	u64		p99;
+	spinlock_t	quantiles_lock;
+	/* for summing the per cpu histograms into: */
+	struct time_stats_hist *quantiles_hist;
+
+	/* allocated on the first event: */
+	struct time_stats_hist __percpu *hist;
 	struct time_stat_buffer __percpu *buffer;
 };
 
@@ -351,10 +368,14 @@ static inline void bch2_time_stats_update(struct time_stats *stats, u64 start)
 	__bch2_time_stats_update(stats, start, local_clock());
 }
 
+void bch2_time_stats_hist_read(struct time_stats *, struct time_stats_hist *);
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *,
+				  unsigned, unsigned);
+
 size_t bch2_time_stats_print(struct time_stats *, char *, size_t);
 
 void bch2_time_stats_exit(struct time_stats *);
-void bch2_time_stats_init(struct time_stats *);
+int bch2_time_stats_init(struct time_stats *);
 
 #define ewma_add(ewma, val, weight)					\
 ({									\
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include <libaio.h>
+#include <linux/blkzoned.h>
 
 #include <linux/bio.h>
 #include <linux/blkdev.h>
@@ -20,6 +21,105 @@
 
 static io_context_t aio_ctx;
 
+/*
+ * Zoned devices: real ones (SMR, ZNS, null_blk) enforce sequential writes
+ * themselves; for a regular file standing in for one (see zoned_file_params()
+ * in tools-util.c), we track write pointers here.
+ *
+ * Write pointers aren't persisted, so sequential zones start out full: a zone
+ * has to be reset before it's written to, same as with a real device whose
+ * zones were last written by someone else.
+ */
+
+#define ZONE_WP_CONVENTIONAL	((sector_t) ~0ULL)
+
+static bool zoned_file_write(struct block_device *bdev,
+			     sector_t sector, unsigned sectors)
+{
+	sector_t zone = sector / bdev->bd_zone_sectors;
+	sector_t wp;
+
+	if (zone >= bdev->bd_nr_zones)
+		return false;
+
+	do {
+		wp = READ_ONCE(bdev->bd_zone_wp[zone]);
+		if (wp == ZONE_WP_CONVENTIONAL)
+			return true;
+
+		if (sector != wp ||
+		    sector + sectors > (zone + 1) * bdev->bd_zone_sectors) {
+			fprintf(stderr, "%s: unaligned write to zone %llu "
+				"(sector %llu, %u sectors, write pointer %llu)\n",
+				bdev->name, zone, sector, sectors, wp);
+			return false;
+		}
+	} while (cmpxchg(&bdev->bd_zone_wp[zone], wp, wp + sectors) != wp);
+
+	return true;
+}
+
+static void zoned_file_init(struct block_device *bdev)
+{
+	sector_t zone;
+
+	bdev->bd_nr_zones = get_capacity(bdev->bd_disk) / bdev->bd_zone_sectors;
+	bdev->bd_zone_wp = calloc(bdev->bd_nr_zones, sizeof(sector_t));
+	BUG_ON(!bdev->bd_zone_wp);
+
+	for (zone = 0; zone < bdev->bd_nr_zones; zone++)
+		bdev->bd_zone_wp[zone] =
+			zone_is_conventional(bdev->name, bdev->bd_fd,
+					     zone * bdev->bd_zone_sectors)
+			? ZONE_WP_CONVENTIONAL
+			: (zone + 1) * bdev->bd_zone_sectors;
+}
+
+int blkdev_reset_zones(struct block_device *bdev,
+		       sector_t sector, sector_t nr_sectors,
+		       gfp_t gfp_mask)
+{
+	sector_t zone;
+
+	if (!bdev_is_zoned(bdev))
+		return -EOPNOTSUPP;
+
+	if ((sector | nr_sectors) & (bdev->bd_zone_sectors - 1))
+		return -EINVAL;
+
+	if (!bdev->bd_zone_wp) {
+		struct blk_zone_range range = {
+			.sector		= sector,
+			.nr_sectors	= nr_sectors,
+		};
+
+		return ioctl(bdev->bd_fd, BLKRESETZONE, &range) ? -errno : 0;
+	}
+
+	for (zone = sector / bdev->bd_zone_sectors;
+	     zone < (sector + nr_sectors) / bdev->bd_zone_sectors;
+	     zone++) {
+		if (zone >= bdev->bd_nr_zones)
+			return -EINVAL;
+
+		/* Conventional zones are skipped, as with BLKRESETZONE: */
+		if (bdev->bd_zone_wp[zone] == ZONE_WP_CONVENTIONAL)
+			continue;
+
+		/* Reads past the write pointer return zeroes: */
+		if (fallocate(bdev->bd_fd,
+			      FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			      (zone * bdev->bd_zone_sectors) << 9,
+			      (sector_t) bdev->bd_zone_sectors << 9))
+			return -errno;
+
+		WRITE_ONCE(bdev->bd_zone_wp[zone],
+			   zone * bdev->bd_zone_sectors);
+	}
+
+	return 0;
+}
+
 void generic_make_request(struct bio *bio)
 {
 	struct iovec *iov;
@@ -70,6 +170,14 @@ void generic_make_request(struct bio *bio)
 			die("io_submit err: %s", strerror(-ret));
 		break;
 	case REQ_OP_WRITE:
+		if (bio->bi_bdev->bd_zone_wp &&
+		    !zoned_file_write(bio->bi_bdev, bio->bi_iter.bi_sector,
+				      bio_sectors(bio))) {
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			return;
+		}
+
 		iocb.aio_lio_opcode	= IO_CMD_PWRITEV;
 		iocb.u.v.vec		= iov;
 		iocb.u.v.nr		= i;
@@ -159,6 +267,7 @@ void blkdev_put(struct block_device *bdev, fmode_t mode)
 	fdatasync(bdev->bd_fd);
 	close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
+	free(bdev->bd_zone_wp);
 	free(bdev);
 }
 
@@ -205,6 +314,11 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->bd_bdi		= &bdev->__bd_bdi;
 	bdev->queue.backing_dev_info = bdev->bd_bdi;
 
+	bdev->bd_zone_sectors	= get_zone_sectors(path, fd);
+	if (bdev->bd_zone_sectors &&
+	    S_ISREG(xfstat(fd).st_mode))
+		zoned_file_init(bdev);
+
 	return bdev;
 }
 
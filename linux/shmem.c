@@ -0,0 +1,82 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/err.h>
+#include <linux/shmem_fs.h>
+#include <linux/slab.h>
+
+/*
+ * shmem files are backed by an unlinked file in $TMPDIR, so that they can be
+ * larger than memory:
+ */
+struct file *shmem_file_setup(const char *name, loff_t size, unsigned long flags)
+{
+	const char *dir = getenv("TMPDIR") ?: "/tmp";
+	struct file *file;
+	int fd;
+
+	fd = open(dir, O_TMPFILE|O_RDWR|O_EXCL, 0600);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+
+	if (size && ftruncate(fd, size)) {
+		close(fd);
+		return ERR_PTR(-errno);
+	}
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file) {
+		close(fd);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	file->f_fd = fd;
+	return file;
+}
+
+ssize_t kernel_read(struct file *file, void *buf, size_t count, loff_t *pos)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < count) {
+		r = pread(file->f_fd, buf + done, count - done, *pos + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (!r)
+			break;
+		done += r;
+	}
+
+	*pos += done;
+	return done;
+}
+
+ssize_t kernel_write(struct file *file, const void *buf, size_t count, loff_t *pos)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < count) {
+		r = pwrite(file->f_fd, buf + done, count - done, *pos + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		done += r;
+	}
+
+	*pos += done;
+	return done;
+}
+
+void fput(struct file *file)
+{
+	close(file->f_fd);
+	kfree(file);
+}
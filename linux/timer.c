@@ -93,9 +93,11 @@ do {									\
 									\
 	BUG_ON(_i >= (h)->used);					\
 	(h)->used--;							\
-	heap_swap(h, _i, (h)->used);					\
-	heap_sift_down(h, _i, cmp);					\
-	heap_sift(h, _i, cmp);						\
+	if (_i < (h)->used) {						\
+		heap_swap(h, _i, (h)->used);				\
+		heap_sift_down(h, _i, cmp);				\
+		heap_sift(h, _i, cmp);					\
+	}								\
 } while (0)
 
 #define heap_pop(h, d, cmp)						\
@@ -124,10 +126,14 @@ struct pending_timer {
 	unsigned long		expires;
 };
 
+/*
+ * The heap macros above stop sifting when @cmp(child, parent) is true - so this
+ * has to be greater than, for the timer that expires first to be at the top:
+ */
 static inline bool pending_timer_cmp(struct pending_timer a,
 				     struct pending_timer b)
 {
-	return a.expires < b.expires;
+	return a.expires > b.expires;
 }
 
 static DECLARE_HEAP(struct pending_timer) pending_timers;
@@ -0,0 +1,752 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <attr/xattr.h>
+
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/xattr.h>
+
+#include "ccan/darray/darray.h"
+
+#include "posix_to_bcachefs.h"
+#include "tools-util.h"
+
+#include <linux/dcache.h>
+#include <linux/generic-radix-tree.h>
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
+#include "libbcachefs/btree_update.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/dirent.h"
+#include "libbcachefs/fs.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io.h"
+#include "libbcachefs/keylist.h"
+#include "libbcachefs/str_hash.h"
+#include "libbcachefs/xattr.h"
+
+void update_inode(struct bch_fs *c,
+		  struct bch_inode_unpacked *inode)
+{
+	int ret = bch2_inode_write(c, inode, NULL);
+
+	if (ret)
+		die("error creating file: %s", strerror(-ret));
+}
+
+static void create_dirent(struct bch_fs *c,
+			  struct bch_inode_unpacked *parent,
+			  const char *name, u64 inum, mode_t mode)
+{
+	struct bch_hash_info parent_hash_info = bch2_hash_info_init(c, parent);
+	struct qstr qname = { { { .len = strlen(name), } }, .name = name };
+
+	int ret = bch2_dirent_create(c, parent->bi_inum, &parent_hash_info,
+				     mode_to_type(mode), &qname,
+				     inum, NULL, BCH_HASH_SET_MUST_CREATE);
+	if (ret)
+		die("error creating file: %s", strerror(-ret));
+
+	if (S_ISDIR(mode))
+		parent->bi_nlink++;
+}
+
+void create_link(struct bch_fs *c,
+		 struct bch_inode_unpacked *parent,
+		 const char *name, u64 inum, mode_t mode)
+{
+	struct bch_inode_unpacked inode;
+	int ret = bch2_inode_find_by_inum(c, inum, &inode);
+	if (ret)
+		die("error looking up hardlink: %s", strerror(-ret));
+
+	inode.bi_nlink++;
+	update_inode(c, &inode);
+
+	create_dirent(c, parent, name, inum, mode);
+}
+
+struct bch_inode_unpacked create_file(struct bch_fs *c,
+				      struct bch_inode_unpacked *parent,
+				      const char *name,
+				      uid_t uid, gid_t gid,
+				      mode_t mode, dev_t rdev)
+{
+	struct bch_inode_unpacked new_inode;
+	int ret;
+
+	bch2_inode_init(c, &new_inode, uid, gid, mode, rdev, parent);
+
+	ret = bch2_inode_create(c, &new_inode, BLOCKDEV_INODE_MAX, 0,
+				&c->unused_inode_hint);
+	if (ret)
+		die("error creating file: %s", strerror(-ret));
+
+	create_dirent(c, parent, name, new_inode.bi_inum, mode);
+
+	return new_inode;
+}
+
+#define for_each_xattr_handler(handlers, handler)		\
+	if (handlers)						\
+		for ((handler) = *(handlers)++;			\
+			(handler) != NULL;			\
+			(handler) = *(handlers)++)
+
+static const struct xattr_handler *xattr_resolve_name(const char **name)
+{
+	const struct xattr_handler **handlers = bch2_xattr_handlers;
+	const struct xattr_handler *handler;
+
+	for_each_xattr_handler(handlers, handler) {
+		const char *n;
+
+		n = strcmp_prefix(*name, xattr_prefix(handler));
+		if (n) {
+			if (!handler->prefix ^ !*n) {
+				if (*n)
+					continue;
+				return ERR_PTR(-EINVAL);
+			}
+			*name = n;
+			return handler;
+		}
+	}
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+void copy_times(struct bch_fs *c, struct bch_inode_unpacked *dst,
+		struct stat *src)
+{
+	dst->bi_atime = timespec_to_bch2_time(c, src->st_atim);
+	dst->bi_mtime = timespec_to_bch2_time(c, src->st_mtim);
+	dst->bi_ctime = timespec_to_bch2_time(c, src->st_ctim);
+}
+
+void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
+		 char *src)
+{
+	struct bch_hash_info hash_info = bch2_hash_info_init(c, dst);
+
+	char attrs[XATTR_LIST_MAX];
+	ssize_t attrs_size = llistxattr(src, attrs, sizeof(attrs));
+	if (attrs_size < 0)
+		die("listxattr error: %m");
+
+	const char *next, *attr;
+	for (attr = attrs;
+	     attr < attrs + attrs_size;
+	     attr = next) {
+		next = attr + strlen(attr) + 1;
+
+		char val[XATTR_SIZE_MAX];
+		ssize_t val_size = lgetxattr(src, attr, val, sizeof(val));
+
+		if (val_size < 0)
+			die("error getting xattr val: %m");
+
+		const struct xattr_handler *h = xattr_resolve_name(&attr);
+
+		int ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
+				bch2_xattr_set(&trans, dst->bi_inum, &hash_info, attr,
+					       val, val_size, h->flags, 0));
+		if (ret < 0)
+			die("error creating xattr: %s", strerror(-ret));
+	}
+}
+
+static char buf[1 << 20] __aligned(PAGE_SIZE);
+static const size_t buf_pages = sizeof(buf) / PAGE_SIZE;
+
+static void write_data(struct bch_fs *c,
+		       struct bch_inode_unpacked *dst_inode,
+		       u64 dst_offset, void *buf, size_t len)
+{
+	struct {
+		struct bch_write_op op;
+		struct bio_vec bv[buf_pages];
+	} o;
+	struct closure cl;
+
+	BUG_ON(dst_offset	& (block_bytes(c) - 1));
+	BUG_ON(len		& (block_bytes(c) - 1));
+
+	closure_init_stack(&cl);
+
+	bio_init(&o.op.wbio.bio, o.bv, buf_pages);
+	o.op.wbio.bio.bi_iter.bi_size = len;
+	bch2_bio_map(&o.op.wbio.bio, buf);
+
+	bch2_write_op_init(&o.op, c, bch2_opts_to_inode_opts(c->opts));
+	o.op.write_point	= writepoint_hashed(0);
+	o.op.nr_replicas	= 1;
+	o.op.pos		= POS(dst_inode->bi_inum, dst_offset >> 9);
+
+	int ret = bch2_disk_reservation_get(c, &o.op.res, len >> 9,
+					    c->opts.data_replicas, 0);
+	if (ret)
+		die("error reserving space in new filesystem: %s", strerror(-ret));
+
+	closure_call(&o.op.cl, bch2_write, NULL, &cl);
+	closure_sync(&cl);
+
+	dst_inode->bi_sectors += len >> 9;
+}
+
+void copy_data(struct bch_fs *c,
+	       struct bch_inode_unpacked *dst_inode,
+	       int src_fd, u64 start, u64 end)
+{
+	while (start < end) {
+		unsigned len = min_t(u64, end - start, sizeof(buf));
+		unsigned pad = round_up(len, block_bytes(c)) - len;
+
+		xpread(src_fd, buf, len, start);
+		memset(buf + len, 0, pad);
+
+		write_data(c, dst_inode, start, buf, len + pad);
+		start += len;
+	}
+}
+
+void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
+	       char *src)
+{
+	ssize_t ret = readlink(src, buf, sizeof(buf));
+	if (ret < 0)
+		die("readlink error: %m");
+
+	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+}
+
+/*
+ * Offline image builder: populate a freshly formatted filesystem from a
+ * directory tree.
+ *
+ * Unlike migrate, which creates each file with its own lookups and inserts as
+ * it walks the source, this walks the whole tree up front and assigns inode
+ * numbers itself, in breadth first order with directory entries sorted by
+ * name. File data is written out in inode number order, so data is laid out
+ * sequentially on disk; its extents are indexed as it's written, since until
+ * then nothing stops the allocator from reusing the buckets it went to.
+ * Dirents, xattrs and inodes, once link counts and sizes are known, are sorted
+ * and built bottom up with the bulk loader, into full leaves.
+ *
+ * Inode numbers, hash seeds (derived from the filesystem uuid) and the order
+ * everything is written in depend only on the source tree, so building the
+ * same tree with the same --uuid (and SOURCE_DATE_EPOCH, which timestamps are
+ * encoded relative to) produces the same inodes, dirents and xattrs. The image
+ * isn't reproducible byte for byte: format picks the internal and device uuids
+ * at random, and which buckets data and btree nodes go to depends on the
+ * timing of the allocator thread.
+ */
+
+struct build_inode {
+	char			*path;
+	struct bch_inode_unpacked inode;
+};
+
+struct build_dirent {
+	u64			dir;
+	u64			hash;
+	u64			inum;
+	u8			type;
+	char			*name;
+};
+
+struct build_xattr {
+	u64			hash;
+	struct bkey_i_xattr	*k;
+};
+
+struct build_fs_state {
+	darray(struct build_inode)	inodes;
+	darray(struct build_dirent)	dirents;
+	darray(struct build_xattr)	xattrs;
+	GENRADIX(u64)			hardlinks;
+	dev_t				dev;
+};
+
+#define build_inode(_s, _inum)						\
+	(&darray_item((_s)->inodes, (_inum) - BCACHEFS_ROOT_INO))
+
+static u64 build_hash_seed(struct bch_fs *c, u64 inum)
+{
+	u64 seed[2];
+
+	memcpy(seed, c->sb.user_uuid.b, sizeof(seed));
+	return seed[0] ^ ((inum ^ seed[1]) * GOLDEN_RATIO_64);
+}
+
+static void build_copy_stat(struct bch_fs *c, struct bch_inode_unpacked *inode,
+			    struct stat *st)
+{
+	inode->bi_mode	= st->st_mode;
+	inode->bi_uid	= st->st_uid;
+	inode->bi_gid	= st->st_gid;
+	copy_times(c, inode, st);
+	inode->bi_otime	= inode->bi_ctime;
+}
+
+static int build_name_cmp(const struct dirent **l, const struct dirent **r)
+{
+	return strcmp((*l)->d_name, (*r)->d_name);
+}
+
+static void build_add_dirent(struct build_fs_state *s, u64 dir,
+			     const char *name, u64 inum, mode_t mode)
+{
+	struct build_dirent d = {
+		.dir	= dir,
+		.inum	= inum,
+		.type	= mode_to_type(mode),
+		.name	= strdup(name),
+	};
+
+	darray_append(s->dirents, d);
+}
+
+static void build_scan_dir(struct bch_fs *c, struct build_fs_state *s, u64 dir)
+{
+	const char *dir_path = build_inode(s, dir)->path;
+	struct dirent **names;
+	int i, nr = scandir(dir_path, &names, NULL, build_name_cmp);
+
+	if (nr < 0)
+		die("error reading %s: %m", dir_path);
+
+	for (i = 0; i < nr; i++) {
+		const char *name = names[i]->d_name;
+		struct build_inode new = { NULL };
+		struct stat st;
+		u64 *hardlink = NULL;
+
+		if (!strcmp(name, ".") ||
+		    !strcmp(name, ".."))
+			goto next;
+
+		new.path = mprintf("%s/%s", dir_path, name);
+
+		if (lstat(new.path, &st))
+			die("error statting %s: %m", new.path);
+
+		/* lost+found was created by format; reuse it: */
+		if (dir == BCACHEFS_ROOT_INO &&
+		    !strcmp(name, "lost+found") &&
+		    S_ISDIR(st.st_mode)) {
+			struct build_inode *l =
+				build_inode(s, BCACHEFS_ROOT_INO + 1);
+
+			build_copy_stat(c, &l->inode, &st);
+			l->path = new.path;
+			goto next;
+		}
+
+		if (!S_ISDIR(st.st_mode) &&
+		    st.st_nlink > 1 &&
+		    st.st_dev == s->dev) {
+			hardlink = genradix_ptr_alloc(&s->hardlinks,
+						      st.st_ino, GFP_KERNEL);
+			if (!hardlink)
+				die("insufficient memory");
+
+			if (*hardlink) {
+				build_inode(s, *hardlink)->inode.bi_nlink++;
+				build_add_dirent(s, dir, name, *hardlink,
+						 st.st_mode);
+				free(new.path);
+				goto next;
+			}
+		}
+
+		bch2_inode_init(c, &new.inode, st.st_uid, st.st_gid,
+				st.st_mode, st.st_rdev,
+				&build_inode(s, dir)->inode);
+		new.inode.bi_inum	= BCACHEFS_ROOT_INO +
+			darray_size(s->inodes);
+		new.inode.bi_hash_seed	= build_hash_seed(c, new.inode.bi_inum);
+		build_copy_stat(c, &new.inode, &st);
+
+		if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+			new.inode.bi_size = st.st_size;
+
+		if (S_ISDIR(st.st_mode))
+			build_inode(s, dir)->inode.bi_nlink++;
+
+		if (hardlink)
+			*hardlink = new.inode.bi_inum;
+
+		build_add_dirent(s, dir, name, new.inode.bi_inum, st.st_mode);
+		darray_append(s->inodes, new);
+next:
+		free(names[i]);
+	}
+
+	free(names);
+}
+
+/*
+ * Copy file data with large sequential writes, skipping holes; data regions
+ * are extended to block boundaries and read from the source as is, so partial
+ * blocks at the edges of holes come out right. Regions that meet or overlap
+ * once rounded are merged, so no block is written twice:
+ */
+static void build_copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
+			    const char *path)
+{
+	u64 size = dst->bi_size, pos = 0, start = 0, end = 0;
+	int fd = open(path, O_RDONLY|O_NOATIME);
+
+	if (fd < 0 && errno == EPERM)
+		fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die("error opening %s: %m", path);
+
+	while (pos < size) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		off_t hole;
+
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0) {
+			data = pos;
+			hole = size;
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0)
+				hole = size;
+		}
+
+		data	= round_down(data, block_bytes(c));
+		hole	= round_up(hole, block_bytes(c));
+
+		if (data > end) {
+			if (end > start)
+				copy_data(c, dst, fd, start, min(end, size));
+			start = data;
+		}
+
+		pos = end = hole;
+	}
+
+	if (end > start)
+		copy_data(c, dst, fd, start, min(end, size));
+
+	close(fd);
+}
+
+/*
+ * Xattrs are read into keys as we go, and loaded along with the dirents and
+ * inodes once they're sorted:
+ */
+static void build_read_xattrs(struct bch_fs *c, struct build_fs_state *s,
+			      struct build_inode *i)
+{
+	struct bch_hash_info hash_info = bch2_hash_info_init(c, &i->inode);
+	char attrs[XATTR_LIST_MAX];
+	ssize_t attrs_size = llistxattr(i->path, attrs, sizeof(attrs));
+	const char *next, *attr;
+
+	if (attrs_size < 0)
+		die("listxattr error: %m");
+
+	for (attr = attrs;
+	     attr < attrs + attrs_size;
+	     attr = next) {
+		const struct xattr_handler *h;
+		struct build_xattr x;
+		char val[XATTR_SIZE_MAX];
+		ssize_t val_size;
+		unsigned namelen, u64s;
+
+		next = attr + strlen(attr) + 1;
+
+		val_size = lgetxattr(i->path, attr, val, sizeof(val));
+		if (val_size < 0)
+			die("error getting xattr val: %m");
+
+		h	= xattr_resolve_name(&attr);
+		namelen	= strlen(attr);
+		u64s	= BKEY_U64s + xattr_val_u64s(namelen, val_size);
+
+		if (u64s > U8_MAX)
+			die("error creating xattr: %s", strerror(ERANGE));
+
+		/* zeroed, so the padding after the value is too: */
+		x.k = calloc(u64s, sizeof(u64));
+		if (!x.k)
+			die("insufficient memory");
+
+		bkey_xattr_init(&x.k->k_i);
+		x.k->k.u64s		= u64s;
+		x.k->k.p.inode		= i->inode.bi_inum;
+		x.k->v.x_type		= h->flags;
+		x.k->v.x_name_len	= namelen;
+		x.k->v.x_val_len	= cpu_to_le16(val_size);
+		memcpy(x.k->v.x_name, attr, namelen);
+		memcpy(xattr_val(&x.k->v), val, val_size);
+
+		x.hash = bch2_xattr_hash_desc.hash_bkey(&hash_info,
+						bkey_i_to_s_c(&x.k->k_i));
+		darray_append(s->xattrs, x);
+	}
+}
+
+static int build_dirent_cmp(const void *_l, const void *_r)
+{
+	const struct build_dirent *l = _l, *r = _r;
+
+	return  (l->dir > r->dir) - (l->dir < r->dir) ?:
+		(l->hash > r->hash) - (l->hash < r->hash) ?:
+		strcmp(l->name, r->name);
+}
+
+static void build_load_keys(struct bch_fs *c, enum btree_id id,
+			    struct keylist *keys)
+{
+	int ret = bch2_btree_bulk_load(c, id, keys, NULL, 0);
+
+	if (ret)
+		die("error loading %s btree: %s",
+		    bch2_btree_ids[id], strerror(-ret));
+
+	bch2_keylist_free(keys, NULL);
+}
+
+static void build_load_dirents(struct bch_fs *c, struct build_fs_state *s)
+{
+	struct bch_hash_info hash_info;
+	struct build_dirent *d;
+	struct keylist keys;
+	u64 dir = 0, pos = 0;
+
+	darray_foreach(d, s->dirents) {
+		struct qstr qname = QSTR_INIT(d->name, strlen(d->name));
+
+		if (d->dir != dir) {
+			dir = d->dir;
+			hash_info = bch2_hash_info_init(c,
+					&build_inode(s, dir)->inode);
+		}
+
+		d->hash = bch2_dirent_hash_desc.hash_key(&hash_info, &qname);
+	}
+
+	sort(&darray_item(s->dirents, 0), darray_size(s->dirents),
+	     sizeof(struct build_dirent), build_dirent_cmp, NULL);
+
+	bch2_keylist_init(&keys, NULL);
+
+	dir = 0;
+	darray_foreach(d, s->dirents) {
+		struct qstr qname = QSTR_INIT(d->name, strlen(d->name));
+		struct bkey_i_dirent *dirent;
+
+		if (qname.len > BCH_NAME_MAX)
+			die("error creating dirent %s: %s",
+			    d->name, strerror(ENAMETOOLONG));
+
+		if (d->dir != dir) {
+			dir = d->dir;
+			pos = 0;
+		} else if (!pos) {
+			die("error creating dirent %s: %s",
+			    d->name, strerror(ENOSPC));
+		}
+
+		/*
+		 * On a hash collision, take the next slot, as bch2_hash_set()
+		 * would - lookups probe forwards from the hash:
+		 */
+		pos = max(pos, d->hash);
+
+		if (bch2_keylist_realloc(&keys, NULL, 0,
+					 bch2_dirent_u64s(qname.len)))
+			die("insufficient memory");
+
+		dirent = (struct bkey_i_dirent *) keys.top;
+		bch2_dirent_init(dirent, d->type, &qname, d->inum);
+		dirent->k.p = POS(d->dir, pos++);
+		bch2_keylist_push(&keys);
+	}
+
+	build_load_keys(c, BTREE_ID_DIRENTS, &keys);
+}
+
+static int build_xattr_cmp(const void *_l, const void *_r)
+{
+	const struct build_xattr *l = _l, *r = _r;
+	const struct bch_xattr *lv = &l->k->v, *rv = &r->k->v;
+
+	return  (l->k->k.p.inode > r->k->k.p.inode) -
+		(l->k->k.p.inode < r->k->k.p.inode) ?:
+		(l->hash > r->hash) - (l->hash < r->hash) ?:
+		(lv->x_type > rv->x_type) - (lv->x_type < rv->x_type) ?:
+		memcmp(lv->x_name, rv->x_name,
+		       min(lv->x_name_len, rv->x_name_len)) ?:
+		(lv->x_name_len > rv->x_name_len) -
+		(lv->x_name_len < rv->x_name_len);
+}
+
+static void build_load_xattrs(struct bch_fs *c, struct build_fs_state *s)
+{
+	struct build_xattr *x;
+	struct keylist keys;
+	u64 inum = 0, pos = 0;
+
+	sort(&darray_item(s->xattrs, 0), darray_size(s->xattrs),
+	     sizeof(struct build_xattr), build_xattr_cmp, NULL);
+
+	bch2_keylist_init(&keys, NULL);
+
+	darray_foreach(x, s->xattrs) {
+		if (x->k->k.p.inode != inum) {
+			inum = x->k->k.p.inode;
+			pos = 0;
+		} else if (!pos) {
+			die("error creating xattr: %s", strerror(ENOSPC));
+		}
+
+		/* Hash collisions take the next slot, as with dirents: */
+		pos = max(pos, x->hash);
+		x->k->k.p.offset = pos++;
+
+		if (bch2_keylist_realloc(&keys, NULL, 0, x->k->k.u64s))
+			die("insufficient memory");
+
+		bch2_keylist_add(&keys, &x->k->k_i);
+		free(x->k);
+	}
+
+	build_load_keys(c, BTREE_ID_XATTRS, &keys);
+}
+
+/*
+ * The root directory and lost+found were created by format, and are updated in
+ * place; everything after them is loaded:
+ */
+static void build_load_inodes(struct bch_fs *c, struct build_fs_state *s)
+{
+	struct bkey_inode_buf packed;
+	struct build_inode *i;
+	struct keylist keys;
+
+	bch2_keylist_init(&keys, NULL);
+
+	darray_foreach(i, s->inodes) {
+		if (i->inode.bi_inum <= BCACHEFS_ROOT_INO + 1) {
+			update_inode(c, &i->inode);
+			continue;
+		}
+
+		bch2_inode_pack(&packed, &i->inode);
+
+		if (bch2_keylist_realloc(&keys, NULL, 0, packed.inode.k.u64s))
+			die("insufficient memory");
+
+		bch2_keylist_add(&keys, &packed.inode.k_i);
+	}
+
+	build_load_keys(c, BTREE_ID_INODES, &keys);
+}
+
+void build_fs_image(struct bch_fs *c, const char *src_path)
+{
+	struct build_fs_state s = { .dev = 0 };
+	struct build_inode root = { NULL }, lostfound = { NULL };
+	struct build_inode *i;
+	struct build_dirent *d;
+	struct stat st;
+	u64 inum;
+	int ret;
+
+	if (lstat(src_path, &st))
+		die("error statting %s: %m", src_path);
+	if (!S_ISDIR(st.st_mode))
+		die("%s is not a directory", src_path);
+
+	darray_init(s.inodes);
+	darray_init(s.dirents);
+	darray_init(s.xattrs);
+	genradix_init(&s.hardlinks);
+	s.dev = st.st_dev;
+
+	ret =   bch2_inode_find_by_inum(c, BCACHEFS_ROOT_INO, &root.inode) ?:
+		bch2_inode_find_by_inum(c, BCACHEFS_ROOT_INO + 1, &lostfound.inode);
+	if (ret)
+		die("error looking up root directory: %s", strerror(-ret));
+
+	/*
+	 * The root directory's hash seed was picked at random by format; drop
+	 * the lost+found dirent so it can be recreated under the new seed. A
+	 * range delete can't leave a hash table whiteout in the way of the
+	 * dirents we load:
+	 */
+	ret = bch2_btree_delete_range(c, BTREE_ID_DIRENTS,
+				      POS(BCACHEFS_ROOT_INO, 0),
+				      POS(BCACHEFS_ROOT_INO + 1, 0),
+				      ZERO_VERSION, NULL, NULL, NULL);
+	if (ret)
+		die("error deleting lost+found dirent: %s", strerror(-ret));
+
+	root.path = strdup(src_path);
+	root.inode.bi_hash_seed = build_hash_seed(c, BCACHEFS_ROOT_INO);
+	build_copy_stat(c, &root.inode, &st);
+	darray_append(s.inodes, root);
+
+	lostfound.inode.bi_hash_seed = build_hash_seed(c, BCACHEFS_ROOT_INO + 1);
+	build_copy_stat(c, &lostfound.inode, &st);
+	lostfound.inode.bi_mode = S_IFDIR|0700;
+	darray_append(s.inodes, lostfound);
+
+	build_add_dirent(&s, BCACHEFS_ROOT_INO, "lost+found",
+			 BCACHEFS_ROOT_INO + 1, S_IFDIR);
+
+	/* darray_size() grows as we go: */
+	for (inum = BCACHEFS_ROOT_INO;
+	     inum < BCACHEFS_ROOT_INO + darray_size(s.inodes);
+	     inum++) {
+		i = build_inode(&s, inum);
+
+		if (S_ISDIR(i->inode.bi_mode) && i->path)
+			build_scan_dir(c, &s, inum);
+	}
+
+	darray_foreach(i, s.inodes) {
+		if (!i->path)
+			continue;
+
+		switch (mode_to_type(i->inode.bi_mode)) {
+		case DT_REG:
+			build_copy_file(c, &i->inode, i->path);
+			break;
+		case DT_LNK:
+			copy_link(c, &i->inode, i->path);
+			break;
+		}
+
+		build_read_xattrs(c, &s, i);
+	}
+
+	build_load_dirents(c, &s);
+	build_load_xattrs(c, &s);
+	build_load_inodes(c, &s);
+
+	c->unused_inode_hint = BCACHEFS_ROOT_INO + darray_size(s.inodes);
+
+	darray_foreach(i, s.inodes)
+		free(i->path);
+	darray_foreach(d, s.dirents)
+		free(d->name);
+	darray_free(s.inodes);
+	darray_free(s.dirents);
+	darray_free(s.xattrs);
+	genradix_free(&s.hardlinks);
+
+	bch2_alloc_write(c);
+}
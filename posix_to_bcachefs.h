@@ -0,0 +1,25 @@
+#ifndef _POSIX_TO_BCACHEFS_H
+#define _POSIX_TO_BCACHEFS_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/inode.h"
+
+void update_inode(struct bch_fs *, struct bch_inode_unpacked *);
+void create_link(struct bch_fs *, struct bch_inode_unpacked *,
+		 const char *, u64, mode_t);
+struct bch_inode_unpacked create_file(struct bch_fs *,
+				      struct bch_inode_unpacked *,
+				      const char *, uid_t, gid_t,
+				      mode_t, dev_t);
+
+void copy_times(struct bch_fs *, struct bch_inode_unpacked *, struct stat *);
+void copy_xattrs(struct bch_fs *, struct bch_inode_unpacked *, char *);
+void copy_data(struct bch_fs *, struct bch_inode_unpacked *, int, u64, u64);
+void copy_link(struct bch_fs *, struct bch_inode_unpacked *, char *);
+
+void build_fs_image(struct bch_fs *, const char *);
+
+#endif /* _POSIX_TO_BCACHEFS_H */
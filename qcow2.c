@@ -1,14 +1,37 @@
 
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
 
 #include "qcow2.h"
 #include "tools-util.h"
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define QCOW_VERSION		2
+#define QCOW_VERSION_V3		3
 #define QCOW_OFLAG_COPIED	(1LL << 63)
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+
+/* v3 incompatible feature: compression_type field is valid */
+#define QCOW_INCOMPAT_COMPRESSION	(1ULL << 3)
+
+#define QCOW_COMPRESSION_ZLIB	0
+#define QCOW_COMPRESSION_ZSTD	1
+
+/* Source reads are done in chunks of this size, with readahead one ahead: */
+#define QCOW2_READ_MAX		(8U << 20)
+#define QCOW2_WRITE_BUF		(8U << 20)
+
+const char * const qcow2_compression_types[] = {
+	"none",
+	"zlib",
+	"zstd",
+	NULL
+};
 
 struct qcow2_hdr {
 	u32			magic;
@@ -29,32 +52,110 @@ struct qcow2_hdr {
 
 	u32			nb_snapshots;
 	u64			snapshots_offset;
+
+	/* v3: */
+	u64			incompatible_features;
+	u64			compatible_features;
+	u64			autoclear_features;
+
+	u32			refcount_order;
+	u32			header_length;
+
+	u8			compression_type;
+	u8			pad[7];
 };
 
-struct qcow2_image {
+/*
+ * Output is written strictly sequentially through a large buffer, so that it
+ * can go to a pipe; a dry run writer just tracks the offset, for working out
+ * the layout before anything is written:
+ */
+struct qcow2_writer {
 	int			fd;
+	bool			dry_run;
+	char			*buf;
+	size_t			buf_used;
+	u64			offset;
+};
+
+static void writer_flush(struct qcow2_writer *w)
+{
+	char *p = w->buf;
+
+	while (w->buf_used) {
+		ssize_t r = write(w->fd, p, w->buf_used);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			die("write error: %m");
+
+		p		+= r;
+		w->buf_used	-= r;
+	}
+}
+
+static void writer_write(struct qcow2_writer *w, const void *data, size_t len)
+{
+	w->offset += len;
+
+	if (w->dry_run)
+		return;
+
+	while (len) {
+		size_t n = min_t(size_t, len, QCOW2_WRITE_BUF - w->buf_used);
+
+		if (data)
+			memcpy(w->buf + w->buf_used, data, n);
+		else
+			memset(w->buf + w->buf_used, 0, n);
+
+		w->buf_used += n;
+		if (data)
+			data += n;
+		len -= n;
+
+		if (w->buf_used == QCOW2_WRITE_BUF)
+			writer_flush(w);
+	}
+}
+
+static void writer_align(struct qcow2_writer *w, unsigned align)
+{
+	writer_write(w, NULL, round_up(w->offset, align) - w->offset);
+}
+
+struct qcow2_image {
+	int			infd;
 	u32			block_size;
+	enum qcow2_compression	compression;
+
 	u64			*l1_table;
-	u64			l1_offset;
-	u32			l1_index;
+	u64			l1_index;
 	u64			*l2_table;
-	u64			offset;
+
+	struct qcow2_writer	w;
+
+	char			*cbuf;
+	z_stream		zstrm;
+	ZSTD_CCtx		*zctx;
 };
 
 static void flush_l2(struct qcow2_image *img)
 {
 	if (img->l1_index != -1) {
+		writer_align(&img->w, img->block_size);
+
 		img->l1_table[img->l1_index] =
-			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
-		xpwrite(img->fd, img->l2_table, img->block_size, img->offset);
-		img->offset += img->block_size;
+			cpu_to_be64(img->w.offset|QCOW_OFLAG_COPIED);
+		writer_write(&img->w, img->l2_table, img->block_size);
 
 		memset(img->l2_table, 0, img->block_size);
 		img->l1_index = -1;
 	}
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void add_l2(struct qcow2_image *img, u64 src_blk, u64 entry)
 {
 	unsigned l2_size = img->block_size / sizeof(u64);
 	u64 l1_index = src_blk / l2_size;
@@ -65,66 +166,215 @@ static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
 		img->l1_index = l1_index;
 	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	img->l2_table[l2_index] = cpu_to_be64(entry);
 }
 
+static bool cluster_is_zero(const void *buf, unsigned len)
+{
+	const u64 *p = buf, *end = buf + len;
+
+	while (p < end)
+		if (*p++)
+			return false;
+	return true;
+}
+
+/* Returns compressed size, or 0 if the cluster doesn't compress: */
+static size_t compress_cluster(struct qcow2_image *img, const void *src)
+{
+	size_t ret;
+
+	switch (img->compression) {
+	case QCOW2_COMPRESSION_ZLIB:
+		if (deflateReset(&img->zstrm) != Z_OK)
+			die("deflateReset error");
+
+		img->zstrm.next_in	= (void *) src;
+		img->zstrm.avail_in	= img->block_size;
+		img->zstrm.next_out	= (void *) img->cbuf;
+		img->zstrm.avail_out	= img->block_size;
+
+		if (deflate(&img->zstrm, Z_FINISH) != Z_STREAM_END)
+			return 0;
+
+		ret = img->block_size - img->zstrm.avail_out;
+		break;
+	case QCOW2_COMPRESSION_ZSTD:
+		ret = ZSTD_compressCCtx(img->zctx, img->cbuf, img->block_size,
+					src, img->block_size, 0);
+		if (ZSTD_isError(ret))
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	return ret < img->block_size ? ret : 0;
+}
+
+static void write_cluster(struct qcow2_image *img, const void *src,
+			  u64 src_offset)
+{
+	unsigned cluster_bits = ilog2(img->block_size);
+	size_t clen;
+	u64 entry;
+
+	/* Unallocated clusters read as zeroes: */
+	if (cluster_is_zero(src, img->block_size))
+		return;
+
+	clen = compress_cluster(img, src);
+	if (clen) {
+		/*
+		 * Compressed clusters are packed at byte granularity; the L2
+		 * entry has the offset and the number of additional 512 byte
+		 * sectors the data spans:
+		 */
+		unsigned csize_shift = 62 - (cluster_bits - 8);
+		u64 nr_sectors = ((img->w.offset + clen - 1) >> 9) -
+			(img->w.offset >> 9);
+
+		entry = QCOW_OFLAG_COMPRESSED|
+			(nr_sectors << csize_shift)|
+			img->w.offset;
+		writer_write(&img->w, img->cbuf, clen);
+	} else {
+		writer_align(&img->w, img->block_size);
+
+		entry = img->w.offset|QCOW_OFLAG_COPIED;
+		writer_write(&img->w, src, img->block_size);
+	}
+
+	add_l2(img, src_offset >> cluster_bits, entry);
+}
+
+static void write_data(struct qcow2_image *img, ranges *data, char *buf)
+{
+	struct range *r;
+	u64 start, end, i;
+
+	darray_foreach(r, *data)
+		for (start = r->start; start < r->end; start = end) {
+			end = min_t(u64, r->end, start + QCOW2_READ_MAX);
+
+			if (end < r->end)
+				posix_fadvise(img->infd, end,
+					      min_t(u64, r->end - end,
+						    QCOW2_READ_MAX),
+					      POSIX_FADV_WILLNEED);
+
+			xpread(img->infd, buf, end - start, start);
+
+			for (i = start; i < end; i += img->block_size)
+				write_cluster(img, buf + (i - start), i);
+		}
+
+	flush_l2(img);
+}
+
+/*
+ * Image layout is header, L1 table, then data clusters with each L2 table
+ * following the data it maps. When the output can seek we do a single pass and
+ * go back to fill in the header and L1 table; otherwise we do a dry run first
+ * to compute the L1 table, so everything can be written in order.
+ */
 void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+		       unsigned block_size,
+		       enum qcow2_compression compression)
 {
 	u64 image_size = get_size(NULL, infd);
 	unsigned l2_size = block_size / sizeof(u64);
 	unsigned l1_size = DIV_ROUND_UP(image_size, (u64) block_size * l2_size);
+	u64 l1_offset = block_size;
+	u64 data_offset = l1_offset + round_up(l1_size * sizeof(u64), block_size);
+	bool seekable = lseek(outfd, 0, SEEK_CUR) >= 0;
 	struct qcow2_hdr hdr = { 0 };
 	struct qcow2_image img = {
-		.fd		= outfd,
+		.infd		= infd,
 		.block_size	= block_size,
+		.compression	= compression,
 		.l2_table	= xcalloc(l2_size, sizeof(u64)),
 		.l1_table	= xcalloc(l1_size, sizeof(u64)),
 		.l1_index	= -1,
-		.offset		= round_up(sizeof(hdr), block_size),
+		.cbuf		= xmalloc(block_size),
+		.w.fd		= outfd,
+		.w.buf		= xmalloc(QCOW2_WRITE_BUF),
 	};
-	struct range *r;
-	char *buf = xmalloc(block_size);
-	u64 src_offset, dst_offset;
+	char *buf = xmalloc(max_t(unsigned, QCOW2_READ_MAX, block_size));
 
 	assert(is_power_of_2(block_size));
 
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
-	/* Write data: */
-	darray_foreach(r, *data)
-		for (src_offset = r->start;
-		     src_offset < r->end;
-		     src_offset += block_size) {
-			dst_offset = img.offset;
-			img.offset += img.block_size;
+	posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-			xpread(infd, buf, block_size, src_offset);
-			xpwrite(outfd, buf, block_size, dst_offset);
-
-			add_l2(&img, src_offset / block_size, dst_offset);
-		}
-
-	flush_l2(&img);
-
-	/* Write L1 table: */
-	dst_offset		= img.offset;
-	img.offset		+= round_up(l1_size * sizeof(u64), block_size);
-	xpwrite(img.fd, img.l1_table, l1_size * sizeof(u64), dst_offset);
+	switch (compression) {
+	case QCOW2_COMPRESSION_ZLIB:
+		/* qcow2 uses raw deflate, with a 4k window: */
+		if (deflateInit2(&img.zstrm, Z_DEFAULT_COMPRESSION,
+				 Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+			die("deflateInit2 error");
+		break;
+	case QCOW2_COMPRESSION_ZSTD:
+		img.zctx = ZSTD_createCCtx();
+		if (!img.zctx)
+			die("insufficient memory");
+		break;
+	default:
+		break;
+	}
 
-	/* Write header: */
 	hdr.magic		= cpu_to_be32(QCOW_MAGIC);
 	hdr.version		= cpu_to_be32(QCOW_VERSION);
 	hdr.block_bits		= cpu_to_be32(ilog2(block_size));
 	hdr.size		= cpu_to_be64(image_size);
 	hdr.l1_size		= cpu_to_be32(l1_size);
-	hdr.l1_table_offset	= cpu_to_be64(dst_offset);
+	hdr.l1_table_offset	= cpu_to_be64(l1_offset);
 
+	if (compression == QCOW2_COMPRESSION_ZSTD) {
+		hdr.version		= cpu_to_be32(QCOW_VERSION_V3);
+		hdr.incompatible_features =
+			cpu_to_be64(QCOW_INCOMPAT_COMPRESSION);
+		hdr.refcount_order	= cpu_to_be32(4);
+		hdr.header_length	= cpu_to_be32(sizeof(hdr));
+		hdr.compression_type	= QCOW_COMPRESSION_ZSTD;
+	}
+
+	if (!seekable) {
+		img.w.dry_run	= true;
+		img.w.offset	= data_offset;
+		write_data(&img, data, buf);
+
+		img.w.dry_run	= false;
+		img.w.offset	= 0;
+	}
+
+	/* Header, then L1 table - zeroes for now if we can seek: */
 	memset(buf, 0, block_size);
 	memcpy(buf, &hdr, sizeof(hdr));
-	xpwrite(img.fd, buf, block_size, 0);
+	writer_write(&img.w, buf, block_size);
+
+	writer_write(&img.w, seekable ? NULL : img.l1_table,
+		     l1_size * sizeof(u64));
+	writer_align(&img.w, block_size);
+
+	BUG_ON(img.w.offset != data_offset);
+
+	write_data(&img, data, buf);
+	writer_align(&img.w, 512);
+	writer_flush(&img.w);
+
+	if (seekable)
+		xpwrite(outfd, img.l1_table, l1_size * sizeof(u64), l1_offset);
+
+	if (compression == QCOW2_COMPRESSION_ZLIB)
+		deflateEnd(&img.zstrm);
+	if (img.zctx)
+		ZSTD_freeCCtx(img.zctx);
 
+	free(img.w.buf);
+	free(img.cbuf);
 	free(img.l2_table);
 	free(img.l1_table);
 	free(buf);
@@ -4,6 +4,14 @@
 #include <linux/types.h>
 #include "tools-util.h"
 
-void qcow2_write_image(int, int, ranges *, unsigned);
+enum qcow2_compression {
+	QCOW2_COMPRESSION_NONE,
+	QCOW2_COMPRESSION_ZLIB,
+	QCOW2_COMPRESSION_ZSTD,
+};
+
+extern const char * const qcow2_compression_types[];
+
+void qcow2_write_image(int, int, ranges *, unsigned, enum qcow2_compression);
 
 #endif /* _QCOW2_H */
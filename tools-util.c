@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/blkzoned.h>
 #include <linux/fs.h>
 #include <math.h>
 #include <stdbool.h>
@@ -14,6 +15,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <attr/xattr.h>
 #include <blkid.h>
 #include <uuid/uuid.h>
 
@@ -179,6 +181,19 @@ struct units_buf __pr_units(s64 _v, enum units units)
 	return ret;
 }
 
+const char *pr_ns(char *buf, size_t len, u64 ns)
+{
+	if (ns >= 2 * NSEC_PER_SEC)
+		snprintf(buf, len, "%llus", ns / NSEC_PER_SEC);
+	else if (ns >= 2 * NSEC_PER_MSEC)
+		snprintf(buf, len, "%llums", ns / NSEC_PER_MSEC);
+	else if (ns >= 2 * NSEC_PER_USEC)
+		snprintf(buf, len, "%lluus", ns / NSEC_PER_USEC);
+	else
+		snprintf(buf, len, "%lluns", ns);
+	return buf;
+}
+
 /* Argument parsing stuff: */
 
 /* File parsing (i.e. sysfs) */
@@ -251,6 +266,82 @@ unsigned get_blocksize(const char *path, int fd)
 	return ret >> 9;
 }
 
+/*
+ * Zoned devices: for testing without SMR/ZNS hardware or null_blk, a regular
+ * file can stand in for a host managed zoned device, by setting the
+ * user.bcachefs.zoned xattr on it to "<zone size>[,<nr conventional zones>]".
+ * The conventional zones are at the start of the file.
+ */
+static unsigned zoned_file_params(int fd, unsigned *nr_conv)
+{
+	char buf[64], *conv;
+	ssize_t len;
+	u64 zone_size;
+
+	*nr_conv = 0;
+
+	len = fgetxattr(fd, "user.bcachefs.zoned", buf, sizeof(buf) - 1);
+	if (len < 0)
+		return 0;
+	buf[len] = '\0';
+
+	conv = strchr(buf, ',');
+	if (conv)
+		*conv++ = '\0';
+
+	if (bch2_strtoull_h(buf, &zone_size) ||
+	    zone_size < 512 ||
+	    !is_power_of_2(zone_size))
+		die("user.bcachefs.zoned: bad zone size %s", buf);
+
+	if (conv && kstrtouint(conv, 10, nr_conv))
+		die("user.bcachefs.zoned: bad number of conventional zones %s",
+		    conv);
+
+	return zone_size >> 9;
+}
+
+/* Returns zone size in units of 512 byte sectors, 0 if not zoned: */
+unsigned get_zone_sectors(const char *path, int fd)
+{
+	struct stat statbuf = xfstat(fd);
+	unsigned nr_conv;
+
+	if (!S_ISBLK(statbuf.st_mode))
+		return S_ISREG(statbuf.st_mode)
+			? zoned_file_params(fd, &nr_conv)
+			: 0;
+
+	unsigned ret;
+	if (ioctl(fd, BLKGETZONESZ, &ret))
+		return 0;
+	return ret;
+}
+
+bool zone_is_conventional(const char *path, int fd, u64 sector)
+{
+	struct stat statbuf = xfstat(fd);
+
+	if (!S_ISBLK(statbuf.st_mode)) {
+		unsigned nr_conv, zone_sectors = zoned_file_params(fd, &nr_conv);
+
+		return !zone_sectors || sector / zone_sectors < nr_conv;
+	}
+
+	struct blk_zone_report *r =
+		xcalloc(1, sizeof(*r) + sizeof(struct blk_zone));
+	bool ret;
+
+	r->sector	= sector;
+	r->nr_zones	= 1;
+	xioctl(fd, BLKREPORTZONE, r);
+
+	ret = !r->nr_zones ||
+		r->zones[0].type == BLK_ZONE_TYPE_CONVENTIONAL;
+	free(r);
+	return ret;
+}
+
 /* Open a block device, do magic blkid stuff to probe for existing filesystems: */
 int open_for_format(const char *dev, bool force)
 {
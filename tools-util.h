@@ -65,6 +65,8 @@ struct units_buf {
 
 #define pr_units(_v, _u)	&(__pr_units(_v, _u).b[0])
 
+const char *pr_ns(char *, size_t, u64);
+
 char *read_file_str(int, const char *);
 u64 read_file_u64(int, const char *);
 
@@ -73,6 +75,8 @@ ssize_t read_string_list_or_die(const char *, const char * const[],
 
 u64 get_size(const char *, int);
 unsigned get_blocksize(const char *, int);
+unsigned get_zone_sectors(const char *, int);
+bool zone_is_conventional(const char *, int, u64);
 int open_for_format(const char *, bool);
 
 bool ask_yn(void);